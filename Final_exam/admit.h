@@ -0,0 +1,349 @@
+// Admission control and fair shares for server_tcp's uploads.
+//
+// Every upload (FRAME_FILE, FRAME_RESUME, FRAME_BATCH) is admitted before
+// its FRAME_READY goes out. The limits are each off when 0:
+//
+//   - uploads in progress on the server (-a) and per user (-A)
+//   - bytes a user may upload while the server runs (-q), counting the
+//     sizes of its completed uploads and of those admitted or queued
+//   - free disk (-D): the admitted and queued uploads must leave at least
+//     this much free on the save directory's filesystem
+//
+// An upload over the quota or the disk budget is refused. One held back
+// only by a transfer limit waits in its user's queue, and when a slot
+// frees the users with uploads waiting are served in turn, one upload
+// each. A user with fifty uploads queued delays one with a single upload
+// by at most one turn. The admission reaches the waiting connection through
+// its worker's inbox, woken like batch.h's through the rooms' eventfd.
+// UDP uploads cannot wait (their clients give up on a silent server), so
+// the shards of server_tcp -u pass no inbox and are refused instead.
+//
+// With a bandwidth budget (-B) the bytes that admitted uploads receive are
+// metered by deficit round robin over users. Every SCHED_ROUND_US each user
+// with an upload in progress gets an equal quantum of the round's budget,
+// shared by all of its uploads and their data connections. A connection
+// whose user has spent its deficit stops receiving until the next round.
+// A receive that overshoots is paid back from the following rounds, and an
+// idle user saves up no more than one quantum.
+//
+// Users are kept by name for as long as the server runs, so the quota
+// outlives connections. The table has one lock. It is taken when an upload
+// is announced, admitted or finished, and with -B once per receive.
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#include "protocol.h"
+#include "server.h"
+
+#define SCHED_BUCKETS 1024               // Hash chains of the user table
+#define SCHED_ROUND_US 10000             // Deficit round robin round (-B)
+#define SCHED_USER_QUEUE_MAX 64          // Uploads one user may have waiting
+
+typedef struct sched_wait sched_wait_t;
+
+// Per worker: queued uploads that have been admitted. Shares the worker's
+// room eventfd.
+typedef struct {
+    pthread_mutex_t lock;
+    int efd;
+    sched_wait_t *ready;
+} sched_inbox_t;
+
+typedef struct sched_user {
+    struct sched_user *next;     // Hash chain
+    char name[USERNAME_MAX];
+    int active;                  // Admitted uploads not finished yet
+    uint64_t bytes_used;         // Sizes of its completed uploads...
+    uint64_t bytes_reserved;     // ...and of those admitted or queued
+    sched_wait_t *queue;         // Uploads waiting for a slot, oldest first
+    int queued;
+    struct sched_user *rr_prev;  // Ring of users with uploads waiting
+    struct sched_user *rr_next;
+    int64_t deficit;             // -B: bytes it may still receive...
+    uint64_t round;              // ...as of this round
+} sched_user_t;
+
+struct sched_wait {
+    sched_wait_t *next;          // In its user's queue, then in the inbox
+    sched_user_t *user;
+    sched_inbox_t *inbox;
+    void *owner;                 // Connection, NULL once it has closed
+    uint64_t size;
+    uint64_t since_us;
+    int granted;
+};
+
+typedef enum {
+    SCHED_ADMITTED,
+    SCHED_QUEUED,
+    SCHED_REFUSED
+} sched_result_t;
+
+static struct {
+    pthread_mutex_t lock;
+    sched_user_t *users[SCHED_BUCKETS];
+    sched_user_t *rr;            // Next user served from the queues
+    int active;                  // Admitted uploads of all users
+    int active_users;            // Users with any
+    int queued;
+    uint64_t reserved;           // Bytes of admitted and queued uploads
+
+    // Limits, 0 for none
+    int max_active;
+    int max_user_active;
+    uint64_t quota;
+    uint64_t disk_reserve;
+    uint64_t rate;               // Bytes per second received by admitted uploads
+    const char *dir;             // Where the disk budget is measured
+} sched = {PTHREAD_MUTEX_INITIALIZER};
+
+static inline void sched_inbox_init(sched_inbox_t *in, int efd) {
+    pthread_mutex_init(&in->lock, NULL);
+    in->efd = efd;
+    in->ready = NULL;
+}
+
+// Caller holds the lock. NULL if a new user cannot be allocated.
+static inline sched_user_t *sched_user(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    sched_user_t **chain = &sched.users[h % SCHED_BUCKETS];
+    for (sched_user_t *u = *chain; u; u = u->next) {
+        if (strcmp(u->name, name) == 0) return u;
+    }
+    sched_user_t *u = (sched_user_t *)calloc(1, sizeof(sched_user_t));
+    if (!u) return NULL;
+    snprintf(u->name, sizeof(u->name), "%s", name);
+    u->next = *chain;
+    *chain = u;
+    return u;
+}
+
+static inline int sched_slot_free(const sched_user_t *u) {
+    return (!sched.max_active || sched.active < sched.max_active) &&
+           (!sched.max_user_active || u->active < sched.max_user_active);
+}
+
+static inline void sched_take_slot(sched_user_t *u) {
+    if (u->active++ == 0) sched.active_users++;
+    sched.active++;
+}
+
+static inline void sched_rr_remove(sched_user_t *u) {
+    if (u->rr_next == u) {
+        sched.rr = NULL;
+    } else {
+        u->rr_prev->rr_next = u->rr_next;
+        u->rr_next->rr_prev = u->rr_prev;
+        if (sched.rr == u) sched.rr = u->rr_next;
+    }
+    u->rr_next = u->rr_prev = NULL;
+}
+
+// Hand free slots to waiting uploads, one per user in turn. Caller holds
+// the lock.
+static inline void sched_dispatch() {
+    int idle = 0;  // Users passed over in a row, at their own limit
+    while (sched.rr && (!sched.max_active || sched.active < sched.max_active)) {
+        sched_user_t *u = sched.rr;
+        if (!sched_slot_free(u)) {
+            sched.rr = u->rr_next;
+            if (++idle > sched.queued) break;  // More than there are users waiting
+            continue;
+        }
+        idle = 0;
+        sched_wait_t *wt = u->queue;
+        u->queue = wt->next;
+        u->queued--;
+        sched.queued--;
+        sched_take_slot(u);
+        sched.rr = u->rr_next;
+        if (!u->queue) sched_rr_remove(u);
+
+        wt->granted = 1;
+        sched_inbox_t *in = wt->inbox;
+        pthread_mutex_lock(&in->lock);
+        wt->next = in->ready;
+        in->ready = wt;
+        pthread_mutex_unlock(&in->lock);
+        uint64_t one = 1;
+        ssize_t n = write(in->efd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+// Admit an upload of size bytes by username. SCHED_ADMITTED sets *user;
+// SCHED_QUEUED sets *wait, handed to inbox once admitted, with owner as
+// its connection; SCHED_REFUSED sets *why. Without an inbox an upload
+// that would have to wait is refused.
+static inline sched_result_t sched_admit(const char *username, uint64_t size, void *owner, sched_inbox_t *inbox,
+                                         sched_user_t **user, sched_wait_t **wait, const char **why) {
+    sched_result_t r = SCHED_REFUSED;
+    pthread_mutex_lock(&sched.lock);
+    sched_user_t *u = sched_user(username);
+    struct statvfs vfs;
+    if (!u) {
+        *why = "out of memory";
+    } else if (sched.quota && u->bytes_used + u->bytes_reserved + size > sched.quota) {
+        *why = "over the user's quota";
+    } else if (sched.disk_reserve && statvfs(sched.dir, &vfs) == 0 &&
+               (uint64_t)vfs.f_bavail * vfs.f_frsize < sched.reserved + size + sched.disk_reserve) {
+        *why = "not enough disk space";
+    } else if (sched_slot_free(u) && !u->queue) {
+        sched_take_slot(u);
+        *user = u;
+        r = SCHED_ADMITTED;
+    } else if (!inbox) {
+        *why = "no transfer slot free";
+    } else if (u->queued >= SCHED_USER_QUEUE_MAX) {
+        *why = "too many uploads waiting";
+    } else if (!(*wait = (sched_wait_t *)calloc(1, sizeof(sched_wait_t)))) {
+        *why = "out of memory";
+    } else {
+        sched_wait_t *wt = *wait;
+        wt->user = u;
+        wt->inbox = inbox;
+        wt->owner = owner;
+        wt->size = size;
+        wt->since_us = now_us();
+        sched_wait_t **p = &u->queue;
+        while (*p) p = &(*p)->next;
+        *p = wt;
+        u->queued++;
+        sched.queued++;
+        if (!u->rr_next) {
+            if (!sched.rr) {
+                u->rr_next = u->rr_prev = u;
+                sched.rr = u;
+            } else {
+                // Served last, after every user already waiting
+                u->rr_next = sched.rr;
+                u->rr_prev = sched.rr->rr_prev;
+                u->rr_prev->rr_next = u;
+                sched.rr->rr_prev = u;
+            }
+        }
+        r = SCHED_QUEUED;
+    }
+    if (r != SCHED_REFUSED) {
+        u->bytes_reserved += size;
+        sched.reserved += size;
+    }
+    pthread_mutex_unlock(&sched.lock);
+    return r;
+}
+
+// An admitted upload of size bytes ended; ok keeps it on the user's quota.
+static inline void sched_release(sched_user_t *u, uint64_t size, int ok) {
+    pthread_mutex_lock(&sched.lock);
+    if (--u->active == 0) sched.active_users--;
+    sched.active--;
+    u->bytes_reserved -= size;
+    sched.reserved -= size;
+    if (ok) u->bytes_used += size;
+    sched_dispatch();
+    pthread_mutex_unlock(&sched.lock);
+}
+
+// The connection of a queued upload closed. A wait not admitted yet is
+// dropped here; an admitted one is in the inbox, whose owner releases it.
+static inline void sched_cancel(sched_wait_t *wt) {
+    pthread_mutex_lock(&sched.lock);
+    wt->owner = NULL;
+    int granted = wt->granted;
+    if (!granted) {
+        sched_user_t *u = wt->user;
+        for (sched_wait_t **p = &u->queue; *p; p = &(*p)->next) {
+            if (*p == wt) {
+                *p = wt->next;
+                break;
+            }
+        }
+        u->queued--;
+        sched.queued--;
+        u->bytes_reserved -= wt->size;
+        sched.reserved -= wt->size;
+        if (!u->queue) sched_rr_remove(u);
+    }
+    pthread_mutex_unlock(&sched.lock);
+    if (!granted) free(wt);
+}
+
+static inline sched_wait_t *sched_inbox_take(sched_inbox_t *in) {
+    if (!__atomic_load_n(&in->ready, __ATOMIC_ACQUIRE)) return NULL;
+    pthread_mutex_lock(&in->lock);
+    sched_wait_t *list = in->ready;
+    in->ready = NULL;
+    pthread_mutex_unlock(&in->lock);
+    return list;
+}
+
+static inline uint64_t sched_round(uint64_t t_us) {
+    return t_us / SCHED_ROUND_US;
+}
+
+// When the next round starts.
+static inline uint64_t sched_next_round_us() {
+    return (sched_round(now_us()) + 1) * SCHED_ROUND_US;
+}
+
+// Top u up for the rounds that passed. Caller holds the lock.
+static inline void sched_refill(sched_user_t *u) {
+    uint64_t round = sched_round(now_us());
+    if (u->round == round) return;
+    int64_t quantum = (int64_t)(sched.rate * SCHED_ROUND_US / 1000000) / (sched.active_users ? sched.active_users : 1);
+    if (quantum < 1) quantum = 1;
+    uint64_t rounds = round - u->round;
+    u->deficit = rounds > 1000 ? quantum : u->deficit + quantum * (int64_t)rounds;
+    if (u->deficit > quantum) u->deficit = quantum;
+    u->round = round;
+}
+
+// -B: whether u may receive more this round.
+static inline int sched_may_receive(sched_user_t *u) {
+    if (!sched.rate) return 1;
+    pthread_mutex_lock(&sched.lock);
+    sched_refill(u);
+    int ok = u->deficit > 0;
+    pthread_mutex_unlock(&sched.lock);
+    return ok;
+}
+
+// -B: u received n bytes.
+static inline void sched_charge(sched_user_t *u, uint64_t n) {
+    if (!sched.rate) return;
+    pthread_mutex_lock(&sched.lock);
+    sched_refill(u);
+    u->deficit -= (int64_t)n;
+    pthread_mutex_unlock(&sched.lock);
+}
+
+static inline void sched_write_metrics(FILE *out, const char *prefix) {
+    pthread_mutex_lock(&sched.lock);
+    int active = sched.active, users = sched.active_users, queued = sched.queued;
+    uint64_t reserved = sched.reserved;
+    pthread_mutex_unlock(&sched.lock);
+    fprintf(out, "# HELP %s_uploads_active Admitted uploads in progress\n# TYPE %s_uploads_active gauge\n", prefix,
+            prefix);
+    fprintf(out, "%s_uploads_active %d\n", prefix, active);
+    fprintf(out, "# HELP %s_upload_users_active Users with uploads in progress\n# TYPE %s_upload_users_active gauge\n",
+            prefix, prefix);
+    fprintf(out, "%s_upload_users_active %d\n", prefix, users);
+    fprintf(out, "# HELP %s_uploads_queued Uploads waiting for a transfer slot\n# TYPE %s_uploads_queued gauge\n",
+            prefix, prefix);
+    fprintf(out, "%s_uploads_queued %d\n", prefix, queued);
+    fprintf(out, "# HELP %s_upload_reserved_bytes Bytes of admitted and queued uploads\n"
+                 "# TYPE %s_upload_reserved_bytes gauge\n", prefix, prefix);
+    fprintf(out, "%s_upload_reserved_bytes %llu\n", prefix, (unsigned long long)reserved);
+}
+
+#endif
@@ -0,0 +1,445 @@
+// Batch uploads of many files: a directory tree or a glob, sent by the
+// `dir` command of the TCP client.
+//
+// One round trip per file is what limits a transfer of many small files,
+// so files up to BATCH_SMALL_MAX are packed several to a FRAME_PACK and
+// streamed without waiting for any reply. Each pack starts with a manifest
+// of its entries:
+//
+//   u16 count, then count x (u16 name length, u32 size),
+//   then each entry's name followed by its contents
+//
+// Names are relative paths; batch_path() accepts only ones that stay inside
+// the save directory. Larger files go as ordinary uploads with
+// FILE_FLAG_BATCH over a few more connections in parallel.
+//
+// Creating files costs the server more than receiving them (open, write
+// and close per file, plus directories), so the event loop only copies
+// each pack into a job for a pool of writer threads. The queue is bounded
+// by BATCH_QUEUE_BYTES; past that the worker writes the pack itself, which
+// stops it reading more until the disk catches up. When the client has
+// committed and the last pack is written, the writer links the batch into
+// its worker's inbox and wakes it through the rooms' eventfd, and the
+// worker sends the reply.
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "pool.h"
+#include "metrics.h"
+
+#define BATCH_SMALL_MAX (32 * 1024)          // Larger files are sent on their own
+#define BATCH_PACK_MAX 1024                  // Entries per pack
+#define BATCH_ENTRY_SIZE 6
+#define BATCH_PATH_MAX 400                   // Relative path, with its terminator
+#define BATCH_QUEUE_BYTES (32 * 1024 * 1024) // Packs waiting for a writer
+#define BATCH_MAX_WRITERS 64
+
+// ---------------------------------------------------------------------------
+// Packs and paths, shared by client and server
+// ---------------------------------------------------------------------------
+
+// Copy name into out as a C string if it is a relative path made of
+// ordinary components: no leading '/', no empty, "." or ".." component,
+// no backslash or NUL. Returns -1 otherwise.
+static inline int batch_path(const char *name, size_t len, char *out, size_t cap) {
+    if (len == 0 || len >= cap || len >= BATCH_PATH_MAX) return -1;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && name[i] != '/') {
+            if (name[i] == '\\' || name[i] == '\0') return -1;
+            continue;
+        }
+        size_t n = i - start;
+        if (n == 0 || (n == 1 && name[start] == '.') || (n == 2 && name[start] == '.' && name[start + 1] == '.')) {
+            return -1;
+        }
+        start = i + 1;
+    }
+    memcpy(out, name, len);
+    out[len] = '\0';
+    return 0;
+}
+
+// Create the directories above path (a file name), starting after its
+// first skip bytes, which must exist already.
+static inline int batch_mkdirs(char *path, size_t skip) {
+    for (char *p = path + skip; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        int r = mkdir(path, 0755);
+        *p = '/';
+        if (r < 0 && errno != EEXIST) return -1;
+    }
+    return 0;
+}
+
+// Client side: a pack being filled. Contents are read straight into body.
+typedef struct {
+    uint32_t count;
+    uint16_t name_len[BATCH_PACK_MAX];
+    uint32_t size[BATCH_PACK_MAX];
+    size_t body_len;
+    char body[FRAME_MAX_PAYLOAD];
+} batch_pack_t;
+
+static inline int batch_pack_fits(const batch_pack_t *pk, size_t name_len, uint64_t size) {
+    return pk->count < BATCH_PACK_MAX &&
+           2 + (pk->count + 1) * BATCH_ENTRY_SIZE + pk->body_len + name_len + size <= FRAME_MAX_PAYLOAD;
+}
+
+// Add an entry; returns where its size bytes of contents go.
+static inline char *batch_pack_add(batch_pack_t *pk, const char *name, size_t name_len, uint32_t size) {
+    pk->name_len[pk->count] = (uint16_t)name_len;
+    pk->size[pk->count] = size;
+    pk->count++;
+    memcpy(pk->body + pk->body_len, name, name_len);
+    pk->body_len += name_len + size;
+    return pk->body + pk->body_len - size;
+}
+
+// Take the last entry back out, when its file could not be read.
+static inline void batch_pack_drop(batch_pack_t *pk) {
+    pk->count--;
+    pk->body_len -= pk->name_len[pk->count] + pk->size[pk->count];
+}
+
+// The FRAME_PACK payload, into out (FRAME_MAX_PAYLOAD bytes); empties pk.
+static inline size_t batch_pack_encode(batch_pack_t *pk, char *out) {
+    put_u16(out, (uint16_t)pk->count);
+    char *p = out + 2;
+    for (uint32_t i = 0; i < pk->count; i++, p += BATCH_ENTRY_SIZE) {
+        put_u16(p, pk->name_len[i]);
+        put_u32(p + 2, pk->size[i]);
+    }
+    memcpy(p, pk->body, pk->body_len);
+    size_t len = (size_t)(p - out) + pk->body_len;
+    pk->count = 0;
+    pk->body_len = 0;
+    return len;
+}
+
+// Server side: the entry count of a FRAME_PACK whose manifest accounts for
+// exactly its payload, or -1.
+static inline int batch_pack_check(const char *p, uint32_t len) {
+    if (len < 2) return -1;
+    uint32_t count = get_u16(p);
+    uint64_t need = 2 + (uint64_t)count * BATCH_ENTRY_SIZE;
+    if (need > len) return -1;
+    for (uint32_t i = 0; i < count; i++) {
+        need += get_u16(p + 2 + i * BATCH_ENTRY_SIZE) + (uint64_t)get_u32(p + 4 + i * BATCH_ENTRY_SIZE);
+    }
+    return need == len ? (int)count : -1;
+}
+
+// ---------------------------------------------------------------------------
+// Server: batches and the writer pool
+// ---------------------------------------------------------------------------
+
+typedef struct batch batch_t;
+
+// Per worker: batches whose packs are all written, waiting for a reply.
+// Shares the worker's room eventfd.
+typedef struct {
+    pthread_mutex_t lock;
+    int efd;
+    batch_t *ready;
+} batch_inbox_t;
+
+struct batch {
+    pthread_mutex_t lock;
+    int refs;             // Owner, each queued pack, and the inbox while linked
+    void *owner;          // Connection, NULL once it has closed
+    batch_inbox_t *inbox;
+    int pending;          // Packs queued or being written
+    int committed;        // FRAME_COMMIT arrived
+    int scheduled;        // Linked into the inbox
+    batch_t *next_ready;
+    const char *dir;      // Save directory, with its trailing '/'
+    uint32_t announced;   // Files FRAME_BATCH said would come
+    uint64_t announced_bytes;
+    uint64_t packed_bytes; // Owner side: file bytes in the packs so far...
+    int overrun;           // ...were more than announced_bytes
+    uint32_t files;       // Written
+    uint32_t failed;
+    uint64_t bytes;
+    uint64_t start_us;
+};
+
+typedef struct batch_job {
+    struct batch_job *next;
+    batch_t *batch;
+    uint32_t len;         // Pack payload, which follows
+} batch_job_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    batch_job_t *head;
+    batch_job_t *tail;
+    size_t queued;        // Payload bytes
+    int nthreads;
+} batch_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0};
+
+// Parent directory each thread created last, so a tree of many files
+// costs one mkdir() pass per directory rather than one per file.
+static __thread char batch_last_dir[BATCH_PATH_MAX + 64];
+
+static inline void batch_inbox_init(batch_inbox_t *in, int efd) {
+    pthread_mutex_init(&in->lock, NULL);
+    in->efd = efd;
+    in->ready = NULL;
+}
+
+static inline batch_t *batch_new(batch_inbox_t *inbox, void *owner, const char *dir, uint32_t files, uint64_t bytes) {
+    batch_t *b = (batch_t *)calloc(1, sizeof(batch_t));
+    if (!b) return NULL;
+    pthread_mutex_init(&b->lock, NULL);
+    b->refs = 1;
+    b->owner = owner;
+    b->inbox = inbox;
+    b->dir = dir;
+    b->announced = files;
+    b->announced_bytes = bytes;
+    b->start_us = now_us();
+    return b;
+}
+
+static inline void batch_put(batch_t *b) {
+    pthread_mutex_lock(&b->lock);
+    int last = --b->refs == 0;
+    pthread_mutex_unlock(&b->lock);
+    if (!last) return;
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+// Owner side: the connection is going away, or is done with the batch.
+static inline void batch_detach(batch_t *b) {
+    pthread_mutex_lock(&b->lock);
+    b->owner = NULL;
+    pthread_mutex_unlock(&b->lock);
+    batch_put(b);
+}
+
+// Create one file of a pack. Returns 0 on success.
+static inline int batch_write_file(batch_t *b, const char *name, size_t name_len, const char *data, uint32_t size) {
+    char rel[BATCH_PATH_MAX];
+    char path[BATCH_PATH_MAX + 64];
+    if (batch_path(name, name_len, rel, sizeof(rel)) < 0) {
+        printf("Batch: rejected file name '%.*s'\n", (int)name_len, name);
+        return -1;
+    }
+    size_t skip = strlen(b->dir);
+    snprintf(path, sizeof(path), "%s%s", b->dir, rel);
+
+    // Directories only when the parent differs from the last file's
+    const char *slash = strrchr(path, '/');
+    size_t parent = (size_t)(slash - path);
+    int fresh = strncmp(batch_last_dir, path, parent) != 0 || batch_last_dir[parent] != '\0';
+    if (fresh && parent > skip) {
+        if (batch_mkdirs(path, skip) < 0) {
+            printf("Batch: cannot create directories for '%s': %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    memcpy(batch_last_dir, path, parent);
+    batch_last_dir[parent] = '\0';
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 && errno == ENOENT && !fresh && batch_mkdirs(path, skip) == 0) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);  // Removed behind our back
+    }
+    if (fd < 0) {
+        printf("Batch: cannot create '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    for (uint32_t off = 0; off < size;) {
+        ssize_t n = write(fd, data + off, size - off);
+        metrics_add(M_SYS_WRITE, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("Batch: write failed for '%s': %s\n", path, strerror(errno));
+            close(fd);
+            remove(path);
+            return -1;
+        }
+        off += (uint32_t)n;
+    }
+    close(fd);
+    metrics_add(M_BYTES_RECEIVED, size);
+    metrics_add(M_BATCH_FILES, 1);
+    return 0;
+}
+
+// Write every file of one FRAME_PACK and add them to the batch's totals.
+static inline void batch_write_pack(batch_t *b, const char *p, uint32_t len) {
+    uint32_t files = 0, failed = 0;
+    uint64_t bytes = 0;
+    int count = batch_pack_check(p, len);
+    if (count < 0) {
+        printf("Batch: malformed pack of %u bytes dropped\n", len);
+        failed = 1;
+    }
+    const char *data = p + 2 + (count > 0 ? count : 0) * BATCH_ENTRY_SIZE;
+    for (int i = 0; i < count; i++) {
+        uint16_t name_len = get_u16(p + 2 + i * BATCH_ENTRY_SIZE);
+        uint32_t size = get_u32(p + 4 + i * BATCH_ENTRY_SIZE);
+        if (batch_write_file(b, data, name_len, data + name_len, size) == 0) {
+            files++;
+            bytes += size;
+        } else {
+            failed++;
+        }
+        data += name_len + size;
+    }
+    pthread_mutex_lock(&b->lock);
+    b->files += files;
+    b->failed += failed;
+    b->bytes += bytes;
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Writer side: one queued pack is done. The last one after the commit
+// hands the batch back to its worker for the reply.
+static inline void batch_job_done(batch_t *b) {
+    pthread_mutex_lock(&b->lock);
+    int wake = --b->pending == 0 && b->committed && b->owner && !b->scheduled;
+    if (wake) {
+        b->scheduled = 1;
+        b->refs++;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (wake) {
+        batch_inbox_t *in = b->inbox;
+        pthread_mutex_lock(&in->lock);
+        b->next_ready = in->ready;
+        in->ready = b;
+        pthread_mutex_unlock(&in->lock);
+        uint64_t one = 1;
+        ssize_t n = write(in->efd, &one, sizeof(one));
+        (void)n;
+    }
+    batch_put(b);
+}
+
+static inline void *batch_writer_loop(void *data) {
+    metrics_thread_init((int)(intptr_t)data);
+    while (1) {
+        pthread_mutex_lock(&batch_pool.lock);
+        while (!batch_pool.head) pthread_cond_wait(&batch_pool.cond, &batch_pool.lock);
+        batch_job_t *job = batch_pool.head;
+        batch_pool.head = job->next;
+        if (!batch_pool.head) batch_pool.tail = NULL;
+        pthread_mutex_unlock(&batch_pool.lock);
+
+        batch_write_pack(job->batch, (const char *)(job + 1), job->len);
+
+        pthread_mutex_lock(&batch_pool.lock);
+        batch_pool.queued -= job->len;
+        pthread_mutex_unlock(&batch_pool.lock);
+        batch_job_done(job->batch);
+        pbuf_put(job);
+    }
+    return NULL;
+}
+
+// Start n writer threads; their metrics are labelled first_id onwards.
+static inline int batch_writers_start(int n, int first_id) {
+    for (int i = 0; i < n; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, batch_writer_loop, (void *)(intptr_t)(first_id + i)) != 0) return -1;
+        pthread_detach(t);
+        batch_pool.nthreads++;
+    }
+    return 0;
+}
+
+// Owner side: count the file bytes of one FRAME_PACK. Returns -1 once the
+// packs hold more than FRAME_BATCH announced, which is what the upload was
+// admitted for.
+static inline int batch_account(batch_t *b, const char *p, uint32_t len) {
+    int count = batch_pack_check(p, len);
+    for (int i = 0; i < count; i++) b->packed_bytes += get_u32(p + 4 + i * BATCH_ENTRY_SIZE);
+    return b->packed_bytes > b->announced_bytes ? -1 : 0;
+}
+
+// Owner side: hand one FRAME_PACK to the writers, or write it right here
+// when they are too far behind (or there are none).
+static inline void batch_submit(batch_t *b, const char *payload, uint32_t len) {
+    pthread_mutex_lock(&batch_pool.lock);
+    int queue = batch_pool.nthreads > 0 && batch_pool.queued + len <= BATCH_QUEUE_BYTES;
+    if (queue) batch_pool.queued += len;
+    pthread_mutex_unlock(&batch_pool.lock);
+
+    batch_job_t *job = queue ? (batch_job_t *)pbuf_alloc(sizeof(batch_job_t) + len) : NULL;
+    if (!job) {
+        if (queue) {
+            pthread_mutex_lock(&batch_pool.lock);
+            batch_pool.queued -= len;
+            pthread_mutex_unlock(&batch_pool.lock);
+        }
+        batch_write_pack(b, payload, len);
+        return;
+    }
+    job->next = NULL;
+    job->batch = b;
+    job->len = len;
+    memcpy(job + 1, payload, len);
+    pthread_mutex_lock(&b->lock);
+    b->pending++;
+    b->refs++;
+    pthread_mutex_unlock(&b->lock);
+
+    pthread_mutex_lock(&batch_pool.lock);
+    if (batch_pool.tail) {
+        batch_pool.tail->next = job;
+    } else {
+        batch_pool.head = job;
+    }
+    batch_pool.tail = job;
+    pthread_cond_signal(&batch_pool.cond);
+    pthread_mutex_unlock(&batch_pool.lock);
+}
+
+// Owner side: the client sent FRAME_COMMIT. Returns 1 if every pack is
+// already written, so the reply can go out now; otherwise the last writer
+// schedules the batch in the inbox.
+static inline int batch_commit(batch_t *b) {
+    pthread_mutex_lock(&b->lock);
+    b->committed = 1;
+    int done = b->pending == 0;
+    pthread_mutex_unlock(&b->lock);
+    return done;
+}
+
+static inline batch_t *batch_inbox_take(batch_inbox_t *in) {
+    if (!__atomic_load_n(&in->ready, __ATOMIC_ACQUIRE)) return NULL;
+    pthread_mutex_lock(&in->lock);
+    batch_t *list = in->ready;
+    in->ready = NULL;
+    pthread_mutex_unlock(&in->lock);
+    return list;
+}
+
+// Owner side: the connection of a batch taken from the inbox, or NULL if
+// it has closed. The caller still puts the inbox's reference.
+static inline void *batch_claim(batch_t *b) {
+    pthread_mutex_lock(&b->lock);
+    b->scheduled = 0;
+    void *owner = b->owner;
+    pthread_mutex_unlock(&b->lock);
+    return owner;
+}
+
+#endif
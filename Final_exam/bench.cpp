@@ -0,0 +1,727 @@
+// Headless load generator for server_tcp and server_udp: N concurrent
+// clients exchange echo messages and upload files from memory, timing
+// every round trip. Run it once against `server_tcp -e uring` and once
+// against `server_tcp -e epoll` to compare the two event loops, or with -u
+// against server_udp, optionally through a lossy relay (-l).
+//
+// With -V every upload is verified (checksum.h): TCP uploads commit their
+// chunk CRCs and digest, UDP ones their digest. Comparing a run with and
+// without it gives the end-to-end cost; the single-core speed of each
+// checksum is measured on the upload data first. -x corrupts file segments
+// in the relay to exercise the UDP CRC check.
+//
+// Messages can be sent open-loop at a fixed rate (-R). Their latency is then
+// measured from when each one was due, not from when it went out, so a
+// stalled server shows up in the tail instead of slowing the clients down.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "rudp.h"
+#include "checksum.h"
+
+#define SERVER_IP "127.0.0.2"
+#define SERVERPORT 9000
+#define MAX_CLIENTS 4096
+#define UDP_TRIES 5                  // Attempts per UDP request before it counts as failed
+#define UDP_ECHO_TIMEOUT_US 200000   // Per attempt; file handshakes use RUDP_INITIAL_RTO_US
+#define ACK_BUFSIZE 256
+#define RELAY_BATCH 64               // Datagrams the relay moves per wakeup and socket
+
+static struct sockaddr_in serveraddr;
+static int nclients = 16;
+static int files_per_client = 4;
+static long long file_size = 16 * 1024 * 1024;
+static int msgs_per_client = 100;
+static int msg_size = 16;
+static int msg_rate = 0;           // Messages per second per client, 0: next one as soon as the last returns
+static int use_udp = 0;
+static double loss = 0.0;          // Share of datagrams the relay drops, each way
+static double corrupt = 0.0;       // Share of file segments the relay damages on the way up
+static int verify = 0;             // Verified uploads (FILE_FLAG_VERIFY)
+static const char *json_path;
+static char *file_data;            // Shared by every client; the content does not matter
+static int file_memfd = -1;        // The same bytes for rudp.h, which reads with preadv()
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int ok;
+    struct sockaddr_in target;  // Server, or this client's relay port
+    uint64_t *file_us;  // Per-upload latency, FRAME_FILE to FILE_OK
+    uint64_t *msg_us;   // Per-message echo latency
+    size_t nfile;
+    size_t nmsg;
+    int file_failed;
+    int msg_failed;
+    uint64_t retransmits;  // UDP segments sent again
+} bench_client_t;
+
+// The lossy path for -u -l and -x: every client gets a pair of sockets,
+// one it sends to and one that talks to the server, and a single thread
+// copies datagrams between them, dropping each with probability loss and
+// flipping a byte in a file segment with probability corrupt.
+typedef struct {
+    int down;                 // Faces the client
+    int up;                   // Faces the server
+    struct sockaddr_in client;
+    int have_client;
+} relay_pair_t;
+
+typedef struct {
+    relay_pair_t *pairs;
+    int npairs;
+    int epfd;
+    uint64_t forwarded;
+    uint64_t dropped;
+    uint64_t corrupted;
+} relay_t;
+
+static relay_t relay;
+
+void err_quit(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+int send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Sleep until the monotonic clock reads at least when_us.
+void sleep_until(uint64_t when_us) {
+    uint64_t now = now_us();
+    if (when_us <= now) return;
+    struct timespec ts = {(time_t)((when_us - now) / 1000000), (long)((when_us - now) % 1000000) * 1000};
+    nanosleep(&ts, NULL);
+}
+
+// When message i is due: now for closed-loop runs, on the rate schedule otherwise.
+uint64_t msg_due(uint64_t start, int i) {
+    if (msg_rate <= 0) return now_us();
+    uint64_t due = start + (uint64_t)i * 1000000 / (uint64_t)msg_rate;
+    sleep_until(due);
+    return due;
+}
+
+// ---------------------------------------------------------------------------
+// TCP
+// ---------------------------------------------------------------------------
+
+// Receive one frame and return its type, or -1.
+int recv_type(int sock, ring_t *in) {
+    frame_hdr_t hdr = {0};
+    const char *payload = NULL;
+    if (recv_frame(sock, in, &hdr, &payload) <= 0) return -1;
+    ring_consume(in, FRAME_HDR_SIZE + hdr.length);
+    return hdr.type;
+}
+
+// Send file_data as a verified upload's body, checksumming each chunk on
+// the way, then commit. Returns the server's verdict or -1.
+int tcp_send_verified(int sock, ring_t *in, uint32_t stream_id, uint32_t chunk_size, char *commit) {
+    verify_t v;
+    if (verify_init(&v, (uint64_t)file_size, chunk_size) < 0) return -1;
+    int r = 0;
+    for (long long off = 0; off < file_size && r == 0; off += chunk_size) {
+        size_t n = file_size - off < chunk_size ? (size_t)(file_size - off) : chunk_size;
+        verify_update(&v, file_data + off, n);
+        r = send_all(sock, file_data + off, n);
+    }
+    if (r == 0) r = send_frame(sock, FRAME_COMMIT, 0, stream_id, commit, verify_encode_commit(&v, commit));
+    verify_free(&v);
+    return r < 0 ? -1 : recv_type(sock, in);
+}
+
+void *tcp_client_loop(void *data) {
+    bench_client_t *bc = (bench_client_t *)data;
+    ring_t in;
+    if (ring_init(&in, RING_SIZE) < 0) return NULL;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&bc->target, sizeof(bc->target)) < 0) {
+        printf("Client %d: connect failed: %s\n", bc->index, strerror(errno));
+        if (sock >= 0) close(sock);
+        ring_free(&in);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char name[64];
+    char *msg = (char *)malloc((size_t)msg_size + 1);
+    char *commit = verify ? (char *)malloc(FRAME_MAX_PAYLOAD) : NULL;
+    uint32_t stream_id = 1;
+    snprintf(name, sizeof(name), "bench%d", bc->index);
+    if (!msg || (verify && !commit) || send_frame(sock, FRAME_USER, 0, stream_id++, name, strlen(name)) < 0 ||
+        recv_type(sock, &in) != FRAME_USER_OK) {
+        printf("Client %d: login failed\n", bc->index);
+        goto out;
+    }
+
+    memset(msg, 'x', (size_t)msg_size);
+    {
+        uint64_t start = now_us();
+        for (int i = 0; i < msgs_per_client; i++) {
+            uint64_t due = msg_due(start, i);
+            if (send_frame(sock, FRAME_MSG, 0, stream_id++, msg, (size_t)msg_size) < 0 ||
+                recv_type(sock, &in) != FRAME_MSG) {
+                printf("Client %d: echo failed\n", bc->index);
+                goto out;
+            }
+            bc->msg_us[bc->nmsg++] = now_us() - due;
+        }
+    }
+
+    // Every upload of a client goes to the same name, so the server's
+    // directory does not grow with the run length
+    snprintf(name, sizeof(name), "bench-%d.bin", bc->index);
+    for (int i = 0; i < files_per_client; i++) {
+        char file_info[FILE_INFO_SIZE + 64];
+        file_info_t info = {(uint64_t)file_size, verify ? verify_chunk_size((uint64_t)file_size) : 0, name, strlen(name)};
+        size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+        uint32_t id = stream_id++;
+        uint64_t start = now_us();
+        if (send_frame(sock, FRAME_FILE, verify ? FILE_FLAG_VERIFY : 0, id, file_info, info_len) < 0 ||
+            recv_type(sock, &in) != FRAME_READY) {
+            printf("Client %d: upload refused\n", bc->index);
+            goto out;
+        }
+        int type = verify ? tcp_send_verified(sock, &in, id, info.chunk_size, commit)
+                          : send_all(sock, file_data, (size_t)file_size) < 0 ? -1 : recv_type(sock, &in);
+        if (type != FRAME_FILE_OK) {
+            printf("Client %d: upload failed\n", bc->index);
+            goto out;
+        }
+        bc->file_us[bc->nfile++] = now_us() - start;
+    }
+    bc->ok = 1;
+
+out:
+    free(msg);
+    free(commit);
+    close(sock);
+    ring_free(&in);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// UDP
+// ---------------------------------------------------------------------------
+
+// Wait up to timeout_us for a reply to stream_id and return its type, or -1.
+int udp_recv_reply(int sock, char *buf, size_t cap, uint32_t stream_id, uint64_t timeout_us) {
+    uint64_t deadline = now_us() + timeout_us;
+    while (1) {
+        uint64_t now = now_us();
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (now >= deadline || poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) <= 0) return -1;
+        ssize_t n = recv(sock, buf, cap, 0);
+        if (n < 0) return -1;
+        frame_hdr_t hdr;
+        if (frame_parse_datagram(buf, (size_t)n, &hdr) < 0 || hdr.stream_id != stream_id) continue;
+        return hdr.type;
+    }
+}
+
+// Send a request until a reply arrives. Returns the reply type, or -1.
+int udp_request(bench_client_t *bc, int sock, uint8_t type, uint16_t flags, uint32_t stream_id, const char *payload,
+                size_t len, uint64_t timeout_us, char *buf, size_t cap) {
+    for (int i = 0; i < UDP_TRIES; i++) {
+        if (sendto_frame(sock, &bc->target, type, flags, stream_id, payload, len) < 0) return -1;
+        int reply = udp_recv_reply(sock, buf, cap, stream_id, timeout_us);
+        if (reply >= 0) return reply;
+    }
+    return -1;
+}
+
+// One reliable upload of file_data, as client_udp sends it. Returns the
+// server's verdict or -1.
+int udp_send_file(bench_client_t *bc, int sock, rudp_tx_t *tx, uint32_t stream_id, char *buf) {
+    if (rudp_tx_init(tx, sock, &bc->target, stream_id, file_memfd, (uint64_t)file_size, RUDP_DEFAULT_SEG_SIZE,
+                     RUDP_DEFAULT_WINDOW, &cc_aimd) < 0) {
+        return -1;
+    }
+    tx->verify = verify;
+    int committed = 0;
+    int result = -1;
+    while (result < 0 && !rudp_tx_done(tx)) {
+        if (rudp_tx_fill_window(tx) < 0) break;
+        int64_t wait_us = rudp_tx_check_loss(tx);
+        if (wait_us < 0) break;
+        if (!committed && rudp_tx_digest_ready(tx)) {
+            rudp_tx_commit(tx);
+            committed = 1;
+        }
+
+        struct pollfd pfd = {sock, POLLIN, 0};
+        struct timespec ts = {(time_t)(wait_us / 1000000), (long)(wait_us % 1000000) * 1000};
+        ppoll(&pfd, 1, &ts, NULL);
+
+        ssize_t n;
+        while (result < 0 && (n = recv(sock, buf, ACK_BUFSIZE, MSG_DONTWAIT)) > 0) {
+            frame_hdr_t hdr;
+            if (frame_parse_datagram(buf, (size_t)n, &hdr) < 0 || hdr.stream_id != stream_id) continue;
+            if (hdr.type == FRAME_ACK) {
+                rudp_tx_on_ack(tx, buf + FRAME_HDR_SIZE, hdr.length);
+            } else if (hdr.type == FRAME_FILE_OK || hdr.type == FRAME_FILE_FAIL) {
+                result = hdr.type;
+            }
+        }
+        if (now_us() - tx->last_progress_us > RUDP_IDLE_TIMEOUT_US) break;
+    }
+
+    // A lost verdict is repeated when the commit or the last segment comes again
+    for (int i = 0; result < 0 && rudp_tx_done(tx) && i < UDP_TRIES; i++) {
+        if (tx->verify) rudp_tx_commit(tx);
+        result = udp_recv_reply(sock, buf, ACK_BUFSIZE, stream_id, tx->rto_us);
+        if (result == FRAME_ACK) result = -1;
+        if (result < 0 && !tx->verify && tx->nsegs > 0) rudp_tx_transmit(tx, tx->nsegs - 1);
+    }
+    bc->retransmits += tx->retransmits;
+    rudp_tx_free(tx);
+    return result;
+}
+
+void *udp_client_loop(void *data) {
+    bench_client_t *bc = (bench_client_t *)data;
+    char buf[UDP_MAX_DATAGRAM];
+    char name[64];
+    uint32_t stream_id = 1;
+    char *msg = (char *)malloc((size_t)msg_size + 1);
+    rudp_tx_t *tx = (rudp_tx_t *)malloc(sizeof(rudp_tx_t));
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!msg || !tx || sock < 0) {
+        printf("Client %d: setup failed: %s\n", bc->index, strerror(errno));
+        goto out;
+    }
+    rudp_tune_socket(sock);
+
+    snprintf(name, sizeof(name), "bench%d", bc->index);
+    if (udp_request(bc, sock, FRAME_USER, 0, stream_id++, name, strlen(name), UDP_ECHO_TIMEOUT_US, buf, sizeof(buf)) !=
+        FRAME_USER_OK) {
+        printf("Client %d: login failed\n", bc->index);
+        goto out;
+    }
+
+    memset(msg, 'x', (size_t)msg_size);
+    {
+        uint64_t start = now_us();
+        for (int i = 0; i < msgs_per_client; i++) {
+            uint64_t due = msg_due(start, i);
+            if (udp_request(bc, sock, FRAME_MSG, 0, stream_id++, msg, (size_t)msg_size, UDP_ECHO_TIMEOUT_US, buf,
+                            sizeof(buf)) != FRAME_MSG) {
+                bc->msg_failed++;
+                continue;
+            }
+            bc->msg_us[bc->nmsg++] = now_us() - due;
+        }
+    }
+
+    snprintf(name, sizeof(name), "bench-%d.bin", bc->index);
+    for (int i = 0; i < files_per_client; i++) {
+        char file_info[FILE_INFO_SIZE + 64];
+        file_info_t info = {(uint64_t)file_size, RUDP_DEFAULT_SEG_SIZE, name, strlen(name)};
+        size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+        uint32_t id = stream_id++;
+        uint64_t start = now_us();
+        uint16_t flags = FILE_FLAG_RELIABLE | (verify ? FILE_FLAG_VERIFY : 0);
+        int type = udp_request(bc, sock, FRAME_FILE, flags, id, file_info, info_len, RUDP_INITIAL_RTO_US, buf,
+                               sizeof(buf));
+        if (type == FRAME_READY) type = udp_send_file(bc, sock, tx, id, buf);
+        if (type != FRAME_FILE_OK) {
+            bc->file_failed++;
+            continue;
+        }
+        bc->file_us[bc->nfile++] = now_us() - start;
+    }
+    bc->ok = bc->msg_failed == 0 && bc->file_failed == 0;
+    if (!bc->ok) printf("Client %d: %d echoes and %d uploads failed\n", bc->index, bc->msg_failed, bc->file_failed);
+
+out:
+    free(msg);
+    free(tx);
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Lossy relay
+// ---------------------------------------------------------------------------
+
+static inline uint64_t xorshift64(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+void *relay_loop(void *data) {
+    (void)data;
+    uint64_t seed = now_us() | 1;
+    uint64_t threshold = (uint64_t)(loss * (double)UINT64_MAX);
+    uint64_t damage = (uint64_t)(corrupt * (double)UINT64_MAX);
+    char (*bufs)[UDP_MAX_DATAGRAM] = (char (*)[UDP_MAX_DATAGRAM])malloc((size_t)RELAY_BATCH * UDP_MAX_DATAGRAM);
+    struct mmsghdr msgs[RELAY_BATCH];
+    struct iovec iov[RELAY_BATCH];
+    struct sockaddr_in from[RELAY_BATCH];
+    struct epoll_event events[256];
+    if (!bufs) err_quit("Relay allocation failed");
+
+    while (1) {
+        int n = epoll_wait(relay.epfd, events, 256, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err_quit("epoll_wait failed");
+        }
+        for (int e = 0; e < n; e++) {
+            relay_pair_t *p = &relay.pairs[events[e].data.u32 >> 1];
+            int upward = !(events[e].data.u32 & 1);
+            int in = upward ? p->down : p->up;
+
+            for (int i = 0; i < RELAY_BATCH; i++) {
+                iov[i].iov_base = bufs[i];
+                iov[i].iov_len = UDP_MAX_DATAGRAM;
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &from[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            }
+            int got = recvmmsg(in, msgs, RELAY_BATCH, MSG_DONTWAIT, NULL);
+            for (int i = 0; i < got; i++) {
+                if (upward) {
+                    p->client = from[i];
+                    p->have_client = 1;
+                }
+                if (xorshift64(&seed) < threshold || (!upward && !p->have_client)) {
+                    __atomic_add_fetch(&relay.dropped, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                frame_hdr_t hdr;
+                if (upward && damage && xorshift64(&seed) < damage &&
+                    frame_parse_datagram(bufs[i], msgs[i].msg_len, &hdr) == 0 && hdr.type == FRAME_DATA) {
+                    bufs[i][FRAME_HDR_SIZE + xorshift64(&seed) % hdr.length] ^= 0x20;
+                    __atomic_add_fetch(&relay.corrupted, 1, __ATOMIC_RELAXED);
+                }
+                if (upward) {
+                    sendto(p->up, bufs[i], msgs[i].msg_len, 0, (struct sockaddr *)&serveraddr, sizeof(serveraddr));
+                } else {
+                    sendto(p->down, bufs[i], msgs[i].msg_len, 0, (struct sockaddr *)&p->client, sizeof(p->client));
+                }
+                __atomic_add_fetch(&relay.forwarded, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Give every client its own relay port; they send there instead of to the server.
+void relay_start(bench_client_t *clients) {
+    relay.pairs = (relay_pair_t *)calloc(nclients, sizeof(relay_pair_t));
+    relay.npairs = nclients;
+    relay.epfd = epoll_create1(0);
+    if (!relay.pairs || relay.epfd < 0) err_quit("Relay setup failed");
+
+    for (int i = 0; i < nclients; i++) {
+        relay_pair_t *p = &relay.pairs[i];
+        struct sockaddr_in local = {0};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(local);
+        p->down = socket(AF_INET, SOCK_DGRAM, 0);
+        p->up = socket(AF_INET, SOCK_DGRAM, 0);
+        if (p->down < 0 || p->up < 0 || bind(p->down, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+            getsockname(p->down, (struct sockaddr *)&clients[i].target, &len) < 0) {
+            err_quit("Relay socket setup failed");
+        }
+        rudp_tune_socket(p->down);
+        rudp_tune_socket(p->up);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i << 1;
+        if (epoll_ctl(relay.epfd, EPOLL_CTL_ADD, p->down, &ev) < 0) err_quit("epoll_ctl failed");
+        ev.data.u32 = ((uint32_t)i << 1) | 1;
+        if (epoll_ctl(relay.epfd, EPOLL_CTL_ADD, p->up, &ev) < 0) err_quit("epoll_ctl failed");
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relay_loop, NULL) != 0) err_quit("Failed to create relay thread");
+    pthread_detach(thread);
+}
+
+// ---------------------------------------------------------------------------
+// Results
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    size_t samples;
+    int failed;
+    double p50, p99, p999, max, mean;  // Milliseconds
+} latency_t;
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentiles of n latencies, sorting them in place.
+latency_t summarize(uint64_t *us, size_t n, int failed) {
+    latency_t l = {n, failed, 0, 0, 0, 0, 0};
+    if (n == 0) return l;
+    qsort(us, n, sizeof(uint64_t), cmp_u64);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) sum += (double)us[i];
+    l.p50 = us[(n * 50 + 99) / 100 - 1] / 1000.0;
+    l.p99 = us[(n * 99 + 99) / 100 - 1] / 1000.0;
+    l.p999 = us[(n * 999 + 999) / 1000 - 1] / 1000.0;
+    l.max = us[n - 1] / 1000.0;
+    l.mean = sum / n / 1000.0;
+    return l;
+}
+
+void print_latency(const char *what, const latency_t *l) {
+    if (l->samples == 0 && l->failed == 0) return;
+    printf("%-8s %8zu samples %5d failed  p50 %9.3f ms  p99 %9.3f ms  p999 %9.3f ms  max %9.3f ms\n", what,
+           l->samples, l->failed, l->p50, l->p99, l->p999, l->max);
+}
+
+void json_latency(FILE *out, const char *what, const latency_t *l, int last) {
+    fprintf(out,
+            "  \"%s\": {\"samples\": %zu, \"failed\": %d, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, "
+            "\"max_ms\": %.3f, \"mean_ms\": %.3f}%s\n",
+            what, l->samples, l->failed, l->p50, l->p99, l->p999, l->max, l->mean, last ? "" : ",");
+}
+
+typedef struct {
+    double crc, crc_table, hash;  // GB/s
+} checksum_speed_t;
+
+// Single-core speed of each checksum over the upload data, about 256 MB each.
+checksum_speed_t measure_checksums() {
+    checksum_speed_t s = {0, 0, 0};
+    if (file_size == 0) return s;
+    long long reps = (256LL << 20) / file_size + 1;
+    volatile uint32_t sink = 0;  // Keeps the loops from being optimized away
+    uint64_t t0 = now_us();
+    for (long long i = 0; i < reps; i++) sink = sink ^ crc32c(0, file_data, (size_t)file_size);
+    uint64_t t1 = now_us();
+    for (long long i = 0; i < reps; i++) sink = sink ^ crc32c_portable(0, file_data, (size_t)file_size);
+    uint64_t t2 = now_us();
+    for (long long i = 0; i < reps; i++) sink = sink ^ (uint32_t)bhash(file_data, (size_t)file_size).lo;
+    uint64_t t3 = now_us();
+    double bytes = (double)reps * file_size / 1e3;  // GB/s from microseconds
+    s.crc = bytes / (t1 - t0 + 1);
+    s.crc_table = bytes / (t2 - t1 + 1);
+    s.hash = bytes / (t3 - t2 + 1);
+    return s;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-u] [-c clients] [-n files] [-f file_kb] [-m messages] [-s msg_bytes] [-R rate] "
+                    "[-l loss_pct] [-x corrupt_pct] [-V] [-j results.json] [server_ip]\n", prog);
+    fprintf(stderr, "  -u    UDP: reliable uploads (rudp.h) and datagram echoes against server_udp\n");
+    fprintf(stderr, "  -c N  concurrent clients (default 16, max %d)\n", MAX_CLIENTS);
+    fprintf(stderr, "  -n N  uploads per client (default 4)\n");
+    fprintf(stderr, "  -f N  upload size in KB (default 16384)\n");
+    fprintf(stderr, "  -m N  echo messages per client, sent before the uploads (default 100)\n");
+    fprintf(stderr, "  -s N  message size in bytes (default 16)\n");
+    fprintf(stderr, "  -R N  messages per second per client (default 0: each as soon as the last returns)\n");
+    fprintf(stderr, "  -l P  UDP only: drop P%% of datagrams each way in an in-process relay\n");
+    fprintf(stderr, "  -x P  UDP only: damage one byte in P%% of the file segments in the relay\n");
+    fprintf(stderr, "  -V    verified uploads: chunk CRCs (TCP) and a whole-file digest, checked by the server\n");
+    fprintf(stderr, "  -j F  also write the results to F as JSON\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "uc:n:f:m:s:R:l:x:Vj:")) != -1) {
+        switch (opt) {
+        case 'u':
+            use_udp = 1;
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'n':
+            files_per_client = atoi(optarg);
+            break;
+        case 'f':
+            file_size = atoll(optarg) * 1024;
+            break;
+        case 'm':
+            msgs_per_client = atoi(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        case 'R':
+            msg_rate = atoi(optarg);
+            break;
+        case 'l':
+            loss = atof(optarg) / 100.0;
+            break;
+        case 'x':
+            corrupt = atof(optarg) / 100.0;
+            break;
+        case 'V':
+            verify = 1;
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    int max_msg = use_udp ? UDP_MAX_PAYLOAD : FRAME_MAX_PAYLOAD;
+    if (nclients < 1 || nclients > MAX_CLIENTS || files_per_client < 0 || file_size < 0 || msgs_per_client < 0 ||
+        msg_size < 0 || msg_size > max_msg || msg_rate < 0 || loss < 0 || loss >= 1 || corrupt < 0 || corrupt >= 1) {
+        usage(argv[0]);
+    }
+    if (corrupt > 0 && !use_udp) {
+        fprintf(stderr, "-x needs -u\n");
+        exit(1);
+    }
+    if (loss > 0 && !use_udp) {
+        fprintf(stderr, "-l needs -u; for TCP, add loss to loopback with: tc qdisc add dev lo root netem loss 1%%\n");
+        exit(1);
+    }
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(SERVERPORT);
+    if (inet_pton(AF_INET, optind < argc ? argv[optind] : SERVER_IP, &serveraddr.sin_addr) != 1) usage(argv[0]);
+
+    file_data = (char *)malloc(file_size > 0 ? (size_t)file_size : 1);
+    if (!file_data) err_quit("malloc failed");
+    for (long long i = 0; i < file_size; i++) file_data[i] = (char)(i * 131 + (i >> 12));
+    if (use_udp) {
+        file_memfd = memfd_create("bench", 0);
+        if (file_memfd < 0 || pwrite(file_memfd, file_data, (size_t)file_size, 0) != (ssize_t)file_size) {
+            err_quit("memfd setup failed");
+        }
+    }
+
+    bench_client_t *clients = (bench_client_t *)calloc(nclients, sizeof(bench_client_t));
+    uint64_t *file_us = (uint64_t *)calloc((size_t)nclients * files_per_client + 1, sizeof(uint64_t));
+    uint64_t *msg_us = (uint64_t *)calloc((size_t)nclients * msgs_per_client + 1, sizeof(uint64_t));
+    if (!clients || !file_us || !msg_us) err_quit("calloc failed");
+    for (int i = 0; i < nclients; i++) {
+        clients[i].index = i;
+        clients[i].target = serveraddr;
+        clients[i].file_us = file_us + (size_t)i * files_per_client;
+        clients[i].msg_us = msg_us + (size_t)i * msgs_per_client;
+    }
+    if (loss > 0 || corrupt > 0) relay_start(clients);
+
+    printf("%d %s clients, %d uploads of %lld KB and %d messages of %d bytes each", nclients, use_udp ? "UDP" : "TCP",
+           files_per_client, file_size / 1024, msgs_per_client, msg_size);
+    if (msg_rate > 0) printf(", %d messages/s", msg_rate);
+    if (loss > 0) printf(", %.2f%% loss", loss * 100);
+    if (corrupt > 0) printf(", %.2f%% of segments corrupted", corrupt * 100);
+    if (verify) printf(", verified");
+    printf("\n");
+
+    checksum_speed_t speed = {0, 0, 0};
+    if (verify) {
+        speed = measure_checksums();
+        printf("Checksums on one core: CRC-32C %.2f GB/s (%s), %.2f GB/s with tables; bhash %.2f GB/s\n", speed.crc,
+               crc32c_hardware() ? "SSE4.2" : "tables", speed.crc_table, speed.hash);
+    }
+
+    uint64_t start = now_us();
+    for (int i = 0; i < nclients; i++) {
+        if (pthread_create(&clients[i].thread, NULL, use_udp ? udp_client_loop : tcp_client_loop, &clients[i]) != 0) {
+            err_quit("Failed to create client thread");
+        }
+    }
+    int ok = 0, file_failed = 0, msg_failed = 0;
+    uint64_t retransmits = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        ok += clients[i].ok;
+        file_failed += clients[i].file_failed;
+        msg_failed += clients[i].msg_failed;
+        retransmits += clients[i].retransmits;
+    }
+    double secs = (now_us() - start) / 1e6;
+
+    // Pack the samples every client recorded into one array per kind
+    size_t nfile = 0, nmsg = 0;
+    for (int i = 0; i < nclients; i++) {
+        memmove(file_us + nfile, clients[i].file_us, clients[i].nfile * sizeof(uint64_t));
+        nfile += clients[i].nfile;
+    }
+    for (int i = 0; i < nclients; i++) {
+        memmove(msg_us + nmsg, clients[i].msg_us, clients[i].nmsg * sizeof(uint64_t));
+        nmsg += clients[i].nmsg;
+    }
+    latency_t echo = summarize(msg_us, nmsg, msg_failed);
+    latency_t upload = summarize(file_us, nfile, file_failed);
+
+    double mb = (double)nfile * file_size / (1024.0 * 1024.0);
+    double mb_per_s = secs > 0 ? mb / secs : 0.0;
+    double msg_per_s = secs > 0 ? nmsg / secs : 0.0;
+    printf("%d/%d clients completed in %.2f s: %.1f MB uploaded, %.2f MB/s, %.0f echoes/s\n", ok, nclients, secs, mb,
+           mb_per_s, msg_per_s);
+    print_latency("echo", &echo);
+    print_latency("upload", &upload);
+    if (use_udp) {
+        printf("%llu segments retransmitted", (unsigned long long)retransmits);
+        if (loss > 0 || corrupt > 0) {
+            printf(", relay forwarded %llu datagrams, dropped %llu and corrupted %llu",
+                   (unsigned long long)__atomic_load_n(&relay.forwarded, __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&relay.dropped, __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&relay.corrupted, __ATOMIC_RELAXED));
+        }
+        printf("\n");
+    }
+
+    if (json_path) {
+        FILE *out = fopen(json_path, "w");
+        if (!out) err_quit("Cannot write results");
+        fprintf(out, "{\n  \"protocol\": \"%s\",\n  \"clients\": %d,\n  \"uploads_per_client\": %d,\n", use_udp ? "udp" : "tcp",
+                nclients, files_per_client);
+        fprintf(out, "  \"file_bytes\": %lld,\n  \"messages_per_client\": %d,\n  \"message_bytes\": %d,\n", file_size,
+                msgs_per_client, msg_size);
+        fprintf(out, "  \"message_rate\": %d,\n  \"loss\": %.4f,\n  \"clients_completed\": %d,\n  \"seconds\": %.3f,\n",
+                msg_rate, loss, ok, secs);
+        fprintf(out, "  \"corrupt\": %.4f,\n  \"verify\": %d,\n", corrupt, verify);
+        if (verify) {
+            fprintf(out, "  \"crc32c_gb_per_s\": %.3f,\n  \"crc32c_table_gb_per_s\": %.3f,\n  \"bhash_gb_per_s\": %.3f,\n",
+                    speed.crc, speed.crc_table, speed.hash);
+        }
+        fprintf(out, "  \"upload_mb_per_s\": %.3f,\n  \"echoes_per_s\": %.1f,\n  \"retransmits\": %llu,\n", mb_per_s,
+                msg_per_s, (unsigned long long)retransmits);
+        json_latency(out, "echo", &echo, 0);
+        json_latency(out, "upload", &upload, 1);
+        fprintf(out, "}\n");
+        fclose(out);
+    }
+    return ok == nclients ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Build the servers and the load generator, then run a fixed set of
+# benchmarks on localhost and write one JSON file per run to RESULTS
+# (default: bench-results/). Servers run in a scratch directory that is
+# removed afterwards.
+#
+#   ./bench.sh                  # default suite
+#   CLIENTS=64 FILE_KB=4096 ./bench.sh
+#   READ_SIZES=4K,1G,50G ./bench.sh   # client read engines (bench_read)
+set -e
+
+cd "$(dirname "$0")"
+SRC=$(pwd)
+RESULTS=${RESULTS:-$SRC/bench-results}
+CLIENTS=${CLIENTS:-16}
+FILES=${FILES:-4}
+FILE_KB=${FILE_KB:-4096}
+MESSAGES=${MESSAGES:-200}
+MSG_BYTES=${MSG_BYTES:-64}
+LOSS=${LOSS:-1}
+READ_SIZES=${READ_SIZES:-4K,1M,64M}
+CXX=${CXX:-g++}
+
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null || true; wait $SERVER 2>/dev/null || true; rm -rf "$WORK"' EXIT INT TERM
+mkdir -p "$RESULTS"
+
+for prog in server_tcp server_udp bench bench_read; do
+    $CXX -O2 -o "$WORK/$prog" "$SRC/$prog.cpp" -lpthread
+done
+
+# run NAME SERVER_ARGS... -- BENCH_ARGS...
+run() {
+    name=$1
+    shift
+    server=$1
+    shift
+    args=""
+    while [ "$1" != "--" ]; do
+        args="$args $1"
+        shift
+    done
+    shift
+    (cd "$WORK" && exec "./$server" -M 0 $args >"$WORK/$name.log" 2>&1) &
+    SERVER=$!
+    sleep 0.5
+    echo "== $name"
+    "$WORK/bench" -c "$CLIENTS" -n "$FILES" -f "$FILE_KB" -m "$MESSAGES" -s "$MSG_BYTES" \
+        -j "$RESULTS/$name.json" "$@" || echo "$name: some clients failed"
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+}
+
+run tcp-uring server_tcp -e uring -- 127.0.0.1
+run tcp-epoll server_tcp -e epoll -- 127.0.0.1
+run udp server_udp -- -u 127.0.0.1
+run udp-loss server_udp -- -u -l "$LOSS" 127.0.0.1
+
+echo "== read"
+"$WORK/bench_read" -d "$WORK" -s "$READ_SIZES" -j "$RESULTS/read.json" || echo "read: some runs failed"
+
+echo "Results in $RESULTS"
@@ -0,0 +1,324 @@
+// Read engine benchmark: streams files of several sizes through each
+// engine of reader.h into a local socket, the way the clients send an
+// upload, and reports the throughput and the time the sender spent
+// waiting for the disk: blocked in read() or on the read-ahead thread, or
+// for mmap, which waits inside page faults it cannot time, the number of
+// faults that had to go to the disk. "plain" is the 64 KB read()-then-send() loop the
+// clients used before, for comparison.
+//
+// Files are created in a scratch directory (-d) unless given on the
+// command line, and dropped from the page cache before each run so the
+// disk is really read (-w keeps them cached instead). Sizes take K, M and
+// G suffixes: -s 4K,1M,1G,50G covers the range the engines are tuned for,
+// given the disk space.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "protocol.h"
+#include "reader.h"
+
+#define DEFAULT_SIZES "4K,64K,1M,16M,256M"
+#define SEND_SIZE 65536      // Per send(), as the TCP client sends
+#define SINK_BUFSIZE (1 << 20)
+#define MAX_FILES 32
+#define ENGINE_PLAIN 4       // After the reader_mode_t values
+
+static const char *engine_names[] = {"auto", "read", "mmap", "thread", "plain"};
+
+typedef struct {
+    const char *path;
+    long long size;
+    int engine;
+    double mb_per_s;
+    double secs;
+    double wait_secs;
+    long major_faults;       // Page faults that read the disk
+    const char *picked;      // What auto chose
+} result_t;
+
+void err_quit(const char *msg) {
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+long long parse_size(const char *s) {
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; // Fall through
+    case 'M': case 'm': n <<= 10; // Fall through
+    case 'K': case 'k': n <<= 10; end++;
+    }
+    return (*end && *end != ',') || n < 0 ? -1 : n;
+}
+
+void format_size(char *out, size_t cap, long long n) {
+    if (n >= 1LL << 30 && n % (1LL << 30) == 0) snprintf(out, cap, "%lldG", n >> 30);
+    else if (n >= 1 << 20 && n % (1 << 20) == 0) snprintf(out, cap, "%lldM", n >> 20);
+    else if (n >= 1 << 10 && n % (1 << 10) == 0) snprintf(out, cap, "%lldK", n >> 10);
+    else snprintf(out, cap, "%lld", n);
+}
+
+// Fill path with size bytes of incompressible data, written through so
+// creating a large file does not evict the other test files.
+void create_file(const char *path, long long size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) err_quit("Cannot create test file");
+    char *buf = (char *)malloc(SINK_BUFSIZE);
+    uint64_t x = 0x9E3779B97F4A7C15ull ^ (uint64_t)size;
+    long long done = 0;
+    while (done < size) {
+        size_t n = size - done < SINK_BUFSIZE ? (size_t)(size - done) : SINK_BUFSIZE;
+        for (size_t i = 0; i + 8 <= n; i += 8) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            memcpy(buf + i, &x, 8);
+        }
+        if (write(fd, buf, n) != (ssize_t)n) err_quit("Cannot write test file");
+        done += (long long)n;
+        if ((done & ((256LL << 20) - 1)) == 0) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+    free(buf);
+    fdatasync(fd);
+    close(fd);
+}
+
+void drop_cache(int fd) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// The network: a thread that reads the other end of the socket and
+// throws the data away.
+void *sink_loop(void *data) {
+    int sock = *(int *)data;
+    char *buf = (char *)malloc(SINK_BUFSIZE);
+    while (recv(sock, buf, SINK_BUFSIZE, 0) > 0) {
+    }
+    free(buf);
+    return NULL;
+}
+
+int send_all(int sock, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Send the whole file through one engine; fills in r.
+int run_one(result_t *r, int warm) {
+    int fd = open(r->path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (!warm) drop_cache(fd);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) err_quit("socketpair failed");
+    pthread_t sink;
+    if (pthread_create(&sink, NULL, sink_loop, &sv[1]) != 0) err_quit("Failed to create sink thread");
+
+    int failed = 0;
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_THREAD, &ru0);
+    uint64_t start = now_us();
+    uint64_t wait_us = 0;
+    if (r->engine == ENGINE_PLAIN) {
+        char *buf = (char *)malloc(SEND_SIZE);
+        ssize_t n;
+        uint64_t t0 = now_us();
+        while ((n = read(fd, buf, SEND_SIZE)) > 0) {
+            wait_us += now_us() - t0;
+            if (send_all(sv[0], buf, (size_t)n) < 0) failed = 1;
+            t0 = now_us();
+        }
+        if (n < 0) failed = 1;
+        free(buf);
+        r->picked = "plain";
+    } else {
+        reader_t rd;
+        if (reader_open(&rd, fd, r->size, (reader_mode_t)r->engine) < 0) {
+            failed = 1;
+        } else {
+            const char *p;
+            ssize_t n;
+            while ((n = reader_next(&rd, &p, SEND_SIZE)) > 0) {
+                if (send_all(sv[0], p, (size_t)n) < 0) failed = 1;
+            }
+            if (n < 0) failed = 1;
+            r->picked = reader_mode_names[rd.mode];
+            wait_us = rd.wait_us;
+            reader_close(&rd);
+        }
+    }
+    uint64_t elapsed = now_us() - start;
+    getrusage(RUSAGE_THREAD, &ru1);
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(sink, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    close(fd);
+
+    r->secs = elapsed / 1e6;
+    r->wait_secs = wait_us / 1e6;
+    r->major_faults = ru1.ru_majflt - ru0.ru_majflt;
+    r->mb_per_s = elapsed ? r->size / (double)elapsed : 0;
+    return failed ? -1 : 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s sizes] [-d dir] [-e engines] [-r repeats] [-w] [-j results.json] [file...]\n",
+            prog);
+    fprintf(stderr, "  -s L  comma-separated file sizes with K, M or G suffixes (default %s)\n", DEFAULT_SIZES);
+    fprintf(stderr, "  -d D  where to create the test files (default: a new directory under /tmp)\n");
+    fprintf(stderr, "  -e L  engines to compare (default auto,read,mmap,thread,plain)\n");
+    fprintf(stderr, "  -r N  runs per file and engine, best one reported (default 3)\n");
+    fprintf(stderr, "  -w    warm: leave the files in the page cache between runs\n");
+    fprintf(stderr, "  -j F  also write the results to F as JSON\n");
+    fprintf(stderr, "Files given on the command line are used as they are instead of -s.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *sizes = DEFAULT_SIZES;
+    const char *dir = NULL;
+    const char *engines = "auto,read,mmap,thread,plain";
+    const char *json_path = NULL;
+    int repeats = 3;
+    int warm = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:e:r:wj:")) != -1) {
+        switch (opt) {
+        case 's':
+            sizes = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'e':
+            engines = optarg;
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'w':
+            warm = 1;
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (repeats < 1) usage(argv[0]);
+
+    int engine_list[ENGINE_PLAIN + 1];
+    int nengines = 0;
+    char names[256];
+    snprintf(names, sizeof(names), "%s", engines);
+    for (char *tok = strtok(names, ","); tok; tok = strtok(NULL, ",")) {
+        int e = ENGINE_PLAIN;
+        while (e >= 0 && strcmp(tok, engine_names[e]) != 0) e--;
+        if (e < 0 || nengines > ENGINE_PLAIN) usage(argv[0]);
+        engine_list[nengines++] = e;
+    }
+
+    // The files: given, or created at each size
+    char *paths[MAX_FILES];
+    long long file_sizes[MAX_FILES];
+    int nfiles = 0;
+    int created = optind == argc;
+    char scratch[] = "/tmp/bench_read.XXXXXX";
+    if (created) {
+        if (!dir) {
+            if (!mkdtemp(scratch)) err_quit("Cannot create scratch directory");
+            dir = scratch;
+        }
+        for (const char *s = sizes; *s && nfiles < MAX_FILES; s = strchr(s, ',') ? strchr(s, ',') + 1 : "") {
+            long long size = parse_size(s);
+            if (size < 0) usage(argv[0]);
+            char label[32];
+            format_size(label, sizeof(label), size);
+            paths[nfiles] = (char *)malloc(strlen(dir) + 48);
+            sprintf(paths[nfiles], "%s/read-%s.bin", dir, label);
+            struct stat st;
+            if (stat(paths[nfiles], &st) < 0 || st.st_size != size) {
+                printf("Creating %s\n", paths[nfiles]);
+                fflush(stdout);
+                create_file(paths[nfiles], size);
+            }
+            file_sizes[nfiles++] = size;
+        }
+    } else {
+        for (int i = optind; i < argc && nfiles < MAX_FILES; i++) {
+            struct stat st;
+            if (stat(argv[i], &st) < 0 || !S_ISREG(st.st_mode)) err_quit(argv[i]);
+            paths[nfiles] = argv[i];
+            file_sizes[nfiles++] = st.st_size;
+        }
+    }
+
+    result_t *results = (result_t *)calloc((size_t)nfiles * nengines, sizeof(result_t));
+    int nresults = 0;
+    int failures = 0;
+    printf("%-10s %-7s %-7s %12s %10s %12s %12s\n", "size", "engine", "picked", "MB/s", "seconds", "disk wait s",
+           "major faults");
+    for (int f = 0; f < nfiles; f++) {
+        for (int e = 0; e < nengines; e++) {
+            result_t best = {paths[f], file_sizes[f], engine_list[e], 0, 0, 0, 0, ""};
+            for (int i = 0; i < repeats; i++) {
+                result_t r = best;
+                if (run_one(&r, warm) < 0) {
+                    fprintf(stderr, "%s with %s failed: %s\n", paths[f], engine_names[r.engine], strerror(errno));
+                    failures++;
+                    break;
+                }
+                if (i == 0 || r.secs < best.secs) best = r;
+            }
+            char label[32];
+            format_size(label, sizeof(label), best.size);
+            printf("%-10s %-7s %-7s %12.1f %10.4f %12.4f %12ld\n", label, engine_names[best.engine], best.picked,
+                   best.mb_per_s, best.secs, best.wait_secs, best.major_faults);
+            fflush(stdout);
+            results[nresults++] = best;
+        }
+    }
+
+    if (json_path) {
+        FILE *out = fopen(json_path, "w");
+        if (!out) err_quit("Cannot write results");
+        fprintf(out, "{\n  \"warm\": %d,\n  \"repeats\": %d,\n  \"runs\": [\n", warm, repeats);
+        for (int i = 0; i < nresults; i++) {
+            const result_t *r = &results[i];
+            fprintf(out,
+                    "    {\"file_bytes\": %lld, \"engine\": \"%s\", \"picked\": \"%s\", \"mb_per_s\": %.1f, "
+                    "\"seconds\": %.4f, \"disk_wait_seconds\": %.4f, \"major_faults\": %ld}%s\n",
+                    r->size, engine_names[r->engine], r->picked, r->mb_per_s, r->secs, r->wait_secs, r->major_faults,
+                    i + 1 < nresults ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+        fclose(out);
+    }
+
+    if (created && dir == scratch) {
+        for (int f = 0; f < nfiles; f++) unlink(paths[f]);
+        rmdir(scratch);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,361 @@
+// Congestion control and pacing for the reliable UDP sender (rudp.h).
+//
+// A controller owns two outputs: cwnd, the bytes the sender may have in
+// flight, and pacing_rate, the rate at which the token bucket releases
+// them. It is driven by ACK events carrying the bytes newly delivered, an
+// RTT sample and a delivery-rate sample measured by the receiver, plus
+// loss and timeout events. Controllers plug in through cc_ops_t:
+//
+//   aimd  Reno-style slow start and additive increase, multiplicative
+//         decrease once per loss episode. Paced at a multiple of cwnd/srtt.
+//   bbr   Delay-based, after BBR: paces at the estimated bottleneck
+//         bandwidth and caps inflight at a multiple of the bandwidth-delay
+//         product, probing up and down in a gain cycle. Loss outside a
+//         probe does not shrink the window; loss while probing up caps
+//         inflight below the level that caused it (after BBRv2's
+//         inflight_hi) until later probes grow it back.
+//   fixed No control: the sender's static window, unpaced.
+#ifndef CC_H
+#define CC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CC_INITIAL_CWND_SEGS 10
+#define CC_MIN_CWND_SEGS 4
+#define CC_BW_ROUNDS 10              // Max-filter length for bandwidth, in rounds
+#define CC_MIN_RTT_WINDOW_US 10000000
+#define CC_PROBE_RTT_US 200000
+#define CC_STARTUP_GAIN 2.885        // 2/ln(2)
+#define CC_PACER_BURST_US 1000       // Token bucket depth, in time at the pacing rate
+#define CC_BBR_LOSS_BETA 0.7         // inflight_hi after a loss episode, as a share of cwnd
+
+typedef struct cc cc_t;
+
+typedef struct {
+    uint64_t now_us;
+    uint64_t acked_bytes;     // Newly delivered (cumulatively or selectively)
+    uint64_t rtt_us;          // 0 when the ACK gave no valid sample
+    double delivery_rate;     // Bytes/s seen by the receiver, 0 if none
+    uint64_t inflight_bytes;  // After this ACK was applied
+} cc_ack_t;
+
+typedef struct {
+    const char *name;
+    void (*init)(cc_t *cc);
+    void (*on_ack)(cc_t *cc, const cc_ack_t *ack);
+    void (*on_loss)(cc_t *cc, uint64_t now_us);     // Once per loss episode
+    void (*on_timeout)(cc_t *cc, uint64_t now_us);  // Retransmission timeout
+} cc_ops_t;
+
+typedef enum {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT
+} bbr_mode_t;
+
+struct cc {
+    const cc_ops_t *ops;
+    uint32_t mss;
+    double cwnd;          // Bytes
+    double pacing_rate;   // Bytes/s; 0 means unpaced
+    uint64_t srtt_us;
+    uint64_t min_rtt_us;
+    uint64_t min_rtt_stamp_us;
+
+    // aimd
+    double ssthresh;
+
+    // bbr
+    bbr_mode_t mode;
+    double bw_max[CC_BW_ROUNDS];  // Per-round maxima
+    uint32_t round;
+    uint64_t round_start_us;
+    double btl_bw;
+    double full_bw;
+    int full_bw_rounds;
+    int cycle_idx;
+    uint64_t probe_rtt_done_us;
+    double pacing_gain;
+    double cwnd_gain;
+    double inflight_hi;   // Bytes; 0 until the first loss
+};
+
+static inline void cc_update_rtt(cc_t *cc, uint64_t rtt_us, uint64_t now) {
+    if (!rtt_us) return;
+    cc->srtt_us = cc->srtt_us ? (7 * cc->srtt_us + rtt_us) / 8 : rtt_us;
+    if (!cc->min_rtt_us || rtt_us <= cc->min_rtt_us) {
+        cc->min_rtt_us = rtt_us;
+        cc->min_rtt_stamp_us = now;
+    }
+}
+
+static inline double cc_min_cwnd(const cc_t *cc) {
+    return (double)CC_MIN_CWND_SEGS * cc->mss;
+}
+
+// ---------------------------------------------------------------------------
+// aimd
+// ---------------------------------------------------------------------------
+
+static inline void aimd_pace(cc_t *cc) {
+    // Like Linux: pace faster than cwnd/srtt so pacing never limits growth
+    double gain = cc->cwnd < cc->ssthresh ? 2.0 : 1.2;
+    cc->pacing_rate = cc->srtt_us ? gain * cc->cwnd * 1e6 / cc->srtt_us : 0;
+}
+
+static inline void aimd_init(cc_t *cc) {
+    cc->cwnd = (double)CC_INITIAL_CWND_SEGS * cc->mss;
+    cc->ssthresh = 1e18;
+    cc->pacing_rate = 0;
+}
+
+static inline void aimd_on_ack(cc_t *cc, const cc_ack_t *ack) {
+    cc_update_rtt(cc, ack->rtt_us, ack->now_us);
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += ack->acked_bytes;
+    } else {
+        cc->cwnd += (double)cc->mss * ack->acked_bytes / cc->cwnd;
+    }
+    aimd_pace(cc);
+}
+
+static inline void aimd_on_loss(cc_t *cc, uint64_t now) {
+    (void)now;
+    cc->ssthresh = cc->cwnd / 2 > cc_min_cwnd(cc) ? cc->cwnd / 2 : cc_min_cwnd(cc);
+    cc->cwnd = cc->ssthresh;
+    aimd_pace(cc);
+}
+
+static inline void aimd_on_timeout(cc_t *cc, uint64_t now) {
+    (void)now;
+    cc->ssthresh = cc->cwnd / 2 > cc_min_cwnd(cc) ? cc->cwnd / 2 : cc_min_cwnd(cc);
+    cc->cwnd = cc->mss;
+    aimd_pace(cc);
+}
+
+static const cc_ops_t cc_aimd = {"aimd", aimd_init, aimd_on_ack, aimd_on_loss, aimd_on_timeout};
+
+// ---------------------------------------------------------------------------
+// bbr
+// ---------------------------------------------------------------------------
+
+static const double bbr_cycle_gains[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+static inline double bbr_bdp(const cc_t *cc) {
+    if (!cc->btl_bw || !cc->min_rtt_us) return (double)CC_INITIAL_CWND_SEGS * cc->mss;
+    return cc->btl_bw * cc->min_rtt_us / 1e6;
+}
+
+static inline void bbr_set_outputs(cc_t *cc) {
+    if (cc->btl_bw) {
+        cc->pacing_rate = cc->pacing_gain * cc->btl_bw;
+    } else if (cc->srtt_us) {
+        cc->pacing_rate = cc->pacing_gain * cc->cwnd * 1e6 / cc->srtt_us;
+    }
+
+    double target = cc->cwnd_gain * bbr_bdp(cc);
+    if (cc->inflight_hi && target > cc->inflight_hi) target = cc->inflight_hi;
+    if (cc->mode == BBR_PROBE_RTT) target = cc_min_cwnd(cc);
+    cc->cwnd = target > cc_min_cwnd(cc) ? target : cc_min_cwnd(cc);
+}
+
+static inline void bbr_init(cc_t *cc) {
+    memset(cc->bw_max, 0, sizeof(cc->bw_max));
+    cc->mode = BBR_STARTUP;
+    cc->round = 0;
+    cc->round_start_us = 0;
+    cc->btl_bw = 0;
+    cc->full_bw = 0;
+    cc->full_bw_rounds = 0;
+    cc->cycle_idx = 0;
+    cc->pacing_gain = CC_STARTUP_GAIN;
+    cc->cwnd_gain = CC_STARTUP_GAIN;
+    cc->inflight_hi = 0;
+    cc->cwnd = (double)CC_INITIAL_CWND_SEGS * cc->mss;
+    cc->pacing_rate = 0;
+}
+
+static inline void bbr_enter_drain(cc_t *cc) {
+    cc->mode = BBR_DRAIN;
+    cc->pacing_gain = 1 / CC_STARTUP_GAIN;
+    cc->cwnd_gain = CC_STARTUP_GAIN;
+}
+
+// One "round" is one min_rtt of wall time; the receiver-side rate samples
+// do not let us track packet-timed rounds exactly.
+static inline int bbr_new_round(cc_t *cc, uint64_t now) {
+    uint64_t len = cc->min_rtt_us > 1000 ? cc->min_rtt_us : 1000;
+    if (now - cc->round_start_us < len) return 0;
+    cc->round_start_us = now;
+    cc->round++;
+    cc->bw_max[cc->round % CC_BW_ROUNDS] = 0;
+    return 1;
+}
+
+static inline void bbr_on_ack(cc_t *cc, const cc_ack_t *ack) {
+    uint64_t now = ack->now_us;
+    int min_rtt_expired = cc->min_rtt_us && now - cc->min_rtt_stamp_us > CC_MIN_RTT_WINDOW_US;
+    cc_update_rtt(cc, ack->rtt_us, now);
+    int new_round = bbr_new_round(cc, now);
+
+    if (ack->delivery_rate > 0) {
+        double *slot = &cc->bw_max[cc->round % CC_BW_ROUNDS];
+        if (ack->delivery_rate > *slot) *slot = ack->delivery_rate;
+    }
+    cc->btl_bw = 0;
+    for (int i = 0; i < CC_BW_ROUNDS; i++) {
+        if (cc->bw_max[i] > cc->btl_bw) cc->btl_bw = cc->bw_max[i];
+    }
+
+    switch (cc->mode) {
+    case BBR_STARTUP:
+        // Pipe is full once bandwidth stops growing 25% per round for 3 rounds
+        if (new_round && cc->btl_bw) {
+            if (cc->btl_bw >= cc->full_bw * 1.25) {
+                cc->full_bw = cc->btl_bw;
+                cc->full_bw_rounds = 0;
+            } else if (++cc->full_bw_rounds >= 3) {
+                bbr_enter_drain(cc);
+            }
+        }
+        break;
+    case BBR_DRAIN:
+        if (ack->inflight_bytes <= bbr_bdp(cc)) {
+            cc->mode = BBR_PROBE_BW;
+            cc->cycle_idx = 0;
+            cc->pacing_gain = bbr_cycle_gains[0];
+            cc->cwnd_gain = 2;
+        }
+        break;
+    case BBR_PROBE_BW:
+        if (new_round) {
+            cc->cycle_idx = (cc->cycle_idx + 1) % 8;
+            cc->pacing_gain = bbr_cycle_gains[cc->cycle_idx];
+            // A probe that finished without loss may raise the cap
+            if (cc->cycle_idx == 1 && cc->inflight_hi) cc->inflight_hi += 4.0 * cc->mss;
+        }
+        break;
+    case BBR_PROBE_RTT:
+        if (now >= cc->probe_rtt_done_us) {
+            cc->min_rtt_stamp_us = now;
+            cc->mode = BBR_PROBE_BW;
+            cc->pacing_gain = 1;
+            cc->cwnd_gain = 2;
+        }
+        break;
+    }
+
+    // Drain the queue briefly to re-measure the propagation delay
+    if (min_rtt_expired && cc->mode != BBR_PROBE_RTT) {
+        cc->mode = BBR_PROBE_RTT;
+        cc->pacing_gain = 1;
+        cc->probe_rtt_done_us = now + CC_PROBE_RTT_US;
+        cc->min_rtt_us = ack->rtt_us ? ack->rtt_us : cc->min_rtt_us;
+    }
+
+    bbr_set_outputs(cc);
+}
+
+static inline void bbr_on_loss(cc_t *cc, uint64_t now) {
+    (void)now;
+    // Loss outside a probe is taken as random and ignored
+    if (cc->pacing_gain <= 1) return;
+
+    double hi = cc->cwnd * CC_BBR_LOSS_BETA;
+    cc->inflight_hi = hi > cc_min_cwnd(cc) ? hi : cc_min_cwnd(cc);
+    if (cc->mode == BBR_STARTUP) {
+        bbr_enter_drain(cc);
+    } else if (cc->mode == BBR_PROBE_BW && cc->pacing_gain > 1) {
+        // Stop probing up: go straight to the draining phase
+        cc->cycle_idx = 1;
+        cc->pacing_gain = bbr_cycle_gains[1];
+    }
+    bbr_set_outputs(cc);
+}
+
+static inline void bbr_on_timeout(cc_t *cc, uint64_t now) {
+    (void)now;
+    // Everything in flight is presumed lost: restart from a small window
+    // but keep the bandwidth model
+    cc->cwnd = cc_min_cwnd(cc);
+}
+
+static const cc_ops_t cc_bbr = {"bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_timeout};
+
+// ---------------------------------------------------------------------------
+// fixed
+// ---------------------------------------------------------------------------
+
+static inline void fixed_init(cc_t *cc) {
+    cc->cwnd = 1e18;
+    cc->pacing_rate = 0;
+}
+
+static inline void fixed_on_ack(cc_t *cc, const cc_ack_t *ack) {
+    cc_update_rtt(cc, ack->rtt_us, ack->now_us);
+}
+
+static inline void fixed_on_event(cc_t *cc, uint64_t now) {
+    (void)cc;
+    (void)now;
+}
+
+static const cc_ops_t cc_fixed = {"fixed", fixed_init, fixed_on_ack, fixed_on_event, fixed_on_event};
+
+static inline const cc_ops_t *cc_find(const char *name) {
+    static const cc_ops_t *all[] = {&cc_aimd, &cc_bbr, &cc_fixed};
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(all[i]->name, name) == 0) return all[i];
+    }
+    return NULL;
+}
+
+static inline void cc_init(cc_t *cc, const cc_ops_t *ops, uint32_t mss) {
+    memset(cc, 0, sizeof(*cc));
+    cc->ops = ops;
+    cc->mss = mss;
+    ops->init(cc);
+}
+
+// ---------------------------------------------------------------------------
+// Token bucket pacer
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    double tokens;  // Bytes that may go out right now
+    uint64_t last_us;
+} pacer_t;
+
+static inline void pacer_init(pacer_t *p, uint64_t now) {
+    p->tokens = 0;
+    p->last_us = now;
+}
+
+static inline void pacer_refill(pacer_t *p, double rate, uint32_t mss, uint64_t now) {
+    double burst = rate * CC_PACER_BURST_US / 1e6;
+    if (burst < 2.0 * mss) burst = 2.0 * mss;
+    p->tokens += rate * (now - p->last_us) / 1e6;
+    if (p->tokens > burst) p->tokens = burst;
+    p->last_us = now;
+}
+
+// Whether len bytes may be sent now at the given rate (0: unpaced).
+static inline int pacer_allow(pacer_t *p, double rate, uint32_t mss, uint32_t len, uint64_t now) {
+    if (rate <= 0) return 1;
+    pacer_refill(p, rate, mss, now);
+    return p->tokens >= len;
+}
+
+static inline void pacer_consume(pacer_t *p, double rate, uint32_t len) {
+    if (rate > 0) p->tokens -= len;
+}
+
+// Microseconds until len bytes of tokens will be available.
+static inline uint64_t pacer_delay_us(const pacer_t *p, double rate, uint32_t len) {
+    if (rate <= 0 || p->tokens >= len) return 0;
+    return (uint64_t)((len - p->tokens) * 1e6 / rate) + 1;
+}
+
+#endif
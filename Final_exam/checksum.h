@@ -0,0 +1,519 @@
+// Checksums for file transfers.
+//
+// crc32c() is CRC-32C (Castagnoli), the checksum of every UDP segment and
+// every verified TCP chunk. On x86 with SSE4.2 it runs on the crc32
+// instruction over three interleaved streams, so the instruction's
+// three-cycle latency is hidden, and the three partial CRCs are joined with
+// one carry-less multiply each (PCLMUL); elsewhere it uses slicing-by-8
+// tables. Both compute the same value.
+//
+// bhash() is a 128-bit hash in the style of XXH3: eight 64-bit lanes fed
+// with 32x32->64 multiplies, AVX2 when the CPU has it. It is the strong
+// hash of delta.h and the whole-file digest of verified uploads. It can be
+// fed in pieces of any size, so a digest is computed in the same pass that
+// sends or writes the data.
+//
+// A verified TCP upload (verify_t) keeps one CRC per chunk and the digest
+// of the file as the body goes by. The client sends both in FRAME_COMMIT;
+// the server compares them with its own and asks again for just the chunks
+// that differ.
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+#include "protocol.h"
+
+#define CRC32C_POLY 0x82F63B78u   // Reflected
+#define CRC32C_LONG 8192          // Bytes per stream of the three-way hardware loop...
+#define CRC32C_SHORT 256          // ...and of its second pass over what is left
+
+typedef struct {
+    uint64_t lo, hi;
+} bhash_t;
+
+// ---------------------------------------------------------------------------
+// CRC-32C
+// ---------------------------------------------------------------------------
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long_k[2];   // Shift a CRC past one and two CRC32C_LONG streams
+static uint32_t crc32c_short_k[2];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// a * b modulo the polynomial, both reflected (bit 31 is x^0).
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    while (m) {
+        if (a & m) p ^= b;
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^n modulo the polynomial.
+static inline uint32_t crc32c_xpow(uint64_t n) {
+    uint32_t r = 1u << 31, sq = 1u << 30;
+    while (n) {
+        if (n & 1) r = crc32c_multmodp(sq, r);
+        sq = crc32c_multmodp(sq, sq);
+        n >>= 1;
+    }
+    return r;
+}
+
+static void crc32c_init_once() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t c = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+    // The hardware shift multiplies by k and folds the 64-bit product with
+    // one crc32 instruction, which itself multiplies by x^33
+    crc32c_long_k[0] = crc32c_xpow(8ULL * CRC32C_LONG - 33);
+    crc32c_long_k[1] = crc32c_xpow(16ULL * CRC32C_LONG - 33);
+    crc32c_short_k[0] = crc32c_xpow(8ULL * CRC32C_SHORT - 33);
+    crc32c_short_k[1] = crc32c_xpow(16ULL * CRC32C_SHORT - 33);
+#ifdef CHECKSUM_X86
+    crc32c_hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#endif
+}
+
+// Slicing-by-8 on the raw (not inverted) register.
+static inline uint32_t crc32c_sw(uint32_t c, const uint8_t *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t d;
+        memcpy(&d, p, 8);  // Little-endian hosts only, like the rest of this file
+        d ^= c;
+        c = crc32c_table[7][d & 0xff] ^ crc32c_table[6][(d >> 8) & 0xff] ^ crc32c_table[5][(d >> 16) & 0xff] ^
+            crc32c_table[4][(d >> 24) & 0xff] ^ crc32c_table[3][(d >> 32) & 0xff] ^
+            crc32c_table[2][(d >> 40) & 0xff] ^ crc32c_table[1][(d >> 48) & 0xff] ^ crc32c_table[0][d >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xff];
+    return c;
+}
+
+#ifdef CHECKSUM_X86
+// c * x^n for the n that k was made for.
+__attribute__((target("sse4.2,pclmul"))) static inline uint32_t crc32c_shift(uint32_t c, uint32_t k) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)c), _mm_cvtsi32_si128((int)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(prod));
+}
+
+// Three streams of block bytes each, while at least that much is left.
+__attribute__((target("sse4.2,pclmul"))) static inline uint64_t crc32c_hw_streams(uint64_t c, const uint8_t **pp,
+                                                                                   size_t *lenp, size_t block,
+                                                                                   const uint32_t *k) {
+    const uint8_t *p = *pp;
+    while (*lenp >= 3 * block) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < block; i += 8) {
+            uint64_t d0, d1, d2;
+            memcpy(&d0, p + i, 8);
+            memcpy(&d1, p + block + i, 8);
+            memcpy(&d2, p + 2 * block + i, 8);
+            c = _mm_crc32_u64(c, d0);
+            c1 = _mm_crc32_u64(c1, d1);
+            c2 = _mm_crc32_u64(c2, d2);
+        }
+        c = crc32c_shift((uint32_t)c, k[1]) ^ crc32c_shift((uint32_t)c1, k[0]) ^ (uint32_t)c2;
+        p += 3 * block;
+        *lenp -= 3 * block;
+    }
+    *pp = p;
+    return c;
+}
+
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    c = crc32c_hw_streams(c, &p, &len, CRC32C_LONG, crc32c_long_k);
+    c = crc32c_hw_streams(c, &p, &len, CRC32C_SHORT, crc32c_short_k);
+    while (len >= 8) {
+        uint64_t d;
+        memcpy(&d, p, 8);
+        c = _mm_crc32_u64(c, d);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+// CRC-32C of len bytes, continuing from crc (0 to start).
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init_once);
+    const uint8_t *p = (const uint8_t *)data;
+#ifdef CHECKSUM_X86
+    if (crc32c_hw) return ~crc32c_hw_update(~crc, p, len);
+#endif
+    return ~crc32c_sw(~crc, p, len);
+}
+
+// The table version, whatever the CPU has; for benchmarks.
+static inline uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init_once);
+    return ~crc32c_sw(~crc, (const uint8_t *)data, len);
+}
+
+static inline int crc32c_hardware() {
+    pthread_once(&crc32c_once, crc32c_init_once);
+    return crc32c_hw;
+}
+
+// ---------------------------------------------------------------------------
+// Whole-file hash (bhash)
+// ---------------------------------------------------------------------------
+
+#define BH_STRIPE 64
+#define BH_STRIPES_PER_SCRAMBLE 16
+#define BH_PRIME32 0x9E3779B1u
+#define BH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define BH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static const uint64_t bh_key[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL};
+static const uint64_t bh_scramble_key[8] = {
+    0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+    0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL};
+
+typedef struct {
+    uint64_t acc[8];
+    uint8_t buf[BH_STRIPE];  // Partial stripe
+    uint32_t buf_len;
+    uint32_t stripes;        // Since the last scramble
+    uint64_t total;
+} bhash_state_t;
+
+static inline uint64_t bh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;  // Little-endian hosts only, like the rest of the x86 paths
+}
+
+static inline void bh_stripes_scalar(uint64_t *acc, const uint8_t *p, size_t n, uint32_t *stripes) {
+    for (size_t s = 0; s < n; s++, p += BH_STRIPE) {
+        for (int i = 0; i < 8; i++) {
+            uint64_t d = bh_read64(p + 8 * i);
+            uint64_t k = d ^ bh_key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (k & 0xffffffff) * (k >> 32);
+        }
+        if (++*stripes == BH_STRIPES_PER_SCRAMBLE) {
+            *stripes = 0;
+            for (int i = 0; i < 8; i++) {
+                uint64_t a = acc[i];
+                a ^= a >> 47;
+                a ^= bh_scramble_key[i];
+                acc[i] = a * BH_PRIME32;
+            }
+        }
+    }
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("avx2"))) static void bh_stripes_avx2(uint64_t *acc, const uint8_t *p, size_t n,
+                                                              uint32_t *stripes) {
+    __m256i acc0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+    const __m256i key0 = _mm256_loadu_si256((const __m256i *)bh_key);
+    const __m256i key1 = _mm256_loadu_si256((const __m256i *)(bh_key + 4));
+    const __m256i skey0 = _mm256_loadu_si256((const __m256i *)bh_scramble_key);
+    const __m256i skey1 = _mm256_loadu_si256((const __m256i *)(bh_scramble_key + 4));
+    const __m256i prime = _mm256_set1_epi32((int)BH_PRIME32);
+    for (size_t s = 0; s < n; s++, p += BH_STRIPE) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i d1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i k0 = _mm256_xor_si256(d0, key0);
+        __m256i k1 = _mm256_xor_si256(d1, key1);
+        // acc[i ^ 1] += d: swap the 64-bit halves of each 128-bit lane
+        acc0 = _mm256_add_epi64(acc0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc0 = _mm256_add_epi64(acc0, _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32)));
+        if (++*stripes == BH_STRIPES_PER_SCRAMBLE) {
+            *stripes = 0;
+            __m256i a0 = _mm256_xor_si256(_mm256_xor_si256(acc0, _mm256_srli_epi64(acc0, 47)), skey0);
+            __m256i a1 = _mm256_xor_si256(_mm256_xor_si256(acc1, _mm256_srli_epi64(acc1, 47)), skey1);
+            // 64x32-bit multiply from two 32x32->64 halves
+            acc0 = _mm256_add_epi64(_mm256_mul_epu32(a0, prime),
+                                    _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a0, 32), prime), 32));
+            acc1 = _mm256_add_epi64(_mm256_mul_epu32(a1, prime),
+                                    _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a1, 32), prime), 32));
+        }
+    }
+    _mm256_storeu_si256((__m256i *)acc, acc0);
+    _mm256_storeu_si256((__m256i *)(acc + 4), acc1);
+}
+#endif
+
+static inline void bh_stripes(uint64_t *acc, const uint8_t *p, size_t n, uint32_t *stripes) {
+#ifdef CHECKSUM_X86
+    if (__builtin_cpu_supports("avx2")) {
+        bh_stripes_avx2(acc, p, n, stripes);
+        return;
+    }
+#endif
+    bh_stripes_scalar(acc, p, n, stripes);
+}
+
+static inline void bhash_init(bhash_state_t *st) {
+    for (int i = 0; i < 8; i++) st->acc[i] = bh_key[i] * BH_PRIME64_1;
+    st->buf_len = 0;
+    st->stripes = 0;
+    st->total = 0;
+}
+
+static inline void bhash_update(bhash_state_t *st, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    st->total += len;
+    if (st->buf_len) {
+        size_t take = BH_STRIPE - st->buf_len < len ? BH_STRIPE - st->buf_len : len;
+        memcpy(st->buf + st->buf_len, p, take);
+        st->buf_len += (uint32_t)take;
+        p += take;
+        len -= take;
+        if (st->buf_len < BH_STRIPE) return;
+        bh_stripes(st->acc, st->buf, 1, &st->stripes);
+        st->buf_len = 0;
+    }
+    size_t n = len / BH_STRIPE;
+    if (n) bh_stripes(st->acc, p, n, &st->stripes);
+    memcpy(st->buf, p + n * BH_STRIPE, len - n * BH_STRIPE);
+    st->buf_len = (uint32_t)(len - n * BH_STRIPE);
+}
+
+static inline uint64_t bh_mix(uint64_t a, uint64_t b) {
+    __uint128_t m = (__uint128_t)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+static inline uint64_t bh_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+static inline bhash_t bhash_final(const bhash_state_t *st) {
+    uint64_t acc[8];
+    memcpy(acc, st->acc, sizeof(acc));
+    uint32_t stripes = st->stripes;
+    if (st->buf_len) {
+        uint8_t last[BH_STRIPE] = {0};
+        memcpy(last, st->buf, st->buf_len);
+        bh_stripes(acc, last, 1, &stripes);
+    }
+    bhash_t h;
+    h.lo = st->total * BH_PRIME64_1;
+    h.hi = ~st->total * BH_PRIME64_2;
+    for (int i = 0; i < 8; i += 2) {
+        h.lo += bh_mix(acc[i] ^ bh_scramble_key[i], acc[i + 1] ^ bh_key[i + 1]);
+        h.hi += bh_mix(acc[i] ^ bh_key[i], acc[i + 1] ^ bh_scramble_key[i + 1]);
+    }
+    h.lo = bh_avalanche(h.lo);
+    h.hi = bh_avalanche(h.hi ^ h.lo);
+    return h;
+}
+
+static inline bhash_t bhash(const void *data, size_t len) {
+    bhash_state_t st;
+    bhash_init(&st);
+    bhash_update(&st, data, len);
+    return bhash_final(&st);
+}
+
+static inline int bhash_eq(const bhash_t *a, const bhash_t *b) {
+    return a->lo == b->lo && a->hi == b->hi;
+}
+
+static inline void bhash_encode(char *out, const bhash_t *h) {
+    put_u64(out, h->lo);
+    put_u64(out + 8, h->hi);
+}
+
+static inline void bhash_decode(const char *in, bhash_t *h) {
+    h->lo = get_u64(in);
+    h->hi = get_u64(in + 8);
+}
+
+// ---------------------------------------------------------------------------
+// Verified TCP uploads
+// ---------------------------------------------------------------------------
+
+#define VERIFY_MIN_CHUNK (256 * 1024)
+#define VERIFY_MAX_CHUNKS ((FRAME_MAX_PAYLOAD - 16) / 4)  // The whole CRC list fits in one FRAME_COMMIT
+#define VERIFY_MAX_RANGES ((FRAME_MAX_PAYLOAD - 5) / CHUNK_INFO_SIZE)  // Per READY, within a client's reply buffer
+#define VERIFY_MAX_ROUNDS 3       // Repair rounds before the upload fails
+
+typedef struct {
+    uint64_t file_size;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    uint32_t *crcs;          // Of the bytes that went by, one per chunk
+    uint32_t *expected;      // Server: the client's, from the first FRAME_COMMIT
+    bhash_t expected_digest;
+    uint64_t pos;            // File offset of the next byte
+    uint32_t crc;            // Of the current chunk so far
+    bhash_state_t digest;    // Of the whole file, in order
+    int repairing;           // Chunks are being sent again; the digest is no longer in-pass
+    int rounds;
+} verify_t;
+
+// Smallest power-of-two chunk, at least VERIFY_MIN_CHUNK, that keeps the
+// CRC list within VERIFY_MAX_CHUNKS.
+static inline uint32_t verify_chunk_size(uint64_t file_size) {
+    uint64_t chunk = VERIFY_MIN_CHUNK;
+    while (file_size / chunk >= VERIFY_MAX_CHUNKS) chunk *= 2;
+    return chunk > (1u << 31) ? 1u << 31 : (uint32_t)chunk;
+}
+
+static inline int verify_init(verify_t *v, uint64_t file_size, uint32_t chunk_size) {
+    memset(v, 0, sizeof(*v));
+    if (chunk_size == 0 || (file_size + chunk_size - 1) / chunk_size > VERIFY_MAX_CHUNKS) return -1;
+    v->file_size = file_size;
+    v->chunk_size = chunk_size;
+    v->nchunks = (uint32_t)((file_size + chunk_size - 1) / chunk_size);
+    v->crcs = (uint32_t *)calloc(v->nchunks + 1, sizeof(uint32_t));
+    bhash_init(&v->digest);
+    return v->crcs ? 0 : -1;
+}
+
+static inline void verify_free(verify_t *v) {
+    free(v->crcs);
+    free(v->expected);
+    v->crcs = v->expected = NULL;
+}
+
+static inline size_t verify_mem(const verify_t *v) {
+    return sizeof(verify_t) + (size_t)(v->nchunks + 1) * sizeof(uint32_t) * (v->expected ? 2 : 1);
+}
+
+// The next len bytes of the file, starting at v->pos.
+static inline void verify_update(verify_t *v, const void *data, size_t len) {
+    const char *p = (const char *)data;
+    if (!v->repairing) bhash_update(&v->digest, p, len);
+    while (len > 0) {
+        uint64_t room = v->chunk_size - v->pos % v->chunk_size;
+        size_t n = len < room ? len : (size_t)room;
+        v->crc = crc32c(v->crc, p, n);
+        v->pos += n;
+        p += n;
+        len -= n;
+        if (v->pos % v->chunk_size == 0 || v->pos == v->file_size) {
+            v->crcs[(v->pos - 1) / v->chunk_size] = v->crc;
+            v->crc = 0;
+        }
+    }
+}
+
+// Jump to a chunk being sent again.
+static inline void verify_seek(verify_t *v, uint64_t offset) {
+    v->pos = offset;
+    v->crc = 0;
+    v->repairing = 1;
+}
+
+// Whether [offset, offset + length) is a run of whole chunks.
+static inline int verify_chunk_aligned(const verify_t *v, uint64_t offset, uint64_t length) {
+    uint64_t end = offset + length;
+    return offset % v->chunk_size == 0 && end <= v->file_size && (end % v->chunk_size == 0 || end == v->file_size);
+}
+
+// FRAME_COMMIT payload: the 16-byte digest, then a u32 CRC per chunk.
+static inline size_t verify_commit_size(const verify_t *v) {
+    return 16 + (size_t)v->nchunks * 4;
+}
+
+static inline size_t verify_encode_commit(verify_t *v, char *out) {
+    bhash_t h = bhash_final(&v->digest);
+    bhash_encode(out, &h);
+    for (uint32_t i = 0; i < v->nchunks; i++) put_u32(out + 16 + 4 * i, v->crcs[i]);
+    return verify_commit_size(v);
+}
+
+// Server: take the client's digest and CRC list. -1 if it does not
+// describe this file.
+static inline int verify_set_expected(verify_t *v, const char *payload, uint32_t len) {
+    if (len != verify_commit_size(v)) return -1;
+    v->expected = (uint32_t *)malloc((v->nchunks + 1) * sizeof(uint32_t));
+    if (!v->expected) return -1;
+    bhash_decode(payload, &v->expected_digest);
+    for (uint32_t i = 0; i < v->nchunks; i++) v->expected[i] = get_u32(payload + 16 + 4 * i);
+    return 0;
+}
+
+// Server: the chunks whose CRC differs from the client's, merged into
+// ranges, as a READY payload (u32 count, then chunk_info_t ranges, as for
+// resume). Returns the number of bad chunks.
+static inline uint32_t verify_bad_ranges(const verify_t *v, char *out, size_t *out_len) {
+    uint32_t bad = 0, count = 0;
+    uint32_t max = VERIFY_MAX_RANGES;
+    for (uint32_t i = 0; i < v->nchunks; i++) {
+        if (v->crcs[i] == v->expected[i]) continue;
+        bad++;
+        uint64_t offset = (uint64_t)i * v->chunk_size;
+        uint64_t end = offset + v->chunk_size < v->file_size ? offset + v->chunk_size : v->file_size;
+        char *last = out + 4 + CHUNK_INFO_SIZE * (count ? count - 1 : 0);
+        if (count && get_u64(last) + get_u64(last + 8) == offset) {
+            put_u64(last + 8, end - get_u64(last));
+            continue;
+        }
+        if (count == max) continue;  // Asked for in a later round
+        chunk_info_t range = {offset, end - offset};
+        chunk_info_encode(out + 4 + CHUNK_INFO_SIZE * count, &range);
+        count++;
+    }
+    put_u32(out, count);
+    *out_len = 4 + (size_t)count * CHUNK_INFO_SIZE;
+    return bad;
+}
+
+// Server: a repair leaves damaged bytes in the running digest, so hash the
+// file again from disk. The only case where the body is read back.
+static inline int verify_rehash(verify_t *v, int fd, char *buf, size_t cap) {
+    bhash_init(&v->digest);
+    for (uint64_t off = 0; off < v->file_size;) {
+        size_t want = v->file_size - off < cap ? (size_t)(v->file_size - off) : cap;
+        ssize_t n = pread(fd, buf, want, (off_t)off);
+        if (n <= 0) return -1;
+        bhash_update(&v->digest, buf, (size_t)n);
+        off += (uint64_t)n;
+    }
+    v->repairing = 0;
+    return 0;
+}
+
+static inline int verify_digest_ok(const verify_t *v) {
+    bhash_t h = bhash_final(&v->digest);
+    return bhash_eq(&h, &v->expected_digest);
+}
+
+#endif
@@ -0,0 +1,684 @@
+// Client library: sessions with server_tcp and server_udp as coroutines on
+// a loop_t (coro.h), so that one thread can drive thousands of sessions
+// and transfers. Needs -std=c++20.
+//
+//   task_t session(tcp_client_t *c) {
+//       if (co_await c->connect("127.0.0.1:9000") < 0) co_return -1;
+//       co_await c->login("alice");
+//       char echo[256];
+//       co_await c->message("hello", echo, sizeof(echo));  // Echo length
+//       int type = co_await c->send_file("notes.txt");      // FRAME_FILE_OK
+//       co_await c->close();
+//       co_return type;
+//   }
+//
+//   loop_t loop;
+//   tcp_client_t c;
+//   loop_init(&loop);
+//   tcp_client_init(&c, &loop);
+//   loop_spawn(&loop, session(&c));
+//   loop_run(&loop);
+//
+// While connected, a session runs one receive coroutine. It reads every
+// frame the server sends and hands each reply to the coroutine waiting on
+// that stream id. A FRAME_MSG that nobody waits for was pushed by the
+// server and goes to on_push. So several coroutines can have requests
+// in flight on one session. A lock keeps their sends apart; a TCP upload
+// holds it from FRAME_FILE to the end of its body, which is raw bytes.
+//
+// Against server_tcp -u, a TCP session can open a bulk channel: bulk()
+// gets a ticket for it and logs a udp_client_t in with it, so messages
+// stay on TCP and files go over UDP under the same name.
+//
+// Uploads are verified (checksum.h). Over TCP they carry chunk CRCs and a
+// digest, and damaged ranges are sent again when the server asks. Over
+// UDP they go through rudp.h with a digest. File data is read with pread()
+// on the loop thread. client_tcp's striped, resumable, delta, compressed
+// and batch uploads are not part of the library.
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "coro.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "rudp.h"
+#include "tcptune.h"
+
+#define CLIENT_PORT 9000                  // When the address names none
+#define CLIENT_BUFSIZE 65536              // File data per send
+#define CLIENT_UDP_TRIES 5                // Sends of a UDP request before it fails
+#define CLIENT_UDP_TIMEOUT_US 200000      // Per try; file requests wait RUDP_INITIAL_RTO_US
+
+// ---------------------------------------------------------------------------
+// Replies
+// ---------------------------------------------------------------------------
+
+// A coroutine waiting for the reply to stream_id. type stays -1 if the
+// session ends first. The payload is copied into buf, cut to cap.
+typedef struct co_reply {
+    uint32_t stream_id;
+    int type;
+    uint16_t flags;
+    uint32_t len;
+    char *buf;
+    size_t cap;
+    int listed;
+    co_event_t done;
+    struct co_reply *next;
+} co_reply_t;
+
+static inline void reply_add(co_reply_t **list, co_reply_t *r, uint32_t stream_id, char *buf, size_t cap) {
+    memset(r, 0, sizeof(*r));
+    r->stream_id = stream_id;
+    r->type = -1;
+    r->buf = buf;
+    r->cap = cap;
+    r->listed = 1;
+    r->next = *list;
+    *list = r;
+}
+
+static inline void reply_remove(co_reply_t **list, co_reply_t *r) {
+    if (!r->listed) return;
+    for (co_reply_t **p = list; *p; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    r->listed = 0;
+}
+
+// Hand a frame to whoever waits for its stream. Returns 0 if no one does.
+static inline int reply_deliver(co_reply_t **list, const frame_hdr_t *hdr, const char *payload) {
+    for (co_reply_t *r = *list; r; r = r->next) {
+        if (r->stream_id != hdr->stream_id) continue;
+        r->type = hdr->type;
+        r->flags = hdr->flags;
+        r->len = hdr->length;
+        if (r->buf && r->cap > 0) {
+            size_t n = hdr->length < r->cap - 1 ? hdr->length : r->cap - 1;
+            memcpy(r->buf, payload, n);
+            r->buf[n] = '\0';
+        }
+        reply_remove(list, r);
+        event_fire(&r->done);
+        return 1;
+    }
+    return 0;
+}
+
+// The session ended: wake every waiter with type -1.
+static inline void reply_fail_all(co_reply_t **list) {
+    while (*list) {
+        co_reply_t *r = *list;
+        reply_remove(list, r);
+        event_fire(&r->done);
+    }
+}
+
+static inline const char *client_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// ---------------------------------------------------------------------------
+// TCP
+// ---------------------------------------------------------------------------
+
+struct udp_client;
+
+typedef struct tcp_client {
+    loop_t *loop;
+    int sock;
+    co_watch_t watch;
+    ring_t in;
+    co_lock_t send_lock;
+    co_reply_t *replies;
+    uint32_t next_stream_id;
+    int receiving;           // The receive coroutine runs
+    co_event_t received;     // Fired when it stops
+    char *buf;               // File data, under send_lock
+    void (*on_push)(void *ctx, const char *text, uint32_t len);
+    void *ctx;
+    uint64_t file_bytes;     // Upload bodies sent, repairs included
+    uint64_t repaired_bytes;
+
+    task_t connect(const char *addr);
+    task_t login(const char *username);
+    task_t message(const char *text, char *reply, size_t cap);
+    task_t join(const char *room, char *reply, size_t cap);
+    task_t send_file(const char *path);
+    task_t bulk(struct udp_client *u);
+    task_t close();
+
+    task_t request(uint8_t type, const char *payload, size_t len, char *reply, size_t cap);
+    task_t receive();
+    task_t send_bytes(const char *data, size_t len);
+    task_t send_frame(uint8_t type, uint16_t flags, uint32_t stream_id, const void *payload, size_t len);
+    task_t send_range(int fd, long long off, long long len, verify_t *v);
+} tcp_client_t;
+
+static inline void tcp_client_init(tcp_client_t *c, loop_t *loop) {
+    memset(c, 0, sizeof(*c));
+    c->loop = loop;
+    c->sock = -1;
+    c->next_stream_id = 1;
+    lock_init(&c->send_lock, loop);
+}
+
+// Connect to "ip" or "ip:port". Returns 0, or -1 with errno set.
+inline task_t tcp_client::connect(const char *addr) {
+    struct sockaddr_in sa;
+    if (addr_parse(addr, CLIENT_PORT, &sa) < 0) {
+        errno = EINVAL;
+        co_return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) co_return -1;
+    tcp_apply(fd, TCP_ROLE_CHAT);
+    buf = (char *)malloc(CLIENT_BUFSIZE);
+    if (!buf || ring_init(&in, RING_SIZE) < 0 || loop_watch(loop, &watch, fd) < 0) {
+        int err = errno;
+        free(buf);
+        buf = NULL;
+        ring_free(&in);
+        ::close(fd);
+        errno = err;
+        co_return -1;
+    }
+    sock = fd;
+    int err = ::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ? errno : 0;
+    if (err == EINPROGRESS) {
+        co_await event_wait(loop, &watch.writable, LOOP_NO_TIMEOUT);
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    }
+    if (err != 0) {
+        loop_unwatch(loop, &watch);
+        ::close(fd);
+        sock = -1;
+        ring_free(&in);
+        free(buf);
+        buf = NULL;
+        errno = err;
+        co_return -1;
+    }
+    receiving = 1;
+    loop_spawn(loop, receive());
+    co_return 0;
+}
+
+inline task_t tcp_client::receive() {
+    while (1) {
+        frame_hdr_t hdr;
+        const char *payload;
+        int got = ring_peek_frame(&in, &hdr, &payload);
+        if (got < 0) break;
+        if (got > 0) {
+            if (!reply_deliver(&replies, &hdr, payload) && hdr.type == FRAME_MSG && on_push) {
+                on_push(ctx, payload, hdr.length);
+            }
+            ring_consume(&in, FRAME_HDR_SIZE + hdr.length);
+            continue;
+        }
+        ssize_t n = ring_recv(&in, sock);
+        if (n > 0 || (n < 0 && errno == EINTR)) continue;
+        if (n < 0 && errno == EAGAIN) {
+            co_await event_wait(loop, &watch.readable, LOOP_NO_TIMEOUT);
+            continue;
+        }
+        break;  // Closed, or an error
+    }
+    receiving = 0;
+    reply_fail_all(&replies);
+    event_fire(&received);
+    co_return 0;
+}
+
+inline task_t tcp_client::send_bytes(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) {
+            co_await event_wait(loop, &watch.writable, LOOP_NO_TIMEOUT);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) co_return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    co_return 0;
+}
+
+// One frame; the caller holds send_lock.
+inline task_t tcp_client::send_frame(uint8_t type, uint16_t flags, uint32_t stream_id, const void *payload,
+                                     size_t len) {
+    char hdr[FRAME_HDR_SIZE];
+    frame_encode(hdr, type, flags, (uint32_t)len, stream_id);
+    struct iovec iov[2] = {{hdr, FRAME_HDR_SIZE}, {(void *)payload, len}};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) {
+            co_await event_wait(loop, &watch.writable, LOOP_NO_TIMEOUT);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) co_return -1;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    co_return 0;
+}
+
+// Send a request frame and wait for its reply. Returns the reply type.
+inline task_t tcp_client::request(uint8_t type, const char *payload, size_t len, char *reply, size_t cap) {
+    if (!receiving) co_return -1;
+    co_reply_t r;
+    reply_add(&replies, &r, next_stream_id++, reply, cap);
+    co_await lock_acquire(&send_lock);
+    int sent = co_await send_frame(type, 0, r.stream_id, payload, len);
+    lock_release(&send_lock);
+    if (sent == 0 && r.listed) co_await event_wait(loop, &r.done, LOOP_NO_TIMEOUT);
+    reply_remove(&replies, &r);
+    if (reply && cap > 0 && r.type < 0) reply[0] = '\0';
+    co_return r.type;
+}
+
+// Returns FRAME_USER_OK, FRAME_USER_FAIL or -1.
+inline task_t tcp_client::login(const char *username) {
+    co_return co_await request(FRAME_USER, username, strlen(username), NULL, 0);
+}
+
+// Send a chat message and wait for its echo, copied into reply. Returns
+// the echo's length, or -1.
+inline task_t tcp_client::message(const char *text, char *reply, size_t cap) {
+    int type = co_await request(FRAME_MSG, text, strlen(text), reply, cap);
+    co_return type == FRAME_MSG ? (int)strlen(reply ? reply : "") : -1;
+}
+
+// Join a room ("" leaves it). The server's answer goes into reply.
+inline task_t tcp_client::join(const char *room, char *reply, size_t cap) {
+    int type = co_await request(FRAME_JOIN, room, strlen(room), reply, cap);
+    co_return type == FRAME_MSG ? 0 : -1;
+}
+
+// Send len bytes of fd from off as raw body bytes, checksumming them into
+// v if given. The caller holds send_lock.
+inline task_t tcp_client::send_range(int fd, long long off, long long len, verify_t *v) {
+    while (len > 0) {
+        size_t want = len < CLIENT_BUFSIZE ? (size_t)len : CLIENT_BUFSIZE;
+        ssize_t n = pread(fd, buf, want, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) co_return -1;
+        if (v) verify_update(v, buf, (size_t)n);
+        if (co_await send_bytes(buf, (size_t)n) < 0) co_return -1;
+        file_bytes += (uint64_t)n;
+        off += n;
+        len -= n;
+    }
+    co_return 0;
+}
+
+// Upload a file, verified. Returns FRAME_FILE_OK, FRAME_FILE_FAIL or -1.
+inline task_t tcp_client::send_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) co_return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !receiving) {
+        ::close(fd);
+        co_return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    long long size = st.st_size;
+    verify_t v;
+    if (verify_init(&v, (uint64_t)size, verify_chunk_size((uint64_t)size)) < 0) {
+        ::close(fd);
+        co_return -1;
+    }
+
+    const char *name = client_basename(path);
+    char info_buf[FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)size, v.chunk_size, name, strlen(name)};
+    size_t info_len = file_info_encode(info_buf, sizeof(info_buf), &info);
+    uint32_t id = next_stream_id++;
+    char *reply = (char *)malloc(FRAME_MAX_PAYLOAD + 1);
+    char *commit = (char *)malloc(verify_commit_size(&v));
+    co_reply_t r;
+    int type = -1;
+
+    // The body follows READY with nothing in between, so the lock is held
+    // through both
+    co_await lock_acquire(&send_lock);
+    tcp_apply(sock, TCP_ROLE_BULK);
+    reply_add(&replies, &r, id, NULL, 0);
+    if (reply && commit && co_await send_frame(FRAME_FILE, FILE_FLAG_VERIFY, id, info_buf, info_len) == 0) {
+        if (r.listed) co_await event_wait(loop, &r.done, LOOP_NO_TIMEOUT);
+        if (r.type == FRAME_READY && co_await send_range(fd, 0, size, &v) == 0) {
+            reply_add(&replies, &r, id, reply, FRAME_MAX_PAYLOAD + 1);
+            if (co_await send_frame(FRAME_COMMIT, 0, id, commit, verify_encode_commit(&v, commit)) == 0) type = 0;
+        } else if (r.type >= 0) {
+            type = r.type;
+        }
+    }
+    tcp_apply(sock, TCP_ROLE_CHAT);
+    lock_release(&send_lock);
+
+    // Wait for the verdict, sending again whatever the server found damaged
+    while (type == 0) {
+        if (r.listed) co_await event_wait(loop, &r.done, LOOP_NO_TIMEOUT);
+        type = r.type;
+        if (type != FRAME_READY) break;
+        uint32_t count = r.len >= 4 ? get_u32(reply) : 0;
+        if (count > (r.len - 4) / CHUNK_INFO_SIZE) {
+            type = -1;
+            break;
+        }
+        type = -1;
+        co_await lock_acquire(&send_lock);
+        int failed = 0;
+        for (uint32_t i = 0; i < count && !failed; i++) {
+            chunk_info_t range;
+            chunk_info_decode(reply + 4 + CHUNK_INFO_SIZE * i, CHUNK_INFO_SIZE, &range);
+            failed = co_await send_frame(FRAME_CHUNK, 0, id, reply + 4 + CHUNK_INFO_SIZE * i, CHUNK_INFO_SIZE) < 0 ||
+                     co_await send_range(fd, (long long)range.offset, (long long)range.length, NULL) < 0;
+            repaired_bytes += range.length;
+        }
+        if (!failed) {
+            reply_add(&replies, &r, id, reply, FRAME_MAX_PAYLOAD + 1);
+            if (co_await send_frame(FRAME_COMMIT, 0, id, NULL, 0) == 0) type = 0;
+        }
+        lock_release(&send_lock);
+    }
+    reply_remove(&replies, &r);
+    verify_free(&v);
+    free(reply);
+    free(commit);
+    ::close(fd);
+    co_return type;
+}
+
+// Disconnect, once every coroutine of the session is done with it.
+inline task_t tcp_client::close() {
+    if (sock < 0) co_return 0;
+    shutdown(sock, SHUT_RDWR);
+    if (receiving) co_await event_wait(loop, &received, LOOP_NO_TIMEOUT);
+    co_await lock_acquire(&send_lock);
+    loop_unwatch(loop, &watch);
+    ::close(sock);
+    sock = -1;
+    ring_free(&in);
+    free(buf);
+    buf = NULL;
+    lock_release(&send_lock);
+    co_return 0;
+}
+
+// ---------------------------------------------------------------------------
+// UDP
+// ---------------------------------------------------------------------------
+
+// A reliable upload in progress; the receive coroutine applies its ACKs.
+typedef struct udp_upload {
+    rudp_tx_t tx;
+    int result;              // FRAME_FILE_OK or FRAME_FILE_FAIL once it comes
+    co_event_t acked;
+    struct udp_upload *next;
+} udp_upload_t;
+
+typedef struct udp_client {
+    loop_t *loop;
+    int sock;
+    co_watch_t watch;
+    struct sockaddr_in server;
+    co_reply_t *replies;
+    udp_upload_t *uploads;
+    uint32_t next_stream_id;
+    int receiving;
+    int closing;
+    co_event_t received;
+    char *buf;               // One datagram
+    void (*on_push)(void *ctx, const char *text, uint32_t len);
+    void *ctx;
+    uint32_t seg_size;
+    uint32_t window;
+    const cc_ops_t *cc;
+    uint64_t retransmits;
+
+    task_t connect(const char *addr);
+    task_t login(const char *username);
+    task_t bind(uint64_t ticket);
+    task_t message(const char *text, char *reply, size_t cap);
+    task_t send_file(const char *path);
+    task_t close();
+
+    task_t request(uint32_t stream_id, uint8_t type, uint16_t flags, const char *payload, size_t len, char *reply,
+                   size_t cap, uint64_t timeout_us);
+    task_t receive();
+} udp_client_t;
+
+static inline void udp_client_init(udp_client_t *c, loop_t *loop) {
+    memset(c, 0, sizeof(*c));
+    c->loop = loop;
+    c->sock = -1;
+    c->next_stream_id = 1;
+    c->seg_size = RUDP_DEFAULT_SEG_SIZE;
+    c->window = RUDP_DEFAULT_WINDOW;
+    c->cc = &cc_aimd;
+}
+
+// Open the socket for "ip" or "ip:port"; nothing is sent yet.
+inline task_t udp_client::connect(const char *addr) {
+    if (addr_parse(addr, CLIENT_PORT, &server) < 0) {
+        errno = EINVAL;
+        co_return -1;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) co_return -1;
+    rudp_tune_socket(fd);
+    buf = (char *)malloc(UDP_MAX_DATAGRAM);
+    if (!buf || loop_watch(loop, &watch, fd) < 0) {
+        int err = errno;
+        free(buf);
+        buf = NULL;
+        ::close(fd);
+        errno = err;
+        co_return -1;
+    }
+    sock = fd;
+    receiving = 1;
+    loop_spawn(loop, receive());
+    co_return 0;
+}
+
+inline task_t udp_client::receive() {
+    while (!closing) {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(sock, buf, UDP_MAX_DATAGRAM, 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0 && errno == EAGAIN) {
+            co_await event_wait(loop, &watch.readable, LOOP_NO_TIMEOUT);
+            continue;
+        }
+        if (n < 0 && (errno == EINTR || errno == ECONNREFUSED)) continue;
+        if (n < 0) break;
+        frame_hdr_t hdr;
+        if (from.sin_addr.s_addr != server.sin_addr.s_addr || from.sin_port != server.sin_port) continue;
+        if (frame_parse_datagram(buf, (size_t)n, &hdr) < 0) continue;
+        const char *payload = buf + FRAME_HDR_SIZE;
+
+        udp_upload_t *u = uploads;
+        while (u && u->tx.stream_id != hdr.stream_id) u = u->next;
+        if (u && (hdr.type == FRAME_ACK || hdr.type == FRAME_FILE_OK || hdr.type == FRAME_FILE_FAIL)) {
+            if (hdr.type == FRAME_ACK) rudp_tx_on_ack(&u->tx, payload, hdr.length);
+            else u->result = hdr.type;
+            event_fire(&u->acked);
+            continue;
+        }
+        if (!reply_deliver(&replies, &hdr, payload) && !u && hdr.type == FRAME_MSG && on_push) {
+            on_push(ctx, payload, hdr.length);
+        }
+    }
+    receiving = 0;
+    reply_fail_all(&replies);
+    for (udp_upload_t *u = uploads; u; u = u->next) event_fire(&u->acked);
+    event_fire(&received);
+    co_return 0;
+}
+
+// Send a request until its reply arrives, CLIENT_UDP_TRIES times at most.
+// Returns the reply type, or -1.
+inline task_t udp_client::request(uint32_t stream_id, uint8_t type, uint16_t flags, const char *payload, size_t len,
+                                  char *reply, size_t cap, uint64_t timeout_us) {
+    co_reply_t r;
+    reply_add(&replies, &r, stream_id, reply, cap);
+    for (int i = 0; i < CLIENT_UDP_TRIES && r.listed && receiving; i++) {
+        // A full socket buffer loses the datagram like the network would
+        if (sendto_frame(sock, &server, type, flags, stream_id, payload, len) < 0 && errno != EAGAIN) break;
+        co_await event_wait(loop, &r.done, timeout_us);
+    }
+    reply_remove(&replies, &r);
+    if (reply && cap > 0 && r.type < 0) reply[0] = '\0';
+    co_return r.type;
+}
+
+inline task_t udp_client::login(const char *username) {
+    co_return co_await request(next_stream_id++, FRAME_USER, 0, username, strlen(username), NULL, 0,
+                               CLIENT_UDP_TIMEOUT_US);
+}
+
+// Log in with a ticket from tcp_client::bulk(). Returns FRAME_USER_OK,
+// FRAME_USER_FAIL or -1.
+inline task_t udp_client::bind(uint64_t ticket) {
+    char payload[8];
+    put_u64(payload, ticket);
+    co_return co_await request(next_stream_id++, FRAME_BIND, 0, payload, sizeof(payload), NULL, 0,
+                               CLIENT_UDP_TIMEOUT_US);
+}
+
+inline task_t udp_client::message(const char *text, char *reply, size_t cap) {
+    int type = co_await request(next_stream_id++, FRAME_MSG, 0, text, strlen(text), reply, cap, CLIENT_UDP_TIMEOUT_US);
+    co_return type == FRAME_MSG ? (int)strlen(reply ? reply : "") : -1;
+}
+
+// Upload a file over rudp.h, verified by its digest. Returns
+// FRAME_FILE_OK, FRAME_FILE_FAIL or -1.
+inline task_t udp_client::send_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) co_return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        co_return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    const char *name = client_basename(path);
+    char info_buf[FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)st.st_size, seg_size, name, strlen(name)};
+    size_t info_len = file_info_encode(info_buf, sizeof(info_buf), &info);
+    uint32_t id = next_stream_id++;
+    int type = co_await request(id, FRAME_FILE, FILE_FLAG_RELIABLE | FILE_FLAG_VERIFY, info_buf, info_len, NULL, 0,
+                                RUDP_INITIAL_RTO_US);
+    udp_upload_t *u = type == FRAME_READY ? (udp_upload_t *)malloc(sizeof(udp_upload_t)) : NULL;
+    if (!u || rudp_tx_init(&u->tx, sock, &server, id, fd, (uint64_t)st.st_size, seg_size, window, cc) < 0) {
+        free(u);
+        ::close(fd);
+        co_return type == FRAME_READY ? -1 : type;
+    }
+    u->tx.verify = 1;
+    u->result = -1;
+    memset(&u->acked, 0, sizeof(u->acked));
+    u->next = uploads;
+    uploads = u;
+
+    int committed = 0;
+    while (u->result < 0 && receiving && !rudp_tx_done(&u->tx)) {
+        if (rudp_tx_fill_window(&u->tx) < 0) break;
+        int64_t wait_us = rudp_tx_check_loss(&u->tx);
+        if (wait_us < 0) break;
+        if (!committed && rudp_tx_digest_ready(&u->tx)) {
+            rudp_tx_commit(&u->tx);
+            committed = 1;
+        }
+        co_await event_wait(loop, &u->acked, (uint64_t)wait_us);
+        if (now_us() - u->tx.last_progress_us > RUDP_IDLE_TIMEOUT_US) break;
+    }
+    // Everything is acknowledged; a lost verdict comes again with the commit
+    for (int i = 0; u->result < 0 && receiving && rudp_tx_done(&u->tx) && i < CLIENT_UDP_TRIES; i++) {
+        rudp_tx_commit(&u->tx);
+        co_await event_wait(loop, &u->acked, u->tx.rto_us);
+    }
+
+    type = u->result;
+    retransmits += u->tx.retransmits;
+    for (udp_upload_t **p = &uploads; *p; p = &(*p)->next) {
+        if (*p == u) {
+            *p = u->next;
+            break;
+        }
+    }
+    rudp_tx_free(&u->tx);
+    free(u);
+    ::close(fd);
+    co_return type;
+}
+
+inline task_t udp_client::close() {
+    if (sock < 0) co_return 0;
+    closing = 1;
+    event_fire(&watch.readable);
+    if (receiving) co_await event_wait(loop, &received, LOOP_NO_TIMEOUT);
+    loop_unwatch(loop, &watch);
+    ::close(sock);
+    sock = -1;
+    free(buf);
+    buf = NULL;
+    co_return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Bulk channel
+// ---------------------------------------------------------------------------
+
+// Open u as the bulk channel of this logged-in session: ask for a ticket,
+// connect u to the granted port of the same server and log it in with the
+// ticket. Returns FRAME_USER_OK, or -1 if the server has no UDP side or
+// refused.
+inline task_t tcp_client::bulk(udp_client_t *u) {
+    char grant[BULK_GRANT_SIZE + 1] = {0};
+    if (co_await request(FRAME_BULK, NULL, 0, grant, sizeof(grant)) != FRAME_BULK) co_return -1;
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    char ip[INET_ADDRSTRLEN], addr[INET_ADDRSTRLEN + 8];
+    if (getpeername(sock, (struct sockaddr *)&peer, &len) < 0 || !inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip))) {
+        co_return -1;
+    }
+    snprintf(addr, sizeof(addr), "%s:%u", ip, get_u16(grant + 8));
+    if (co_await u->connect(addr) < 0) co_return -1;
+    int type = co_await u->bind(get_u64(grant));
+    co_return type == FRAME_USER_OK ? type : -1;
+}
+
+#endif
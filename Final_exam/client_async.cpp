@@ -0,0 +1,377 @@
+// Command-line client on the coroutine library (client.h): the chat and
+// verified uploads of client_tcp and client_udp on one thread, without a
+// reader thread per session.
+//
+// Interactively it works like the other clients: a username, then lines
+// that are messages, "file <path>", "/join <room>", "/leave" or "quit".
+// Messages are pipelined and each echo is printed when it arrives.
+//
+// With -c it runs that many sessions at once instead, each logging in,
+// exchanging -m messages and uploading the -f file -n times. That tests
+// how many sessions one thread can drive.
+//
+// With -b a session logs in over TCP and opens a bulk channel to
+// server_tcp -u: messages and rooms stay on TCP, files go over UDP.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "client.h"
+
+#define SERVER_ADDR "127.0.0.1"
+#define MAX_LINE 4096
+#define DRAIN_US 2000000    // How long quitting waits for outstanding echoes
+
+typedef struct {
+    int index;
+    tcp_client_t tcp;
+    udp_client_t udp;
+    int ok;
+    int messages;
+    int uploads;
+} session_t;
+
+static loop_t loop;
+static int use_udp = 0;
+static int use_bulk = 0;            // -b: TCP, with files over a UDP bulk channel
+static const char *server = SERVER_ADDR;
+static int nsessions = 0;           // -c: load mode
+static int msgs_per_session = 10;
+static int uploads_per_session = 1;
+static const char *upload_path;
+static int interactive;
+static int pending;                 // Messages awaiting their echo
+static char username[64];
+
+void err_quit(const char *msg) {
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+// The same calls over whichever transport the session uses
+
+task_t session_connect(session_t *s) {
+    if (use_udp) co_return co_await s->udp.connect(server);
+    co_return co_await s->tcp.connect(server);
+}
+
+task_t session_login(session_t *s, const char *name) {
+    if (use_udp) co_return co_await s->udp.login(name);
+    int type = co_await s->tcp.login(name);
+    if (type != FRAME_USER_OK || !use_bulk) co_return type;
+    co_return co_await s->tcp.bulk(&s->udp);
+}
+
+task_t session_message(session_t *s, const char *text, char *reply, size_t cap) {
+    if (use_udp) co_return co_await s->udp.message(text, reply, cap);
+    co_return co_await s->tcp.message(text, reply, cap);
+}
+
+task_t session_send_file(session_t *s, const char *path) {
+    if (use_udp || use_bulk) co_return co_await s->udp.send_file(path);
+    co_return co_await s->tcp.send_file(path);
+}
+
+task_t session_close(session_t *s) {
+    if (use_udp || use_bulk) co_await s->udp.close();
+    if (use_udp) co_return 0;
+    co_return co_await s->tcp.close();
+}
+
+void print_push(void *ctx, const char *text, uint32_t len) {
+    (void)ctx;
+    printf("\r[server] %.*s\n", (int)len, text);
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+}
+
+// ---------------------------------------------------------------------------
+// Interactive
+// ---------------------------------------------------------------------------
+
+task_t say(session_t *s, char *text) {
+    char reply[MAX_LINE];
+    uint64_t start = now_us();
+    int n = co_await session_message(s, text, reply, sizeof(reply));
+    if (n >= 0) printf("\rServer: %s (%.2f ms)\n", reply, (now_us() - start) / 1000.0);
+    else printf("\rNo echo for: %s\n", text);
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+    pending--;
+    free(text);
+    co_return 0;
+}
+
+task_t join(session_t *s, char *room) {
+    char reply[MAX_LINE];
+    if (co_await s->tcp.join(room, reply, sizeof(reply)) == 0) printf("\rServer: %s\n", reply);
+    else printf("\rRoom change failed\n");
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+    free(room);
+    co_return 0;
+}
+
+// Uploads run side by side, queued on the session's send lock, so the
+// rate is this file's size over the time from asking to the verdict.
+task_t upload(session_t *s, char *path) {
+    uint64_t start = now_us();
+    struct stat st;
+    long long size = stat(path, &st) == 0 ? (long long)st.st_size : 0;
+    printf("Sending file: %s\n", path);
+    int type = co_await session_send_file(s, path);
+    double secs = (now_us() - start) / 1e6;
+    if (type == FRAME_FILE_OK) {
+        printf("\rFile %s sent successfully, digest verified by the server (%.2f s, %.2f MB/s)\n", path, secs,
+               secs > 0 ? size / secs / 1e6 : 0.0);
+    } else {
+        printf("\rFile %s failed (%s)\n", path, type < 0 ? "error or disconnect" : "rejected by the server");
+    }
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+    free(path);
+    co_return type;
+}
+
+int handle_line(session_t *s, char *line) {
+    if (strcmp(line, "quit") == 0) return -1;
+    if (line[0] == '\0') return 0;
+    if (strncmp(line, "file ", 5) == 0) {
+        char *path = strdup(line + 5);
+        if (path) loop_spawn(&loop, upload(s, path));
+        return 0;
+    }
+    if (!use_udp && (strncmp(line, "/join ", 6) == 0 || strcmp(line, "/leave") == 0)) {
+        char *room = strdup(line[1] == 'j' ? line + 6 : "");
+        if (room) loop_spawn(&loop, join(s, room));
+        return 0;
+    }
+    char *text = strdup(line);
+    if (!text) return -1;
+    pending++;
+    loop_spawn(&loop, say(s, text));
+    return 0;
+}
+
+task_t console(session_t *s) {
+    co_watch_t watch;
+    // A regular file on stdin cannot be watched, but never blocks either
+    int watched = loop_watch(&loop, &watch, STDIN_FILENO) == 0;
+    int saved = fcntl(STDIN_FILENO, F_GETFL);
+    if (watched) fcntl(STDIN_FILENO, F_SETFL, saved | O_NONBLOCK);
+
+    char buf[MAX_LINE];
+    size_t len = 0;
+    int done = 0;
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+    while (!done) {
+        char *nl = (char *)memchr(buf, '\n', len);
+        if (nl || len == sizeof(buf) - 1) {
+            size_t line_len = nl ? (size_t)(nl - buf) : len;
+            buf[line_len] = '\0';
+            if (line_len > 0 && buf[line_len - 1] == '\r') buf[line_len - 1] = '\0';
+            done = handle_line(s, buf) < 0;
+            size_t used = nl ? line_len + 1 : len;
+            memmove(buf, buf + used, len - used);
+            len -= used;
+            if (interactive && !done) printf("%s> ", username);
+            fflush(stdout);
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, buf + len, sizeof(buf) - len - 1);
+        if (n < 0 && errno == EAGAIN) {
+            co_await event_wait(&loop, &watch.readable, LOOP_NO_TIMEOUT);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (len > 0) {
+                buf[len] = '\0';
+                handle_line(s, buf);
+            }
+            break;
+        }
+        len += (size_t)n;
+    }
+    if (watched) {
+        loop_unwatch(&loop, &watch);
+        fcntl(STDIN_FILENO, F_SETFL, saved);
+    }
+
+    // Datagrams can be lost, so some echoes may never come
+    uint64_t deadline = now_us() + DRAIN_US;
+    while (pending > 0 && now_us() < deadline) co_await loop_sleep(&loop, 10000);
+    if (pending > 0) printf("%d messages got no echo\n", pending);
+    co_return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Load
+// ---------------------------------------------------------------------------
+
+task_t load_session(session_t *s) {
+    char name[32];
+    char msg[64];
+    char reply[128];
+    if (co_await session_connect(s) < 0) {
+        printf("Session %d: connect failed: %s\n", s->index, strerror(errno));
+        co_return -1;
+    }
+    snprintf(name, sizeof(name), "async%d", s->index);
+    if (co_await session_login(s, name) != FRAME_USER_OK) {
+        printf("Session %d: login failed\n", s->index);
+        co_await session_close(s);
+        co_return -1;
+    }
+    for (int i = 0; i < msgs_per_session; i++) {
+        snprintf(msg, sizeof(msg), "message %d from %s", i, name);
+        if (co_await session_message(s, msg, reply, sizeof(reply)) >= 0) s->messages++;
+    }
+    for (int i = 0; upload_path && i < uploads_per_session; i++) {
+        if (co_await session_send_file(s, upload_path) == FRAME_FILE_OK) s->uploads++;
+    }
+    co_await session_close(s);
+    s->ok = s->messages == msgs_per_session && (!upload_path || s->uploads == uploads_per_session);
+    co_return 0;
+}
+
+void run_load() {
+    // Every session holds a socket
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    session_t *sessions = (session_t *)calloc((size_t)nsessions, sizeof(session_t));
+    if (!sessions) err_quit("Session allocation failed");
+    long long file_size = 0;
+    if (upload_path) {
+        struct stat st;
+        if (stat(upload_path, &st) < 0) err_quit(upload_path);
+        file_size = st.st_size;
+    }
+
+    uint64_t start = now_us();
+    for (int i = 0; i < nsessions; i++) {
+        sessions[i].index = i;
+        tcp_client_init(&sessions[i].tcp, &loop);
+        udp_client_init(&sessions[i].udp, &loop);
+        loop_spawn(&loop, load_session(&sessions[i]));
+    }
+    if (loop_run(&loop) < 0) err_quit("Event loop failed");
+    double secs = (now_us() - start) / 1e6;
+
+    int ok = 0, messages = 0, uploads = 0;
+    uint64_t retransmits = 0;
+    for (int i = 0; i < nsessions; i++) {
+        ok += sessions[i].ok;
+        messages += sessions[i].messages;
+        uploads += sessions[i].uploads;
+        retransmits += sessions[i].udp.retransmits;
+    }
+    double mb = (double)uploads * file_size / 1e6;
+    printf("%d/%d %s sessions completed in %.2f s on one thread: %d echoes (%.0f/s), %d uploads, %.1f MB "
+           "(%.2f MB/s)",
+           ok, nsessions, use_udp ? "UDP" : use_bulk ? "TCP+UDP" : "TCP", secs, messages,
+           secs > 0 ? messages / secs : 0.0, uploads, mb, secs > 0 ? mb / secs : 0.0);
+    if (use_udp || use_bulk) printf(", %llu segments retransmitted", (unsigned long long)retransmits);
+    printf("\n");
+    free(sessions);
+    exit(ok == nsessions ? 0 : 1);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-u|-b] [-c sessions [-m messages] [-f file [-n uploads]]] [server[:port]]\n", prog);
+    fprintf(stderr, "  -u    UDP: talk to server_udp, uploads over rudp.h\n");
+    fprintf(stderr, "  -b    TCP with uploads over a UDP bulk channel (server_tcp -u)\n");
+    fprintf(stderr, "  -c N  run N sessions at once instead of reading commands\n");
+    fprintf(stderr, "  -m N  messages per session (default 10)\n");
+    fprintf(stderr, "  -f F  file each session uploads\n");
+    fprintf(stderr, "  -n N  uploads per session (default 1)\n");
+    fprintf(stderr, "The server defaults to %s:%d.\n", SERVER_ADDR, CLIENT_PORT);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ubc:m:f:n:")) != -1) {
+        switch (opt) {
+        case 'u':
+            use_udp = 1;
+            break;
+        case 'b':
+            use_bulk = 1;
+            break;
+        case 'c':
+            nsessions = atoi(optarg);
+            break;
+        case 'm':
+            msgs_per_session = atoi(optarg);
+            break;
+        case 'f':
+            upload_path = optarg;
+            break;
+        case 'n':
+            uploads_per_session = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc) server = argv[optind];
+    struct sockaddr_in check;
+    if (addr_parse(server, CLIENT_PORT, &check) < 0 || nsessions < 0 || msgs_per_session < 0 ||
+        (use_udp && use_bulk)) {
+        usage(argv[0]);
+    }
+    if (loop_init(&loop) < 0) err_quit("Event loop creation failed");
+    if (nsessions > 0) run_load();
+
+    session_t s;
+    memset(&s, 0, sizeof(s));
+    tcp_client_init(&s.tcp, &loop);
+    udp_client_init(&s.udp, &loop);
+    s.tcp.on_push = s.udp.on_push = print_push;
+
+    printf("Enter your username: ");
+    fflush(stdout);
+    // A byte at a time, so that the commands after it stay for console()
+    size_t name_len = 0;
+    char ch;
+    ssize_t got;
+    while ((got = read(STDIN_FILENO, &ch, 1)) == 1 && ch != '\n') {
+        if (name_len < sizeof(username) - 1) username[name_len++] = ch;
+    }
+    if (got <= 0 && name_len == 0) return 0;
+    username[strcspn(username, "\r")] = '\0';
+
+    task_t connect = session_connect(&s);
+    if (loop_run_task(&loop, connect) < 0) err_quit("Connect failed");
+    task_t login = session_login(&s, username);
+    int type = loop_run_task(&loop, login);
+    if (type == FRAME_USER_OK) printf("Username '%s' registered successfully.\n", username);
+    else if (type < 0 && use_bulk) err_quit("Login or bulk channel failed (is the server running with -u?)");
+    else if (type < 0) err_quit("Connection failed during username registration");
+    else printf("Username registration failed. Using default identifier.\n");
+
+    printf("\nCommands:\n");
+    printf("  file <filepath> - Send a file\n");
+    if (!use_udp) printf("  /join <room>    - Join a chat room\n  /leave          - Leave the room\n");
+    printf("  quit            - Exit\n");
+    printf("  Any other text  - Send as message\n\n");
+
+    interactive = isatty(STDIN_FILENO);
+    task_t session = console(&s);
+    loop_run_task(&loop, session);
+    loop_run(&loop);  // Uploads still running
+    task_t close = session_close(&s);
+    loop_run_task(&loop, close);
+    loop_free(&loop);
+    return 0;
+}
@@ -1,159 +1,1472 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <glob.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "resume.h"
+#include "delta.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "compress.h"
+#include "batch.h"
+#include "tcptune.h"
+#include "reader.h"
 
 #define SERVER_IP "127.0.0.2"
 #define SERVERPORT 9000
 #define BUFSIZE 65536
 #define MAX_USERNAME 32
+#define MAX_STREAMS 64
+#define STREAM_STACK_SIZE (256 * 1024)  // Stream threads keep their buffers in the pool
+#define DEFAULT_CHUNK_KB 4096
+#define RESUME_RETRIES 5  // Reconnect attempts per resumable upload, 1 s backoff doubling
+#define BATCH_LANES 4     // Connections for the large files of a dir upload (-P)
+
+// Send file bodies with sendfile() straight from the page cache instead
+// of read()+send() through a user-space buffer.
+static int zero_copy = 0;
+
+// Striped upload: with more than one stream the file is cut into chunks
+// that parallel data connections take turns sending (see protocol.h).
+static int streams = 1;
+static long long chunk_size = DEFAULT_CHUNK_KB * 1024LL;
+
+// Resumable upload: the server keeps partial files, and a dropped
+// connection is re-established and the upload continued where it stopped.
+static int resumable = 0;
+
+// Delta upload: send only the parts of the file the server's copy lacks.
+static int delta_mode = 0;
 
-#pragma comment(lib, "ws2_32.lib")
+// Compressed upload: the codec asked for with -C, and whether the server
+// agreed to it at login (compress.h).
+static int compress_codec = CODEC_NONE;
+static int compress_ok = 0;
+
+// Batch upload (dir command): small files go packed over the main
+// connection while this many more send the large ones (batch.h).
+static int batch_lanes = BATCH_LANES;
+
+// How plain and compressed uploads read the file (reader.h, -E).
+static reader_mode_t read_mode = READER_AUTO;
+
+static struct sockaddr_in serveraddr;
+static ring_t in;  // Inbound frames from the server
+static uint32_t next_stream_id = 1;
+static char username[MAX_USERNAME];
+static pipeline_t msgs;      // Chat messages in flight (pipeline.h)
+static int interactive;      // stdin is a terminal: redraw the prompt after async output
+
+// One data connection of a striped upload
+typedef struct {
+    pthread_t thread;
+    int index;
+    int fd;                  // The file, shared by every stream
+    uint64_t transfer_id;
+    long long file_size;
+    long long *next_chunk;   // Shared chunk counter
+    long long bytes;         // Acknowledged by the server
+    double secs;
+    int ok;
+} stream_t;
 
 void err_quit(const char *msg) {
-    fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
     exit(1);
 }
 
-void send_file(SOCKET sock, const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
+// Buffered path: send() the file as the read engine hands it out, from
+// total_sent on. v, when set, checksums each block on its way out
+// (checksum.h).
+long long send_buffered(int sock, reader_t *r, long long total_sent, verify_t *v) {
+    long long file_size = r->size;
+    uint64_t progress_us = 0;
+    r->pos = total_sent;
+    while (total_sent < file_size) {
+        const char *buf;
+        ssize_t bytes_read = reader_next(r, &buf, BUFSIZE);
+        if (bytes_read < 0) return -1;
+        if (bytes_read == 0) break;
+        if (v) verify_update(v, buf, (size_t)bytes_read);
+        ssize_t off = 0;
+        while (off < bytes_read) {
+            ssize_t bytes_sent = send(sock, buf + off, bytes_read - off, MSG_NOSIGNAL);
+            if (bytes_sent < 0) return -1;
+            off += bytes_sent;
+        }
+        total_sent += bytes_read;
+        if (progress_due(&progress_us, total_sent == file_size)) {
+            printf("Sent %lld/%lld bytes (%.2f%%)\r", total_sent, file_size, ((double)total_sent / file_size) * 100);
+        }
+    }
+    return total_sent;
+}
+
+// Zero-copy path. Returns the bytes sent so far when sendfile() is not
+// supported for this file so the caller can finish with send_buffered.
+long long send_zero_copy(int sock, int fd, long long file_size, int *unsupported) {
+    off_t offset = 0;
+    uint64_t progress_us = 0;
+    while (offset < file_size) {
+        long long remaining = file_size - offset;
+        ssize_t n = sendfile(sock, fd, &offset, remaining < BUFSIZE ? (size_t)remaining : BUFSIZE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                *unsupported = 1;
+                lseek(fd, offset, SEEK_SET);
+                return offset;
+            }
+            return -1;
+        }
+        if (n == 0) break;
+        if (progress_due(&progress_us, offset == file_size)) {
+            printf("Sent %lld/%lld bytes (%.2f%%)\r", (long long)offset, file_size, ((double)offset / file_size) * 100);
+        }
+    }
+    return offset;
+}
+
+// Compressed path: blocks are read in order and handed to the pool's
+// threads, and sent in order as they come back compressed.
+long long send_compressed(int sock, reader_t *r, uint32_t stream_id, zpool_t *pool, verify_t *v) {
+    long long file_size = r->size;
+    long long read_off = 0;
+    long long total_sent = 0;
+    uint64_t progress_us = 0;
+    while (total_sent < file_size) {
+        zslot_t *s;
+        while (read_off < file_size && (s = zpool_slot(pool)) != NULL) {
+            long long remaining = file_size - read_off;
+            size_t n = remaining < COMPRESS_BLOCK_SIZE ? (size_t)remaining : COMPRESS_BLOCK_SIZE;
+            if (reader_read_at(r, s->raw, n, read_off) < 0) return -1;
+            if (v) verify_update(v, s->raw, (size_t)n);
+            zpool_submit(pool, s, (uint32_t)n);
+            read_off += n;
+        }
+        s = zpool_next(pool);
+        if (!s) break;
+        if (send_frame(sock, FRAME_BLOCK, 0, stream_id, s->out, s->out_len) < 0) return -1;
+        total_sent += s->raw_len;
+        zpool_release(pool, s);
+        if (progress_due(&progress_us, total_sent == file_size)) {
+            printf("Sent %lld/%lld bytes (%.2f%%)\r", total_sent, file_size, ((double)total_sent / file_size) * 100);
+        }
+    }
+    return total_sent;
+}
+
+// Delta operations waiting to go out in the next FRAME_DELTA. Consecutive
+// copies are merged into one run before they are encoded.
+typedef struct {
+    int sock;
+    uint32_t stream_id;
+    int failed;
+    size_t len;
+    uint32_t run_first;
+    uint32_t run_count;
+    long long copied;
+    long long literal;
+    long long done;       // File bytes covered by the operations so far
+    long long file_size;
+    uint64_t progress_us;  // Last progress line
+    char buf[FRAME_MAX_PAYLOAD];
+} delta_out_t;
+
+void delta_flush(delta_out_t *o) {
+    if (o->len == 0 || o->failed) return;
+    if (send_frame(o->sock, FRAME_DELTA, 0, o->stream_id, o->buf, o->len) < 0) o->failed = 1;
+    o->len = 0;
+    if (!progress_due(&o->progress_us, o->done == o->file_size)) return;
+    printf("Sent delta for %lld/%lld bytes (%.2f%%)\r", o->done, o->file_size,
+           o->file_size ? ((double)o->done / o->file_size) * 100 : 100.0);
+}
+
+void delta_put_run(delta_out_t *o) {
+    if (o->run_count == 0) return;
+    if (sizeof(o->buf) - o->len < DELTA_COPY_SIZE) delta_flush(o);
+    o->buf[o->len] = DELTA_OP_COPY;
+    put_u32(o->buf + o->len + 1, o->run_first);
+    put_u32(o->buf + o->len + 5, o->run_count);
+    o->len += DELTA_COPY_SIZE;
+    o->run_count = 0;
+}
+
+void delta_copy(delta_out_t *o, uint32_t block, uint32_t block_size) {
+    if (o->run_count == 0 || block != o->run_first + o->run_count) {
+        delta_put_run(o);
+        o->run_first = block;
+    }
+    o->run_count++;
+    o->copied += block_size;
+    o->done += block_size;
+}
+
+void delta_literal(delta_out_t *o, const uint8_t *data, size_t len) {
+    if (len == 0) return;
+    delta_put_run(o);
+    o->literal += (long long)len;
+    o->done += (long long)len;
+    while (len > 0) {
+        if (sizeof(o->buf) - o->len <= DELTA_LITERAL_HDR_SIZE) delta_flush(o);
+        size_t take = sizeof(o->buf) - o->len - DELTA_LITERAL_HDR_SIZE;
+        if (take > len) take = len;
+        o->buf[o->len] = DELTA_OP_LITERAL;
+        put_u32(o->buf + o->len + 1, (uint32_t)take);
+        memcpy(o->buf + o->len + DELTA_LITERAL_HDR_SIZE, data, take);
+        o->len += DELTA_LITERAL_HDR_SIZE + take;
+        data += take;
+        len -= take;
+    }
+}
+
+// Server blocks by weak checksum: bucket heads and a chain through the
+// blocks that share a bucket.
+typedef struct {
+    const delta_sig_t *sigs;
+    uint32_t nblocks;
+    uint32_t mask;
+    int32_t *head;
+    int32_t *next;
+} sig_table_t;
+
+static inline uint32_t sig_bucket(const sig_table_t *t, uint32_t weak) {
+    return (weak * 0x9E3779B1u) >> 7 & t->mask;
+}
+
+int sig_table_init(sig_table_t *t, const delta_sig_t *sigs, uint32_t nblocks) {
+    uint32_t buckets = 1;
+    while (buckets < 2 * nblocks) buckets *= 2;
+    t->sigs = sigs;
+    t->nblocks = nblocks;
+    t->mask = buckets - 1;
+    t->head = (int32_t *)malloc(buckets * sizeof(int32_t));
+    t->next = (int32_t *)malloc((nblocks + 1) * sizeof(int32_t));
+    if (!t->head || !t->next) return -1;
+    memset(t->head, 0xff, buckets * sizeof(int32_t));
+    // Insert in reverse so each chain lists blocks in file order
+    for (uint32_t i = nblocks; i-- > 0;) {
+        uint32_t bucket = sig_bucket(t, sigs[i].weak);
+        t->next[i] = t->head[bucket];
+        t->head[bucket] = (int32_t)i;
+    }
+    return 0;
+}
+
+// Server block holding exactly the block_size bytes at p, or -1. The block
+// after the current copy run is tried first so runs stay unbroken.
+int sig_table_find(const sig_table_t *t, uint32_t weak, const uint8_t *p, uint32_t block_size, int64_t prefer) {
+    bhash_t strong;
+    int have_strong = 0;
+    if (prefer >= 0 && prefer < t->nblocks && t->sigs[prefer].weak == weak) {
+        strong = bhash(p, block_size);
+        have_strong = 1;
+        if (bhash_eq(&strong, &t->sigs[prefer].strong)) return (int)prefer;
+    }
+    for (int32_t i = t->head[sig_bucket(t, weak)]; i >= 0; i = t->next[i]) {
+        if (t->sigs[i].weak != weak) continue;
+        if (!have_strong) {
+            strong = bhash(p, block_size);
+            have_strong = 1;
+        }
+        if (bhash_eq(&strong, &t->sigs[i].strong)) return i;
+    }
+    return -1;
+}
+
+int send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Send len bytes of the file starting at offset, without moving the file
+// position, so streams can share one descriptor.
+int send_range(int sock, int fd, char *buf, off_t offset, long long len) {
+    off_t end = offset + len;
+    while (zero_copy && offset < end) {
+        long long remaining = end - offset;
+        ssize_t n = sendfile(sock, fd, &offset, remaining < BUFSIZE ? (size_t)remaining : BUFSIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;  // Finish buffered
+        if (n <= 0) return -1;
+    }
+    while (offset < end) {
+        long long remaining = end - offset;
+        ssize_t n = pread(fd, buf, remaining < BUFSIZE ? (size_t)remaining : BUFSIZE, offset);
+        if (n <= 0) return -1;
+        if (send_all(sock, buf, (size_t)n) < 0) return -1;
+        offset += n;
+    }
+    return 0;
+}
+
+// Apply a role's socket profile (tcptune.h), warning once per role if the
+// kernel refuses some of it. Every built-in profile turns Nagle off:
+// frames are written whole, so there is nothing for it to merge, and with
+// it on a FRAME_COMMIT right after a small body waits for that body's
+// (delayed) ACK.
+void tune_socket(int sock, int role) {
+    static int warned[TCP_ROLES];
+    int failed = tcp_apply(sock, role);
+    if (failed && !__atomic_exchange_n(&warned[role], 1, __ATOMIC_RELAXED)) {
+        printf("Warning: %d socket option(s) of profile '%s' not applied: %s\n", failed, tcp_profiles[role].name,
+               strerror(errno));
+    }
+}
+
+void print_tcp_info(int sock, int role) {
+    tcp_sample_t s;
+    char line[256];
+    if (tcp_sample(sock, &s) < 0) return;
+    tcp_format(line, sizeof(line), role, &s);
+    printf("%s\n", line);
+}
+
+// A FRAME_CHUNK and its body. The bulk profile corks the socket around
+// them, so the header leaves in the body's first segment.
+int send_chunk(int sock, int fd, char *buf, uint32_t stream_id, const chunk_info_t *chunk) {
+    char info[CHUNK_INFO_SIZE];
+    chunk_info_encode(info, chunk);
+    tcp_cork(sock, TCP_ROLE_BULK, 1);
+    int r = send_frame(sock, FRAME_CHUNK, 0, stream_id, info, sizeof(info)) < 0 ||
+                    send_range(sock, fd, buf, (off_t)chunk->offset, (long long)chunk->length) < 0
+                ? -1
+                : 0;
+    tcp_cork(sock, TCP_ROLE_BULK, 0);
+    return r;
+}
+
+void *stream_loop(void *data) {
+    stream_t *s = (stream_t *)data;
+    ring_t ring = {0};
+    uint64_t start = now_us();
+
+    // From the pool rather than the stack, so stream threads stay small
+    char *buf = (char *)pbuf_alloc(BUFSIZE);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock >= 0) tune_socket(sock, TCP_ROLE_BULK);
+    if (!buf || sock < 0 || connect(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0 ||
+        ring_init(&ring, RING_SIZE) < 0) {
+        printf("Stream %d: cannot connect: %s\n", s->index, strerror(errno));
+        if (sock >= 0) close(sock);
+        pbuf_put(buf);
+        pool_thread_exit();
+        return NULL;
+    }
+
+    frame_hdr_t hdr = {0};
+    const char *payload = NULL;
+    char id[8];
+    put_u64(id, s->transfer_id);
+    if (send_frame(sock, FRAME_ATTACH, 0, 0, id, sizeof(id)) < 0 || recv_frame(sock, &ring, &hdr, &payload) <= 0 ||
+        hdr.type != FRAME_READY) {
+        printf("Stream %d: server refused to attach\n", s->index);
+        goto out;
+    }
+    ring_consume(&ring, FRAME_HDR_SIZE + hdr.length);
+
+    // Chunks are handed out in file order, so all streams advance together
+    while (1) {
+        long long off = __atomic_fetch_add(s->next_chunk, 1, __ATOMIC_RELAXED) * chunk_size;
+        if (off >= s->file_size) break;
+
+        chunk_info_t chunk;
+        chunk.offset = (uint64_t)off;
+        chunk.length = (uint64_t)(s->file_size - off < chunk_size ? s->file_size - off : chunk_size);
+        if (send_chunk(sock, s->fd, buf, 0, &chunk) < 0) {
+            printf("Stream %d: send failed: %s\n", s->index, strerror(errno));
+            goto out;
+        }
+    }
+
+    if (send_frame(sock, FRAME_COMMIT, 0, 0, NULL, 0) < 0 || recv_frame(sock, &ring, &hdr, &payload) <= 0 ||
+        hdr.type != FRAME_FILE_OK || hdr.length < 8) {
+        printf("Stream %d: no acknowledgement from server\n", s->index);
+        goto out;
+    }
+    s->bytes = (long long)get_u64(payload);
+    s->ok = 1;
+
+out:
+    s->secs = (now_us() - start) / 1e6;
+    close(sock);
+    ring_free(&ring);
+    pbuf_put(buf);
+    pool_thread_exit();
+    return NULL;
+}
+
+// An echo of one of our messages, or a message the server pushed.
+void print_message(const frame_hdr_t *hdr, const char *payload) {
+    uint64_t rtt;
+    if (pipeline_take(&msgs, hdr->stream_id, &rtt)) {
+        printf("\rServer: %.*s (%.2f ms)\n", (int)hdr->length, payload, rtt / 1000.0);
+    } else {
+        // Room messages arrive as "[room] user: text"
+        printf("\r%.*s\n", (int)hdr->length, payload);
+    }
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+}
+
+// Next frame that is not a chat message; those are printed on the way.
+int recv_sync_frame(int sock, frame_hdr_t *hdr, const char **payload) {
+    while (1) {
+        if (recv_frame(sock, &in, hdr, payload) <= 0) return -1;
+        if (hdr->type != FRAME_MSG) return 0;
+        print_message(hdr, *payload);
+        ring_consume(&in, FRAME_HDR_SIZE + hdr->length);
+    }
+}
+
+// Wait for the reply to a request. Returns the frame type, or -1 if the
+// server went away. The payload (if any) is copied into buf as a string.
+int recv_reply(int sock, char *buf, size_t cap) {
+    frame_hdr_t hdr = {0};
+    const char *payload = NULL;
+    if (recv_sync_frame(sock, &hdr, &payload) < 0) return -1;
+
+    size_t n = hdr.length < cap - 1 ? hdr.length : cap - 1;
+    memcpy(buf, payload, n);
+    buf[n] = '\0';
+    ring_consume(&in, FRAME_HDR_SIZE + hdr.length);
+    return hdr.type;
+}
+
+// Open a connection to carry on an upload and identify as username.
+// Returns the socket, or -1.
+int connect_server() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    tune_socket(sock, TCP_ROLE_BULK);
+    if (connect(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    ring_consume(&in, ring_used(&in));  // Drop whatever the old connection left
+
+    char buf[BUFSIZE];
+    if (send_frame(sock, FRAME_USER, 0, next_stream_id++, username, strlen(username)) < 0 ||
+        recv_reply(sock, buf, BUFSIZE) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// One attempt at a resumable upload: learn which ranges the server lacks
+// and send just those. Returns 0 on success, 1 if the server refused the
+// upload, and -1 if the connection failed and the upload can be resumed.
+int resume_attempt(int sock, int fd, const char *filename, long long file_size, uint64_t id) {
+    char payload[RESUME_INFO_SIZE + FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)file_size, 0, filename, strlen(filename)};
+    put_u64(payload, id);
+    size_t len = RESUME_INFO_SIZE + file_info_encode(payload + RESUME_INFO_SIZE, sizeof(payload) - RESUME_INFO_SIZE, &info);
+    uint32_t stream_id = next_stream_id++;
+    if (send_frame(sock, FRAME_RESUME, 0, stream_id, payload, len) < 0) return -1;
+
+    char buf[BUFSIZE];
+    int type = recv_reply(sock, buf, BUFSIZE);
+    if (type < 0) return -1;
+    if (type != FRAME_READY) {
+        printf("Server not ready (frame type %d)\n", type);
+        return 1;
+    }
+
+    // Copy the range list out; buf is reused for file data below
+    uint32_t count = get_u32(buf);
+    if (count > (BUFSIZE - 4) / CHUNK_INFO_SIZE) return 1;
+    chunk_info_t *ranges = (chunk_info_t *)malloc((count ? count : 1) * sizeof(chunk_info_t));
+    if (!ranges) return 1;
+    long long missing = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        chunk_info_decode(buf + 4 + CHUNK_INFO_SIZE * i, CHUNK_INFO_SIZE, &ranges[i]);
+        missing += (long long)ranges[i].length;
+    }
+    if (missing < file_size) {
+        printf("Resuming file: %s (%lld of %lld bytes already on server)\n", filename, file_size - missing, file_size);
+    } else {
+        printf("Sending file: %s (Size: %lld bytes)\n", filename, file_size);
+    }
+
+    // Each range goes out as chunks of at most chunk_size bytes
+    long long sent = 0;
+    uint64_t progress_us = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint64_t off = 0; off < ranges[i].length; off += (uint64_t)chunk_size) {
+            chunk_info_t chunk;
+            chunk.offset = ranges[i].offset + off;
+            chunk.length = ranges[i].length - off < (uint64_t)chunk_size ? ranges[i].length - off : (uint64_t)chunk_size;
+            if (send_chunk(sock, fd, buf, stream_id, &chunk) < 0) {
+                free(ranges);
+                return -1;
+            }
+            sent += (long long)chunk.length;
+            if (progress_due(&progress_us, sent == missing)) {
+                printf("Sent %lld/%lld bytes (%.2f%%)\r", sent, missing, ((double)sent / missing) * 100);
+            }
+        }
+    }
+    free(ranges);
+
+    if (send_frame(sock, FRAME_COMMIT, 0, stream_id, NULL, 0) < 0) return -1;
+    type = recv_reply(sock, buf, BUFSIZE);
+    if (type == FRAME_FILE_OK) {
+        printf("\nFile sent successfully\n");
+        return 0;
+    }
+    if (type == FRAME_FILE_FAIL) {
+        printf("\nServer still missing data, resuming\n");
+        return -1;
+    }
+    if (type >= 0) {
+        printf("\nFile transfer failed (frame type %d)\n", type);
+        return 1;
+    }
+    return -1;
+}
+
+// Send the CRC list and digest of a verified upload, then resend whatever
+// chunks the server says arrived damaged until it accepts or gives up.
+// Returns the server's final frame type, or -1.
+int commit_verified(int sock, int fd, verify_t *v, uint32_t stream_id, char *buf) {
+    char *commit = (char *)malloc(verify_commit_size(v));
+    if (!commit) return -1;
+    size_t len = verify_encode_commit(v, commit);
+    int r = send_frame(sock, FRAME_COMMIT, 0, stream_id, commit, len);
+    free(commit);
+    if (r < 0) return -1;
+
+    int type;
+    while ((type = recv_reply(sock, buf, BUFSIZE)) == FRAME_READY) {
+        // Copy the range list out; buf is reused for file data below
+        uint32_t count = get_u32(buf);
+        if (count > (BUFSIZE - 4) / CHUNK_INFO_SIZE) return -1;
+        chunk_info_t *ranges = (chunk_info_t *)malloc((count ? count : 1) * sizeof(chunk_info_t));
+        if (!ranges) return -1;
+        long long damaged = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            chunk_info_decode(buf + 4 + CHUNK_INFO_SIZE * i, CHUNK_INFO_SIZE, &ranges[i]);
+            damaged += (long long)ranges[i].length;
+        }
+        printf("\nServer found %lld bytes damaged in transit, sending them again\n", damaged);
+        for (uint32_t i = 0; i < count; i++) {
+            if (send_chunk(sock, fd, buf, stream_id, &ranges[i]) < 0) {
+                free(ranges);
+                return -1;
+            }
+        }
+        free(ranges);
+        if (send_frame(sock, FRAME_COMMIT, 0, stream_id, NULL, 0) < 0) return -1;
+    }
+    return type;
+}
+
+// Resumable mode: the transfer id ties every attempt at this file together,
+// so a reconnect (or a later run of the client) only sends what is missing.
+void send_resumable(int *sock, int fd, const char *filename, const struct stat *st) {
+    uint64_t id = resume_transfer_id(filename, (uint64_t)st->st_size,
+                                     (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec);
+    int backoff = 1;
+    for (int attempt = 0;; attempt++) {
+        if (*sock >= 0) {
+            int r = resume_attempt(*sock, fd, filename, (long long)st->st_size, id);
+            if (r >= 0) return;
+            printf("\nConnection lost during file transfer: %s\n", strerror(errno));
+            close(*sock);
+            *sock = -1;
+        }
+        if (attempt == RESUME_RETRIES) {
+            printf("Giving up after %d attempts; run 'file %s' again to resume\n", RESUME_RETRIES, filename);
+            return;
+        }
+        printf("Reconnecting in %d s (attempt %d/%d)...\n", backoff, attempt + 1, RESUME_RETRIES);
+        sleep(backoff);
+        backoff *= 2;
+        *sock = connect_server();
+    }
+}
+
+// Receive the server's block signatures after a delta READY.
+delta_sig_t *recv_signatures(int sock, uint32_t nblocks) {
+    delta_sig_t *sigs = (delta_sig_t *)malloc(((size_t)nblocks + 1) * sizeof(delta_sig_t));
+    if (!sigs) return NULL;
+    uint32_t got = 0;
+    while (got < nblocks) {
+        frame_hdr_t hdr = {0};
+        const char *payload = NULL;
+        if (recv_sync_frame(sock, &hdr, &payload) < 0 || hdr.type != FRAME_SIGNATURES ||
+            hdr.length % DELTA_SIG_SIZE != 0 || hdr.length / DELTA_SIG_SIZE > nblocks - got) {
+            free(sigs);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < hdr.length / DELTA_SIG_SIZE; i++) {
+            delta_sig_decode(payload + DELTA_SIG_SIZE * i, &sigs[got++]);
+        }
+        ring_consume(&in, FRAME_HDR_SIZE + hdr.length);
+    }
+    return sigs;
+}
+
+// Delta mode: slide a window over the file and send a copy operation for
+// every block the server already has, literal bytes for the rest.
+void send_delta(int sock, int fd, const char *filename, long long file_size) {
+    const uint8_t *map = NULL;
+    if (file_size > 0) {
+        map = (const uint8_t *)mmap(NULL, (size_t)file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Error: Cannot map file '%s': %s\n", filename, strerror(errno));
+            return;
+        }
+        madvise((void *)map, (size_t)file_size, MADV_SEQUENTIAL);
+    }
+
+    uint64_t start = now_us();
+    bhash_t file_hash = bhash(map, (size_t)file_size);
+    double hash_secs = (now_us() - start) / 1e6;
+
+    char file_info[FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)file_size, 0, filename, strlen(filename)};
+    size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+    uint32_t stream_id = next_stream_id++;
+    delta_out_t *o = NULL;
+    delta_sig_t *sigs = NULL;
+    sig_table_t table = {0};
+    weak_filter_t filter = {0};
+    char buf[BUFSIZE];
+    if (send_frame(sock, FRAME_FILE, FILE_FLAG_DELTA, stream_id, file_info, info_len) < 0) {
+        printf("Failed to send file info\n");
+        goto out;
+    }
+    {
+        int type = recv_reply(sock, buf, BUFSIZE);
+        if (type != FRAME_READY) {
+            printf("Server not ready (frame type %d)\n", type);
+            goto out;
+        }
+        uint32_t block_size = get_u32(buf);
+        uint32_t nblocks = get_u32(buf + 4);
+        if (block_size == 0 || (sigs = recv_signatures(sock, nblocks)) == NULL ||
+            sig_table_init(&table, sigs, nblocks) < 0 || weak_filter_init(&filter, sigs, nblocks) < 0 || (o = (delta_out_t *)calloc(1, sizeof(delta_out_t))) == NULL) {
+            printf("Failed to receive block signatures\n");
+            goto out;
+        }
+        printf("Sending delta: %s (Size: %lld bytes, server has %u blocks of %u bytes)\n", filename, file_size, nblocks,
+               block_size);
+
+        o->sock = sock;
+        o->stream_id = stream_id;
+        o->file_size = file_size;
+        start = now_us();
+        long long pos = 0, lit = 0, last = file_size - block_size;  // Last window start
+        int have_sums = 0;
+        uint32_t a = 0, b = 0;
+        while (nblocks > 0 && pos <= last && !o->failed) {
+            if (!have_sums) {
+                weak_sums(map + pos, block_size, &a, &b);
+                have_sums = 1;
+            }
+            // Skip positions whose checksum no server block has
+            size_t max = last - pos < FRAME_MAX_PAYLOAD ? (size_t)(last - pos) : FRAME_MAX_PAYLOAD;
+            pos += (long long)weak_scan(&filter, map + pos, max, block_size, &a, &b);
+            int64_t prefer = o->run_count ? (int64_t)o->run_first + o->run_count : -1;
+            int block = sig_table_find(&table, weak_pack(a, b), map + pos, block_size, prefer);
+            if (block >= 0) {
+                delta_literal(o, map + lit, (size_t)(pos - lit));
+                delta_copy(o, (uint32_t)block, block_size);
+                pos += block_size;
+                lit = pos;
+                have_sums = 0;
+                continue;
+            }
+            if (pos == last) break;
+            weak_roll(&a, &b, map[pos], map[pos + block_size], block_size);
+            pos++;
+            // Do not hold back a long unmatched stretch
+            if (pos - lit >= FRAME_MAX_PAYLOAD) {
+                delta_literal(o, map + lit, (size_t)(pos - lit));
+                lit = pos;
+            }
+        }
+        delta_literal(o, map + lit, (size_t)(file_size - lit));
+        delta_put_run(o);
+        delta_flush(o);
+        double scan_secs = (now_us() - start) / 1e6;
+        if (o->failed) {
+            printf("\nsend failed: %s\n", strerror(errno));
+            goto out;
+        }
+
+        printf("\nDelta: %lld bytes matched on the server, %lld literal (%.2f%% not resent)\n", o->copied, o->literal,
+               file_size ? (double)o->copied / file_size * 100 : 0.0);
+        printf("Hashing: %.2f MB/s whole file, %.2f MB/s rolling scan\n",
+               hash_secs > 0 ? file_size / hash_secs / 1e6 : 0.0, scan_secs > 0 ? file_size / scan_secs / 1e6 : 0.0);
+
+        char hash[16];
+        bhash_encode(hash, &file_hash);
+        if (send_frame(sock, FRAME_COMMIT, 0, stream_id, hash, sizeof(hash)) < 0) {
+            printf("Failed to commit file\n");
+            goto out;
+        }
+        type = recv_reply(sock, buf, BUFSIZE);
+        if (type == FRAME_FILE_OK) {
+            printf("File sent successfully\n");
+        } else if (type >= 0) {
+            printf("File transfer failed (frame type %d)\n", type);
+        } else {
+            printf("Server disconnected during file transfer confirmation\n");
+        }
+    }
+
+out:
+    free(o);
+    free(table.head);
+    free(table.next);
+    free(filter.bits);
+    free(sigs);
+    if (map) munmap((void *)map, (size_t)file_size);
+}
+
+// One file of a dir upload
+typedef struct {
+    char *path;      // Where it is here
+    char *name;      // Relative path it gets on the server
+    long long size;
+} batch_entry_t;
+
+// Files found so far; nftw() callbacks take no argument of their own
+static batch_entry_t *walk_files;
+static int walk_count;
+static int walk_cap;
+static size_t walk_strip;  // Leading bytes of a walked path that are not part of its name
+
+int walk_add(const char *path, const char *name, long long size) {
+    if (walk_count == walk_cap) {
+        int cap = walk_cap ? walk_cap * 2 : 256;
+        batch_entry_t *p = (batch_entry_t *)realloc(walk_files, cap * sizeof(batch_entry_t));
+        if (!p) return -1;
+        walk_files = p;
+        walk_cap = cap;
+    }
+    batch_entry_t *e = &walk_files[walk_count];
+    e->path = strdup(path);
+    e->name = strdup(name);
+    e->size = size;
+    if (!e->path || !e->name) {
+        free(e->path);
+        free(e->name);
+        return -1;
+    }
+    walk_count++;
+    return 0;
+}
+
+int walk_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;  // Symlinks and special files are skipped
+    return walk_add(path, path + walk_strip, st->st_size) < 0 ? -1 : 0;
+}
+
+// Expand the argument of dir: a directory is walked and keeps its own
+// name on the server, a file goes by its base name, and a glob may match
+// any mix of both. Returns -1 if the expansion failed.
+int batch_collect(const char *pattern) {
+    glob_t g;
+    int r = glob(pattern, 0, NULL, &g);
+    if (r == GLOB_NOMATCH) return 0;
+    if (r != 0) return -1;
+    for (size_t i = 0; i < g.gl_pathc && r == 0; i++) {
+        const char *path = g.gl_pathv[i];
+        struct stat st;
+        if (stat(path, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            char real[PATH_MAX];
+            if (!realpath(path, real)) continue;
+            walk_strip = (size_t)(strrchr(real, '/') - real) + 1;
+            if (nftw(real, walk_visit, 64, FTW_PHYS) != 0) r = -1;
+        } else if (S_ISREG(st.st_mode)) {
+            const char *slash = strrchr(path, '/');
+            if (walk_add(path, slash ? slash + 1 : path, st.st_size) < 0) r = -1;
+        }
+    }
+    globfree(&g);
+    return r;
+}
+
+// One connection sending the large files of a dir upload, each as an
+// ordinary upload, taking the next one from the shared list until none
+// are left.
+typedef struct {
+    pthread_t thread;
+    int index;
+    batch_entry_t **files;
+    int nfiles;
+    int *next;               // Shared file counter
+    int sent;
+    int failed;
+    long long bytes;
+} lane_t;
+
+// Returns 0 once the server has the file, 1 if it refused it, and -1 if
+// the connection failed.
+int lane_send(int sock, ring_t *ring, char *buf, const batch_entry_t *e) {
+    int fd = open(e->path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file '%s'\n", e->path);
+        return 1;
+    }
+    char file_info[FILE_INFO_SIZE + BATCH_PATH_MAX];
+    file_info_t info = {(uint64_t)e->size, 0, e->name, strlen(e->name)};
+    size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+    frame_hdr_t hdr = {0};
+    const char *payload = NULL;
+    int r = -1;
+    if (send_frame(sock, FRAME_FILE, FILE_FLAG_BATCH, 0, file_info, info_len) < 0 ||
+        recv_frame(sock, ring, &hdr, &payload) <= 0) {
+        goto out;
+    }
+    ring_consume(ring, FRAME_HDR_SIZE + hdr.length);
+    if (hdr.type != FRAME_READY) {
+        printf("Server refused %s (frame type %d)\n", e->name, hdr.type);
+        r = 1;
+        goto out;
+    }
+    if (send_range(sock, fd, buf, 0, e->size) < 0 || recv_frame(sock, ring, &hdr, &payload) <= 0) goto out;
+    ring_consume(ring, FRAME_HDR_SIZE + hdr.length);
+    r = hdr.type == FRAME_FILE_OK ? 0 : 1;
+    if (r) printf("File transfer failed: %s (frame type %d)\n", e->name, hdr.type);
+out:
+    close(fd);
+    return r;
+}
+
+void *lane_loop(void *data) {
+    lane_t *l = (lane_t *)data;
+    ring_t ring = {0};
+    frame_hdr_t hdr = {0};
+    const char *payload = NULL;
+
+    char *buf = (char *)pbuf_alloc(BUFSIZE);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock >= 0) tune_socket(sock, TCP_ROLE_BULK);
+    if (!buf || sock < 0 || connect(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0 ||
+        ring_init(&ring, RING_SIZE) < 0 || send_frame(sock, FRAME_USER, 0, 0, username, strlen(username)) < 0 ||
+        recv_frame(sock, &ring, &hdr, &payload) <= 0 || hdr.type != FRAME_USER_OK) {
+        printf("Connection %d: cannot connect: %s\n", l->index, strerror(errno));
+        goto out;
+    }
+    ring_consume(&ring, FRAME_HDR_SIZE + hdr.length);
+
+    while (1) {
+        int i = __atomic_fetch_add(l->next, 1, __ATOMIC_RELAXED);
+        if (i >= l->nfiles) break;
+        int r = lane_send(sock, &ring, buf, l->files[i]);
+        if (r == 0) {
+            l->sent++;
+            l->bytes += l->files[i]->size;
+        } else {
+            l->failed++;
+        }
+        if (r < 0) {
+            printf("Connection %d: send failed: %s\n", l->index, strerror(errno));
+            break;  // The others take over the rest
+        }
+    }
+
+out:
+    if (sock >= 0) close(sock);
+    if (ring.base) ring_free(&ring);
+    pbuf_put(buf);
+    pool_thread_exit();
+    return NULL;
+}
+
+// The small files of a dir upload, packed into FRAME_PACKs on the main
+// connection without waiting for the server in between. Returns the
+// reply's frame type, or -1, with the server's count of files written.
+int send_packs(int sock, batch_entry_t **files, int n, long long bytes, uint32_t *written) {
+    char info[BATCH_INFO_SIZE];
+    put_u32(info, (uint32_t)n);
+    put_u64(info + 4, (uint64_t)bytes);
+    uint32_t stream_id = next_stream_id++;
+    char buf[BUFSIZE];
+    if (send_frame(sock, FRAME_BATCH, 0, stream_id, info, sizeof(info)) < 0) return -1;
+    int type = recv_reply(sock, buf, BUFSIZE);
+    if (type != FRAME_READY) {
+        if (type >= 0) printf("Server not ready (frame type %d)\n", type);
+        return type;
+    }
+
+    batch_pack_t *pk = (batch_pack_t *)malloc(sizeof(batch_pack_t));
+    if (!pk) return -1;
+    pk->count = 0;
+    pk->body_len = 0;
+    uint64_t progress_us = 0;
+    for (int i = 0; i <= n; i++) {
+        if (i == n || !batch_pack_fits(pk, strlen(files[i]->name), (uint64_t)files[i]->size)) {
+            size_t len = batch_pack_encode(pk, buf);
+            if (len > 2 && send_frame(sock, FRAME_PACK, 0, stream_id, buf, len) < 0) {
+                free(pk);
+                return -1;
+            }
+            if (progress_due(&progress_us, i == n)) printf("Packed %d/%d files (%.2f%%)\r", i, n, 100.0 * i / n);
+            if (i == n) break;
+        }
+
+        // Unreadable files are left out; the server counts them as failed
+        batch_entry_t *e = files[i];
+        char *dst = batch_pack_add(pk, e->name, strlen(e->name), (uint32_t)e->size);
+        int fd = open(e->path, O_RDONLY);
+        long long got = 0;
+        while (fd >= 0 && got < e->size) {
+            ssize_t r = pread(fd, dst + got, (size_t)(e->size - got), got);
+            if (r <= 0) break;
+            got += r;
+        }
+        if (fd >= 0) close(fd);
+        if (got < e->size) {
+            printf("Error: Cannot read file '%s'\n", e->path);
+            batch_pack_drop(pk);
+        }
+    }
+    free(pk);
+
+    if (send_frame(sock, FRAME_COMMIT, 0, stream_id, NULL, 0) < 0) return -1;
+    type = recv_reply(sock, buf, BUFSIZE);
+    *written = 0;
+    if (type == FRAME_FILE_OK || type == FRAME_FILE_FAIL) *written = get_u32(buf);
+    return type;
+}
+
+// dir <path or glob>: small files packed on this connection, large ones as
+// ordinary uploads over batch_lanes more connections, all at once.
+void send_batch(int sock, const char *pattern) {
+    walk_count = 0;
+    if (batch_collect(pattern) < 0) printf("Error: Cannot read all of '%s'\n", pattern);
+    if (walk_count == 0) {
+        printf("No files match '%s'\n", pattern);
+        return;
+    }
+
+    batch_entry_t **small = (batch_entry_t **)malloc(walk_count * sizeof(batch_entry_t *));
+    batch_entry_t **large = (batch_entry_t **)malloc(walk_count * sizeof(batch_entry_t *));
+    int nsmall = 0, nlarge = 0, skipped = 0;
+    long long small_bytes = 0, large_bytes = 0;
+    for (int i = 0; small && large && i < walk_count; i++) {
+        batch_entry_t *e = &walk_files[i];
+        char check[BATCH_PATH_MAX];
+        if (batch_path(e->name, strlen(e->name), check, sizeof(check)) < 0) {
+            printf("Skipping %s: name cannot be used on the server\n", e->path);
+            skipped++;
+        } else if (e->size <= BATCH_SMALL_MAX) {
+            small[nsmall++] = e;
+            small_bytes += e->size;
+        } else {
+            large[nlarge++] = e;
+            large_bytes += e->size;
+        }
+    }
+
+    int nlanes = nlarge < batch_lanes ? nlarge : batch_lanes;
+    printf("Sending %d files (%lld bytes): %d packed, %d on their own over %d connections\n", nsmall + nlarge,
+           small_bytes + large_bytes, nsmall, nlarge, nlanes);
+    uint64_t start = now_us();
+
+    lane_t lanes[MAX_STREAMS];
+    int next = 0;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STREAM_STACK_SIZE);
+    for (int i = 0; i < nlanes; i++) {
+        memset(&lanes[i], 0, sizeof(lanes[i]));
+        lanes[i].index = i;
+        lanes[i].files = large;
+        lanes[i].nfiles = nlarge;
+        lanes[i].next = &next;
+        if (pthread_create(&lanes[i].thread, &attr, lane_loop, &lanes[i]) != 0) {
+            printf("Failed to start connection %d\n", i);
+            nlanes = i;
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    uint32_t written = 0;
+    int type = nsmall > 0 ? send_packs(sock, small, nsmall, small_bytes, &written) : FRAME_FILE_OK;
+    if (type < 0) printf("\nServer disconnected during batch upload\n");
+
+    int sent = 0;
+    long long bytes = 0;
+    for (int i = 0; i < nlanes; i++) {
+        pthread_join(lanes[i].thread, NULL);
+        sent += lanes[i].sent;
+        bytes += lanes[i].bytes;
+    }
+    double secs = (now_us() - start) / 1e6;
+    int failed = skipped + (nsmall - (int)written) + (nlarge - sent);
+    printf("\nBatch sent: %d packed and %d large files in %.2f s (%.0f files/s, %.2f MB/s)", (int)written, sent, secs,
+           secs > 0 ? (written + sent) / secs : 0.0, secs > 0 ? (small_bytes + bytes) / secs / 1e6 : 0.0);
+    if (failed) {
+        printf(", %d failed\n", failed);
+    } else {
+        printf("\n");
+    }
+
+    for (int i = 0; i < walk_count; i++) {
+        free(walk_files[i].path);
+        free(walk_files[i].name);
+    }
+    walk_count = 0;
+    free(small);
+    free(large);
+}
+
+// Striped mode: the control connection announces the file and commits it
+// once every data connection has had its bytes acknowledged.
+void send_striped(int sock, int fd, const char *filename, long long file_size) {
+    char file_info[FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)file_size, (uint32_t)chunk_size, filename, strlen(filename)};
+    size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+    uint32_t stream_id = next_stream_id++;
+    if (send_frame(sock, FRAME_FILE, FILE_FLAG_STRIPED, stream_id, file_info, info_len) < 0) {
+        printf("Failed to send file info\n");
+        return;
+    }
+
+    char buf[BUFSIZE];
+    int type = recv_reply(sock, buf, BUFSIZE);
+    if (type != FRAME_READY) {
+        printf("Server not ready (frame type %d)\n", type);
+        return;
+    }
+    uint64_t transfer_id = get_u64(buf);
+
+    printf("Sending file: %s (Size: %lld bytes, %d streams, %lld KB chunks)\n", filename, file_size, streams,
+           chunk_size / 1024);
+    stream_t st[MAX_STREAMS];
+    long long next_chunk = 0;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STREAM_STACK_SIZE);
+    uint64_t start = now_us();
+    for (int i = 0; i < streams; i++) {
+        memset(&st[i], 0, sizeof(st[i]));
+        st[i].index = i;
+        st[i].fd = fd;
+        st[i].transfer_id = transfer_id;
+        st[i].file_size = file_size;
+        st[i].next_chunk = &next_chunk;
+        if (pthread_create(&st[i].thread, &attr, stream_loop, &st[i]) != 0) {
+            printf("Failed to start stream %d\n", i);
+            streams = i;
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    long long total = 0;
+    for (int i = 0; i < streams; i++) {
+        pthread_join(st[i].thread, NULL);
+        printf("Stream %d: %lld bytes in %.2f s (%.2f MB/s)%s\n", i, st[i].bytes, st[i].secs,
+               st[i].secs > 0 ? st[i].bytes / st[i].secs / 1e6 : 0.0, st[i].ok ? "" : " FAILED");
+        total += st[i].bytes;
+    }
+    double secs = (now_us() - start) / 1e6;
+    printf("Total: %lld bytes in %.2f s (%.2f MB/s)\n", total, secs, secs > 0 ? total / secs / 1e6 : 0.0);
+
+    if (send_frame(sock, FRAME_COMMIT, 0, stream_id, NULL, 0) < 0) {
+        printf("Failed to commit file\n");
+        return;
+    }
+    type = recv_reply(sock, buf, BUFSIZE);
+    if (type == FRAME_FILE_OK) {
+        printf("File sent successfully\n");
+    } else if (type >= 0) {
+        printf("File transfer failed (frame type %d)\n", type);
+    } else {
+        printf("Server disconnected during file transfer confirmation\n");
+    }
+}
+
+void send_file(int *sockp, const char *filename) {
+    int sock = *sockp;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         printf("Error: Cannot open file '%s'\n", filename);
         return;
     }
 
-    fseek(file, 0, SEEK_END);
-    long long file_size = _ftelli64(file);
-    fseek(file, 0, SEEK_SET);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printf("Error: Cannot stat file '%s'\n", filename);
+        close(fd);
+        return;
+    }
+    long long file_size = st.st_size;
 
-    char file_info[BUFSIZE];
-    snprintf(file_info, BUFSIZE, "FILE:%s:%lld", filename, file_size);
-    send(sock, file_info, strlen(file_info), 0);
+    if (resumable) {
+        send_resumable(sockp, fd, filename, &st);
+        close(fd);
+        return;
+    }
+    if (delta_mode) {
+        send_delta(sock, fd, filename, file_size);
+        close(fd);
+        return;
+    }
+    if (streams > 1) {
+        send_striped(sock, fd, filename, file_size);
+        close(fd);
+        return;
+    }
+
+    // Checksummed unless sendfile() keeps the data out of reach
+    verify_t verify;
+    int verified = !zero_copy && verify_init(&verify, (uint64_t)file_size, verify_chunk_size((uint64_t)file_size)) == 0;
+    verify_t *v = verified ? &verify : NULL;
+
+    char file_info[FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)file_size, verified ? verify.chunk_size : 0, filename, strlen(filename)};
+    size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+    uint32_t stream_id = next_stream_id++;
+    uint16_t flags = (compress_ok ? FILE_FLAG_COMPRESSED : 0) | (verified ? FILE_FLAG_VERIFY : 0);
+    if (send_frame(sock, FRAME_FILE, flags, stream_id, file_info, info_len) < 0) {
+        printf("Failed to send file info\n");
+        if (v) verify_free(v);
+        close(fd);
+        return;
+    }
 
     char buf[BUFSIZE];
-    int bytes_read, bytes_sent;
     long long total_sent = 0;
 
-    int retval = recv(sock, buf, BUFSIZE - 1, 0); // Wait for server ready
-    if (retval <= 0) {
+    int type = recv_reply(sock, buf, BUFSIZE); // Wait for server ready
+    if (type < 0) {
         printf("Server disconnected during file transfer\n");
-        fclose(file);
+        if (v) verify_free(v);
+        close(fd);
         return;
     }
-    buf[retval] = '\0';
 
-    if (strcmp(buf, "READY") != 0) {
-        printf("Server not ready: %s\n", buf);
-        fclose(file);
+    if (type != FRAME_READY) {
+        printf("Server not ready (frame type %d)\n", type);
+        if (v) verify_free(v);
+        close(fd);
         return;
     }
 
     printf("Sending file: %s (Size: %lld bytes)\n", filename, file_size);
-    while ((bytes_read = fread(buf, 1, BUFSIZE, file)) > 0) {
-        bytes_sent = send(sock, buf, bytes_read, 0);
-        if (bytes_sent == SOCKET_ERROR) break;
-        total_sent += bytes_sent;
-        printf("Sent %lld/%lld bytes (%.2f%%)\r", total_sent, file_size, ((double)total_sent / file_size) * 100);
-    }
-
-    fclose(file);
-    
-    // Wait for final confirmation from server
-    retval = recv(sock, buf, BUFSIZE - 1, 0);
-    if (retval > 0) {
-        buf[retval] = '\0';
-        if (strcmp(buf, "FILE_OK") == 0) {
-            printf("\nFile sent successfully\n");
+    reader_t rd;
+    int reading = !zero_copy && reader_open(&rd, fd, file_size, read_mode) == 0;
+    if (!zero_copy && !reading) {
+        printf("Failed to read %s: %s\n", filename, strerror(errno));
+        if (v) verify_free(v);
+        close(fd);
+        return;
+    }
+    if (compress_ok) {
+        zpool_t pool;
+        long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (zpool_init(&pool, compress_codec, (int)nthreads) < 0) {
+            printf("Failed to start compression threads\n");
+            if (v) verify_free(v);
+            reader_close(&rd);
+            close(fd);
+            return;
+        }
+        total_sent = send_compressed(sock, &rd, stream_id, &pool, v);
+        printf("\nCompressed with %s: %llu -> %llu bytes (%.2fx), level %d-%d, %llu/%llu blocks stored",
+               codec_name(compress_codec), (unsigned long long)pool.raw_bytes, (unsigned long long)pool.wire_bytes,
+               pool.wire_bytes ? (double)pool.raw_bytes / pool.wire_bytes : 1.0, pool.level_lo, pool.level_hi,
+               (unsigned long long)pool.stored_blocks, (unsigned long long)pool.blocks);
+        zpool_free(&pool);
+    } else if (zero_copy) {
+        int unsupported = 0;
+        total_sent = send_zero_copy(sock, fd, file_size, &unsupported);
+        if (unsupported) {
+            printf("sendfile unsupported, using buffered send\n");
+            reading = reader_open(&rd, fd, file_size, read_mode) == 0;
+            total_sent = reading ? send_buffered(sock, &rd, total_sent, NULL) : -1;
+        }
+    } else {
+        total_sent = send_buffered(sock, &rd, 0, v);
+    }
+    if (reading) {
+        printf("\nRead engine: %s, %.3f s waiting on the disk", reader_mode_names[rd.mode], rd.wait_us / 1e6);
+        reader_close(&rd);
+    }
+
+    if (total_sent < 0) {
+        printf("\nsend failed: %s\n", strerror(errno));
+    }
+
+    // Wait for final confirmation from server, after any repairs
+    if (v) {
+        type = total_sent < 0 ? -1 : commit_verified(sock, fd, v, stream_id, buf);
+        verify_free(v);
+    } else {
+        type = recv_reply(sock, buf, BUFSIZE);
+    }
+    close(fd);
+    if (type >= 0) {
+        if (type == FRAME_FILE_OK) {
+            printf("\nFile sent successfully%s\n", v ? ", checksums and digest verified by the server" : "");
         } else {
-            printf("\nFile transfer failed: %s\n", buf);
+            printf("\nFile transfer failed (frame type %d)\n", type);
         }
     } else {
         printf("\nServer disconnected during file transfer confirmation\n");
     }
 }
 
-int main() {
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        err_quit("WSAStartup failed");
+// Reads the connection whenever no file transfer is using it, printing
+// echoes and pushed messages as they arrive.
+void *reader_loop(void *data) {
+    (void)data;
+    while (1) {
+        int sock = pipeline_park(&msgs);
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (sock < 0) {
+            poll(NULL, 0, PIPELINE_POLL_MS);
+            continue;
+        }
+        if (poll(&pfd, 1, PIPELINE_POLL_MS) <= 0) continue;
+
+        ssize_t n = ring_recv(&in, sock);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) {
+            printf("\nServer closed the connection\n");
+            pipeline_lost(&msgs, sock);
+            continue;
+        }
+        frame_hdr_t hdr;
+        const char *payload;
+        int got;
+        while ((got = ring_peek_frame(&in, &hdr, &payload)) > 0) {
+            if (hdr.type == FRAME_MSG) {
+                print_message(&hdr, payload);
+            } else {
+                printf("\nUnexpected frame type %d\n", hdr.type);
+            }
+            ring_consume(&in, FRAME_HDR_SIZE + hdr.length);
+        }
+        if (got < 0) {
+            printf("\nProtocol error from server\n");
+            pipeline_lost(&msgs, sock);
+        }
+    }
+    return NULL;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-z | -C codec] [-r | -d] [-s streams] [-k chunk_kb] [-P connections]\n"
+                    "       [-T role=profile[,key=value...]] [-E engine] [server[:port]]\n", prog);
+    fprintf(stderr, "  -z    zero-copy file send with sendfile()\n");
+    fprintf(stderr, "  -r    resumable uploads: reconnect and send only what the server is missing\n");
+    fprintf(stderr, "  -d    delta uploads: send only what differs from the server's copy of the file\n");
+    fprintf(stderr, "  -s N  striped upload over N parallel data connections (max %d)\n", MAX_STREAMS);
+    fprintf(stderr, "  -k N  striped or resumable chunk size in KB (default %d)\n", DEFAULT_CHUNK_KB);
+    fprintf(stderr, "  -C    compress plain uploads with lz4 or zstd, if the server has it too\n");
+    fprintf(stderr, "  -P N  connections for the large files of a dir upload (default %d, max %d)\n", BATCH_LANES,
+            MAX_STREAMS);
+    fprintf(stderr, "  -T    socket profile of the chat or bulk role: interactive, bulk or lan-low-latency,\n"
+                    "        optionally with sndbuf, rcvbuf, nodelay, cork, lowat, busy_poll or keepalive changed\n");
+    fprintf(stderr, "  -E    file read engine: auto (by size, default), read, mmap or thread\n");
+    fprintf(stderr, "The server defaults to %s:%d.\n", SERVER_IP, SERVERPORT);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "zrds:k:C:P:T:E:")) != -1) {
+        switch (opt) {
+        case 'z':
+            zero_copy = 1;
+            break;
+        case 'r':
+            resumable = 1;
+            break;
+        case 'd':
+            delta_mode = 1;
+            break;
+        case 's':
+            streams = atoi(optarg);
+            break;
+        case 'k':
+            chunk_size = atoll(optarg) * 1024;
+            break;
+        case 'C':
+            compress_codec = codec_parse(optarg);
+            if (compress_codec < 0) usage(argv[0]);
+            break;
+        case 'P':
+            batch_lanes = atoi(optarg);
+            break;
+        case 'T':
+            if (tcp_profile_parse(optarg) < 0) usage(argv[0]);
+            break;
+        case 'E': {
+            int mode = reader_mode_parse(optarg);
+            if (mode < 0) usage(argv[0]);
+            read_mode = (reader_mode_t)mode;
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (streams < 1 || streams > MAX_STREAMS || chunk_size <= 0 || chunk_size > UINT32_MAX) usage(argv[0]);
+    if (batch_lanes < 1 || batch_lanes > MAX_STREAMS) usage(argv[0]);
+    if (delta_mode && (resumable || streams > 1)) usage(argv[0]);
+    if (addr_parse(optind < argc ? argv[optind] : SERVER_IP, SERVERPORT, &serveraddr) < 0) usage(argv[0]);
+    if (compress_codec && (zero_copy || resumable || delta_mode || streams > 1)) usage(argv[0]);
+    if (compress_codec && !(codecs_available() & CODEC_FLAG(compress_codec))) {
+        fprintf(stderr, "%s is not available: lib%s.so.1 could not be loaded\n", codec_name(compress_codec),
+                codec_name(compress_codec));
+        exit(1);
     }
 
-    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == INVALID_SOCKET) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
         err_quit("Socket creation failed");
     }
 
-    struct sockaddr_in serveraddr = {0};
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    serveraddr.sin_port = htons(SERVERPORT);
-
-    if (connect(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) == SOCKET_ERROR) {
+    // The main connection is tuned for chat, and for bulk while it uploads
+    tune_socket(sock, TCP_ROLE_CHAT);
+    if (connect(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
         err_quit("Connect failed");
     }
+    if (ring_init(&in, RING_SIZE) < 0) {
+        err_quit("Receive ring allocation failed");
+    }
 
     // Get username from user
-    char username[MAX_USERNAME];
     printf("Enter your username: ");
-    fgets(username, MAX_USERNAME, stdin);
+    if (!fgets(username, MAX_USERNAME, stdin)) return 0;
     username[strcspn(username, "\r\n")] = '\0';
 
-    // Send username to server
-    char user_msg[BUFSIZE];
-    snprintf(user_msg, BUFSIZE, "USER:%s", username);
-    if (send(sock, user_msg, strlen(user_msg), 0) == SOCKET_ERROR) {
+    // Send username to server, with the codec we would like to use
+    uint16_t want = compress_codec ? (uint16_t)CODEC_FLAG(compress_codec) : 0;
+    if (send_frame(sock, FRAME_USER, want, next_stream_id++, username, strlen(username)) < 0) {
         err_quit("Username registration failed");
     }
 
     // Wait for server response
-    char buf[BUFSIZE];
-    int retval = recv(sock, buf, BUFSIZE - 1, 0);
-    if (retval <= 0) {
+    frame_hdr_t hdr;
+    const char *payload;
+    if (recv_sync_frame(sock, &hdr, &payload) < 0) {
         err_quit("Connection failed during username registration");
     }
-    buf[retval] = '\0';
+    ring_consume(&in, FRAME_HDR_SIZE + hdr.length);
 
-    if (strcmp(buf, "USER_OK") != 0) {
+    if (hdr.type != FRAME_USER_OK) {
         printf("Username registration failed. Using default identifier.\n");
     } else {
         printf("Username '%s' registered successfully.\n", username);
+        compress_ok = want && (hdr.flags & want) == want;
     }
+    if (want && !compress_ok) printf("Server cannot decompress %s, sending files uncompressed\n", codec_name(compress_codec));
 
     printf("\nConnected to server. Available commands:\n");
     printf("  file <filename> - Send a file\n");
+    printf("  dir <path|glob> - Send a directory tree or several files at once\n");
+    printf("  /join <room>    - Join a chat room (messages go to everyone in it)\n");
+    printf("  /leave          - Leave the room\n");
+    printf("  /tcp            - Show the connection's RTT, congestion window and retransmits\n");
     printf("  quit            - Exit the program\n");
     printf("  Any other text  - Send as message\n\n");
 
+    // Messages are pipelined: the reader thread prints each echo when it
+    // arrives, so the next line can be sent right away
+    interactive = isatty(STDIN_FILENO);
+    pipeline_init(&msgs, sock);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_loop, NULL) != 0) err_quit("Failed to create reader thread");
+
     char cmd[BUFSIZE];
     while (1) {
         printf("%s> ", username);
-        fgets(cmd, BUFSIZE, stdin);
+        if (!fgets(cmd, BUFSIZE, stdin)) break;
         cmd[strcspn(cmd, "\r\n")] = '\0';
 
         if (strncmp(cmd, "file ", 5) == 0) {
             char *filename = cmd + 5;
-            send_file(sock, filename);
-        } 
+            pipeline_claim(&msgs);
+            tune_socket(sock, TCP_ROLE_BULK);
+            send_file(&sock, filename);
+            if (sock >= 0) {
+                print_tcp_info(sock, TCP_ROLE_BULK);
+                tune_socket(sock, TCP_ROLE_CHAT);
+            }
+            pipeline_release(&msgs, sock);
+            if (sock < 0) {
+                printf("Not connected to server\n");
+                break;
+            }
+        }
+        else if (strncmp(cmd, "dir ", 4) == 0) {
+            pipeline_claim(&msgs);
+            tune_socket(sock, TCP_ROLE_BULK);
+            send_batch(sock, cmd + 4);
+            print_tcp_info(sock, TCP_ROLE_BULK);
+            tune_socket(sock, TCP_ROLE_CHAT);
+            pipeline_release(&msgs, sock);
+        }
+        else if (strcmp(cmd, "/tcp") == 0) {
+            print_tcp_info(sock, TCP_ROLE_CHAT);
+        }
         else if (strcmp(cmd, "quit") == 0) {
             break;
         }
-        else if (strlen(cmd) > 0) {
-            // Send regular message
-            if (send(sock, cmd, strlen(cmd), 0) == SOCKET_ERROR) {
+        else if (cmd[0] != '\0') {
+            // Send regular message, or a room change; the reader thread
+            // prints the reply
+            uint8_t type = FRAME_MSG;
+            const char *text = cmd;
+            if (strncmp(cmd, "/join ", 6) == 0 || strcmp(cmd, "/leave") == 0) {
+                type = FRAME_JOIN;
+                text = cmd[1] == 'j' ? cmd + 6 : "";
+            }
+            uint32_t stream_id = next_stream_id++;
+            if (pipeline_add(&msgs, stream_id) < 0) {
+                printf("Too many messages awaiting an echo, not sent\n");
+                continue;
+            }
+            if (send_frame(sock, type, 0, stream_id, text, strlen(text)) < 0) {
+                pipeline_cancel(&msgs, stream_id);
                 printf("Error sending message\n");
                 break;
             }
-            
-            // Wait for echo from server
-            retval = recv(sock, buf, BUFSIZE - 1, 0);
-            if (retval <= 0) break;
-            buf[retval] = '\0';
-            printf("Server: %s\n", buf);
         }
     }
 
-    closesocket(sock);
-    WSACleanup();
+    int unanswered = pipeline_drain(&msgs, PIPELINE_DRAIN_US);
+    if (unanswered > 0) printf("%d messages got no echo\n", unanswered);
+    pipeline_claim(&msgs);
+    close(sock);
+    ring_free(&in);
     return 0;
-}
\ No newline at end of file
+}
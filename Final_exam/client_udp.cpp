@@ -1,145 +1,516 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "rudp.h"
+#include "resume.h"
+#include "pipeline.h"
+#include "reader.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVERPORT 9000
 #define BUFSIZE 65536
 #define MAX_USERNAME 32
-
-#pragma comment(lib, "ws2_32.lib")
+#define HANDSHAKE_TRIES 5
+#define ACK_BATCH 32        // Replies taken per recvmmsg() during a transfer
+#define ACK_BUFSIZE 256     // Fits an ACK or any other reply expected then
+#define RESUME_RETRIES 5    // Extra attempts per resumable upload, 1 s backoff doubling
+
+static uint32_t next_stream_id = 1;
+
+// Reliable mode settings (see rudp.h); -u falls back to the old
+// fire-and-forget datagram stream.
+static int reliable = 1;
+static uint32_t seg_size = RUDP_DEFAULT_SEG_SIZE;
+static uint32_t window = RUDP_DEFAULT_WINDOW;
+static const cc_ops_t *cc = &cc_aimd;
+static int resumable = 0;   // -r: FRAME_RESUME, retried until the server has every segment
+static rudp_tx_t tx;
+static reader_mode_t read_mode = READER_AUTO;  // -E: how uploads read the file (reader.h)
+
+static char ack_bufs[ACK_BATCH][ACK_BUFSIZE];
+static struct iovec ack_iov[ACK_BATCH];
+static struct mmsghdr ack_msgs[ACK_BATCH];
+
+static char username[MAX_USERNAME];
+static pipeline_t msgs;      // Chat messages in flight (pipeline.h)
+static int interactive;      // stdin is a terminal: redraw the prompt after async output
 
 void err_quit(const char *msg) {
-    fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
     exit(1);
 }
 
-const char *basename(const char *path) {
+const char *path_basename(const char *path) {
     const char *slash = strrchr(path, '\\');
     if (!slash) slash = strrchr(path, '/');
     return slash ? slash + 1 : path;
 }
 
-void send_file(SOCKET sock, struct sockaddr_in *serveraddr, int addrlen, const char *filepath) {
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        printf("Error: Cannot open file '%s'\n", filepath);
-        return;
+// An echo of one of our messages, or a message the server pushed.
+void print_message(const frame_hdr_t *hdr, const char *payload) {
+    uint64_t rtt;
+    if (pipeline_take(&msgs, hdr->stream_id, &rtt)) {
+        printf("\rServer: %.*s (%.2f ms)\n", (int)hdr->length, payload, rtt / 1000.0);
+    } else {
+        printf("\r[server] %.*s\n", (int)hdr->length, payload);
     }
+    if (interactive) printf("%s> ", username);
+    fflush(stdout);
+}
+
+// Wait up to timeout_ms (-1: forever) for a reply frame to stream_id.
+// Returns the frame type and points *payload into buf, or -1 if nothing
+// usable arrived in time.
+int recv_reply(int sock, char *buf, size_t cap, uint32_t stream_id, int timeout_ms, const char **payload,
+               uint32_t *len) {
+    uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+    while (1) {
+        if (timeout_ms >= 0) {
+            uint64_t now = now_us();
+            struct pollfd pfd = {sock, POLLIN, 0};
+            if (now >= deadline || poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) <= 0) return -1;
+        }
+        ssize_t retval = recvfrom(sock, buf, cap, 0, NULL, NULL);
+        if (retval < 0) return -1;
+
+        frame_hdr_t hdr;
+        if (frame_parse_datagram(buf, (size_t)retval, &hdr) < 0) continue;
+        if (hdr.stream_id != stream_id) {
+            // A chat message, or a stale reply to an earlier request
+            if (hdr.type == FRAME_MSG) print_message(&hdr, buf + FRAME_HDR_SIZE);
+            continue;
+        }
+        if (payload) *payload = buf + FRAME_HDR_SIZE;
+        if (len) *len = hdr.length;
+        return hdr.type;
+    }
+}
+
+// Old mode: every datagram goes out once, in order, as fast as sendto() allows.
+long long send_unreliable(int sock, struct sockaddr_in *serveraddr, reader_t *r, uint32_t stream_id) {
+    long long file_size = r->size;
+    long long total_sent = 0;
+    uint64_t progress_us = 0;
+    while (total_sent < file_size) {
+        const char *buf;
+        ssize_t bytes_read = reader_next(r, &buf, UDP_MAX_PAYLOAD);
+        if (bytes_read < 0) {
+            printf("read failed: %s\n", strerror(errno));
+            return -1;
+        }
+        if (bytes_read == 0) break;
 
-    fseek(file, 0, SEEK_END);
-    long long file_size = _ftelli64(file);
-    fseek(file, 0, SEEK_SET);
+        if (sendto_frame(sock, serveraddr, FRAME_DATA, 0, stream_id, buf, (size_t)bytes_read) < 0) {
+            printf("sendto failed: %s\n", strerror(errno));
+            return -1;
+        }
 
-    char file_only[260];
-    strncpy(file_only, basename(filepath), sizeof(file_only));
-    file_only[sizeof(file_only) - 1] = '\0';
+        total_sent += bytes_read;
+        if (progress_due(&progress_us, total_sent == file_size)) {
+            printf("Sent %lld/%lld bytes (%.2f%%)\r", total_sent, file_size, (double)total_sent / file_size * 100);
+        }
+    }
+    printf("\n");
+    return total_sent;
+}
 
-    char file_info[BUFSIZE];
-    snprintf(file_info, BUFSIZE, "FILE:%s:%lld", file_only, file_size);
+int tx_read(void *ctx, char *dst, size_t len, uint64_t offset) {
+    return reader_read_at((reader_t *)ctx, dst, len, (long long)offset);
+}
 
-    // Send file info
-    if (sendto(sock, file_info, (int)strlen(file_info), 0, (struct sockaddr *)serveraddr, addrlen) == SOCKET_ERROR) {
-        printf("Failed to send file info\n");
-        fclose(file);
-        return;
+// Reliable mode: sliding window with SACK-driven retransmission. Segments
+// set in present (if given) are already on the server and are skipped;
+// otherwise the file is hashed on the way and the digest committed.
+// Returns the final frame type from the server (FRAME_FILE_OK on success)
+// or -1.
+int send_reliable(int sock, struct sockaddr_in *serveraddr, int fd, long long file_size, uint32_t stream_id, char *buf,
+                  const uint8_t *present) {
+    if (rudp_tx_init(&tx, sock, serveraddr, stream_id, fd, (uint64_t)file_size, seg_size, window, cc) < 0) {
+        printf("Error: Cannot set up reliable transfer\n");
+        return -1;
+    }
+    reader_t rd;
+    if (reader_open(&rd, fd, file_size, read_mode) < 0) {
+        printf("Error: Cannot read file: %s\n", strerror(errno));
+        rudp_tx_free(&tx);
+        return -1;
+    }
+    tx.read = tx_read;
+    tx.ctx = &rd;
+    tx.present = present;
+    tx.verify = present == NULL;
+    int committed = 0;
+
+    for (int i = 0; i < ACK_BATCH; i++) {
+        ack_iov[i].iov_base = ack_bufs[i];
+        ack_iov[i].iov_len = ACK_BUFSIZE;
+        memset(&ack_msgs[i].msg_hdr, 0, sizeof(ack_msgs[i].msg_hdr));
+        ack_msgs[i].msg_hdr.msg_iov = &ack_iov[i];
+        ack_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    uint64_t ack_dgrams = 0, ack_calls = 0;
+    uint64_t progress_us = 0;
+
+    uint64_t start = now_us();
+    uint64_t cpu_start = thread_cpu_us();
+    int result = -1;
+    while (!rudp_tx_done(&tx)) {
+        if (rudp_tx_fill_window(&tx) < 0) {
+            printf("\nsendto failed: %s\n", strerror(errno));
+            break;
+        }
+        int64_t wait_us = rudp_tx_check_loss(&tx);
+        if (wait_us < 0) {
+            printf("\nsendto failed: %s\n", strerror(errno));
+            break;
+        }
+        if (!committed && rudp_tx_digest_ready(&tx)) {
+            rudp_tx_commit(&tx);
+            committed = 1;
+        }
+
+        // The pacer works in microseconds, poll() only in milliseconds
+        struct pollfd pfd = {sock, POLLIN, 0};
+        struct timespec ts = {(time_t)(wait_us / 1000000), (long)(wait_us % 1000000) * 1000};
+        ppoll(&pfd, 1, &ts, NULL);
+
+        // Drain every ACK that is queued before touching the window again
+        int n;
+        while (result < 0 && (n = recvmmsg(sock, ack_msgs, ACK_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+            ack_calls++;
+            ack_dgrams += n;
+            for (int i = 0; i < n; i++) {
+                const char *reply = ack_bufs[i];
+                frame_hdr_t hdr;
+                if (ack_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+                if (frame_parse_datagram(reply, ack_msgs[i].msg_len, &hdr) < 0) continue;
+                if (hdr.stream_id != stream_id) {
+                    if (hdr.type == FRAME_MSG) print_message(&hdr, reply + FRAME_HDR_SIZE);
+                    continue;
+                }
+                if (hdr.type == FRAME_ACK) {
+                    rudp_tx_on_ack(&tx, reply + FRAME_HDR_SIZE, hdr.length);
+                } else if (hdr.type == FRAME_FILE_OK || hdr.type == FRAME_FILE_FAIL) {
+                    result = hdr.type;
+                    break;
+                }
+            }
+            if (n < ACK_BATCH) break;
+        }
+        if (result >= 0) break;
+
+        uint64_t done = tx.acked_bytes + tx.skipped_bytes;
+        if (progress_due(&progress_us, done == (uint64_t)file_size)) {
+            printf("Sent %lld/%lld bytes (%.2f%%)\r", (long long)done, file_size,
+                   file_size ? (double)done / file_size * 100 : 100.0);
+        }
+        if (now_us() - tx.last_progress_us > RUDP_IDLE_TIMEOUT_US) {
+            printf("\nNo acknowledgement for %d s, giving up\n", RUDP_IDLE_TIMEOUT_US / 1000000);
+            break;
+        }
+    }
+
+    // Everything is acknowledged; the final verdict may still be in flight.
+    // Resending the commit, or the last segment of an unverified upload,
+    // makes the server repeat a lost FILE_OK.
+    for (int i = 0; result < 0 && rudp_tx_done(&tx) && i < HANDSHAKE_TRIES; i++) {
+        if (tx.verify) rudp_tx_commit(&tx);
+        result = recv_reply(sock, buf, BUFSIZE, stream_id, (int)(tx.rto_us / 1000), NULL, NULL);
+        if (result == FRAME_ACK) result = -1;
+        if (result < 0 && !tx.verify && tx.nsegs > 0) rudp_tx_transmit(&tx, tx.nsegs - 1);
     }
 
+    double secs = (now_us() - start) / 1e6;
+    double cpu_secs = (thread_cpu_us() - cpu_start) / 1e6;
+    printf("\n%lld bytes in %.2f s (%.2f MB/s), %llu retransmits, %llu timeouts, srtt %.2f ms\n",
+           (long long)tx.acked_bytes, secs, secs > 0 ? tx.acked_bytes / secs / 1e6 : 0.0,
+           (unsigned long long)tx.retransmits, (unsigned long long)tx.timeouts, tx.srtt_us / 1000.0);
+    if (tx.cc.pacing_rate > 0) {
+        printf("Congestion control %s: cwnd %.0f KB, pacing %.2f MB/s\n", tx.cc.ops->name, tx.cc.cwnd / 1024,
+               tx.cc.pacing_rate / 1e6);
+    }
+    printf("Batching: %llu datagrams in %llu sendmmsg calls (%.1f per call, GSO %s), %llu replies in %llu recvmmsg "
+           "calls (%.1f per call), %.0f datagrams/s per core\n",
+           (unsigned long long)tx.dgrams_sent, (unsigned long long)tx.send_calls,
+           tx.send_calls ? (double)tx.dgrams_sent / tx.send_calls : 0.0, tx.gso_segs > 1 ? "on" : "off",
+           (unsigned long long)ack_dgrams, (unsigned long long)ack_calls,
+           ack_calls ? (double)ack_dgrams / ack_calls : 0.0,
+           cpu_secs > 0 ? (tx.dgrams_sent + ack_dgrams) / cpu_secs : 0.0);
+    printf("Read engine: %s, %.3f s waiting on the disk\n", reader_mode_names[rd.mode], rd.wait_us / 1e6);
+    reader_close(&rd);
+    rudp_tx_free(&tx);
+    return result;
+}
+
+// Segments not covered by a READY's missing ranges, as a bitmap for
+// send_reliable(). NULL if the range list is malformed.
+uint8_t *present_segments(const char *payload, uint32_t len, long long file_size) {
+    uint32_t nsegs = rudp_segment_count((uint64_t)file_size, seg_size);
+    if (len < 4 || get_u32(payload) > (len - 4) / CHUNK_INFO_SIZE) return NULL;
+    uint8_t *present = (uint8_t *)malloc(nsegs / 8 + 1);
+    if (!present) return NULL;
+    memset(present, 0xff, nsegs / 8 + 1);
+
+    uint32_t count = get_u32(payload);
+    for (uint32_t i = 0; i < count; i++) {
+        chunk_info_t range;
+        chunk_info_decode(payload + 4 + CHUNK_INFO_SIZE * i, CHUNK_INFO_SIZE, &range);
+        uint64_t end = range.offset + range.length;
+        for (uint64_t seq = range.offset / seg_size; seq < nsegs && seq * seg_size < end; seq++) {
+            present[seq >> 3] &= (uint8_t)~(1 << (seq & 7));
+        }
+    }
+    return present;
+}
+
+// Resumable mode: every attempt announces the same transfer id, learns
+// which segments the server still lacks and sends only those. A stalled
+// attempt (server restarted, network gone) is retried with backoff.
+void send_resumable(int sock, struct sockaddr_in *serveraddr, int fd, const char *file_only, const struct stat *st) {
+    long long file_size = st->st_size;
+    char payload[RESUME_INFO_SIZE + FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)file_size, seg_size, file_only, strlen(file_only)};
+    put_u64(payload, resume_transfer_id(file_only, (uint64_t)file_size,
+                                        (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec));
+    size_t len = RESUME_INFO_SIZE + file_info_encode(payload + RESUME_INFO_SIZE, sizeof(payload) - RESUME_INFO_SIZE, &info);
+
     char buf[BUFSIZE];
-    int retval;
+    int backoff = 1;
+    for (int attempt = 0; attempt <= RESUME_RETRIES; attempt++) {
+        if (attempt > 0) {
+            printf("Retrying in %d s (attempt %d/%d)...\n", backoff, attempt, RESUME_RETRIES);
+            sleep(backoff);
+            backoff *= 2;
+        }
 
-    // Wait for server READY
-    retval = recvfrom(sock, buf, BUFSIZE - 1, 0, NULL, NULL);
-    if (retval == SOCKET_ERROR) {
-        printf("Server not responding.\n");
-        fclose(file);
+        uint32_t stream_id = next_stream_id++;
+        const char *reply;
+        uint32_t reply_len;
+        int type = -1;
+        for (int i = 0; i < HANDSHAKE_TRIES && type < 0; i++) {
+            if (sendto_frame(sock, serveraddr, FRAME_RESUME, FILE_FLAG_RELIABLE, stream_id, payload, len) < 0) break;
+            type = recv_reply(sock, buf, sizeof(buf), stream_id, RUDP_INITIAL_RTO_US / 1000, &reply, &reply_len);
+        }
+        if (type < 0) {
+            printf("Server not responding.\n");
+            continue;
+        }
+        if (type != FRAME_READY) {
+            printf("Server not ready (frame type %d)\n", type);
+            return;
+        }
+
+        uint8_t *present = present_segments(reply, reply_len, file_size);
+        if (!present) {
+            printf("Malformed resume reply\n");
+            return;
+        }
+        long long missing = 0;
+        for (uint32_t i = 0; i < get_u32(reply); i++) missing += (long long)get_u64(reply + 12 + CHUNK_INFO_SIZE * i);
+        if (missing < file_size) {
+            printf("Resuming file: %s (%lld of %lld bytes already on server)\n", file_only, file_size - missing,
+                   file_size);
+        } else {
+            printf("Sending file: %s (%lld bytes)\n", file_only, file_size);
+        }
+
+        type = send_reliable(sock, serveraddr, fd, file_size, stream_id, buf, present);
+        free(present);
+        if (type == FRAME_FILE_OK) {
+            printf("File sent successfully\n");
+            return;
+        }
+        printf("File transfer interrupted (frame type %d)\n", type);
+    }
+    printf("Giving up; run 'file %s' again to resume\n", file_only);
+}
+
+void send_file(int sock, struct sockaddr_in *serveraddr, const char *filepath) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file '%s'\n", filepath);
         return;
     }
-    buf[retval] = '\0';
 
-    if (strcmp(buf, "READY") != 0) {
-        printf("Server not ready: %s\n", buf);
-        fclose(file);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printf("Error: Cannot stat file '%s'\n", filepath);
+        close(fd);
         return;
     }
+    long long file_size = st.st_size;
 
-    printf("Sending file: %s (%lld bytes)\n", file_only, file_size);
+    const char *file_only = path_basename(filepath);
+    if (resumable && reliable) {
+        send_resumable(sock, serveraddr, fd, file_only, &st);
+        close(fd);
+        return;
+    }
+    uint32_t stream_id = next_stream_id++;
 
-    long long total_sent = 0;
-    while (total_sent < file_size) {
-        int bytes_to_send = (int)((file_size - total_sent) < BUFSIZE ? (file_size - total_sent) : BUFSIZE);
-        int bytes_read = (int)fread(buf, 1, bytes_to_send, file);
-        if (bytes_read <= 0) break;
-
-        int sent = sendto(sock, buf, bytes_read, 0, (struct sockaddr *)serveraddr, addrlen);
-        if (sent == SOCKET_ERROR) {
-            printf("sendto failed: %d\n", WSAGetLastError());
-            fclose(file);
+    char file_info[FILE_INFO_SIZE + 256];
+    file_info_t info = {(uint64_t)file_size, reliable ? seg_size : 0, file_only, strlen(file_only)};
+    size_t info_len = file_info_encode(file_info, sizeof(file_info), &info);
+
+    char buf[BUFSIZE];
+    int type = -1;
+
+    // Send file info and wait for server READY. In reliable mode a lost
+    // request or reply is retried; the server answers duplicates with READY.
+    for (int i = 0; i < (reliable ? HANDSHAKE_TRIES : 1) && type < 0; i++) {
+        if (sendto_frame(sock, serveraddr, FRAME_FILE, reliable ? FILE_FLAG_RELIABLE | FILE_FLAG_VERIFY : 0, stream_id,
+                         file_info, info_len) < 0) {
+            printf("Failed to send file info\n");
+            close(fd);
             return;
         }
+        type = recv_reply(sock, buf, sizeof(buf), stream_id, reliable ? RUDP_INITIAL_RTO_US / 1000 : -1, NULL, NULL);
+    }
+    if (type < 0) {
+        printf("Server not responding.\n");
+        close(fd);
+        return;
+    }
 
-        total_sent += sent;
-        printf("Sent %lld/%lld bytes (%.2f%%)\r", total_sent, file_size, (double)total_sent / file_size * 100);
+    if (type != FRAME_READY) {
+        printf("Server not ready (frame type %d)\n", type);
+        close(fd);
+        return;
     }
-    printf("\n");
 
-    fclose(file);
+    printf("Sending file: %s (%lld bytes)\n", file_only, file_size);
+
+    if (reliable) {
+        type = send_reliable(sock, serveraddr, fd, file_size, stream_id, buf, NULL);
+        close(fd);
+    } else {
+        reader_t rd;
+        long long total_sent = -1;
+        if (reader_open(&rd, fd, file_size, read_mode) == 0) {
+            total_sent = send_unreliable(sock, serveraddr, &rd, stream_id);
+            printf("Read engine: %s, %.3f s waiting on the disk\n", reader_mode_names[rd.mode], rd.wait_us / 1e6);
+            reader_close(&rd);
+        } else {
+            printf("Error: Cannot read file '%s': %s\n", filepath, strerror(errno));
+        }
+        close(fd);
+        if (total_sent < 0) return;
 
-    // Wait for server confirmation
-    retval = recvfrom(sock, buf, BUFSIZE - 1, 0, NULL, NULL);
-    if (retval <= 0) {
+        // Wait for server confirmation
+        type = recv_reply(sock, buf, sizeof(buf), stream_id, -1, NULL, NULL);
+    }
+
+    if (type < 0) {
         printf("Server disconnected during file transfer confirmation\n");
         return;
     }
-    buf[retval] = '\0';
 
-    if (strcmp(buf, "FILE_OK") == 0) {
-        printf("File sent successfully\n");
+    if (type == FRAME_FILE_OK) {
+        printf("File sent successfully%s\n", reliable ? ", digest verified by the server" : "");
     } else {
-        printf("File transfer failed: %s\n", buf);
+        printf("File transfer failed (frame type %d)\n", type);
     }
 }
 
-int main() {
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        err_quit("WSAStartup failed");
+// Reads the socket whenever no file transfer is using it, printing echoes
+// and pushed messages as they arrive.
+void *reader_loop(void *data) {
+    char buf[UDP_MAX_DATAGRAM];
+    (void)data;
+    while (1) {
+        int sock = pipeline_park(&msgs);
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, PIPELINE_POLL_MS) <= 0) continue;
+        ssize_t n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        frame_hdr_t hdr;
+        if (n < 0 || frame_parse_datagram(buf, (size_t)n, &hdr) < 0) continue;
+        if (hdr.type == FRAME_MSG) print_message(&hdr, buf + FRAME_HDR_SIZE);
     }
+    return NULL;
+}
 
-    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock == INVALID_SOCKET) {
-        err_quit("Socket creation failed");
-    }
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-u] [-r] [-m segment_size] [-W window] [-c aimd|bbr|fixed] [-E engine]\n"
+                    "       [server[:port]]\n", prog);
+    fprintf(stderr, "  -u    unreliable mode: no sequencing, ACKs or retransmission\n");
+    fprintf(stderr, "  -r    resumable uploads: retry and send only what the server is missing\n");
+    fprintf(stderr, "  -m N  reliable mode segment size in bytes (default %d)\n", RUDP_DEFAULT_SEG_SIZE);
+    fprintf(stderr, "  -W N  reliable mode window in segments (default %d)\n", RUDP_DEFAULT_WINDOW);
+    fprintf(stderr, "  -c    congestion control: aimd (default), bbr, or fixed (window only, unpaced)\n");
+    fprintf(stderr, "  -E    file read engine: auto (by size, default), read, mmap or thread\n");
+    fprintf(stderr, "The server defaults to %s:%d.\n", SERVER_IP, SERVERPORT);
+    exit(1);
+}
 
-    struct sockaddr_in serveraddr = {0};
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(SERVERPORT);
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "urm:W:c:E:")) != -1) {
+        switch (opt) {
+        case 'u':
+            reliable = 0;
+            break;
+        case 'r':
+            resumable = 1;
+            break;
+        case 'm':
+            seg_size = (uint32_t)atol(optarg);
+            break;
+        case 'W':
+            window = (uint32_t)atol(optarg);
+            break;
+        case 'c':
+            cc = cc_find(optarg);
+            if (!cc) usage(argv[0]);
+            break;
+        case 'E': {
+            int mode = reader_mode_parse(optarg);
+            if (mode < 0) usage(argv[0]);
+            read_mode = (reader_mode_t)mode;
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (seg_size == 0 || seg_size > UDP_MAX_PAYLOAD - RUDP_DATA_HDR_SIZE) usage(argv[0]);
+    struct sockaddr_in serveraddr;
+    if (addr_parse(optind < argc ? argv[optind] : SERVER_IP, SERVERPORT, &serveraddr) < 0) usage(argv[0]);
 
-    if (inet_pton(AF_INET, SERVER_IP, &serveraddr.sin_addr) <= 0) {
-        err_quit("Invalid server IP");
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        err_quit("Socket creation failed");
     }
 
-    char username[MAX_USERNAME];
+    rudp_tune_socket(sock);
+
     printf("Enter your username: ");
-    fgets(username, sizeof(username), stdin);
+    if (!fgets(username, sizeof(username), stdin)) return 0;
     username[strcspn(username, "\r\n")] = 0;
 
     // Send username to server
-    char user_msg[BUFSIZE];
-    snprintf(user_msg, sizeof(user_msg), "USER:%s", username);
-    sendto(sock, user_msg, (int)strlen(user_msg), 0, (struct sockaddr *)&serveraddr, sizeof(serveraddr));
+    uint32_t stream_id = next_stream_id++;
+    sendto_frame(sock, &serveraddr, FRAME_USER, 0, stream_id, username, strlen(username));
 
     // Wait for server response
     char buf[BUFSIZE];
-    int retval = recvfrom(sock, buf, BUFSIZE - 1, 0, NULL, NULL);
-    if (retval <= 0) {
+    int type = recv_reply(sock, buf, sizeof(buf), stream_id, -1, NULL, NULL);
+    if (type < 0) {
         err_quit("Connection failed during username registration");
     }
-    buf[retval] = '\0';
 
-    if (strcmp(buf, "USER_OK") != 0) {
+    if (type != FRAME_USER_OK) {
         printf("Username registration failed. Using default identifier.\n");
     } else {
         printf("Username '%s' registered successfully.\n", username);
@@ -150,31 +521,44 @@ int main() {
     printf("  quit            - Exit\n");
     printf("  Any other text  - Send message\n\n");
 
+    // Messages are pipelined: the reader thread prints each echo when it
+    // arrives, so the next line can be sent right away
+    interactive = isatty(STDIN_FILENO);
+    pipeline_init(&msgs, sock);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_loop, NULL) != 0) err_quit("Failed to create reader thread");
+
+    char cmd[BUFSIZE];
     while (1) {
         printf("%s> ", username);
-        if (!fgets(buf, sizeof(buf), stdin)) break;
-        buf[strcspn(buf, "\r\n")] = 0;
-
-        if (strncmp(buf, "file ", 5) == 0) {
-            send_file(sock, &serveraddr, sizeof(serveraddr), buf + 5);
-        } else if (strcmp(buf, "quit") == 0) {
+        if (!fgets(cmd, sizeof(cmd), stdin)) break;
+        cmd[strcspn(cmd, "\r\n")] = 0;
+
+        if (strncmp(cmd, "file ", 5) == 0) {
+            pipeline_claim(&msgs);
+            send_file(sock, &serveraddr, cmd + 5);
+            pipeline_release(&msgs, sock);
+        } else if (strcmp(cmd, "quit") == 0) {
             break;
-        } else if (strlen(buf) > 0) {
-            // Send message
-            if (sendto(sock, buf, (int)strlen(buf), 0, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) == SOCKET_ERROR) {
+        } else if (cmd[0] != '\0') {
+            // Send message; the reader thread prints the echo
+            stream_id = next_stream_id++;
+            if (pipeline_add(&msgs, stream_id) < 0) {
+                printf("Too many messages awaiting an echo, not sent\n");
+                continue;
+            }
+            if (sendto_frame(sock, &serveraddr, FRAME_MSG, 0, stream_id, cmd, strlen(cmd)) < 0) {
+                pipeline_cancel(&msgs, stream_id);
                 printf("Error sending message\n");
                 break;
             }
-
-            // Wait for echo reply
-            retval = recvfrom(sock, buf, BUFSIZE - 1, 0, NULL, NULL);
-            if (retval <= 0) break;
-            buf[retval] = '\0';
-            printf("Server: %s\n", buf);
         }
     }
 
-    closesocket(sock);
-    WSACleanup();
+    // Datagrams can be lost, so some echoes may never come
+    int unanswered = pipeline_drain(&msgs, PIPELINE_DRAIN_US);
+    if (unanswered > 0) printf("%d messages got no echo\n", unanswered);
+    pipeline_claim(&msgs);
+    close(sock);
     return 0;
 }
@@ -0,0 +1,325 @@
+// Compressed TCP uploads.
+//
+// The codecs, LZ4 and zstd, are loaded at run time with dlopen() from the
+// system's shared libraries, so nothing extra is needed to build and a
+// machine without them simply does not offer compression. The client lists
+// the codecs it wants in the flags of FRAME_USER; the server answers with
+// the ones it has in the flags of FRAME_USER_OK.
+//
+// A compressed upload is announced with FILE_FLAG_COMPRESSED. After READY
+// the body follows as FRAME_BLOCK frames instead of raw bytes, each holding
+// up to COMPRESS_BLOCK_SIZE bytes of the file: a one-byte codec, the raw
+// length, then the data. A block that does not shrink by at least 1/16 is
+// sent stored (CODEC_NONE), so incompressible data costs five bytes per
+// block. The server decompresses and writes every block as it arrives.
+//
+// The client compresses on a pool of threads (zpool_t). The file is read
+// into a ring of slots in order; the threads compress whichever slots are
+// filled, and the sender sends them in order as they come back. The level
+// adapts while the upload runs: if the sender finds every block already
+// compressed, the network is the bottleneck and the level goes up; when it
+// has to wait for one, the level comes down. After a block that did not
+// compress, the next ones are sent stored without trying, a stretch that
+// doubles each time (up to COMPRESS_SKIP_MAX blocks) until a probe
+// compresses again, so already-compressed media costs almost no CPU.
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+#define CODEC_FLAG(codec) (1 << ((codec) - 1))  // In FRAME_USER / FRAME_USER_OK flags
+
+#define BLOCK_HDR_SIZE 5
+#define COMPRESS_BLOCK_SIZE (FRAME_MAX_PAYLOAD - BLOCK_HDR_SIZE)  // A stored block fills one frame
+#define COMPRESS_LEVEL_MIN 1
+#define COMPRESS_LEVEL_MAX 9        // zstd levels 1-9; LZ4 acceleration 9 down to 1
+#define COMPRESS_LEVEL_START 3
+#define COMPRESS_RAISE_AFTER 16     // Blocks found ready in a row before the level goes up
+#define COMPRESS_SKIP_MAX 64        // Longest stretch sent stored without trying
+#define COMPRESS_SLOTS 64           // Blocks in flight (power of two)
+#define COMPRESS_MAX_THREADS 16
+
+typedef struct {
+    int loaded;  // CODEC_FLAG()s available
+    int (*lz4_compress)(const char *src, char *dst, int src_size, int dst_cap, int accel);
+    int (*lz4_decompress)(const char *src, char *dst, int src_size, int dst_cap);
+    void *(*zstd_create_cctx)(void);
+    size_t (*zstd_free_cctx)(void *cctx);
+    size_t (*zstd_compress)(void *cctx, void *dst, size_t dst_cap, const void *src, size_t src_size, int level);
+    void *(*zstd_create_dctx)(void);
+    size_t (*zstd_decompress)(void *dctx, void *dst, size_t dst_cap, const void *src, size_t src_size);
+    unsigned (*zstd_is_error)(size_t code);
+} codecs_t;
+
+static codecs_t codecs;
+static pthread_once_t codecs_once = PTHREAD_ONCE_INIT;
+static __thread void *zstd_dctx;  // Decompression context of the calling thread
+
+static inline void codecs_load_once() {
+    void *lz4 = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (lz4) {
+        *(void **)&codecs.lz4_compress = dlsym(lz4, "LZ4_compress_fast");
+        *(void **)&codecs.lz4_decompress = dlsym(lz4, "LZ4_decompress_safe");
+        if (codecs.lz4_compress && codecs.lz4_decompress) codecs.loaded |= CODEC_FLAG(CODEC_LZ4);
+    }
+    void *zstd = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (zstd) {
+        *(void **)&codecs.zstd_create_cctx = dlsym(zstd, "ZSTD_createCCtx");
+        *(void **)&codecs.zstd_free_cctx = dlsym(zstd, "ZSTD_freeCCtx");
+        *(void **)&codecs.zstd_compress = dlsym(zstd, "ZSTD_compressCCtx");
+        *(void **)&codecs.zstd_create_dctx = dlsym(zstd, "ZSTD_createDCtx");
+        *(void **)&codecs.zstd_decompress = dlsym(zstd, "ZSTD_decompressDCtx");
+        *(void **)&codecs.zstd_is_error = dlsym(zstd, "ZSTD_isError");
+        if (codecs.zstd_create_cctx && codecs.zstd_free_cctx && codecs.zstd_compress && codecs.zstd_create_dctx &&
+            codecs.zstd_decompress && codecs.zstd_is_error) {
+            codecs.loaded |= CODEC_FLAG(CODEC_ZSTD);
+        }
+    }
+}
+
+// CODEC_FLAG()s of the codecs this machine has.
+static inline int codecs_available() {
+    pthread_once(&codecs_once, codecs_load_once);
+    return codecs.loaded;
+}
+
+static inline const char *codec_name(int codec) {
+    return codec == CODEC_LZ4 ? "lz4" : codec == CODEC_ZSTD ? "zstd" : "none";
+}
+
+static inline int codec_parse(const char *name) {
+    if (strcmp(name, "lz4") == 0) return CODEC_LZ4;
+    if (strcmp(name, "zstd") == 0) return CODEC_ZSTD;
+    return -1;
+}
+
+// Compress len bytes into dst, which holds less than len. Returns the
+// compressed size, or 0 if it did not fit: the block is not worth it.
+// cctx is the calling thread's zstd context.
+static inline size_t codec_compress(int codec, int level, void *cctx, const char *src, size_t len, char *dst,
+                                    size_t cap) {
+    if (codec == CODEC_LZ4) {
+        int n = codecs.lz4_compress(src, dst, (int)len, (int)cap, COMPRESS_LEVEL_MAX + 1 - level);
+        return n > 0 ? (size_t)n : 0;
+    }
+    size_t n = codecs.zstd_compress(cctx, dst, cap, src, len, level);
+    return codecs.zstd_is_error(n) ? 0 : n;
+}
+
+static inline void block_hdr_encode(char *out, int codec, uint32_t raw_len) {
+    out[0] = (char)codec;
+    put_u32(out + 1, raw_len);
+}
+
+// Decode a FRAME_BLOCK payload. Returns the raw length and points *data at
+// the raw bytes: the payload itself for a stored block, otherwise buf
+// (COMPRESS_BLOCK_SIZE bytes). Returns -1 for a block that is malformed,
+// fails to decompress, or uses a codec in allowed's complement.
+static inline long block_decode(const char *payload, uint32_t len, int allowed, char *buf, const char **data) {
+    if (len < BLOCK_HDR_SIZE) return -1;
+    int codec = (uint8_t)payload[0];
+    uint32_t raw_len = get_u32(payload + 1);
+    const char *src = payload + BLOCK_HDR_SIZE;
+    size_t src_len = len - BLOCK_HDR_SIZE;
+    if (raw_len > COMPRESS_BLOCK_SIZE) return -1;
+
+    if (codec == CODEC_NONE) {
+        if (src_len != raw_len) return -1;
+        *data = src;
+        return (long)raw_len;
+    }
+    if (!(allowed & CODEC_FLAG(codec)) || !(codecs_available() & CODEC_FLAG(codec))) return -1;
+    if (codec == CODEC_LZ4) {
+        int n = codecs.lz4_decompress(src, buf, (int)src_len, (int)raw_len);
+        if (n != (int)raw_len) return -1;
+    } else if (codec == CODEC_ZSTD) {
+        if (!zstd_dctx) zstd_dctx = codecs.zstd_create_dctx();
+        if (!zstd_dctx) return -1;
+        size_t n = codecs.zstd_decompress(zstd_dctx, buf, raw_len, src, src_len);
+        if (codecs.zstd_is_error(n) || n != raw_len) return -1;
+    } else {
+        return -1;
+    }
+    *data = buf;
+    return (long)raw_len;
+}
+
+enum { ZSLOT_FREE, ZSLOT_FILLED, ZSLOT_DONE };
+
+typedef struct {
+    int state;
+    int level;              // 0: send stored without trying
+    uint32_t raw_len;
+    uint32_t out_len;       // FRAME_BLOCK payload, header included
+    char raw[COMPRESS_BLOCK_SIZE];
+    char out[FRAME_MAX_PAYLOAD];
+} zslot_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // A slot was filled, or stop
+    pthread_cond_t done;    // A slot was compressed
+    int codec;
+    int stop;
+    int nthreads;
+    pthread_t threads[COMPRESS_MAX_THREADS];
+    zslot_t *slots;
+    uint64_t filled;        // Slots handed to the threads so far
+    uint64_t taken;         // ... picked up by one
+    uint64_t sent;          // ... and given back by the sender
+
+    // Sender's view, for the adaptive level and the incompressible skip
+    int level;
+    int level_lo, level_hi;  // Range used, for the summary
+    int ready_run;
+    int skip_len;
+    int skip_left;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+    uint64_t stored_blocks;
+    uint64_t blocks;
+} zpool_t;
+
+static inline void zslot_compress(zpool_t *p, zslot_t *s, void *cctx) {
+    size_t n = 0;
+    if (s->level > 0) {
+        size_t cap = s->raw_len - s->raw_len / 16;
+        n = codec_compress(p->codec, s->level, cctx, s->raw, s->raw_len, s->out + BLOCK_HDR_SIZE, cap);
+    }
+    if (n > 0) {
+        block_hdr_encode(s->out, p->codec, s->raw_len);
+        s->out_len = (uint32_t)(BLOCK_HDR_SIZE + n);
+    } else {
+        block_hdr_encode(s->out, CODEC_NONE, s->raw_len);
+        memcpy(s->out + BLOCK_HDR_SIZE, s->raw, s->raw_len);
+        s->out_len = BLOCK_HDR_SIZE + s->raw_len;
+    }
+}
+
+static inline void *zpool_loop(void *data) {
+    zpool_t *p = (zpool_t *)data;
+    void *cctx = p->codec == CODEC_ZSTD ? codecs.zstd_create_cctx() : NULL;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->stop && p->taken == p->filled) pthread_cond_wait(&p->work, &p->lock);
+        if (p->stop) break;
+        zslot_t *s = &p->slots[p->taken++ & (COMPRESS_SLOTS - 1)];
+        pthread_mutex_unlock(&p->lock);
+        zslot_compress(p, s, cctx);
+        pthread_mutex_lock(&p->lock);
+        s->state = ZSLOT_DONE;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (cctx) codecs.zstd_free_cctx(cctx);
+    return NULL;
+}
+
+// Start nthreads compressing with codec. Returns -1 if the codec is not
+// loaded or the pool cannot be set up.
+static inline int zpool_init(zpool_t *p, int codec, int nthreads) {
+    memset(p, 0, sizeof(*p));
+    if (!(codecs_available() & CODEC_FLAG(codec))) return -1;
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > COMPRESS_MAX_THREADS) nthreads = COMPRESS_MAX_THREADS;
+    p->slots = (zslot_t *)calloc(COMPRESS_SLOTS, sizeof(zslot_t));
+    if (!p->slots) return -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->codec = codec;
+    p->level = p->level_lo = p->level_hi = COMPRESS_LEVEL_START;
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&p->threads[i], NULL, zpool_loop, p) != 0) break;
+        p->nthreads++;
+    }
+    return p->nthreads > 0 ? 0 : -1;
+}
+
+static inline void zpool_free(zpool_t *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+    free(p->slots);
+}
+
+// The next slot to read file data into, or NULL while all are in flight.
+static inline zslot_t *zpool_slot(zpool_t *p) {
+    if (p->filled - p->sent == COMPRESS_SLOTS) return NULL;
+    return &p->slots[p->filled & (COMPRESS_SLOTS - 1)];
+}
+
+// Hand the slot from zpool_slot(), holding raw_len bytes, to the threads.
+static inline void zpool_submit(zpool_t *p, zslot_t *s, uint32_t raw_len) {
+    s->raw_len = raw_len;
+    s->level = p->level;
+    if (p->skip_left > 0) {
+        p->skip_left--;
+        s->level = 0;
+    }
+    pthread_mutex_lock(&p->lock);
+    s->state = ZSLOT_FILLED;
+    p->filled++;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// The oldest slot in flight once it is compressed, or NULL if none is.
+static inline zslot_t *zpool_next(zpool_t *p) {
+    if (p->sent == p->filled) return NULL;
+    zslot_t *s = &p->slots[p->sent & (COMPRESS_SLOTS - 1)];
+    pthread_mutex_lock(&p->lock);
+    int waited = 0;
+    while (s->state != ZSLOT_DONE) {
+        waited = 1;
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    // Compression holding the sender up: go faster. Always ahead: the
+    // network is the limit, spend the spare CPU on a better ratio.
+    if (waited) {
+        p->ready_run = 0;
+        if (p->level > COMPRESS_LEVEL_MIN) p->level--;
+    } else if (++p->ready_run >= COMPRESS_RAISE_AFTER) {
+        p->ready_run = 0;
+        if (p->level < COMPRESS_LEVEL_MAX) p->level++;
+    }
+    if (p->level < p->level_lo) p->level_lo = p->level;
+    if (p->level > p->level_hi) p->level_hi = p->level;
+
+    int stored = (uint8_t)s->out[0] == CODEC_NONE;
+    if (stored && s->level > 0) {
+        // Tried and failed: stop trying for a while, longer each time
+        p->skip_len = p->skip_len ? p->skip_len * 2 : 1;
+        if (p->skip_len > COMPRESS_SKIP_MAX) p->skip_len = COMPRESS_SKIP_MAX;
+        p->skip_left = p->skip_len;
+    } else if (!stored) {
+        p->skip_len = 0;
+    }
+    p->blocks++;
+    p->stored_blocks += stored;
+    p->raw_bytes += s->raw_len;
+    p->wire_bytes += FRAME_HDR_SIZE + s->out_len;
+    return s;
+}
+
+// The slot from zpool_next() has been sent.
+static inline void zpool_release(zpool_t *p, zslot_t *s) {
+    s->state = ZSLOT_FREE;
+    p->sent++;
+}
+
+#endif
@@ -0,0 +1,397 @@
+// Coroutines on an epoll event loop, for driving many client sessions
+// from one thread (client.h). Needs -std=c++20.
+//
+// A task_t is a coroutine that returns an int, by the same convention as
+// the rest of the code: a frame type or a length, -1 on failure. It starts
+// when it is awaited, and the awaiting coroutine continues when it
+// finishes, or when it is handed to loop_spawn(), which runs it detached
+// and frees it at the end. Arguments are not copied: pointers passed to a
+// coroutine must stay valid until it finishes.
+//
+// Coroutines wait on a co_event_t, one waiter at a time, with an optional
+// timeout. The loop fires the two events of a co_watch_t when epoll finds
+// its socket readable or writable (edge-triggered, so the waiter retries
+// its operation first and waits only on EAGAIN). An event fired while no
+// one waits is remembered, and the next wait returns at once. Woken
+// coroutines are queued and resumed one after another by loop_run(), never
+// from inside the code that woke them.
+//
+// co_lock_t serializes coroutines over something they must not interleave
+// on, such as the send side of a connection.
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "protocol.h"
+
+#define LOOP_EVENTS 256      // epoll events taken per wait
+#define LOOP_NO_TIMEOUT UINT64_MAX
+
+typedef struct loop loop_t;
+
+// ---------------------------------------------------------------------------
+// Tasks
+// ---------------------------------------------------------------------------
+
+struct task_t {
+    struct promise_type {
+        int value = -1;
+        std::coroutine_handle<> cont;  // The coroutine awaiting this one
+        loop_t *loop = NULL;           // Set when spawned
+        int detached = 0;
+
+        task_t get_return_object() { return task_t(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept;
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(int v) { value = v; }
+        void unhandled_exception() { abort(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+
+    explicit task_t(std::coroutine_handle<promise_type> handle) : h(handle) {}
+    task_t(task_t &&t) : h(t.h) { t.h = NULL; }
+    task_t(const task_t &) = delete;
+    task_t &operator=(const task_t &) = delete;
+    ~task_t() {
+        if (h) h.destroy();
+    }
+
+    // Awaiting starts the task; the awaiter continues when it returns
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        h.promise().cont = awaiter;
+        return h;
+    }
+    int await_resume() { return h.promise().value; }
+};
+
+// ---------------------------------------------------------------------------
+// Loop
+// ---------------------------------------------------------------------------
+
+typedef struct co_wait co_wait_t;
+
+typedef struct {
+    co_wait_t *waiter;
+    int fired;               // Fired while no one waited
+} co_event_t;
+
+// A socket the loop watches, with an event for each direction.
+typedef struct {
+    int fd;
+    co_event_t readable;
+    co_event_t writable;
+} co_watch_t;
+
+struct loop {
+    int epfd;
+    int live;                // Spawned tasks not yet finished
+    void **ready;            // Coroutines to resume, in order (a ring)
+    size_t ready_head;
+    size_t ready_count;
+    size_t ready_cap;
+    co_wait_t **timers;      // Min-heap on deadline
+    int ntimers;
+    int timers_cap;
+};
+
+// One suspended wait: on an event, a timeout, or both.
+struct co_wait {
+    loop_t *loop;
+    co_event_t *event;       // NULL for a plain sleep
+    uint64_t deadline;       // LOOP_NO_TIMEOUT for none
+    int heap_index;          // In loop->timers, -1 when not armed
+    int timed_out;
+    void *handle;
+};
+
+static inline int loop_init(loop_t *l) {
+    memset(l, 0, sizeof(*l));
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return l->epfd < 0 ? -1 : 0;
+}
+
+static inline void loop_free(loop_t *l) {
+    if (l->epfd >= 0) close(l->epfd);
+    free(l->ready);
+    free(l->timers);
+    memset(l, 0, sizeof(*l));
+    l->epfd = -1;
+}
+
+static inline void loop_schedule(loop_t *l, void *handle) {
+    if (l->ready_count == l->ready_cap) {
+        size_t cap = l->ready_cap ? l->ready_cap * 2 : 64;
+        void **ready = (void **)malloc(cap * sizeof(void *));
+        if (!ready) abort();
+        for (size_t i = 0; i < l->ready_count; i++) ready[i] = l->ready[(l->ready_head + i) % l->ready_cap];
+        free(l->ready);
+        l->ready = ready;
+        l->ready_cap = cap;
+        l->ready_head = 0;
+    }
+    l->ready[(l->ready_head + l->ready_count) % l->ready_cap] = handle;
+    l->ready_count++;
+}
+
+inline std::coroutine_handle<> task_t::promise_type::final_awaiter::await_suspend(
+    std::coroutine_handle<promise_type> h) noexcept {
+    promise_type &p = h.promise();
+    if (p.cont) return p.cont;
+    if (p.detached) {
+        p.loop->live--;
+        h.destroy();
+    }
+    return std::noop_coroutine();
+}
+
+// Run t on the loop without waiting for it; its result is dropped.
+static inline void loop_spawn(loop_t *l, task_t &&t) {
+    t.h.promise().loop = l;
+    t.h.promise().detached = 1;
+    l->live++;
+    loop_schedule(l, t.h.address());
+    t.h = NULL;
+}
+
+// Timer heap
+
+static inline void timer_swap(loop_t *l, int a, int b) {
+    co_wait_t *t = l->timers[a];
+    l->timers[a] = l->timers[b];
+    l->timers[b] = t;
+    l->timers[a]->heap_index = a;
+    l->timers[b]->heap_index = b;
+}
+
+static inline void timer_sift(loop_t *l, int i) {
+    while (i > 0 && l->timers[(i - 1) / 2]->deadline > l->timers[i]->deadline) {
+        timer_swap(l, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int least = i;
+        int a = 2 * i + 1, b = 2 * i + 2;
+        if (a < l->ntimers && l->timers[a]->deadline < l->timers[least]->deadline) least = a;
+        if (b < l->ntimers && l->timers[b]->deadline < l->timers[least]->deadline) least = b;
+        if (least == i) return;
+        timer_swap(l, i, least);
+        i = least;
+    }
+}
+
+static inline void timer_arm(loop_t *l, co_wait_t *w) {
+    if (l->ntimers == l->timers_cap) {
+        int cap = l->timers_cap ? l->timers_cap * 2 : 64;
+        co_wait_t **timers = (co_wait_t **)realloc(l->timers, (size_t)cap * sizeof(co_wait_t *));
+        if (!timers) abort();
+        l->timers = timers;
+        l->timers_cap = cap;
+    }
+    w->heap_index = l->ntimers;
+    l->timers[l->ntimers++] = w;
+    timer_sift(l, w->heap_index);
+}
+
+static inline void timer_cancel(loop_t *l, co_wait_t *w) {
+    int i = w->heap_index;
+    if (i < 0) return;
+    w->heap_index = -1;
+    l->ntimers--;
+    if (i == l->ntimers) return;
+    l->timers[i] = l->timers[l->ntimers];
+    l->timers[i]->heap_index = i;
+    timer_sift(l, i);
+}
+
+// Events
+
+// Wake ev's waiter, or remember that it fired.
+static inline void event_fire(co_event_t *ev) {
+    co_wait_t *w = ev->waiter;
+    if (!w) {
+        ev->fired = 1;
+        return;
+    }
+    ev->waiter = NULL;
+    timer_cancel(w->loop, w);
+    loop_schedule(w->loop, w->handle);
+}
+
+// co_await event_wait(l, ev, timeout_us): 1 when ev fired, 0 on timeout.
+// With ev NULL it just sleeps.
+struct event_wait {
+    co_wait_t w;
+
+    event_wait(loop_t *l, co_event_t *ev, uint64_t timeout_us) {
+        w.loop = l;
+        w.event = ev;
+        w.deadline = timeout_us == LOOP_NO_TIMEOUT ? LOOP_NO_TIMEOUT : now_us() + timeout_us;
+        w.heap_index = -1;
+        w.timed_out = 0;
+        w.handle = NULL;
+    }
+    bool await_ready() {
+        if (w.event && w.event->fired) {
+            w.event->fired = 0;
+            return true;
+        }
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        w.handle = h.address();
+        if (w.event) w.event->waiter = &w;
+        if (w.deadline != LOOP_NO_TIMEOUT) timer_arm(w.loop, &w);
+    }
+    int await_resume() { return !w.timed_out; }
+};
+
+static inline event_wait loop_sleep(loop_t *l, uint64_t us) {
+    return event_wait(l, NULL, us);
+}
+
+// Watch fd for readiness in both directions. The fd must be non-blocking.
+static inline int loop_watch(loop_t *l, co_watch_t *cw, int fd) {
+    memset(cw, 0, sizeof(*cw));
+    cw->fd = fd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = cw;
+    return epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Stop watching; coroutines waiting on the watch are woken to notice.
+static inline void loop_unwatch(loop_t *l, co_watch_t *cw) {
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, cw->fd, NULL);
+    event_fire(&cw->readable);
+    event_fire(&cw->writable);
+}
+
+// Wait for epoll or the next timer, without blocking if coroutines are
+// already queued, then resume everything that is ready. Returns -1 if
+// epoll fails.
+static inline int loop_step(loop_t *l) {
+    int timeout = -1;
+    if (l->ready_count > 0) {
+        timeout = 0;
+    } else if (l->ntimers > 0) {
+        uint64_t now = now_us();
+        uint64_t when = l->timers[0]->deadline;
+        timeout = when <= now ? 0 : (int)((when - now + 999) / 1000);
+    }
+    struct epoll_event events[LOOP_EVENTS];
+    int n = epoll_wait(l->epfd, events, LOOP_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) return -1;
+    for (int i = 0; i < n; i++) {
+        co_watch_t *cw = (co_watch_t *)events[i].data.ptr;
+        uint32_t e = events[i].events;
+        if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) event_fire(&cw->readable);
+        if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) event_fire(&cw->writable);
+    }
+
+    uint64_t now = now_us();
+    while (l->ntimers > 0 && l->timers[0]->deadline <= now) {
+        co_wait_t *w = l->timers[0];
+        timer_cancel(l, w);
+        if (w->event) w->event->waiter = NULL;
+        w->timed_out = 1;
+        loop_schedule(l, w->handle);
+    }
+
+    // Only those queued so far, so that the caller sees each round
+    for (size_t count = l->ready_count; count > 0; count--) {
+        void *h = l->ready[l->ready_head];
+        l->ready_head = (l->ready_head + 1) % l->ready_cap;
+        l->ready_count--;
+        std::coroutine_handle<>::from_address(h).resume();
+    }
+    return 0;
+}
+
+// Run until every spawned task has finished.
+static inline int loop_run(loop_t *l) {
+    while (l->live > 0 || l->ready_count > 0) {
+        if (loop_step(l) < 0) return -1;
+    }
+    return 0;
+}
+
+// Run t to completion, along with whatever else is on the loop, and
+// return its result.
+static inline int loop_run_task(loop_t *l, task_t &t) {
+    t.h.promise().loop = l;
+    loop_schedule(l, t.h.address());
+    while (!t.h.done()) {
+        if (loop_step(l) < 0) return -1;
+    }
+    return t.h.promise().value;
+}
+
+// ---------------------------------------------------------------------------
+// Lock
+// ---------------------------------------------------------------------------
+
+typedef struct co_lock_waiter {
+    void *handle;
+    struct co_lock_waiter *next;
+} co_lock_waiter_t;
+
+typedef struct {
+    loop_t *loop;
+    int held;
+    co_lock_waiter_t *head;  // Waiting, first come first served
+    co_lock_waiter_t *tail;
+} co_lock_t;
+
+static inline void lock_init(co_lock_t *k, loop_t *l) {
+    memset(k, 0, sizeof(*k));
+    k->loop = l;
+}
+
+// co_await lock_acquire(k); the lock passes straight to the next waiter
+// on release, so no one can slip in between.
+struct lock_acquire {
+    co_lock_t *k;
+    co_lock_waiter_t node;
+
+    explicit lock_acquire(co_lock_t *lock) : k(lock) {}
+    bool await_ready() {
+        if (k->held) return false;
+        k->held = 1;
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        node.handle = h.address();
+        node.next = NULL;
+        if (k->tail) k->tail->next = &node;
+        else k->head = &node;
+        k->tail = &node;
+    }
+    void await_resume() {}
+};
+
+static inline void lock_release(co_lock_t *k) {
+    co_lock_waiter_t *next = k->head;
+    if (!next) {
+        k->held = 0;
+        return;
+    }
+    k->head = next->next;
+    if (!k->head) k->tail = NULL;
+    loop_schedule(k->loop, next->handle);
+}
+
+#endif
@@ -0,0 +1,430 @@
+// Delta sync for TCP uploads, rsync-style.
+//
+// The server cuts the copy of a file it already has (the basis) into
+// fixed-size blocks and sends the client one signature per block: a weak
+// rolling checksum and a 128-bit strong hash. The client slides a window
+// over its new version of the file, looks the weak checksum of every
+// position up in those signatures, confirms candidates with the strong
+// hash, and sends the server a stream of operations: copy a run of basis
+// blocks, or insert literal bytes. The server rebuilds the file from the
+// two and checks the strong hash of the whole result.
+//
+// The weak checksum is the rsync one (a = sum of bytes, b = sum of a over
+// the window, both mod 2^16), which can be rolled one byte in O(1); its
+// AVX2 version is picked at run time and computes exactly what the scalar
+// code does, so either end may use either. The strong hash is bhash from
+// checksum.h.
+//
+// The server keeps each basis's signatures in a hidden ".<name>.blkidx"
+// file next to it and rebuilds it when the file's size or mtime changes.
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELTA_X86 1
+#endif
+
+#include "protocol.h"
+#include "checksum.h"
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK 131072
+#define DELTA_SIG_SIZE 20            // u32 weak, then 16 bytes of strong hash
+#define DELTA_SIGS_PER_FRAME (FRAME_MAX_PAYLOAD / DELTA_SIG_SIZE)
+#define DELTA_INDEX_MAGIC 0x42495831u  // "BIX1"
+#define DELTA_INDEX_HDR_SIZE 28
+
+// FRAME_DELTA operations
+#define DELTA_OP_COPY 1      // u32 first block, u32 block count
+#define DELTA_OP_LITERAL 2   // u32 length, then that many bytes
+#define DELTA_COPY_SIZE 9
+#define DELTA_LITERAL_HDR_SIZE 5
+
+typedef struct {
+    uint32_t weak;
+    bhash_t strong;
+} delta_sig_t;
+
+// Block size for a basis of the given size: about sqrt(size), as rsync
+// does, so the signature list and the per-block overhead stay balanced.
+static inline uint32_t delta_block_size(uint64_t size) {
+    uint32_t block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (uint64_t)block * block < size) block *= 2;
+    return block;
+}
+
+// ---------------------------------------------------------------------------
+// Weak rolling checksum
+// ---------------------------------------------------------------------------
+
+static inline uint32_t weak_pack(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+static inline void weak_sums_scalar(const uint8_t *p, size_t len, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += a;
+    }
+    *a_out = a;
+    *b_out = b;
+}
+
+#ifdef DELTA_X86
+// 32 bytes per step: a grows by the byte sum, b by 32 times the previous a
+// plus the bytes weighted 32..1.
+__attribute__((target("avx2"))) static void weak_sums_avx2(const uint8_t *p, size_t len, uint32_t *a_out,
+                                                             uint32_t *b_out) {
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,
+                                             14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i va = zero, vprev = zero, vb = zero;
+    size_t n = len / 32;
+    for (size_t i = 0; i < n; i++) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+        vprev = _mm256_add_epi32(vprev, va);
+        va = _mm256_add_epi32(va, _mm256_sad_epu8(x, zero));
+        vb = _mm256_add_epi32(vb, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+    }
+    uint32_t la[8], lprev[8], lb[8];
+    _mm256_storeu_si256((__m256i *)la, va);
+    _mm256_storeu_si256((__m256i *)lprev, vprev);
+    _mm256_storeu_si256((__m256i *)lb, vb);
+    uint32_t a = 0, prev = 0, b = 0;
+    for (int i = 0; i < 8; i++) {
+        a += la[i];
+        prev += lprev[i];
+        b += lb[i];
+    }
+    b += 32 * prev;
+    for (size_t i = n * 32; i < len; i++) {
+        a += p[i];
+        b += a;
+    }
+    *a_out = a;
+    *b_out = b;
+}
+#endif
+
+// Checksum of a whole window, as the starting point for rolling.
+static inline void weak_sums(const uint8_t *p, size_t len, uint32_t *a, uint32_t *b) {
+#ifdef DELTA_X86
+    if (__builtin_cpu_supports("avx2")) {
+        weak_sums_avx2(p, len, a, b);
+        return;
+    }
+#endif
+    weak_sums_scalar(p, len, a, b);
+}
+
+// Slide a window of len bytes one byte forward: out leaves, in enters.
+static inline void weak_roll(uint32_t *a, uint32_t *b, uint8_t out, uint8_t in, uint32_t len) {
+    *a += in - (uint32_t)out;
+    *b += *a - len * (uint32_t)out;
+}
+
+// One bit per hashed weak checksum of the server's blocks. Most window
+// positions match nothing, and the filter rules them out without touching
+// the block table.
+#define WEAK_FILTER_MIN_BITS 15
+#define WEAK_FILTER_MAX_BITS 27
+
+typedef struct {
+    uint32_t *bits;
+    uint32_t shift;  // 32 - log2(number of bits)
+} weak_filter_t;
+
+static inline uint32_t weak_filter_slot(const weak_filter_t *f, uint32_t weak) {
+    return (weak * 0x9E3779B1u) >> f->shift;
+}
+
+static inline int weak_filter_init(weak_filter_t *f, const delta_sig_t *sigs, uint32_t n) {
+    uint32_t log2 = WEAK_FILTER_MIN_BITS;
+    while (log2 < WEAK_FILTER_MAX_BITS && (1ull << log2) < 256ull * n) log2++;
+    f->shift = 32 - log2;
+    f->bits = (uint32_t *)calloc((1u << log2) / 32, sizeof(uint32_t));
+    if (!f->bits) return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t slot = weak_filter_slot(f, sigs[i].weak);
+        f->bits[slot >> 5] |= 1u << (slot & 31);
+    }
+    return 0;
+}
+
+static inline int weak_filter_test(const weak_filter_t *f, uint32_t weak) {
+    uint32_t slot = weak_filter_slot(f, weak);
+    return (f->bits[slot >> 5] >> (slot & 31)) & 1;
+}
+
+static inline size_t weak_scan_scalar(const weak_filter_t *f, const uint8_t *p, size_t max, uint32_t len, uint32_t *a,
+                                      uint32_t *b) {
+    size_t k = 0;
+    for (; k < max; k++) {
+        if (weak_filter_test(f, weak_pack(*a, *b))) return k;
+        weak_roll(a, b, p[k], p[k + len], len);
+    }
+    return k;
+}
+
+#ifdef DELTA_X86
+// Inclusive prefix sum of eight 32-bit lanes.
+__attribute__((target("avx2"))) static inline __m256i prefix_sum_epi32(__m256i x) {
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i low_total = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(3));
+    return _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(), low_total, 0xf0));
+}
+
+// Eight window positions per step: with d = in - out for each step,
+// a at position j is a + (sum of d before j), and b is b plus the a of
+// positions 1..j minus len times the bytes that left.
+__attribute__((target("avx2"))) static size_t weak_scan_avx2(const weak_filter_t *f, const uint8_t *p, size_t max,
+                                                             uint32_t len, uint32_t *a_io, uint32_t *b_io) {
+    const __m128i shift = _mm_cvtsi32_si128((int)f->shift);
+    const __m256i mul = _mm256_set1_epi32((int)0x9E3779B1u);
+    const __m256i vlen = _mm256_set1_epi32((int)len);
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    const __m256i five = _mm256_set1_epi32(5), ones = _mm256_set1_epi32(1), low5 = _mm256_set1_epi32(31);
+    uint32_t a = *a_io, b = *b_io;
+    size_t k = 0;
+    for (; k + 8 <= max; k += 8) {
+        __m256i out = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + k)));
+        __m256i in = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + k + len)));
+        __m256i d = _mm256_sub_epi32(in, out);
+        __m256i incl_d = prefix_sum_epi32(d);
+        __m256i incl_out = prefix_sum_epi32(out);
+        __m256i va = _mm256_add_epi32(_mm256_set1_epi32((int)a), _mm256_sub_epi32(incl_d, d));
+        __m256i incl_a = prefix_sum_epi32(va);
+        __m256i vb = _mm256_add_epi32(_mm256_set1_epi32((int)(b - a)), incl_a);
+        vb = _mm256_sub_epi32(vb, _mm256_mullo_epi32(vlen, _mm256_sub_epi32(incl_out, out)));
+
+        __m256i weak = _mm256_or_si256(_mm256_and_si256(va, low16), _mm256_slli_epi32(vb, 16));
+        __m256i slot = _mm256_srl_epi32(_mm256_mullo_epi32(weak, mul), shift);
+        __m256i word = _mm256_i32gather_epi32((const int *)f->bits, _mm256_srlv_epi32(slot, five), 4);
+        __m256i bit = _mm256_and_si256(_mm256_srlv_epi32(word, _mm256_and_si256(slot, low5)), ones);
+        if (!_mm256_testz_si256(bit, bit)) {
+            uint32_t la[8], lb[8];
+            _mm256_storeu_si256((__m256i *)la, va);
+            _mm256_storeu_si256((__m256i *)lb, vb);
+            int j = __builtin_ctz((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(bit, 31))));
+            *a_io = la[j];
+            *b_io = lb[j];
+            return k + j;
+        }
+        uint32_t a7 = (uint32_t)_mm256_extract_epi32(va, 7);
+        uint32_t a8 = a7 + (uint32_t)_mm256_extract_epi32(d, 7);
+        b = b - a + (uint32_t)_mm256_extract_epi32(incl_a, 7) + a8 - len * (uint32_t)_mm256_extract_epi32(incl_out, 7);
+        a = a8;
+    }
+    *a_io = a;
+    *b_io = b;
+    return k + weak_scan_scalar(f, p + k, max - k, len, a_io, b_io);
+}
+#endif
+
+// Roll the window at p (checksum sums a, b) forward until a position whose
+// checksum passes the filter, trying at most max positions. Returns how
+// far it went; the sums are those of the window there. The caller must
+// have max + len bytes at p.
+static inline size_t weak_scan(const weak_filter_t *f, const uint8_t *p, size_t max, uint32_t len, uint32_t *a,
+                               uint32_t *b) {
+#ifdef DELTA_X86
+    if (__builtin_cpu_supports("avx2")) return weak_scan_avx2(f, p, max, len, a, b);
+#endif
+    return weak_scan_scalar(f, p, max, len, a, b);
+}
+
+static inline void delta_sig_encode(char *out, const delta_sig_t *sig) {
+    put_u32(out, sig->weak);
+    bhash_encode(out + 4, &sig->strong);
+}
+
+static inline void delta_sig_decode(const char *in, delta_sig_t *sig) {
+    sig->weak = get_u32(in);
+    bhash_decode(in + 4, &sig->strong);
+}
+
+// ---------------------------------------------------------------------------
+// Block index (server side)
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint32_t block_size;
+    uint32_t nblocks;     // Full blocks only; a short tail is never matched
+    delta_sig_t *sigs;
+} delta_index_t;
+
+static inline void delta_index_free(delta_index_t *ix) {
+    free(ix->sigs);
+    ix->sigs = NULL;
+    ix->nblocks = 0;
+}
+
+// Builds the index of a file from its bytes in order, in pieces of any
+// size, so a file can be indexed while it is being written.
+typedef struct {
+    delta_index_t ix;
+    uint32_t cap;       // Full blocks the file will have
+    uint32_t fill;      // Bytes of the current block seen so far
+    uint32_t a, b;
+    bhash_state_t strong;
+} delta_builder_t;
+
+static inline int delta_builder_init(delta_builder_t *bld, uint64_t size) {
+    memset(bld, 0, sizeof(*bld));
+    bld->ix.block_size = delta_block_size(size);
+    bld->cap = (uint32_t)(size / bld->ix.block_size);
+    bld->ix.sigs = (delta_sig_t *)malloc(((size_t)bld->cap + 1) * sizeof(delta_sig_t));
+    bhash_init(&bld->strong);
+    return bld->ix.sigs ? 0 : -1;
+}
+
+static inline void delta_builder_update(delta_builder_t *bld, const uint8_t *p, size_t len) {
+    while (len > 0 && bld->ix.nblocks < bld->cap) {
+        uint32_t take = bld->ix.block_size - bld->fill;
+        if (take > len) take = (uint32_t)len;
+        // Appending `take` bytes with sums (a2, b2) to the window so far
+        uint32_t a2, b2;
+        weak_sums(p, take, &a2, &b2);
+        bld->b += take * bld->a + b2;
+        bld->a += a2;
+        bhash_update(&bld->strong, p, take);
+        bld->fill += take;
+        p += take;
+        len -= take;
+
+        if (bld->fill == bld->ix.block_size) {
+            delta_sig_t *sig = &bld->ix.sigs[bld->ix.nblocks++];
+            sig->weak = weak_pack(bld->a, bld->b);
+            sig->strong = bhash_final(&bld->strong);
+            bld->fill = bld->a = bld->b = 0;
+            bhash_init(&bld->strong);
+        }
+    }
+}
+
+static inline int delta_index_build(delta_index_t *ix, int fd, uint64_t size) {
+    delta_builder_t bld;
+    uint8_t *buf = (uint8_t *)malloc(FRAME_MAX_PAYLOAD);
+    if (delta_builder_init(&bld, size) < 0 || !buf) {
+        free(buf);
+        delta_index_free(&bld.ix);
+        return -1;
+    }
+    uint64_t end = (uint64_t)bld.cap * bld.ix.block_size;
+    for (uint64_t off = 0; off < end;) {
+        size_t want = end - off < FRAME_MAX_PAYLOAD ? (size_t)(end - off) : FRAME_MAX_PAYLOAD;
+        ssize_t n = pread(fd, buf, want, (off_t)off);
+        if (n <= 0) {
+            free(buf);
+            delta_index_free(&bld.ix);
+            return -1;
+        }
+        delta_builder_update(&bld, buf, (size_t)n);
+        off += (uint64_t)n;
+    }
+    free(buf);
+    *ix = bld.ix;
+    return 0;
+}
+
+static inline void delta_index_path(char *out, size_t cap, const char *dir, const char *name) {
+    snprintf(out, cap, "%s.%s.blkidx", dir, name);
+}
+
+static inline int64_t delta_mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Read the saved index of a basis, if it still describes this version.
+static inline int delta_index_load(delta_index_t *ix, const char *path, const struct stat *st) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    char hdr[DELTA_INDEX_HDR_SIZE];
+    int ok = read(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) && get_u32(hdr) == DELTA_INDEX_MAGIC &&
+             get_u64(hdr + 4) == (uint64_t)st->st_size && get_u64(hdr + 12) == (uint64_t)delta_mtime_ns(st) &&
+             get_u32(hdr + 20) == delta_block_size((uint64_t)st->st_size) &&
+             get_u32(hdr + 24) == (uint64_t)st->st_size / get_u32(hdr + 20);
+    if (ok) {
+        ix->block_size = get_u32(hdr + 20);
+        ix->nblocks = get_u32(hdr + 24);
+        size_t bytes = (size_t)ix->nblocks * DELTA_SIG_SIZE;
+        char *raw = (char *)malloc(bytes + 1);
+        ix->sigs = (delta_sig_t *)malloc(((size_t)ix->nblocks + 1) * sizeof(delta_sig_t));
+        ok = raw && ix->sigs && read(fd, raw, bytes) == (ssize_t)bytes;
+        for (uint32_t i = 0; ok && i < ix->nblocks; i++) delta_sig_decode(raw + (size_t)i * DELTA_SIG_SIZE, &ix->sigs[i]);
+        free(raw);
+        if (!ok) delta_index_free(ix);
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static inline int delta_index_save(const delta_index_t *ix, const char *path, const struct stat *st) {
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    size_t bytes = DELTA_INDEX_HDR_SIZE + (size_t)ix->nblocks * DELTA_SIG_SIZE;
+    char *raw = (char *)malloc(bytes);
+    int ok = raw != NULL;
+    if (ok) {
+        put_u32(raw, DELTA_INDEX_MAGIC);
+        put_u64(raw + 4, (uint64_t)st->st_size);
+        put_u64(raw + 12, (uint64_t)delta_mtime_ns(st));
+        put_u32(raw + 20, ix->block_size);
+        put_u32(raw + 24, ix->nblocks);
+        for (uint32_t i = 0; i < ix->nblocks; i++) {
+            delta_sig_encode(raw + DELTA_INDEX_HDR_SIZE + (size_t)i * DELTA_SIG_SIZE, &ix->sigs[i]);
+        }
+        ok = write(fd, raw, bytes) == (ssize_t)bytes;
+    }
+    free(raw);
+    close(fd);
+    if (!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Signatures of the basis `name` in dir: from its saved index, or built
+// (and saved) when there is none or the file has changed since. A missing
+// basis gives an empty index, so the delta is one literal.
+static inline int delta_index_open(delta_index_t *ix, const char *dir, const char *name, int *basis_fd) {
+    char path[512], index_path[512];
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    delta_index_path(index_path, sizeof(index_path), dir, name);
+    memset(ix, 0, sizeof(*ix));
+    ix->block_size = DELTA_MIN_BLOCK;
+
+    struct stat st;
+    *basis_fd = open(path, O_RDONLY);
+    if (*basis_fd < 0 || fstat(*basis_fd, &st) < 0) {
+        if (*basis_fd >= 0) close(*basis_fd);
+        *basis_fd = -1;
+        return 0;
+    }
+    if (delta_index_load(ix, index_path, &st) == 0) return 0;
+    if (delta_index_build(ix, *basis_fd, (uint64_t)st.st_size) < 0) {
+        close(*basis_fd);
+        *basis_fd = -1;
+        return -1;
+    }
+    delta_index_save(ix, index_path, &st);
+    return 1;
+}
+
+#endif
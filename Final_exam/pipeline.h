@@ -0,0 +1,148 @@
+// Pipelined chat messaging for the clients.
+//
+// Every FRAME_MSG carries a fresh stream id, which doubles as its request
+// id. The main thread sends messages without waiting; a reader thread owns
+// the socket, matches each echo to its request by stream id and prints it
+// with its round-trip time. A FRAME_MSG that matches no request was pushed
+// by the server and is printed as it arrives.
+//
+// File transfers still read their replies synchronously. Before one
+// starts, the main thread claims the socket: the reader finishes the read
+// it is in (it never blocks for longer than PIPELINE_POLL_MS), parks, and
+// stays parked until the claim is released. While it holds the socket the
+// main thread hands any FRAME_MSG it meets to the same dispatch, so echoes
+// and pushes are not lost during an upload.
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define PIPELINE_MAX_PENDING 4096      // Messages in flight at once (power of two)
+#define PIPELINE_POLL_MS 50            // Longest a claim waits for the reader
+#define PIPELINE_DRAIN_US 2000000      // How long quitting waits for outstanding echoes
+
+typedef struct {
+    uint32_t stream_id;
+    uint64_t sent_us;
+} pipeline_req_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sock;                // Connection the reader watches, -1 for none
+    int claimed;             // The main thread is reading replies itself
+    int parked;              // The reader has noticed and stays off the socket
+    int pending;
+    pipeline_req_t reqs[PIPELINE_MAX_PENDING];  // Indexed by stream_id % size
+} pipeline_t;
+
+static inline void pipeline_init(pipeline_t *p, int sock) {
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->sock = sock;
+}
+
+// Record a message about to be sent. Returns -1 if its slot is still taken,
+// i.e. PIPELINE_MAX_PENDING messages are already in flight.
+static inline int pipeline_add(pipeline_t *p, uint32_t stream_id) {
+    pthread_mutex_lock(&p->lock);
+    pipeline_req_t *r = &p->reqs[stream_id & (PIPELINE_MAX_PENDING - 1)];
+    int busy = r->stream_id != 0;
+    if (!busy) {
+        r->stream_id = stream_id;
+        r->sent_us = now_us();
+        p->pending++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return busy ? -1 : 0;
+}
+
+// Match a reply to its request. Returns 1 and its round-trip time if
+// stream_id was outstanding, 0 if the frame was not a reply of ours.
+static inline int pipeline_take(pipeline_t *p, uint32_t stream_id, uint64_t *rtt_us) {
+    if (stream_id == 0) return 0;
+    pthread_mutex_lock(&p->lock);
+    pipeline_req_t *r = &p->reqs[stream_id & (PIPELINE_MAX_PENDING - 1)];
+    int found = r->stream_id == stream_id;
+    if (found) {
+        *rtt_us = now_us() - r->sent_us;
+        r->stream_id = 0;
+        p->pending--;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return found;
+}
+
+// Forget a request whose send failed.
+static inline void pipeline_cancel(pipeline_t *p, uint32_t stream_id) {
+    uint64_t rtt;
+    pipeline_take(p, stream_id, &rtt);
+}
+
+// Reader side: wait out any claim, then return the socket to read from.
+static inline int pipeline_park(pipeline_t *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->claimed) {
+        if (!p->parked) {
+            p->parked = 1;
+            pthread_cond_broadcast(&p->cond);
+        }
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    p->parked = 0;
+    int sock = p->sock;
+    pthread_mutex_unlock(&p->lock);
+    return sock;
+}
+
+// Main thread: take the socket away from the reader until pipeline_release().
+static inline void pipeline_claim(pipeline_t *p) {
+    pthread_mutex_lock(&p->lock);
+    p->claimed = 1;
+    while (!p->parked) pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Give the socket back, possibly a new one after a reconnect.
+static inline void pipeline_release(pipeline_t *p, int sock) {
+    pthread_mutex_lock(&p->lock);
+    p->sock = sock;
+    p->claimed = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Reader side: the connection failed; stop watching it until a new one
+// is handed over.
+static inline void pipeline_lost(pipeline_t *p, int sock) {
+    pthread_mutex_lock(&p->lock);
+    if (p->sock == sock) p->sock = -1;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Wait until every message has been answered or timeout_us has passed.
+// Returns how many are still outstanding.
+static inline int pipeline_drain(pipeline_t *p, uint64_t timeout_us) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)(timeout_us / 1000000);
+    deadline.tv_nsec += (long)(timeout_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0 && pthread_cond_timedwait(&p->cond, &p->lock, &deadline) == 0) {
+    }
+    int left = p->pending;
+    pthread_mutex_unlock(&p->lock);
+    return left;
+}
+
+#endif
@@ -0,0 +1,242 @@
+// Pooled I/O buffers, shared by the servers and the TCP client.
+//
+// Buffers come in power-of-two size classes from 256 bytes to 128 KB and
+// are carved out of 1 MB slabs. Each one is preceded by a 64-byte header,
+// so the data is cache-line aligned and no two buffers share a line. A
+// buffer carries a reference count: whoever hands it on takes a reference
+// (pbuf_ref) and the last pbuf_put gives it back.
+//
+// Freed buffers go to a freelist of the freeing thread, with no locking.
+// When a thread's list for a class grows past POOL_CACHE_MAX, half of it
+// moves to a shared list under a mutex, and a thread with an empty list
+// refills from there before cutting a new slab. Slabs are never returned
+// to the system; the pool stays as large as its busiest moment.
+//
+// The same per-thread caching is offered for the mirrored frame rings of
+// protocol.h, whose setup (a memfd and three mappings) costs more than the
+// memory itself when connections come and go.
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define POOL_ALIGN 64
+#define POOL_MIN_SHIFT 8                  // 256 bytes
+#define POOL_CLASSES 10                   // ... up to 128 KB
+#define POOL_MAX_SIZE ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+#define POOL_SLAB_SIZE (1024 * 1024)      // At least; large classes get 8 buffers a slab
+#define POOL_CACHE_MAX 64                 // Buffers a thread keeps per class
+#define POOL_LARGE 0xff                   // Class of buffers beyond POOL_MAX_SIZE, malloc'ed singly
+#define POOL_RING_CACHE 16                // Frame rings a thread keeps
+
+typedef struct alignas(POOL_ALIGN) pbuf_hdr {
+    struct pbuf_hdr *next;  // Freelist link while free
+    size_t cap;
+    int refs;
+    uint8_t cls;
+} pbuf_hdr_t;
+
+typedef struct {
+    pbuf_hdr_t *head[POOL_CLASSES];
+    int count[POOL_CLASSES];
+    ring_t rings[POOL_RING_CACHE];
+    int nrings;
+} pool_cache_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pbuf_hdr_t *head[POOL_CLASSES];
+    int count[POOL_CLASSES];
+    size_t slab_bytes;   // Held from the system, never returned
+    size_t used_bytes;   // Handed out and not yet put back (data bytes)
+    size_t large_bytes;  // Part of used_bytes outside the slabs
+} pool_t;
+
+static pool_t pool_shared = {PTHREAD_MUTEX_INITIALIZER, {0}, {0}, 0, 0, 0};
+static __thread pool_cache_t pool_cache;
+
+static inline pbuf_hdr_t *pbuf_hdr(const void *data) {
+    return (pbuf_hdr_t *)((char *)data - sizeof(pbuf_hdr_t));
+}
+
+static inline void *pbuf_data(pbuf_hdr_t *h) {
+    return (char *)h + sizeof(pbuf_hdr_t);
+}
+
+static inline int pool_class(size_t size) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + cls)) < size) cls++;
+    return cls < POOL_CLASSES ? cls : -1;
+}
+
+// Cut a slab into buffers of class cls and put them on the shared list.
+// Called with the lock held.
+static inline int pool_grow(int cls) {
+    size_t stride = sizeof(pbuf_hdr_t) + ((size_t)1 << (POOL_MIN_SHIFT + cls));
+    size_t n = POOL_SLAB_SIZE / stride < 8 ? 8 : POOL_SLAB_SIZE / stride;
+    size_t slab = n * stride;
+    char *mem = (char *)aligned_alloc(POOL_ALIGN, slab);
+    if (!mem) return -1;
+    pool_shared.slab_bytes += slab;
+    for (size_t off = 0; off + stride <= slab; off += stride) {
+        pbuf_hdr_t *h = (pbuf_hdr_t *)(mem + off);
+        h->cls = (uint8_t)cls;
+        h->cap = stride - sizeof(pbuf_hdr_t);
+        h->next = pool_shared.head[cls];
+        pool_shared.head[cls] = h;
+        pool_shared.count[cls]++;
+    }
+    return 0;
+}
+
+// A buffer of at least size bytes with one reference, or NULL.
+static inline void *pbuf_alloc(size_t size) {
+    int cls = pool_class(size);
+    pbuf_hdr_t *h;
+    if (cls < 0) {
+        size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+        h = (pbuf_hdr_t *)aligned_alloc(POOL_ALIGN, sizeof(pbuf_hdr_t) + size);
+        if (!h) return NULL;
+        h->cls = POOL_LARGE;
+        h->cap = size;
+        __atomic_add_fetch(&pool_shared.used_bytes, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pool_shared.large_bytes, size, __ATOMIC_RELAXED);
+    } else {
+        pool_cache_t *pc = &pool_cache;
+        if (!pc->head[cls]) {
+            // Take half a cache's worth from the shared list
+            pthread_mutex_lock(&pool_shared.lock);
+            if (!pool_shared.head[cls] && pool_grow(cls) < 0) {
+                pthread_mutex_unlock(&pool_shared.lock);
+                return NULL;
+            }
+            for (int i = 0; i < POOL_CACHE_MAX / 2 && pool_shared.head[cls]; i++) {
+                pbuf_hdr_t *t = pool_shared.head[cls];
+                pool_shared.head[cls] = t->next;
+                pool_shared.count[cls]--;
+                t->next = pc->head[cls];
+                pc->head[cls] = t;
+                pc->count[cls]++;
+            }
+            pthread_mutex_unlock(&pool_shared.lock);
+        }
+        h = pc->head[cls];
+        pc->head[cls] = h->next;
+        pc->count[cls]--;
+        __atomic_add_fetch(&pool_shared.used_bytes, h->cap, __ATOMIC_RELAXED);
+    }
+    h->next = NULL;
+    h->refs = 1;
+    return pbuf_data(h);
+}
+
+static inline size_t pbuf_cap(const void *data) {
+    return pbuf_hdr(data)->cap;
+}
+
+static inline void pbuf_ref(void *data) {
+    __atomic_add_fetch(&pbuf_hdr(data)->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference; the last one returns the buffer. NULL is ignored.
+static inline void pbuf_put(void *data) {
+    if (!data) return;
+    pbuf_hdr_t *h = pbuf_hdr(data);
+    if (__atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    __atomic_sub_fetch(&pool_shared.used_bytes, h->cap, __ATOMIC_RELAXED);
+    if (h->cls == POOL_LARGE) {
+        __atomic_sub_fetch(&pool_shared.large_bytes, h->cap, __ATOMIC_RELAXED);
+        free(h);
+        return;
+    }
+
+    pool_cache_t *pc = &pool_cache;
+    int cls = h->cls;
+    h->next = pc->head[cls];
+    pc->head[cls] = h;
+    if (++pc->count[cls] <= POOL_CACHE_MAX) return;
+
+    pthread_mutex_lock(&pool_shared.lock);
+    while (pc->count[cls] > POOL_CACHE_MAX / 2) {
+        pbuf_hdr_t *t = pc->head[cls];
+        pc->head[cls] = t->next;
+        pc->count[cls]--;
+        t->next = pool_shared.head[cls];
+        pool_shared.head[cls] = t;
+        pool_shared.count[cls]++;
+    }
+    pthread_mutex_unlock(&pool_shared.lock);
+}
+
+// Resize a buffer that has a single owner, keeping its first len bytes.
+// Like realloc(), NULL data allocates; on failure the old buffer is kept.
+static inline void *pbuf_grow(void *data, size_t len, size_t size) {
+    if (data && pbuf_cap(data) >= size) return data;
+    void *p = pbuf_alloc(size);
+    if (!p) return NULL;
+    if (data) {
+        memcpy(p, data, len);
+        pbuf_put(data);
+    }
+    return p;
+}
+
+// Hand a thread's cached buffers and rings back before it exits.
+static inline void pool_thread_exit() {
+    pool_cache_t *pc = &pool_cache;
+    pthread_mutex_lock(&pool_shared.lock);
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        while (pc->head[cls]) {
+            pbuf_hdr_t *t = pc->head[cls];
+            pc->head[cls] = t->next;
+            t->next = pool_shared.head[cls];
+            pool_shared.head[cls] = t;
+            pool_shared.count[cls]++;
+        }
+        pc->count[cls] = 0;
+    }
+    pthread_mutex_unlock(&pool_shared.lock);
+    while (pc->nrings > 0) ring_free(&pc->rings[--pc->nrings]);
+}
+
+static inline size_t pool_used_bytes() {
+    return __atomic_load_n(&pool_shared.used_bytes, __ATOMIC_RELAXED);
+}
+
+static inline size_t pool_reserved_bytes() {
+    pthread_mutex_lock(&pool_shared.lock);
+    size_t n = pool_shared.slab_bytes;
+    pthread_mutex_unlock(&pool_shared.lock);
+    return n + __atomic_load_n(&pool_shared.large_bytes, __ATOMIC_RELAXED);
+}
+
+// ring_init()/ring_free() through the calling thread's cache of rings.
+static inline int ring_get(ring_t *r, size_t size) {
+    pool_cache_t *pc = &pool_cache;
+    for (int i = pc->nrings - 1; i >= 0; i--) {
+        if (pc->rings[i].size != size) continue;
+        *r = pc->rings[i];
+        pc->rings[i] = pc->rings[--pc->nrings];
+        r->head = r->tail = 0;
+        return 0;
+    }
+    return ring_init(r, size);
+}
+
+static inline void ring_put(ring_t *r) {
+    pool_cache_t *pc = &pool_cache;
+    if (!r->base) return;
+    if (pc->nrings < POOL_RING_CACHE) {
+        pc->rings[pc->nrings++] = *r;
+    } else {
+        ring_free(r);
+    }
+    r->base = NULL;
+}
+
+#endif
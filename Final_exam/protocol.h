@@ -0,0 +1,497 @@
+// Binary frame format shared by the TCP and UDP servers and clients.
+//
+// Every message starts with a fixed 12-byte header in network byte order:
+//
+//   0       1       2               4               8              12
+//   +-------+-------+---------------+---------------+---------------+
+//   |version| type  |     flags     |    length     |   stream id   |
+//   +-------+-------+---------------+---------------+---------------+
+//
+// followed by `length` payload bytes. Over TCP frames are read into a
+// ring_t and parsed in place; over UDP each datagram carries exactly one
+// frame. The only exception is a TCP file body: after READY the client
+// streams exactly the file size announced in the FRAME_FILE payload as raw
+// bytes, so it can go through sendfile()/splice() untouched. The same holds
+// for the chunk announced by each FRAME_CHUNK of a striped upload.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#define PROTO_VERSION 1
+#define FRAME_HDR_SIZE 12
+#define FRAME_MAX_PAYLOAD 65536
+
+// Largest frame that fits in one UDP datagram
+#define UDP_MAX_DATAGRAM 65507
+#define UDP_MAX_PAYLOAD (UDP_MAX_DATAGRAM - FRAME_HDR_SIZE)
+
+typedef enum {
+    FRAME_USER = 1,     // payload: username; flags: codecs the client would compress with (compress.h)
+    FRAME_USER_OK,      // flags: those of them the server can decompress
+    FRAME_USER_FAIL,
+    FRAME_MSG,          // payload: chat text, echoed back with the same stream id
+    FRAME_FILE,         // payload: file_info_t (size, chunk size, name)
+    FRAME_READY,
+    FRAME_FILE_OK,
+    FRAME_FILE_FAIL,
+    FRAME_ERROR,
+    FRAME_DATA,         // payload: file bytes (UDP only)
+    FRAME_ACK,          // payload: cumulative ack and SACK bitmap (rudp.h)
+    FRAME_ATTACH,       // payload: u64 transfer id; opens a data connection of a striped upload
+    FRAME_CHUNK,        // payload: chunk_info_t, then that many raw bytes (TCP only)
+    FRAME_COMMIT,       // payload: none, or the checksums of a verified upload; the upload is finished
+    FRAME_RESUME,       // payload: u64 transfer id, then file_info_t; READY lists the missing ranges
+    FRAME_SIGNATURES,   // payload: block signatures of the server's copy (delta.h)
+    FRAME_DELTA,        // payload: copy and literal operations rebuilding the file (delta.h)
+    FRAME_JOIN,         // payload: room name, empty to leave; answered by a FRAME_MSG (TCP only, room.h)
+    FRAME_BLOCK,        // payload: codec, raw length, data; one block of a compressed upload (compress.h)
+    FRAME_BATCH,        // payload: u32 file count, u64 bytes; starts a packed batch upload (TCP only, batch.h)
+    FRAME_PACK,         // payload: manifest, then names and contents of whole small files (batch.h)
+    FRAME_BULK,         // TCP: asks for a ticket to send files over UDP; answered with a bulk grant (server.h)
+    FRAME_BIND          // UDP payload: u64 ticket; logs the socket in as the ticket's user, answered like FRAME_USER
+} frame_type_t;
+
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t length;
+    uint32_t stream_id;
+} frame_hdr_t;
+
+static inline uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Progress lines are redrawn at most this often; printing one per read
+// costs more than the read itself on a fast link.
+#define PROGRESS_INTERVAL_US 250000
+
+// Whether a progress line is due, updating *last_us when it is. The final
+// line of a transfer is always printed.
+static inline int progress_due(uint64_t *last_us, int final) {
+    uint64_t now = now_us();
+    if (!final && now - *last_us < PROGRESS_INTERVAL_US) return 0;
+    *last_us = now;
+    return 1;
+}
+
+// CPU time consumed by the calling thread, for per-core packet rates.
+static inline uint64_t thread_cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void put_u16(char *p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+}
+
+static inline void put_u32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static inline void put_u64(char *p, uint64_t v) {
+    put_u32(p, (uint32_t)(v >> 32));
+    put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint16_t get_u16(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static inline uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static inline uint64_t get_u64(const char *p) {
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static inline void frame_encode(char *out, uint8_t type, uint16_t flags, uint32_t length, uint32_t stream_id) {
+    out[0] = PROTO_VERSION;
+    out[1] = (char)type;
+    put_u16(out + 2, flags);
+    put_u32(out + 4, length);
+    put_u32(out + 8, stream_id);
+}
+
+static inline void frame_decode(const char *in, frame_hdr_t *hdr) {
+    hdr->version = (uint8_t)in[0];
+    hdr->type = (uint8_t)in[1];
+    hdr->flags = get_u16(in + 2);
+    hdr->length = get_u32(in + 4);
+    hdr->stream_id = get_u32(in + 8);
+}
+
+// Validate one datagram as a complete frame. Returns 0 on success.
+static inline int frame_parse_datagram(const char *buf, size_t len, frame_hdr_t *hdr) {
+    if (len < FRAME_HDR_SIZE) return -1;
+    frame_decode(buf, hdr);
+    if (hdr->version != PROTO_VERSION) return -1;
+    if (hdr->length != len - FRAME_HDR_SIZE) return -1;
+    return 0;
+}
+
+// FRAME_BULK reply: u64 ticket, u16 UDP port of the same server.
+#define BULK_GRANT_SIZE 10
+
+// FRAME_FILE payload: u64 file size, u32 chunk size, then the file name.
+// chunk_size is 0 for a plain stream and the segment size for chunked
+// transfer modes.
+#define FILE_INFO_SIZE 12
+
+// FRAME_FILE flags
+#define FILE_FLAG_RELIABLE 0x0001  // UDP: sequenced, acknowledged segments (rudp.h)
+#define FILE_FLAG_STRIPED 0x0002   // TCP: chunks arrive over parallel data connections
+#define FILE_FLAG_DELTA 0x0004     // TCP: sent as a delta against the server's copy (delta.h)
+#define FILE_FLAG_COMPRESSED 0x0008  // TCP: the body is FRAME_BLOCKs (compress.h)
+#define FILE_FLAG_VERIFY 0x0010   // FRAME_COMMIT follows with the file's digest, and over TCP its chunk CRCs (checksum.h)
+#define FILE_FLAG_BATCH 0x0020    // TCP: the name is a relative path, directories included (batch.h)
+
+typedef struct {
+    uint64_t size;
+    uint32_t chunk_size;
+    const char *name;
+    size_t name_len;
+} file_info_t;
+
+static inline size_t file_info_encode(char *out, size_t cap, const file_info_t *info) {
+    size_t name_len = info->name_len;
+    if (name_len > cap - FILE_INFO_SIZE) name_len = cap - FILE_INFO_SIZE;
+    put_u64(out, info->size);
+    put_u32(out + 8, info->chunk_size);
+    memcpy(out + FILE_INFO_SIZE, info->name, name_len);
+    return FILE_INFO_SIZE + name_len;
+}
+
+static inline int file_info_decode(const char *payload, uint32_t len, file_info_t *info) {
+    if (len < FILE_INFO_SIZE) return -1;
+    info->size = get_u64(payload);
+    info->chunk_size = get_u32(payload + 8);
+    info->name = payload + FILE_INFO_SIZE;
+    info->name_len = len - FILE_INFO_SIZE;
+    return 0;
+}
+
+// Copy the file name out of a decoded FRAME_FILE as a C string, keeping
+// only the last path component so clients cannot write outside the save
+// directory. Returns -1 if nothing usable is left.
+static inline int file_info_basename(const file_info_t *info, char *out, size_t cap) {
+    const char *name = info->name;
+    size_t len = info->name_len;
+    for (size_t i = len; i > 0; i--) {
+        if (name[i - 1] == '/' || name[i - 1] == '\\') {
+            name += i;
+            len -= i;
+            break;
+        }
+    }
+    if (len >= cap) len = cap - 1;
+    memcpy(out, name, len);
+    out[len] = '\0';
+    if (len == 0 || strcmp(out, ".") == 0 || strcmp(out, "..") == 0) return -1;
+    return 0;
+}
+
+// Striped TCP upload. The control connection sends FRAME_FILE with
+// FILE_FLAG_STRIPED and gets READY carrying a u64 transfer id, random so
+// that no one else can guess it. Each data connection opens with
+// FRAME_ATTACH(id) instead of FRAME_USER, sends any
+// number of FRAME_CHUNKs, and ends with FRAME_COMMIT, answered by FILE_OK
+// carrying the u64 bytes that stream delivered. Once every stream is
+// acknowledged, FRAME_COMMIT on the control connection completes the file.
+#define CHUNK_INFO_SIZE 16
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} chunk_info_t;
+
+static inline void chunk_info_encode(char *out, const chunk_info_t *chunk) {
+    put_u64(out, chunk->offset);
+    put_u64(out + 8, chunk->length);
+}
+
+static inline int chunk_info_decode(const char *payload, uint32_t len, chunk_info_t *chunk) {
+    if (len < CHUNK_INFO_SIZE) return -1;
+    chunk->offset = get_u64(payload);
+    chunk->length = get_u64(payload + 8);
+    return 0;
+}
+
+// Resumable upload (resume.h). FRAME_RESUME carries the transfer id in
+// front of an ordinary FRAME_FILE payload; its flags are FRAME_FILE flags.
+// READY answers with a u32 range count and that many chunk_info_t ranges
+// still missing on the server. Over TCP the client then sends each range
+// as a FRAME_CHUNK on the same connection and finishes with FRAME_COMMIT;
+// over UDP it sends the segments that fall inside the ranges.
+#define RESUME_INFO_SIZE 8
+
+static inline int resume_info_decode(const char *payload, uint32_t len, uint64_t *id, file_info_t *info) {
+    if (len < RESUME_INFO_SIZE) return -1;
+    *id = get_u64(payload);
+    return file_info_decode(payload + RESUME_INFO_SIZE, len - RESUME_INFO_SIZE, info);
+}
+
+// Delta upload (delta.h). FRAME_FILE with FILE_FLAG_DELTA is answered by
+// READY carrying u32 block size and u32 block count, followed by that many
+// signatures in FRAME_SIGNATURES frames. The client then sends FRAME_DELTA
+// frames, each a sequence of whole operations, and FRAME_COMMIT carrying
+// the 16-byte strong hash of the file; the server replies FILE_OK once the
+// rebuilt file matches it. No raw body follows the frames in this mode.
+#define DELTA_READY_SIZE 8
+
+// Verified upload (checksum.h). FRAME_FILE with FILE_FLAG_VERIFY is
+// followed, after the body, by FRAME_COMMIT carrying the 16-byte digest of
+// the file and, over TCP, a u32 CRC-32C for every chunk_size bytes of it.
+// FILE_OK only comes once they match. Over TCP, chunks whose CRC differs
+// are listed in a READY (ranges as for resume), sent again as FRAME_CHUNKs
+// and followed by an empty FRAME_COMMIT. Over UDP every segment carries its
+// own CRC (rudp.h), so only the digest is committed.
+
+// Batch upload (batch.h). FRAME_BATCH announces how many small files and
+// bytes will follow and is answered by READY. The client then streams
+// FRAME_PACKs without waiting, each holding whole files, and ends with
+// FRAME_COMMIT; the server answers FILE_OK (FILE_FAIL if any file could
+// not be written) carrying BATCH_RESULT_SIZE bytes: u32 files written,
+// u32 failed, u64 bytes. Larger files of the batch are ordinary uploads
+// with FILE_FLAG_BATCH, usually over further connections in parallel.
+#define BATCH_INFO_SIZE 12
+#define BATCH_RESULT_SIZE 16
+
+// Byte ring backed by two adjacent mappings of the same pages, so the
+// readable and the writable region are always contiguous in memory: recv()
+// lands directly in the ring and frames are parsed where they lie, even
+// when they wrap around the end of the buffer.
+#define RING_SIZE (2 * FRAME_MAX_PAYLOAD)
+
+typedef struct {
+    char *base;
+    size_t size;    // power of two, multiple of the page size
+    uint64_t head;  // read position
+    uint64_t tail;  // write position
+} ring_t;
+
+static inline int ring_init(ring_t *r, size_t size) {
+    int fd = memfd_create("frame_ring", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char *base = (char *)mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * size);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    r->base = base;
+    r->size = size;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+static inline void ring_free(ring_t *r) {
+    if (r->base) munmap(r->base, 2 * r->size);
+    r->base = NULL;
+}
+
+static inline size_t ring_used(const ring_t *r) { return (size_t)(r->tail - r->head); }
+static inline size_t ring_space(const ring_t *r) { return r->size - ring_used(r); }
+static inline char *ring_read_ptr(const ring_t *r) { return r->base + (r->head & (r->size - 1)); }
+static inline char *ring_write_ptr(const ring_t *r) { return r->base + (r->tail & (r->size - 1)); }
+static inline void ring_consume(ring_t *r, size_t n) { r->head += n; }
+static inline void ring_produce(ring_t *r, size_t n) { r->tail += n; }
+
+// recv() as much as fits into the ring. Same return convention as recv().
+static inline ssize_t ring_recv(ring_t *r, int sock) {
+    size_t space = ring_space(r);
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t n = recv(sock, ring_write_ptr(r), space, 0);
+    if (n > 0) ring_produce(r, (size_t)n);
+    return n;
+}
+
+// Look for one complete frame at the read position. Returns 1 and points
+// *payload into the ring when a whole frame is buffered, 0 when more bytes
+// are needed and -1 on a malformed header. The caller consumes
+// FRAME_HDR_SIZE + hdr->length bytes once it is done with the payload.
+static inline int ring_peek_frame(const ring_t *r, frame_hdr_t *hdr, const char **payload) {
+    if (ring_used(r) < FRAME_HDR_SIZE) return 0;
+    const char *p = ring_read_ptr(r);
+    frame_decode(p, hdr);
+    if (hdr->version != PROTO_VERSION || hdr->length > FRAME_MAX_PAYLOAD) return -1;
+    if (ring_used(r) < FRAME_HDR_SIZE + (size_t)hdr->length) return 0;
+    *payload = p + FRAME_HDR_SIZE;
+    return 1;
+}
+
+// Blocking send of one frame (header and payload in a single sendmsg).
+static inline int send_frame(int sock, uint8_t type, uint16_t flags, uint32_t stream_id, const void *payload, size_t len) {
+    char hdr[FRAME_HDR_SIZE];
+    frame_encode(hdr, type, flags, (uint32_t)len, stream_id);
+
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = FRAME_HDR_SIZE;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Blocking receive of one frame into the ring. Returns 1 with the frame
+// peeked (see ring_peek_frame), 0 on orderly shutdown, -1 on error.
+static inline int recv_frame(int sock, ring_t *r, frame_hdr_t *hdr, const char **payload) {
+    while (1) {
+        int got = ring_peek_frame(r, hdr, payload);
+        if (got != 0) return got;
+        ssize_t n = ring_recv(r, sock);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return (int)n;
+    }
+}
+
+// Send one frame as a single datagram.
+static inline int sendto_frame(int sock, const struct sockaddr_in *to, uint8_t type, uint16_t flags, uint32_t stream_id,
+                               const void *payload, size_t len) {
+    char hdr[FRAME_HDR_SIZE];
+    frame_encode(hdr, type, flags, (uint32_t)len, stream_id);
+
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = FRAME_HDR_SIZE;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+
+    struct msghdr msg = {0};
+    msg.msg_name = (void *)to;
+    msg.msg_namelen = sizeof(*to);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+// Parse a server address given as "ip" or "ip:port" into *addr; the port
+// defaults to port. Returns -1 if it is not one.
+static inline int addr_parse(const char *s, uint16_t port, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strchr(s, ':');
+    size_t len = colon ? (size_t)(colon - s) : strlen(s);
+    if (len >= sizeof(ip)) return -1;
+    memcpy(ip, s, len);
+    ip[len] = '\0';
+    if (colon) {
+        char *end;
+        long p = strtol(colon + 1, &end, 10);
+        if (*end || p <= 0 || p > 65535) return -1;
+        port = (uint16_t)p;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+// UDP segmentation and receive offload (Linux 4.18 and 5.0). A GSO send
+// hands the kernel a run of equal-sized datagrams in one buffer; a GRO
+// receive returns several coalesced datagrams in one buffer and reports
+// their size in a control message. Both are probed at run time.
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#define UDP_MAX_GSO_SEGMENTS 64
+#define UDP_GSO_CMSG_SPACE CMSG_SPACE(sizeof(uint16_t))
+#define UDP_GRO_CMSG_SPACE CMSG_SPACE(sizeof(int))
+
+static inline int udp_gso_supported(int sock) {
+    int size;
+    socklen_t len = sizeof(size);
+    return getsockopt(sock, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+static inline int udp_enable_gro(int sock) {
+    int on = 1;
+    return setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on));
+}
+
+// Attach a UDP_SEGMENT control message to msg, using cmsg_buf as storage.
+static inline void udp_set_gso(struct msghdr *msg, char *cmsg_buf, uint16_t segment_size) {
+    msg->msg_control = cmsg_buf;
+    msg->msg_controllen = UDP_GSO_CMSG_SPACE;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+}
+
+// Size of each datagram coalesced into a received buffer, or 0 if the
+// buffer holds a single datagram.
+static inline int udp_gro_size(struct msghdr *msg) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            return size;
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,328 @@
+// File read engine for the clients' uploads.
+//
+// The senders walk a file front to back and want each piece the moment
+// the socket can take it, so the engine's job is to have the disk read
+// done before it is asked for. How depends on the size:
+//
+//   read    files up to READER_SMALL_MAX: one pread() of the whole file;
+//           anything smarter costs more than it saves. Larger files asked
+//           for this way are read a READER_SMALL_MAX piece at a time
+//   mmap    up to READER_MMAP_MAX: the file is mapped with MADV_SEQUENTIAL
+//           (and MADV_HUGEPAGE, where the kernel maps file pages that
+//           way), the sender sends straight from the mapping, and a
+//           MADV_WILLNEED window of READER_AHEAD bytes is kept in front of
+//           it so page faults find the data already read
+//   thread  larger files: a read-ahead thread fills READER_BUFS buffers of
+//           READER_BUF_SIZE in turn (double buffering) while the sender
+//           sends the previous one; past a few tens of MB the mapping's
+//           page faults and WILLNEED calls cost more than the copy out of
+//           the buffers (bench_read measures where)
+//
+// reader_next() hands out the file in order without copying; the pointer
+// stays valid until the next call. reader_read_at() copies any range,
+// from the buffers when they hold it, else with pread(), for senders that
+// go back for retransmissions. wait_us adds up the time the sender spent
+// blocked on the disk, which is the disk time not overlapped: the read
+// engine's preads, or the waits for the read-ahead thread.
+#ifndef READER_H
+#define READER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "protocol.h"
+
+#define READER_SMALL_MAX (256 * 1024)
+#define READER_MMAP_MAX (32LL * 1024 * 1024)
+#define READER_AHEAD (16 * 1024 * 1024)   // WILLNEED window in front of an mmap sender
+#define READER_BUFS 2
+#define READER_BUF_SIZE (4 * 1024 * 1024)
+
+typedef enum {
+    READER_AUTO,
+    READER_READ,
+    READER_MMAP,
+    READER_THREAD
+} reader_mode_t;
+
+static const char *const reader_mode_names[] = {"auto", "read", "mmap", "thread"};
+
+typedef struct {
+    char *data;
+    long long off;
+    size_t len;
+} reader_buf_t;
+
+typedef struct {
+    int fd;
+    reader_mode_t mode;
+    long long size;
+    long long pos;           // Next byte reader_next() returns
+    uint64_t wait_us;        // Sender time spent waiting for the disk
+
+    char *buf;               // read: the whole file, or the piece last read of a larger one
+    char *map;               // mmap
+    long long advised;       // mmap: WILLNEED issued up to here
+
+    // thread: buffers bufs[head..head+nready) hold the file in order from
+    // released; the thread reads the next one at read_off
+    reader_buf_t bufs[READER_BUFS];
+    int head;
+    int nready;
+    long long released;
+    long long read_off;
+    int error;
+    int stop;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} reader_t;
+
+// "auto", "read", "mmap" or "thread", or -1.
+static inline int reader_mode_parse(const char *name) {
+    for (int m = READER_AUTO; m <= READER_THREAD; m++) {
+        if (strcmp(name, reader_mode_names[m]) == 0) return m;
+    }
+    return -1;
+}
+
+static inline reader_mode_t reader_pick(long long size) {
+    if (size <= READER_SMALL_MAX) return READER_READ;
+    if (size <= READER_MMAP_MAX) return READER_MMAP;
+    return READER_THREAD;
+}
+
+static inline int reader_pread(int fd, char *dst, size_t len, long long off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, dst, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;  // The file shrank under us
+            return -1;
+        }
+        dst += n;
+        off += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static inline void *reader_ahead_loop(void *data) {
+    reader_t *r = (reader_t *)data;
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop && r->read_off < r->size) {
+        if (r->nready == READER_BUFS) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        reader_buf_t *b = &r->bufs[(r->head + r->nready) % READER_BUFS];
+        long long off = r->read_off;
+        size_t len = r->size - off < READER_BUF_SIZE ? (size_t)(r->size - off) : READER_BUF_SIZE;
+        pthread_mutex_unlock(&r->lock);
+
+        int failed = reader_pread(r->fd, b->data, len, off) < 0;
+
+        pthread_mutex_lock(&r->lock);
+        if (failed) {
+            r->error = errno;
+            pthread_cond_broadcast(&r->cond);
+            break;
+        }
+        b->off = off;
+        b->len = len;
+        r->read_off = off + (long long)len;
+        r->nready++;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Get ready to read size bytes of fd from the start, the way mode says
+// (READER_AUTO: by size). Falls back to plainer modes when one cannot be
+// set up. Returns -1 (errno set) if none can.
+static inline int reader_open(reader_t *r, int fd, long long size, reader_mode_t mode) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->size = size;
+    r->mode = mode == READER_AUTO ? reader_pick(size) : mode;
+    if (size == 0) r->mode = READER_READ;
+
+    if (r->mode == READER_MMAP) {
+        void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            r->map = (char *)map;
+            madvise(map, (size_t)size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(map, (size_t)size, MADV_HUGEPAGE);
+#endif
+            return 0;
+        }
+        r->mode = READER_THREAD;
+    }
+    if (r->mode == READER_THREAD) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        char *mem = (char *)malloc((size_t)READER_BUFS * READER_BUF_SIZE);
+        if (mem) {
+            for (int i = 0; i < READER_BUFS; i++) r->bufs[i].data = mem + (size_t)i * READER_BUF_SIZE;
+            pthread_mutex_init(&r->lock, NULL);
+            pthread_cond_init(&r->cond, NULL);
+            if (pthread_create(&r->thread, NULL, reader_ahead_loop, r) == 0) {
+                r->running = 1;
+                return 0;
+            }
+            pthread_cond_destroy(&r->cond);
+            pthread_mutex_destroy(&r->lock);
+            free(mem);
+        }
+        r->mode = READER_READ;
+    }
+    if (size > READER_SMALL_MAX) {
+        // Too big to hold whole: stream it through a small buffer
+        r->buf = (char *)malloc(READER_SMALL_MAX);
+        return r->buf ? 0 : -1;
+    }
+    r->buf = (char *)malloc(size > 0 ? (size_t)size : 1);
+    if (!r->buf) return -1;
+    uint64_t start = now_us();
+    int ret = reader_pread(fd, r->buf, (size_t)size, 0);
+    r->wait_us += now_us() - start;
+    return ret;
+}
+
+static inline void reader_close(reader_t *r) {
+    if (r->running) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r->bufs[0].data);
+    }
+    if (r->map) munmap(r->map, (size_t)r->size);
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+// Keep the WILLNEED window in front of an mmap sender, a quarter of it at
+// a time so the advice costs a few system calls per window.
+static inline void reader_advise(reader_t *r, long long off) {
+    if (r->advised >= r->size || off + READER_AHEAD * 3 / 4 < r->advised) return;
+    long long from = r->advised > off ? r->advised : off & ~4095LL;
+    long long to = off + READER_AHEAD < r->size ? off + READER_AHEAD : r->size;
+    if (to > from) madvise(r->map + from, (size_t)(to - from), MADV_WILLNEED);
+    r->advised = to;
+}
+
+// thread: where the byte at off is buffered and how many follow it there
+// (*avail), waiting for the thread when it is still ahead. Buffers before
+// off are released to be refilled. NULL when off was released already, or
+// (with errno set) when reading failed.
+static inline const char *reader_thread_at(reader_t *r, long long off, size_t *avail) {
+    const char *p = NULL;
+    uint64_t start = 0;
+    pthread_mutex_lock(&r->lock);
+    errno = 0;
+    while (off >= r->released) {
+        if (r->nready > 0) {
+            reader_buf_t *b = &r->bufs[r->head];
+            if (off < b->off + (long long)b->len) {
+                *avail = (size_t)(b->off + (long long)b->len - off);
+                p = b->data + (off - b->off);
+                break;
+            }
+            r->released = b->off + (long long)b->len;
+            r->head = (r->head + 1) % READER_BUFS;
+            r->nready--;
+            pthread_cond_broadcast(&r->cond);
+            continue;
+        }
+        if (r->error) {
+            errno = r->error;
+            break;
+        }
+        if (!start) start = now_us();
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (start) r->wait_us += now_us() - start;
+    return p;
+}
+
+// The next piece of the file, at most max bytes, in *data; valid until
+// the next call. Returns its length, 0 at the end, or -1 (errno set).
+static inline ssize_t reader_next(reader_t *r, const char **data, size_t max) {
+    long long left = r->size - r->pos;
+    if (left <= 0) return 0;
+    if ((long long)max > left) max = (size_t)left;
+
+    switch (r->mode) {
+    case READER_MMAP:
+        reader_advise(r, r->pos);
+        *data = r->map + r->pos;
+        break;
+    case READER_THREAD: {
+        size_t avail;
+        const char *p = reader_thread_at(r, r->pos, &avail);
+        if (!p) return -1;
+        if (max > avail) max = avail;
+        *data = p;
+        break;
+    }
+    default:
+        if (r->size > READER_SMALL_MAX) {
+            // Streaming fallback for a file not held whole
+            if (max > READER_SMALL_MAX) max = READER_SMALL_MAX;
+            uint64_t start = now_us();
+            int failed = reader_pread(r->fd, r->buf, max, r->pos) < 0;
+            r->wait_us += now_us() - start;
+            if (failed) return -1;
+            *data = r->buf;
+        } else {
+            *data = r->buf + r->pos;
+        }
+        break;
+    }
+    r->pos += (long long)max;
+    return (ssize_t)max;
+}
+
+// Copy len bytes at off into dst. Returns 0, or -1 (errno set).
+static inline int reader_read_at(reader_t *r, char *dst, size_t len, long long off) {
+    if (off < 0 || off + (long long)len > r->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (r->mode == READER_MMAP) {
+        reader_advise(r, off);
+        memcpy(dst, r->map + off, len);
+        return 0;
+    }
+    if (r->mode == READER_READ && r->size <= READER_SMALL_MAX) {
+        memcpy(dst, r->buf + off, len);
+        return 0;
+    }
+    while (len > 0 && r->mode == READER_THREAD) {
+        size_t avail;
+        const char *p = reader_thread_at(r, off, &avail);
+        if (!p && errno) return -1;
+        if (!p) break;  // Behind the buffers
+        size_t n = len < avail ? len : avail;
+        memcpy(dst, p, n);
+        dst += n;
+        off += (long long)n;
+        len -= n;
+    }
+    return len > 0 ? reader_pread(r->fd, dst, len, off) : 0;
+}
+
+#endif
@@ -0,0 +1,219 @@
+// Resumable uploads, shared by both servers.
+//
+// A resumable upload is named by a 64-bit transfer id the client derives
+// from the file's name, size and modification time, so the same file maps
+// to the same id across reconnects. The server writes it to
+// ".resume-<id>.part" and keeps ".resume-<id>.manifest" beside it: a small
+// header and one bit per chunk that is known to be on disk. The manifest is
+// rewritten at checkpoints, always after fdatasync() of the data, so a bit
+// is only ever set for bytes that survived; a crash loses at most the work
+// since the last checkpoint. On (re)connect the server answers with the
+// ranges that are still missing and the client sends only those.
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+#define RESUME_MAGIC 0x52534d31u                  // "RSM1"
+#define RESUME_HDR_SIZE 20
+#define RESUME_CHECKPOINT_BYTES (64 * 1024 * 1024)  // Sync at least this often...
+#define RESUME_CHECKPOINT_US 2000000                // ...or this long after the first unsynced write
+#define RESUME_MAX_RANGES ((UDP_MAX_PAYLOAD - 4) / CHUNK_INFO_SIZE)
+
+typedef struct {
+    int fd;                   // The .part file
+    char dir[256];
+    char part_path[512];
+    char manifest_path[512];
+    uint64_t file_size;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    uint8_t *done;            // One bit per chunk written (not necessarily synced)
+    uint64_t bytes_done;      // Bytes covered by those chunks
+    uint64_t dirty_bytes;     // Written since the last checkpoint
+    uint64_t dirty_since_us;
+} resume_t;
+
+// FNV-1a over name, size and mtime.
+static inline uint64_t resume_transfer_id(const char *name, uint64_t size, int64_t mtime_ns) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+    for (int i = 0; i < 8; i++) h = (h ^ ((size >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+    for (int i = 0; i < 8; i++) h = (h ^ (((uint64_t)mtime_ns >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+    return h;
+}
+
+static inline int resume_has(const resume_t *r, uint32_t chunk) {
+    return (r->done[chunk >> 3] >> (chunk & 7)) & 1;
+}
+
+static inline size_t resume_bitmap_size(const resume_t *r) {
+    return r->nchunks / 8 + 1;
+}
+
+static inline uint64_t resume_chunk_len(const resume_t *r, uint64_t chunk) {
+    uint64_t off = chunk * r->chunk_size;
+    return r->file_size - off < r->chunk_size ? r->file_size - off : r->chunk_size;
+}
+
+// Read back the manifest of an earlier attempt. Returns 0 if it matches
+// this file and its bits were loaded.
+static inline int resume_load(resume_t *r) {
+    int fd = open(r->manifest_path, O_RDONLY);
+    if (fd < 0) return -1;
+    char hdr[RESUME_HDR_SIZE];
+    int ok = read(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) && get_u32(hdr) == RESUME_MAGIC &&
+             get_u64(hdr + 4) == r->file_size && get_u32(hdr + 12) == r->chunk_size &&
+             get_u32(hdr + 16) == r->nchunks &&
+             read(fd, r->done, resume_bitmap_size(r)) == (ssize_t)resume_bitmap_size(r);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Open (or reopen) the partial file for transfer `id`. *resumed is set when
+// an earlier attempt's progress was found.
+static inline int resume_open(resume_t *r, const char *dir, uint64_t id, uint64_t file_size, uint32_t chunk_size,
+                              int *resumed) {
+    memset(r, 0, sizeof(*r));
+    if (chunk_size == 0) return -1;
+    snprintf(r->dir, sizeof(r->dir), "%s", dir);
+    snprintf(r->part_path, sizeof(r->part_path), "%s.resume-%016llx.part", dir, (unsigned long long)id);
+    snprintf(r->manifest_path, sizeof(r->manifest_path), "%s.resume-%016llx.manifest", dir, (unsigned long long)id);
+    r->file_size = file_size;
+    r->chunk_size = chunk_size;
+    r->nchunks = (uint32_t)((file_size + chunk_size - 1) / chunk_size);
+    r->done = (uint8_t *)calloc(resume_bitmap_size(r), 1);
+    if (!r->done) return -1;
+
+    *resumed = resume_load(r) == 0 && access(r->part_path, F_OK) == 0;
+    if (!*resumed) memset(r->done, 0, resume_bitmap_size(r));
+    for (uint32_t c = 0; c < r->nchunks; c++) {
+        if (resume_has(r, c)) r->bytes_done += resume_chunk_len(r, c);
+    }
+
+    r->fd = open(r->part_path, O_WRONLY | O_CREAT | (*resumed ? 0 : O_TRUNC), 0644);
+    if (r->fd < 0 || ftruncate(r->fd, (off_t)file_size) < 0) {
+        if (r->fd >= 0) close(r->fd);
+        free(r->done);
+        r->done = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void resume_free(resume_t *r) {
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+    free(r->done);
+    r->done = NULL;
+}
+
+// Record that [from, to) of a body that started at body_start has been
+// written, marking every chunk that is now completely covered.
+static inline void resume_mark_range(resume_t *r, uint64_t body_start, uint64_t from, uint64_t to) {
+    uint64_t first = (body_start + r->chunk_size - 1) / r->chunk_size;
+    uint64_t from_chunk = from / r->chunk_size;
+    if (from_chunk > first) first = from_chunk;
+    uint64_t end = to == r->file_size ? r->nchunks : to / r->chunk_size;
+    for (uint64_t c = first; c < end; c++) {
+        if (resume_has(r, (uint32_t)c)) continue;
+        r->done[c >> 3] |= (uint8_t)(1 << (c & 7));
+        r->bytes_done += resume_chunk_len(r, c);
+    }
+
+    if (r->dirty_bytes == 0) r->dirty_since_us = now_us();
+    r->dirty_bytes += to - from;
+}
+
+static inline int resume_complete(const resume_t *r) {
+    return r->bytes_done == r->file_size;
+}
+
+static inline int resume_checkpoint_due(const resume_t *r) {
+    return r->dirty_bytes >= RESUME_CHECKPOINT_BYTES ||
+           (r->dirty_bytes > 0 && now_us() - r->dirty_since_us >= RESUME_CHECKPOINT_US);
+}
+
+// Make everything written so far durable, then record it in the manifest
+// (write to a temporary name, sync, rename over the old one).
+static inline int resume_checkpoint(resume_t *r) {
+    if (fdatasync(r->fd) < 0) return -1;
+
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", r->manifest_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    char hdr[RESUME_HDR_SIZE];
+    put_u32(hdr, RESUME_MAGIC);
+    put_u64(hdr + 4, r->file_size);
+    put_u32(hdr + 12, r->chunk_size);
+    put_u32(hdr + 16, r->nchunks);
+    int ok = write(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+             write(fd, r->done, resume_bitmap_size(r)) == (ssize_t)resume_bitmap_size(r) && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, r->manifest_path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    int dfd = open(r->dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    r->dirty_bytes = 0;
+    return 0;
+}
+
+// The upload stopped short: record its progress for the next attempt.
+// Returns 0 if a newer attempt has already completed it and moved the
+// file away, so there is nothing to keep.
+static inline int resume_suspend(resume_t *r) {
+    if (access(r->part_path, F_OK) < 0) return 0;
+    resume_checkpoint(r);
+    return 1;
+}
+
+// Move the finished file into place and drop its manifest.
+static inline int resume_finish(resume_t *r, const char *full_path) {
+    if (fdatasync(r->fd) < 0 || rename(r->part_path, full_path) < 0) return -1;
+    unlink(r->manifest_path);
+    return 0;
+}
+
+// Encode the missing byte ranges: u32 count, then one chunk_info_t each.
+// If there are more than fit, the last range runs to the end of the file,
+// so the client may resend some bytes but never skips any.
+static inline size_t resume_missing(const resume_t *r, char *out, size_t cap) {
+    uint32_t max = (uint32_t)((cap - 4) / CHUNK_INFO_SIZE);
+    if (max > RESUME_MAX_RANGES) max = RESUME_MAX_RANGES;
+    uint32_t count = 0;
+    uint32_t c = 0;
+    while (c < r->nchunks && count < max) {
+        if (resume_has(r, c)) {
+            c++;
+            continue;
+        }
+        uint32_t start = c;
+        while (c < r->nchunks && !resume_has(r, c)) c++;
+        uint64_t off = (uint64_t)start * r->chunk_size;
+        uint64_t end = c == r->nchunks ? r->file_size : (uint64_t)c * r->chunk_size;
+        if (count == max - 1) end = r->file_size;
+        chunk_info_t range = {off, end - off};
+        chunk_info_encode(out + 4 + CHUNK_INFO_SIZE * count, &range);
+        count++;
+        if (end == r->file_size) break;
+    }
+    put_u32(out, count);
+    return 4 + CHUNK_INFO_SIZE * (size_t)count;
+}
+
+#endif
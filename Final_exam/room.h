@@ -0,0 +1,338 @@
+// Chat rooms for the TCP server.
+//
+// A connection joins at most one room at a time (FRAME_JOIN); every chat
+// message it sends is then also delivered to the other members. The frame
+// is encoded once into a pooled buffer and each recipient's queue takes a
+// reference to it, so fanning out to N members copies nothing.
+//
+// Members may sit on any worker thread. Each connection has a subscriber
+// (sub_t) with a bounded queue of frames, and each worker an inbox listing
+// its subscribers that have something queued. Publishing appends to the
+// queues and links the subscriber into its worker's inbox; the first entry
+// in an inbox that belongs to another thread wakes it through an eventfd.
+// The owning worker then writes each queue with writev() in batches of up
+// to ROOM_BATCH frames, so a burst to one member costs one system call.
+//
+// A slow member never holds up the room. Its queue starts small and grows
+// while it falls behind, up to ROOM_QUEUE_MAX frames or ROOM_QUEUE_BYTES;
+// past that, new frames for it are dropped (tail drop) and counted, and it
+// is told how many it missed once it catches up. Only the head of a queue is ever
+// being written, and only by the owner, so dropping at the tail needs no
+// coordination with a write in progress.
+//
+// Locks are taken in the order rooms_lock, room, subscriber, inbox.
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "pool.h"
+
+#define ROOM_NAME_MAX 32
+#define ROOM_MAX 1024          // Rooms are kept until the server exits
+#define ROOM_QUEUE_MIN 16      // Initial queue slots per member (power of two)
+#define ROOM_QUEUE_MAX 4096    // Frames queued per member before tail drop (power of two)
+#define ROOM_QUEUE_BYTES (1024 * 1024)  // ... or bytes
+#define ROOM_BATCH 64          // Frames per writev()
+
+typedef struct sub sub_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int efd;          // Readable while the owner has not looked at ready
+    sub_t *ready;     // Subscribers with queued frames, linked by next_ready
+} room_inbox_t;
+
+typedef struct {
+    char *frame;      // Pooled, one reference per queue holding it
+    uint32_t len;
+} room_frame_t;
+
+struct sub {
+    pthread_mutex_t lock;
+    int refs;                  // Owner, plus one while in an inbox
+    room_inbox_t *inbox;
+    void *owner;               // Connection, NULL once it has closed
+    int scheduled;             // Linked into the inbox
+    sub_t *next_ready;
+    char room[ROOM_NAME_MAX];  // Current room, "" for none
+    room_frame_t *q;           // Ring of cap slots (pooled)
+    unsigned cap;
+    unsigned head;
+    unsigned count;
+    size_t bytes;
+    uint32_t dropped;          // Frames lost to tail drop, not yet reported
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    char name[ROOM_NAME_MAX];
+    sub_t **members;
+    int nmembers;
+    int cap;
+} room_t;
+
+static room_t *rooms[ROOM_MAX];
+static int nrooms;
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inbox of the calling thread: frames published to it need no wakeup, the
+// thread looks at its inbox after every batch of events anyway.
+static __thread room_inbox_t *room_local;
+
+static inline int room_inbox_init(room_inbox_t *in) {
+    pthread_mutex_init(&in->lock, NULL);
+    in->ready = NULL;
+    in->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return in->efd < 0 ? -1 : 0;
+}
+
+static inline sub_t *sub_new(room_inbox_t *inbox, void *owner) {
+    sub_t *s = (sub_t *)pbuf_alloc(sizeof(sub_t));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(*s));
+    s->q = (room_frame_t *)pbuf_alloc(ROOM_QUEUE_MIN * sizeof(room_frame_t));
+    if (!s->q) {
+        pbuf_put(s);
+        return NULL;
+    }
+    s->cap = ROOM_QUEUE_MIN;
+    pthread_mutex_init(&s->lock, NULL);
+    s->refs = 1;
+    s->inbox = inbox;
+    s->owner = owner;
+    return s;
+}
+
+static inline void sub_put(sub_t *s) {
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    for (unsigned i = 0; i < s->count; i++) pbuf_put(s->q[(s->head + i) & (s->cap - 1)].frame);
+    pbuf_put(s->q);
+    pthread_mutex_destroy(&s->lock);
+    pbuf_put(s);
+}
+
+// Queue a frame for s. Returns 0, 1 if the queue was full and the frame
+// dropped, or -1 if the connection has closed.
+static inline int sub_push(sub_t *s, char *frame, uint32_t len) {
+    int wake = 0;
+    pthread_mutex_lock(&s->lock);
+    if (!s->owner) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    if (s->count == s->cap && s->cap < ROOM_QUEUE_MAX) {
+        // Double the ring, unwrapping it so head is slot 0
+        room_frame_t *q = (room_frame_t *)pbuf_alloc(2 * s->cap * sizeof(room_frame_t));
+        if (q) {
+            for (unsigned i = 0; i < s->count; i++) q[i] = s->q[(s->head + i) & (s->cap - 1)];
+            pbuf_put(s->q);
+            s->q = q;
+            s->cap *= 2;
+            s->head = 0;
+        }
+    }
+    if (s->count == s->cap || s->bytes + len > ROOM_QUEUE_BYTES) {
+        s->dropped++;
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+    pbuf_ref(frame);
+    room_frame_t *f = &s->q[(s->head + s->count) & (s->cap - 1)];
+    f->frame = frame;
+    f->len = len;
+    s->count++;
+    s->bytes += len;
+    if (!s->scheduled) {
+        s->scheduled = 1;
+        __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+        room_inbox_t *in = s->inbox;
+        pthread_mutex_lock(&in->lock);
+        wake = in->ready == NULL && in != room_local;
+        s->next_ready = in->ready;
+        in->ready = s;
+        pthread_mutex_unlock(&in->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t n = write(s->inbox->efd, &one, sizeof(one));
+        (void)n;
+    }
+    return 0;
+}
+
+// Owner side: the subscribers queued for this worker since the last call,
+// each holding a reference for the caller to drop with sub_put().
+static inline sub_t *room_inbox_take(room_inbox_t *in) {
+    if (!__atomic_load_n(&in->ready, __ATOMIC_ACQUIRE)) return NULL;
+    pthread_mutex_lock(&in->lock);
+    sub_t *list = in->ready;
+    in->ready = NULL;
+    pthread_mutex_unlock(&in->lock);
+    return list;
+}
+
+// Owner side: reset the eventfd after it became readable.
+static inline void room_inbox_ack(room_inbox_t *in) {
+    uint64_t n;
+    if (read(in->efd, &n, sizeof(n)) < 0) n = 0;
+}
+
+// Owner side: clear the scheduled mark so later frames link s again, and
+// return its connection, or NULL if it has closed.
+static inline void *sub_claim(sub_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->scheduled = 0;
+    void *owner = s->owner;
+    pthread_mutex_unlock(&s->lock);
+    return owner;
+}
+
+// Owner side: point iov at the first frames of the queue. Returns how many.
+static inline int sub_peek(sub_t *s, struct iovec *iov, int max) {
+    pthread_mutex_lock(&s->lock);
+    int n = s->count < (unsigned)max ? (int)s->count : max;
+    for (int i = 0; i < n; i++) {
+        room_frame_t *f = &s->q[(s->head + (unsigned)i) & (s->cap - 1)];
+        iov[i].iov_base = f->frame;
+        iov[i].iov_len = f->len;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+// Owner side: drop the first n frames, which have been written.
+static inline void sub_pop(sub_t *s, int n) {
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < n; i++) {
+        s->bytes -= s->q[s->head].len;
+        pbuf_put(s->q[s->head].frame);
+        s->head = (s->head + 1) & (s->cap - 1);
+        s->count--;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Owner side: frames dropped since the last call.
+static inline uint32_t sub_take_dropped(sub_t *s) {
+    pthread_mutex_lock(&s->lock);
+    uint32_t n = s->dropped;
+    s->dropped = 0;
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+// Find a room, creating it if create is set. Called with rooms_lock held.
+static inline room_t *room_find(const char *name, int create) {
+    for (int i = 0; i < nrooms; i++) {
+        if (strcmp(rooms[i]->name, name) == 0) return rooms[i];
+    }
+    if (!create || nrooms == ROOM_MAX) return NULL;
+    room_t *r = (room_t *)calloc(1, sizeof(room_t));
+    if (!r) return NULL;
+    pthread_mutex_init(&r->lock, NULL);
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    rooms[nrooms++] = r;
+    return r;
+}
+
+// Take s out of its current room, if any.
+static inline void room_leave(sub_t *s) {
+    if (!s->room[0]) return;
+    pthread_mutex_lock(&rooms_lock);
+    room_t *r = room_find(s->room, 0);
+    if (r) {
+        pthread_mutex_lock(&r->lock);
+        for (int i = 0; i < r->nmembers; i++) {
+            if (r->members[i] != s) continue;
+            r->members[i] = r->members[--r->nmembers];
+            sub_put(s);
+            break;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    s->room[0] = '\0';
+}
+
+// Move s into room name. Returns the number of members including s, or -1
+// if there are too many rooms or no memory.
+static inline int room_join(sub_t *s, const char *name) {
+    room_leave(s);
+    pthread_mutex_lock(&rooms_lock);
+    room_t *r = room_find(name, 1);
+    int n = -1;
+    if (r) {
+        pthread_mutex_lock(&r->lock);
+        if (r->nmembers == r->cap) {
+            int cap = r->cap ? r->cap * 2 : 8;
+            sub_t **m = (sub_t **)realloc(r->members, cap * sizeof(sub_t *));
+            if (m) {
+                r->members = m;
+                r->cap = cap;
+            }
+        }
+        if (r->nmembers < r->cap) {
+            __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+            r->members[r->nmembers++] = s;
+            strcpy(s->room, r->name);
+            n = r->nmembers;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return n;
+}
+
+// Deliver user's chat text as "[room] user: text" to every member of
+// from's room but from itself. Returns how many members it was queued
+// for, and in *dropped how many had no room for it.
+static inline int room_publish(sub_t *from, const char *user, const char *text, size_t len, int *dropped) {
+    *dropped = 0;
+    if (!from->room[0]) return 0;
+    pthread_mutex_lock(&rooms_lock);
+    room_t *r = room_find(from->room, 0);
+    pthread_mutex_unlock(&rooms_lock);
+    if (!r) return 0;
+
+    size_t prefix = strlen(r->name) + strlen(user) + 5;
+    if (len > FRAME_MAX_PAYLOAD - prefix) len = FRAME_MAX_PAYLOAD - prefix;
+    char *frame = (char *)pbuf_alloc(FRAME_HDR_SIZE + prefix + len + 1);
+    if (!frame) return 0;
+    snprintf(frame + FRAME_HDR_SIZE, prefix + 1, "[%s] %s: ", r->name, user);
+    memcpy(frame + FRAME_HDR_SIZE + prefix, text, len);
+    len += prefix;
+    frame_encode(frame, FRAME_MSG, 0, (uint32_t)len, 0);
+
+    int queued = 0;
+    pthread_mutex_lock(&r->lock);
+    for (int i = 0; i < r->nmembers; i++) {
+        if (r->members[i] == from) continue;
+        int res = sub_push(r->members[i], frame, (uint32_t)(FRAME_HDR_SIZE + len));
+        if (res == 0) queued++;
+        if (res > 0) (*dropped)++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    pbuf_put(frame);
+    return queued;
+}
+
+// The connection is gone: leave its room and drop whatever is queued.
+static inline void sub_close(sub_t *s) {
+    room_leave(s);
+    pthread_mutex_lock(&s->lock);
+    s->owner = NULL;
+    pthread_mutex_unlock(&s->lock);
+    sub_put(s);
+}
+
+#endif
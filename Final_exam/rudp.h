@@ -0,0 +1,717 @@
+// Reliable file transfer over UDP.
+//
+// The file is cut into fixed-size segments numbered from 0. Every segment
+// travels in a FRAME_DATA whose payload starts with a small header:
+//
+//   u32 seq, u64 file offset, u32 CRC-32C, then the segment bytes
+//
+// The CRC (checksum.h) covers the seq, the offset and the bytes. A segment
+// that fails it is dropped as if it had been lost, so it is not
+// acknowledged and the sender retransmits just that segment.
+//
+// The receiver answers with FRAME_ACK frames carrying the cumulative ack
+// (every seq below it has arrived), its own count of bytes received and
+// the time it took that count, and a SACK bitmap describing the next
+// RUDP_SACK_BITS segments after it. The sender keeps a sliding window of
+// unacknowledged segments, estimates RTT from first transmissions only
+// (Karn), retransmits on RTO expiry with exponential backoff, and fast
+// retransmits holes that later segments have been SACKed past. How much of
+// the window may be in flight, and how fast it is released, is up to the
+// congestion controller and token-bucket pacer in cc.h, which use the
+// receiver's byte counts as delivery-rate feedback. Segments are written
+// with pwrite() at their offset, so arrival order is irrelevant.
+//
+// The sender queues segments into a batch of back-to-back datagrams and
+// sends the batch with one sendmmsg(), grouping equal-sized datagrams into
+// UDP GSO sends when the kernel supports it; runs of consecutive segments
+// are read from the file with one preadv().
+//
+// Both ends can also hash the whole file (bhash) in segment order, for a
+// digest the receiver checks before it accepts the file. The sender feeds
+// each segment to it when it is first read for sending. The receiver feeds
+// in-order segments straight from the datagram, and reads those that
+// waited behind a hole back from the page cache once the hole is filled.
+//
+// A resumed transfer (resume.h) starts with both ends knowing which
+// segments the receiver already has: the receiver restores its bitmap and
+// the sender skips them as if they had been acknowledged.
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "cc.h"
+#include "checksum.h"
+
+#define RUDP_DATA_HDR_SIZE 16
+#define RUDP_DEFAULT_SEG_SIZE 1444  // Fits a 1500-byte MTU with IP/UDP/frame headers
+#define RUDP_DEFAULT_WINDOW 1024    // Upper bound on segments in flight
+#define RUDP_MAX_WINDOW 65536
+
+#define RUDP_SACK_BITS 256
+#define RUDP_ACK_HDR_SIZE 24
+#define RUDP_ACK_SIZE (RUDP_ACK_HDR_SIZE + RUDP_SACK_BITS / 8)
+#define RUDP_ACK_EVERY 2            // In-order segments per ACK
+#define RUDP_ACK_DELAY_US 5000      // Longest an ACK is held back
+#define RUDP_DUPTHRESH 3            // SACKed segments past a hole before fast retransmit
+
+#define RUDP_INITIAL_RTO_US 1000000
+#define RUDP_MIN_RTO_US 200000
+#define RUDP_MAX_RTO_US 10000000
+#define RUDP_IDLE_TIMEOUT_US 30000000  // Give up after this long without progress
+#define RUDP_SOCKET_BUFFER (4 * 1024 * 1024)  // Room for a full window of segments
+#define RUDP_TX_BATCH 64            // Segments queued per sendmmsg()
+
+// Size the socket buffers for a window of segments; the defaults only hold
+// a few hundred datagrams.
+static inline void rudp_tune_socket(int sock) {
+    int size = RUDP_SOCKET_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+static inline uint32_t rudp_segment_count(uint64_t file_size, uint32_t seg_size) {
+    return (uint32_t)((file_size + seg_size - 1) / seg_size);
+}
+
+// ---------------------------------------------------------------------------
+// Receiver
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int fd;
+    uint64_t file_size;
+    uint32_t seg_size;
+    uint32_t nsegs;
+    uint8_t *have;           // One bit per segment
+    uint32_t cum_ack;        // First segment not yet received
+    uint32_t received_segs;
+    uint64_t received_bytes;
+    uint32_t unacked;        // Segments accepted since the last ACK went out
+    uint64_t ack_due_us;     // When a held-back ACK must be sent (0: none pending)
+    uint64_t last_data_us;
+    uint64_t corrupt;        // Segments dropped for a bad CRC
+
+    // Whole-file digest, when enabled with rudp_rx_enable_digest()
+    char *scratch;           // One segment, for reading back reordered ones
+    bhash_state_t digest;
+    uint32_t digest_next;    // First segment not yet hashed
+
+    // Where accepted segments go instead of a pwrite(), when set (the
+    // server's write-behind); sync makes all of them readable, for the
+    // digest to read reordered ones back
+    void (*write)(void *ctx, const char *data, uint32_t len, uint64_t offset);
+    void (*sync)(void *ctx);
+    void *ctx;
+} rudp_rx_t;
+
+static inline int rudp_rx_init(rudp_rx_t *rx, int fd, uint64_t file_size, uint32_t seg_size) {
+    if (seg_size == 0 || seg_size > UDP_MAX_PAYLOAD - RUDP_DATA_HDR_SIZE) return -1;
+    memset(rx, 0, sizeof(*rx));
+    rx->fd = fd;
+    rx->file_size = file_size;
+    rx->seg_size = seg_size;
+    rx->nsegs = rudp_segment_count(file_size, seg_size);
+    rx->have = (uint8_t *)calloc(rx->nsegs / 8 + 1, 1);
+    rx->last_data_us = now_us();
+    return rx->have ? 0 : -1;
+}
+
+static inline void rudp_rx_free(rudp_rx_t *rx) {
+    free(rx->have);
+    free(rx->scratch);
+    rx->have = NULL;
+    rx->scratch = NULL;
+}
+
+// Hash the file as it arrives. Only for a transfer that starts empty.
+static inline int rudp_rx_enable_digest(rudp_rx_t *rx) {
+    rx->scratch = (char *)malloc(rx->seg_size);
+    bhash_init(&rx->digest);
+    rx->digest_next = 0;
+    return rx->scratch ? 0 : -1;
+}
+
+static inline bhash_t rudp_rx_digest(const rudp_rx_t *rx) {
+    return bhash_final(&rx->digest);
+}
+
+static inline int rudp_rx_has(const rudp_rx_t *rx, uint32_t seq) {
+    return (rx->have[seq >> 3] >> (seq & 7)) & 1;
+}
+
+// Take over the segments an earlier attempt left on disk, one bit each.
+static inline void rudp_rx_restore(rudp_rx_t *rx, const uint8_t *have) {
+    memcpy(rx->have, have, rx->nsegs / 8 + 1);
+    while (rx->cum_ack < rx->nsegs && rudp_rx_has(rx, rx->cum_ack)) rx->cum_ack++;
+}
+
+static inline int rudp_rx_complete(const rudp_rx_t *rx) {
+    return rx->cum_ack == rx->nsegs;
+}
+
+#define RUDP_RX_MALFORMED -1
+#define RUDP_RX_WRITE_FAILED -2
+#define RUDP_RX_CORRUPT -3
+
+static inline uint32_t rudp_segment_crc(const char *hdr, const char *data, uint32_t len) {
+    return crc32c(crc32c(0, hdr, 12), data, len);
+}
+
+// Feed the digest every segment below cum_ack it has not seen: seq from
+// the datagram, any others from the file.
+static inline int rudp_rx_digest_advance(rudp_rx_t *rx, uint32_t seq, const char *data, uint32_t len) {
+    while (rx->digest_next < rx->cum_ack) {
+        uint32_t s = rx->digest_next;
+        if (s == seq) {
+            bhash_update(&rx->digest, data, len);
+        } else {
+            uint64_t offset = (uint64_t)s * rx->seg_size;
+            size_t n = rx->file_size - offset < rx->seg_size ? (size_t)(rx->file_size - offset) : rx->seg_size;
+            if (rx->sync) rx->sync(rx->ctx);
+            if (pread(rx->fd, rx->scratch, n, (off_t)offset) != (ssize_t)n) return -1;
+            bhash_update(&rx->digest, rx->scratch, n);
+        }
+        rx->digest_next++;
+    }
+    return 0;
+}
+
+// Accept one FRAME_DATA payload. Returns 1 if an ACK should go out now,
+// 0 if it may be delayed, RUDP_RX_MALFORMED for a segment that does not
+// belong to this transfer, RUDP_RX_CORRUPT for one that fails its CRC and
+// RUDP_RX_WRITE_FAILED (errno set) on disk errors.
+static inline int rudp_rx_on_data(rudp_rx_t *rx, const char *payload, uint32_t len) {
+    if (len < RUDP_DATA_HDR_SIZE) return RUDP_RX_MALFORMED;
+    uint32_t seq = get_u32(payload);
+    uint64_t offset = get_u64(payload + 4);
+    uint32_t data_len = len - RUDP_DATA_HDR_SIZE;
+
+    if (seq >= rx->nsegs || offset != (uint64_t)seq * rx->seg_size) return RUDP_RX_MALFORMED;
+    uint64_t expect = rx->file_size - offset < rx->seg_size ? rx->file_size - offset : rx->seg_size;
+    if (data_len != expect) return RUDP_RX_MALFORMED;
+
+    const char *data = payload + RUDP_DATA_HDR_SIZE;
+    if (rudp_segment_crc(payload, data, data_len) != get_u32(payload + 12)) {
+        rx->corrupt++;
+        return RUDP_RX_CORRUPT;
+    }
+
+    uint64_t now = now_us();
+    rx->last_data_us = now;
+
+    // Duplicate: the sender missed our ACK, so repeat it right away
+    if (rudp_rx_has(rx, seq)) return 1;
+
+    uint32_t done = 0;
+    if (rx->write) {
+        rx->write(rx->ctx, data, data_len, offset);
+        done = data_len;
+    }
+    while (done < data_len) {
+        ssize_t n = pwrite(rx->fd, data + done, data_len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return RUDP_RX_WRITE_FAILED;
+        }
+        done += (uint32_t)n;
+    }
+
+    rx->have[seq >> 3] |= (uint8_t)(1 << (seq & 7));
+    rx->received_segs++;
+    rx->received_bytes += data_len;
+
+    int in_order = seq == rx->cum_ack;
+    while (rx->cum_ack < rx->nsegs && rudp_rx_has(rx, rx->cum_ack)) rx->cum_ack++;
+    if (rx->scratch && rudp_rx_digest_advance(rx, seq, data, data_len) < 0) return RUDP_RX_WRITE_FAILED;
+
+    rx->unacked++;
+    if (!in_order || rudp_rx_complete(rx) || rx->unacked >= RUDP_ACK_EVERY) return 1;
+    if (!rx->ack_due_us) rx->ack_due_us = now + RUDP_ACK_DELAY_US;
+    return 0;
+}
+
+// Fill in a FRAME_ACK payload: u32 cum_ack, u32 bitmap bits, u64 bytes
+// received, u64 receiver clock (us), then the SACK bitmap where bit i means
+// segment cum_ack + 1 + i has arrived.
+static inline size_t rudp_rx_build_ack(rudp_rx_t *rx, char *out) {
+    put_u32(out, rx->cum_ack);
+    put_u32(out + 4, RUDP_SACK_BITS);
+    put_u64(out + 8, rx->received_bytes);
+    put_u64(out + 16, now_us());
+    uint8_t *bits = (uint8_t *)out + RUDP_ACK_HDR_SIZE;
+    memset(bits, 0, RUDP_SACK_BITS / 8);
+    for (uint32_t i = 0; i < RUDP_SACK_BITS; i++) {
+        uint32_t seq = rx->cum_ack + 1 + i;
+        if (seq >= rx->nsegs) break;
+        if (rudp_rx_has(rx, seq)) bits[i >> 3] |= (uint8_t)(1 << (i & 7));
+    }
+    rx->unacked = 0;
+    rx->ack_due_us = 0;
+    return RUDP_ACK_SIZE;
+}
+
+// ---------------------------------------------------------------------------
+// Sender
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint64_t sent_us;
+    uint16_t tx_count;
+    uint8_t acked;
+} rudp_slot_t;
+
+typedef struct {
+    int sock;
+    const struct sockaddr_in *peer;
+    uint32_t stream_id;
+    int fd;
+    uint64_t file_size;
+    uint32_t seg_size;
+    uint32_t nsegs;
+
+    uint32_t window;
+    rudp_slot_t *slots;      // Indexed by seq % window
+    uint32_t base;           // Oldest unacknowledged segment
+    uint32_t next;           // Next segment never sent
+    uint32_t highest_sacked;
+    uint32_t sacked;         // Acked segments above base
+    uint64_t acked_bytes;
+    const uint8_t *present;  // Segments the receiver already has (resume), or NULL
+    uint64_t skipped_bytes;
+
+    cc_t cc;
+    pacer_t pacer;
+    uint32_t recovery_end;   // Losses below this seq belong to the current episode
+    uint64_t pace_wait_us;   // Set when the pacer held back new data
+    uint64_t rate_ref_bytes; // Receiver feedback at the start of the rate interval
+    uint64_t rate_ref_us;
+
+    // RFC 6298 retransmission timer state
+    uint64_t srtt_us;
+    uint64_t rttvar_us;
+    uint64_t rto_us;
+    uint64_t last_progress_us;
+
+    uint64_t retransmits;
+    uint64_t timeouts;
+
+    // Whole-file digest, fed as new segments are read (set verify after init)
+    int verify;
+    bhash_state_t digest;
+    uint32_t digest_next;
+
+    // Where segment data comes from instead of a preadv(), when set (the
+    // client's read engine, set after init); returns 0 or -1
+    int (*read)(void *ctx, char *dst, size_t len, uint64_t offset);
+    void *ctx;
+
+    // Datagrams queued for rudp_tx_flush(), each dgram_size bytes apart
+    char *batch;
+    uint32_t dgram_size;
+    int batch_count;
+    uint32_t batch_seq[RUDP_TX_BATCH];
+    uint32_t batch_len[RUDP_TX_BATCH];
+    int gso_segs;            // Datagrams per GSO send, 1 when GSO is off
+    struct mmsghdr msgs[RUDP_TX_BATCH];
+    struct iovec iov[RUDP_TX_BATCH];
+    int msg_first[RUDP_TX_BATCH];  // Batch index each message starts at
+    char cmsg[RUDP_TX_BATCH][UDP_GSO_CMSG_SPACE];
+
+    uint64_t dgrams_sent;
+    uint64_t send_calls;
+} rudp_tx_t;
+
+static inline int rudp_tx_init(rudp_tx_t *tx, int sock, const struct sockaddr_in *peer, uint32_t stream_id,
+                               int fd, uint64_t file_size, uint32_t seg_size, uint32_t window, const cc_ops_t *cc) {
+    if (seg_size == 0 || seg_size > UDP_MAX_PAYLOAD - RUDP_DATA_HDR_SIZE) return -1;
+    if (window == 0) window = 1;
+    if (window > RUDP_MAX_WINDOW) window = RUDP_MAX_WINDOW;
+
+    tx->sock = sock;
+    tx->peer = peer;
+    tx->stream_id = stream_id;
+    tx->fd = fd;
+    tx->file_size = file_size;
+    tx->seg_size = seg_size;
+    tx->nsegs = rudp_segment_count(file_size, seg_size);
+    tx->window = window;
+    tx->slots = (rudp_slot_t *)calloc(window, sizeof(rudp_slot_t));
+    tx->base = tx->next = 0;
+    tx->highest_sacked = 0;
+    tx->sacked = 0;
+    tx->acked_bytes = 0;
+    tx->present = NULL;
+    tx->skipped_bytes = 0;
+    cc_init(&tx->cc, cc, seg_size);
+    pacer_init(&tx->pacer, now_us());
+    tx->recovery_end = 0;
+    tx->pace_wait_us = 0;
+    tx->rate_ref_bytes = tx->rate_ref_us = 0;
+    tx->srtt_us = 0;
+    tx->rttvar_us = 0;
+    tx->rto_us = RUDP_INITIAL_RTO_US;
+    tx->last_progress_us = now_us();
+    tx->retransmits = tx->timeouts = 0;
+    tx->verify = 0;
+    bhash_init(&tx->digest);
+    tx->digest_next = 0;
+    tx->read = NULL;
+    tx->ctx = NULL;
+
+    tx->dgram_size = FRAME_HDR_SIZE + RUDP_DATA_HDR_SIZE + seg_size;
+    tx->batch = (char *)malloc((size_t)RUDP_TX_BATCH * tx->dgram_size);
+    tx->batch_count = 0;
+    tx->gso_segs = 1;
+    if (udp_gso_supported(sock)) {
+        tx->gso_segs = UDP_MAX_DATAGRAM / tx->dgram_size;
+        if (tx->gso_segs > UDP_MAX_GSO_SEGMENTS) tx->gso_segs = UDP_MAX_GSO_SEGMENTS;
+    }
+    tx->dgrams_sent = tx->send_calls = 0;
+    if (!tx->slots || !tx->batch) {
+        free(tx->slots);
+        free(tx->batch);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void rudp_tx_free(rudp_tx_t *tx) {
+    free(tx->slots);
+    free(tx->batch);
+    tx->slots = NULL;
+    tx->batch = NULL;
+}
+
+static inline int rudp_tx_done(const rudp_tx_t *tx) {
+    return tx->base == tx->nsegs;
+}
+
+static inline uint32_t rudp_tx_seg_len(const rudp_tx_t *tx, uint32_t seq) {
+    uint64_t offset = (uint64_t)seq * tx->seg_size;
+    uint64_t left = tx->file_size - offset;
+    return left < tx->seg_size ? (uint32_t)left : tx->seg_size;
+}
+
+static inline uint64_t rudp_tx_inflight(const rudp_tx_t *tx) {
+    return (uint64_t)(tx->next - tx->base - tx->sacked) * tx->seg_size;
+}
+
+// Whether every segment has been hashed; not before each was sent once.
+static inline int rudp_tx_digest_ready(const rudp_tx_t *tx) {
+    return tx->verify && tx->digest_next == tx->nsegs;
+}
+
+// Read the file data of every queued segment, one preadv() per run of
+// consecutive segments, and checksum each while it is in cache.
+static inline int rudp_tx_read_batch(rudp_tx_t *tx) {
+    int i = 0;
+    while (i < tx->batch_count) {
+        int run = 0;
+        size_t want = 0;
+        do {
+            char *p = tx->batch + (size_t)(i + run) * tx->dgram_size;
+            tx->iov[run].iov_base = p + FRAME_HDR_SIZE + RUDP_DATA_HDR_SIZE;
+            tx->iov[run].iov_len = tx->batch_len[i + run] - FRAME_HDR_SIZE - RUDP_DATA_HDR_SIZE;
+            want += tx->iov[run].iov_len;
+            run++;
+        } while (i + run < tx->batch_count && tx->batch_seq[i + run] == tx->batch_seq[i + run - 1] + 1);
+
+        off_t offset = (off_t)tx->batch_seq[i] * tx->seg_size;
+        if (tx->read) {
+            for (int j = 0; j < run; j++) {
+                if (tx->read(tx->ctx, (char *)tx->iov[j].iov_base, tx->iov[j].iov_len, (uint64_t)offset) < 0) return -1;
+                offset += (off_t)tx->iov[j].iov_len;
+            }
+        } else if (preadv(tx->fd, tx->iov, run, offset) != (ssize_t)want) {
+            return -1;
+        }
+        for (int j = 0; j < run; j++) {
+            char *hdr = tx->batch + (size_t)(i + j) * tx->dgram_size + FRAME_HDR_SIZE;
+            const char *data = (const char *)tx->iov[j].iov_base;
+            uint32_t len = (uint32_t)tx->iov[j].iov_len;
+            put_u32(hdr + 12, rudp_segment_crc(hdr, data, len));
+            if (tx->verify && tx->batch_seq[i + j] == tx->digest_next) {
+                bhash_update(&tx->digest, data, len);
+                tx->digest_next++;
+            }
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Describe batch entries from `first` on as messages: runs of full-sized
+// datagrams (the last one may be short) become one GSO send each.
+static inline int rudp_tx_build_msgs(rudp_tx_t *tx, int first) {
+    int m = 0;
+    for (int i = first; i < tx->batch_count; m++) {
+        int n = 1;
+        size_t len = tx->batch_len[i];
+        while (n < tx->gso_segs && i + n < tx->batch_count && tx->batch_len[i + n - 1] == tx->dgram_size) {
+            len += tx->batch_len[i + n];
+            n++;
+        }
+
+        struct msghdr *msg = &tx->msgs[m].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        tx->iov[m].iov_base = tx->batch + (size_t)i * tx->dgram_size;
+        tx->iov[m].iov_len = len;
+        msg->msg_name = (void *)tx->peer;
+        msg->msg_namelen = sizeof(*tx->peer);
+        msg->msg_iov = &tx->iov[m];
+        msg->msg_iovlen = 1;
+        if (n > 1) udp_set_gso(msg, tx->cmsg[m], (uint16_t)tx->dgram_size);
+        tx->msg_first[m] = i;
+        i += n;
+    }
+    return m;
+}
+
+// Put every queued segment on the wire.
+static inline int rudp_tx_flush(rudp_tx_t *tx) {
+    if (tx->batch_count == 0) return 0;
+    int count = tx->batch_count;
+    if (rudp_tx_read_batch(tx) < 0) {
+        tx->batch_count = 0;
+        return -1;
+    }
+
+    int nmsgs = rudp_tx_build_msgs(tx, 0);
+    int sent = 0;
+    while (sent < nmsgs) {
+        int r = sendmmsg(tx->sock, tx->msgs + sent, nmsgs - sent, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (tx->gso_segs > 1 && (errno == EIO || errno == EINVAL)) {
+                // No segmentation offload on this route: fall back to plain datagrams
+                tx->gso_segs = 1;
+                nmsgs = rudp_tx_build_msgs(tx, tx->msg_first[sent]);
+                sent = 0;
+                continue;
+            }
+            // A full socket buffer is congestion, not failure: the RTO resends the rest
+            if (errno == ENOBUFS || errno == EAGAIN) break;
+            tx->batch_count = 0;
+            return -1;
+        }
+        tx->send_calls++;
+        sent += r;
+    }
+    tx->dgrams_sent += count;
+    tx->batch_count = 0;
+    return 0;
+}
+
+// Queue one segment for the next flush.
+static inline int rudp_tx_queue(rudp_tx_t *tx, uint32_t seq) {
+    if (tx->batch_count == RUDP_TX_BATCH && rudp_tx_flush(tx) < 0) return -1;
+
+    uint64_t offset = (uint64_t)seq * tx->seg_size;
+    uint32_t len = rudp_tx_seg_len(tx, seq);
+    char *p = tx->batch + (size_t)tx->batch_count * tx->dgram_size;
+    frame_encode(p, FRAME_DATA, 0, RUDP_DATA_HDR_SIZE + len, tx->stream_id);
+    put_u32(p + FRAME_HDR_SIZE, seq);
+    put_u64(p + FRAME_HDR_SIZE + 4, offset);
+    tx->batch_seq[tx->batch_count] = seq;
+    tx->batch_len[tx->batch_count] = FRAME_HDR_SIZE + RUDP_DATA_HDR_SIZE + len;
+    tx->batch_count++;
+
+    rudp_slot_t *slot = &tx->slots[seq % tx->window];
+    slot->sent_us = now_us();
+    slot->tx_count++;
+    pacer_consume(&tx->pacer, tx->cc.pacing_rate, len);
+    return 0;
+}
+
+// Send one segment right away.
+static inline int rudp_tx_transmit(rudp_tx_t *tx, uint32_t seq) {
+    if (rudp_tx_queue(tx, seq) < 0) return -1;
+    return rudp_tx_flush(tx);
+}
+
+// Send FRAME_COMMIT with the digest; again whenever the verdict is late.
+static inline int rudp_tx_commit(rudp_tx_t *tx) {
+    char payload[16];
+    bhash_t h = bhash_final(&tx->digest);
+    bhash_encode(payload, &h);
+    return sendto_frame(tx->sock, tx->peer, FRAME_COMMIT, 0, tx->stream_id, payload, sizeof(payload));
+}
+
+// Send new segments while the congestion window, the slot window and the
+// pacer all have room. Segments the receiver already has are passed over
+// without using any of them.
+static inline int rudp_tx_fill_window(rudp_tx_t *tx) {
+    tx->pace_wait_us = 0;
+    while (tx->next < tx->nsegs && tx->next - tx->base < tx->window) {
+        uint32_t len = rudp_tx_seg_len(tx, tx->next);
+        if (tx->present && ((tx->present[tx->next >> 3] >> (tx->next & 7)) & 1)) {
+            rudp_slot_t *slot = &tx->slots[tx->next % tx->window];
+            slot->tx_count = 0;
+            slot->acked = 1;
+            if (tx->next == tx->base) tx->base++;  // Nothing in flight below it
+            else tx->sacked++;
+            tx->skipped_bytes += len;
+            tx->next++;
+            continue;
+        }
+        if (rudp_tx_inflight(tx) + len > tx->cc.cwnd) break;
+        if (!pacer_allow(&tx->pacer, tx->cc.pacing_rate, tx->seg_size, len, now_us())) {
+            tx->pace_wait_us = pacer_delay_us(&tx->pacer, tx->cc.pacing_rate, len);
+            break;
+        }
+
+        rudp_slot_t *slot = &tx->slots[tx->next % tx->window];
+        slot->tx_count = 0;
+        slot->acked = 0;
+        if (rudp_tx_queue(tx, tx->next) < 0) return -1;
+        tx->next++;
+    }
+    return rudp_tx_flush(tx);
+}
+
+static inline void rudp_tx_rtt_sample(rudp_tx_t *tx, uint64_t rtt) {
+    if (tx->srtt_us == 0) {
+        tx->srtt_us = rtt;
+        tx->rttvar_us = rtt / 2;
+    } else {
+        uint64_t delta = tx->srtt_us > rtt ? tx->srtt_us - rtt : rtt - tx->srtt_us;
+        tx->rttvar_us = (3 * tx->rttvar_us + delta) / 4;
+        tx->srtt_us = (7 * tx->srtt_us + rtt) / 8;
+    }
+    uint64_t rto = tx->srtt_us + (4 * tx->rttvar_us > 1000 ? 4 * tx->rttvar_us : 1000);
+    if (rto < RUDP_MIN_RTO_US) rto = RUDP_MIN_RTO_US;
+    if (rto > RUDP_MAX_RTO_US) rto = RUDP_MAX_RTO_US;
+    tx->rto_us = rto;
+}
+
+// Returns the bytes newly acknowledged by marking seq.
+static inline uint32_t rudp_tx_mark_acked(rudp_tx_t *tx, uint32_t seq, uint64_t now, uint64_t *rtt) {
+    rudp_slot_t *slot = &tx->slots[seq % tx->window];
+    if (slot->acked) return 0;
+    slot->acked = 1;
+    uint32_t len = rudp_tx_seg_len(tx, seq);
+    tx->acked_bytes += len;
+    if (slot->tx_count == 1) *rtt = now - slot->sent_us;  // Karn: skip retransmitted segments
+    return len;
+}
+
+// Delivery rate as measured by the receiver, sampled about once per
+// min RTT so a single ACK's jitter does not dominate. 0 if no sample yet.
+static inline double rudp_tx_rate_sample(rudp_tx_t *tx, uint64_t rx_bytes, uint64_t rx_us) {
+    if (!tx->rate_ref_us || rx_us < tx->rate_ref_us || rx_bytes < tx->rate_ref_bytes) {
+        tx->rate_ref_bytes = rx_bytes;
+        tx->rate_ref_us = rx_us;
+        return 0;
+    }
+    uint64_t interval = tx->cc.min_rtt_us > 1000 ? tx->cc.min_rtt_us : 1000;
+    uint64_t dt = rx_us - tx->rate_ref_us;
+    if (dt < interval) return 0;
+
+    double rate = (double)(rx_bytes - tx->rate_ref_bytes) * 1e6 / dt;
+    tx->rate_ref_bytes = rx_bytes;
+    tx->rate_ref_us = rx_us;
+    return rate;
+}
+
+// Apply one FRAME_ACK payload. Returns -1 if it is malformed.
+static inline int rudp_tx_on_ack(rudp_tx_t *tx, const char *payload, uint32_t len) {
+    if (len < RUDP_ACK_HDR_SIZE) return -1;
+    uint32_t cum_ack = get_u32(payload);
+    uint32_t nbits = get_u32(payload + 4);
+    uint64_t rx_bytes = get_u64(payload + 8);
+    uint64_t rx_us = get_u64(payload + 16);
+    if (cum_ack > tx->next || len < RUDP_ACK_HDR_SIZE + (nbits + 7) / 8) return -1;
+
+    uint64_t now = now_us();
+    uint64_t rtt = 0;
+    uint64_t newly_acked = 0;
+
+    for (uint32_t seq = tx->base; seq < cum_ack; seq++) {
+        uint32_t acked = rudp_tx_mark_acked(tx, seq, now, &rtt);
+        if (acked) newly_acked += acked;
+        else tx->sacked--;  // Was SACKed earlier, now below base
+    }
+    if (cum_ack > tx->base) {
+        tx->base = cum_ack;
+        tx->last_progress_us = now;
+    }
+
+    const uint8_t *bits = (const uint8_t *)payload + RUDP_ACK_HDR_SIZE;
+    for (uint32_t i = 0; i < nbits; i++) {
+        uint32_t seq = cum_ack + 1 + i;
+        if (seq >= tx->next) break;
+        // A reordered, stale ACK can describe segments below the window
+        // whose slots now belong to newer segments
+        if (seq < tx->base) continue;
+        if (!((bits[i >> 3] >> (i & 7)) & 1)) continue;
+        uint32_t acked = rudp_tx_mark_acked(tx, seq, now, &rtt);
+        if (acked) {
+            newly_acked += acked;
+            tx->sacked++;
+        }
+        if (seq > tx->highest_sacked) tx->highest_sacked = seq;
+    }
+
+    if (rtt) rudp_tx_rtt_sample(tx, rtt);
+
+    cc_ack_t ev;
+    ev.now_us = now;
+    ev.acked_bytes = newly_acked;
+    ev.rtt_us = rtt;
+    ev.delivery_rate = rudp_tx_rate_sample(tx, rx_bytes, rx_us);
+    ev.inflight_bytes = rudp_tx_inflight(tx);
+    if (newly_acked || ev.delivery_rate) tx->cc.ops->on_ack(&tx->cc, &ev);
+    return 0;
+}
+
+// Retransmit segments whose timer expired or that were SACKed past.
+// Returns the microseconds until the next retransmission deadline, or -1
+// on a send failure.
+static inline int64_t rudp_tx_check_loss(rudp_tx_t *tx) {
+    uint64_t now = now_us();
+    uint64_t next_deadline = now + tx->rto_us;
+    int timed_out = 0;
+
+    for (uint32_t seq = tx->base; seq < tx->next; seq++) {
+        rudp_slot_t *slot = &tx->slots[seq % tx->window];
+        if (slot->acked) continue;
+
+        uint64_t deadline = slot->sent_us + tx->rto_us;
+        int lost = now >= deadline;
+        if (lost) {
+            timed_out = 1;
+        } else if (slot->tx_count == 1 && tx->highest_sacked >= seq + RUDP_DUPTHRESH) {
+            lost = 1;  // Fast retransmit, once; after that only the RTO resends it
+        }
+
+        if (lost) {
+            // Tell the controller once per episode, not once per segment
+            if (!timed_out && seq >= tx->recovery_end) {
+                tx->cc.ops->on_loss(&tx->cc, now);
+                tx->recovery_end = tx->next;
+            }
+            if (rudp_tx_queue(tx, seq) < 0) return -1;
+            tx->retransmits++;
+            deadline = slot->sent_us + tx->rto_us;
+        }
+        if (deadline < next_deadline) next_deadline = deadline;
+    }
+    if (rudp_tx_flush(tx) < 0) return -1;
+
+    if (timed_out) {
+        tx->timeouts++;
+        tx->rto_us = tx->rto_us * 2 > RUDP_MAX_RTO_US ? RUDP_MAX_RTO_US : tx->rto_us * 2;
+        tx->cc.ops->on_timeout(&tx->cc, now);
+        tx->recovery_end = tx->next;
+    }
+    if (tx->pace_wait_us && now + tx->pace_wait_us < next_deadline) next_deadline = now + tx->pace_wait_us;
+    return next_deadline > now ? (int64_t)(next_deadline - now) : 0;
+}
+
+#endif
@@ -0,0 +1,101 @@
+// What the TCP and UDP servers share: the directories files are saved in,
+// the rule for usernames, and the tickets that let a client logged in over
+// TCP send its files over UDP.
+//
+// A ticket is asked for on the TCP connection (FRAME_BULK) and redeemed
+// from the client's UDP socket (FRAME_BIND), which then counts as logged
+// in under the same name without a FRAME_USER of its own. Tickets are
+// random and expire after BULK_TICKET_TTL_US. The first address to redeem
+// one owns it; a retransmitted FRAME_BIND from there succeeds again, from
+// anywhere else it fails. The two sockets of a client may land on
+// different workers, so the table is locked, but it is touched once per
+// login, never per datagram.
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+
+#define USERNAME_MAX 32
+#define BULK_TICKETS 1024                // Outstanding at once; the oldest is overwritten
+#define BULK_TICKET_TTL_US 30000000ULL
+
+static inline void save_dir_create(const char *dir) {
+    if (mkdir(dir, 0755) == 0) {
+        printf("Directory '%s' created successfully.\n", dir);
+    } else if (errno != EEXIST) {
+        printf("Failed to create directory '%s'\n", dir);
+    }
+}
+
+// Copy the username of a FRAME_USER into name, cut to cap. Returns -1 for
+// an empty name or one with control characters, which would garble the log.
+static inline int login_name(const char *payload, uint32_t len, char *name, size_t cap) {
+    size_t n = len < cap - 1 ? len : cap - 1;
+    if (n == 0) return -1;
+    for (size_t i = 0; i < n; i++) {
+        if ((unsigned char)payload[i] < 0x20 || payload[i] == 0x7f) return -1;
+    }
+    memcpy(name, payload, n);
+    name[n] = '\0';
+    return 0;
+}
+
+typedef struct {
+    uint64_t token;          // 0: free
+    uint64_t expires_us;
+    char username[USERNAME_MAX];
+    int redeemed;
+    struct sockaddr_in peer; // Who redeemed it
+} bulk_ticket_t;
+
+static bulk_ticket_t bulk_tickets[BULK_TICKETS];
+static uint32_t bulk_next;
+static pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A ticket for username, or 0 if no random bytes could be had.
+static inline uint64_t bulk_grant(const char *username) {
+    uint64_t token = 0;
+    if (getrandom(&token, sizeof(token), 0) != (ssize_t)sizeof(token)) return 0;
+    if (token == 0) token = 1;
+    pthread_mutex_lock(&bulk_lock);
+    bulk_ticket_t *t = &bulk_tickets[bulk_next++ % BULK_TICKETS];
+    memset(t, 0, sizeof(*t));
+    t->token = token;
+    t->expires_us = now_us() + BULK_TICKET_TTL_US;
+    snprintf(t->username, sizeof(t->username), "%s", username);
+    pthread_mutex_unlock(&bulk_lock);
+    return token;
+}
+
+// The username a ticket was granted to, if it is valid for peer.
+static inline int bulk_redeem(uint64_t token, const struct sockaddr_in *peer, char *username, size_t cap) {
+    int found = -1;
+    if (token == 0) return -1;
+    uint64_t now = now_us();
+    pthread_mutex_lock(&bulk_lock);
+    for (int i = 0; i < BULK_TICKETS; i++) {
+        bulk_ticket_t *t = &bulk_tickets[i];
+        if (t->token != token || now >= t->expires_us) continue;
+        if (t->redeemed && (t->peer.sin_addr.s_addr != peer->sin_addr.s_addr || t->peer.sin_port != peer->sin_port)) {
+            break;
+        }
+        t->redeemed = 1;
+        t->peer = *peer;
+        snprintf(username, cap, "%s", t->username);
+        found = 0;
+        break;
+    }
+    pthread_mutex_unlock(&bulk_lock);
+    return found;
+}
+
+#endif
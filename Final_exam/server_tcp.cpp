@@ -1,188 +1,2653 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <process.h>  // For _beginthreadex
-#include <direct.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "resume.h"
+#include "delta.h"
+#include "uring.h"
+#include "pool.h"
+#include "metrics.h"
+#include "room.h"
+#include "compress.h"
+#include "batch.h"
+#include "tcptune.h"
+#include "stage.h"
+#include "udp_server.h"
+#include "admit.h"
 
 #define SERVERPORT 9000
 #define BUFSIZE 65536
-#define SAVE_DIR "tcp_received\\"
-#define MAX_USERNAME 32
+#define SAVE_DIR "tcp_received/"
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define MAX_STRIPED 64
+#define RESUME_CHUNK_SIZE (1024 * 1024)  // Manifest granularity of resumable uploads
+#define CONN_MEM_MAX_KB 8192              // Default memory limit per connection (-m)
+#define METRICS_PORT 9100                 // Stats endpoint on 127.0.0.1 (-M)
+#define BATCH_WRITERS 4                   // Threads creating the files of batch uploads (-W)
+
+// io_uring backend, per worker
+#define URING_ENTRIES 512
+#define URING_BUFS 256               // Provided receive buffers (power of two)
+#define URING_BUF_SIZE 65536
+#define URING_FILE_SLOTS 65536       // Fixed files (a socket and a file per connection), at most RLIMIT_NOFILE
+#define URING_WRITES_PER_CONN 8      // File writes in flight per connection
+#define URING_REARM_BUFS 16          // Free buffers before starved receives are re-armed
+#define URING_CONN_BUFS 32           // Queued buffers before a connection's receive is paused
+
+// A striped upload (FILE_FLAG_STRIPED, see protocol.h). Its control
+// connection and all of its data connections hold a reference; the data
+// connections may live on any worker, so the registry is locked and the
+// received count is updated atomically.
+typedef struct {
+    uint64_t id;  // Random, so only the uploader can attach to it
+    int fd;
+    int refs;
+    int committed;
+    char full_path[512];
+    long long file_size;
+    long long received;
+    int streams;
+    uint64_t start_us;
+    sched_user_t *user;  // Whose bandwidth share its data connections use (admit.h)
+} striped_t;
+
+static striped_t *striped_uploads[MAX_STRIPED];
+static pthread_mutex_t striped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A delta upload (FILE_FLAG_DELTA, see delta.h): the file is rebuilt into
+// a hidden temporary from blocks of the old copy and literal bytes, hashed
+// as it is written, and renamed over the old copy once the hash checks out.
+typedef struct {
+    int basis_fd;            // The old copy, or -1 if there was none
+    int out_fd;
+    char tmp_path[512];
+    uint32_t block_size;
+    uint32_t nblocks;
+    long long file_size;
+    long long written;
+    long long copied;        // Bytes taken from the old copy
+    long long literal;       // Bytes sent by the client
+    bhash_state_t hash;      // Whole rebuilt file, checked at commit
+    delta_builder_t index;   // Its block index, saved for the next delta
+    uint64_t start_us;
+} delta_t;
+
+// A file write submitted through io_uring. Writes complete in any order
+// but are accounted in submission order, so progress always describes a
+// contiguous prefix of the body.
+typedef struct {
+    uint16_t bid;        // Receive buffer the bytes are in
+    uint32_t off;        // Not yet written part of it
+    uint32_t len;
+    uint32_t total;      // Whole write, for accounting
+    uint64_t file_off;
+    uint64_t submit_us;  // For the write latency histogram
+    int done;
+} uring_write_t;
+
+// Per-connection protocol phase: the first frame must be FRAME_USER,
+// then the connection alternates between frames and raw file bodies.
+typedef enum {
+    CONN_USER,
+    CONN_CMD,
+    CONN_FILE
+} conn_state_t;
+
+typedef struct conn {
+    int fd;
+    conn_state_t state;
+    char addr[INET_ADDRSTRLEN];
+    char username[USERNAME_MAX];
+    int authed;  // Logged in with FRAME_USER, may ask for a bulk channel
+    ring_t in;  // Inbound bytes not yet parsed into frames
+
+    // Active upload (CONN_FILE only): a whole file, or one chunk of a
+    // striped or resumable upload, written starting at body_off
+    int file_fd;
+    int pipe_fd[2];  // splice() staging pipe, zero-copy mode only
+    char full_path[512];
+    long long body_off;
+    long long file_size;
+    long long total_received;
+    uint32_t file_stream;
+    uint64_t xfer_start_us;  // Upload this connection announced, 0 if none
+    uint64_t progress_us;    // Last progress line
+    int codecs;              // CODEC_FLAG()s agreed on at login
+    int compressed;          // The body arrives as FRAME_BLOCKs (compress.h)
+    long long wire_bytes;    // ... taking this many bytes
+    verify_t *verify;        // Checksums of a verified upload, kept until FRAME_COMMIT (checksum.h)
+    stage_file_t *stage;     // Body written behind by the worker's writer thread (stage.h), epoll only
+    int stage_paused;        // Receive stopped until the writer returns a buffer or finishes the file
+    struct conn *stage_next; // Worker's list of paused connections
+
+    // Admission (admit.h): the user an admitted upload is charged to, or
+    // the wait of a queued one and a copy of the frame that announced it
+    sched_user_t *sched_user;    // Also on a striped upload's data connections, for -B
+    uint64_t sched_size;
+    int sched_admitted;
+    sched_wait_t *sched_wait;
+    frame_hdr_t sched_hdr;
+    char *sched_frame;
+    int sched_paused;            // -B: receive stopped until the next round
+    uint64_t sched_pause_us;
+    struct conn *sched_next;     // Worker's list of paused connections
 
-#pragma comment(lib, "ws2_32.lib")
+    // Striped upload this connection controls, or delivers chunks for
+    striped_t *striped;
+    int data_stream;  // Opened with FRAME_ATTACH
+    long long stream_bytes;
+    uint64_t stream_start_us;
+
+    // Resumable upload (FRAME_RESUME) this connection is sending chunks
+    // for; full_path is where it goes once complete
+    resume_t *resume;
+
+    // Delta upload this connection is sending operations for; full_path is
+    // the old copy and where the new one goes
+    delta_t *delta;
+
+    // Batch upload whose packs this connection is sending (batch.h)
+    batch_t *batch;
+
+    // Pending outbound bytes that did not fit in the socket buffer (pooled)
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+
+    // io_uring backend: fixed-file slots, received buffers not consumed yet
+    // (a queue linked through the worker's buffer table), and file writes
+    // in flight. The connection is freed once no operation is outstanding.
+    int sock_slot;
+    int file_slot;
+    int slot_file_fd;    // File currently in file_slot, or -1
+    int pending;         // Operations whose last completion has not arrived
+    int closing;
+    int recv_armed;
+    int pollout_armed;
+    int starved;         // Receive ran out of buffers, re-arm later
+    int paused;          // Receive cancelled until the queue drains
+    int q_head;
+    int q_tail;
+    int q_count;
+    uring_write_t writes[URING_WRITES_PER_CONN];
+    unsigned wr_head;
+    unsigned wr_count;
+    long long wr_bytes;  // Body bytes in flight
+
+    size_t mem_peak;     // Most memory held at once (conn_mem)
+
+    // Socket tuning (tcptune.h): the role whose profile is applied, the
+    // retransmissions already counted and when TCP_INFO was last read
+    int tcp_role;
+    uint32_t tcp_retrans;
+    uint64_t tcp_sample_us;
+
+    // Chat room membership and the frames queued for us by its members
+    sub_t *sub;
+    int room_blocked;    // The socket filled up while writing them
+} conn_t;
 
 typedef struct {
-    SOCKET client_sock;
-    struct sockaddr_in client_addr;
-} client_info_t;
+    int id;
+    int epfd;
+    int listen_fd;
+    pthread_t thread;
+    char buf[BUFSIZE];  // Shared by every connection on this worker
+    room_inbox_t inbox; // Connections with room frames to write
+    batch_inbox_t batches;  // Batch uploads ready for their reply, woken by the same eventfd
+    stage_t stage;          // Write-behind buffers and writer thread, which wakes the same eventfd
+    conn_t *stage_paused;   // Connections waiting for it
+    udp_shard_t *udp;       // -u: the UDP shard this thread also serves (udp_server.h)
+    sched_inbox_t admits;   // Queued uploads now admitted, woken by the same eventfd
+    conn_t *sched_paused;   // Connections waiting for the next bandwidth round
+
+    // io_uring backend. The receive buffers are both a provided-buffer
+    // ring for multishot recv and fixed buffer 0 for WRITE_FIXED, so file
+    // bodies go from socket to disk without another copy.
+    uring_t ring;
+    uring_bufs_t bufs;
+    char *pool;
+    int *buf_refs;       // Queue entry plus writes using each buffer
+    int *buf_next;       // Per-connection queue links
+    uint32_t *buf_off;
+    uint32_t *buf_len;
+    int bufs_free;
+    int *free_slots;
+    int nfree_slots;
+    int nslots;
+    int timer_fd;        // UDP timers and bandwidth rounds (worker_arm_timer)
+    uint64_t timer_due;
+} worker_t;
+
+// Memory one connection may hold (conn_mem) before it is disconnected.
+static size_t conn_mem_max = CONN_MEM_MAX_KB * 1024ULL;
+
+// Receive file bodies with splice() socket->pipe->file instead of
+// recv()+write() through a user-space buffer.
+static int zero_copy = 0;
+
+// Event loop: io_uring when the kernel allows it, otherwise epoll.
+static int use_uring = 1;
+
+// Serve UDP on the same port from the same workers (-u), which lets a
+// client logged in here send its files over UDP (FRAME_BULK).
+static int serve_udp = 0;
+
+// Write-behind buffers per epoll worker (0 writes inline), and whether the
+// writer leaves received files in the page cache.
+static int stage_depth = STAGE_DEPTH;
+static int stage_keep_cache = 0;
 
 void err_quit(const char *msg) {
-    fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
     exit(1);
 }
 
-void create_save_directory() {
-    if (_mkdir(SAVE_DIR) == 0) {
-        printf("Directory '%s' created successfully.\n", SAVE_DIR);
-    } else if (errno != EEXIST) {
-        printf("Failed to create directory '%s'\n", SAVE_DIR);
+// Lift the soft fd limit to the hard limit so the number of connections
+// is bounded by descriptors rather than by anything in this process.
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int create_listener() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        err_quit("Socket creation failed");
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        err_quit("SO_REUSEPORT failed");
+    }
+
+    struct sockaddr_in serveraddr = {0};
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons(SERVERPORT);
+
+    if (bind(fd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        err_quit("Bind failed");
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        err_quit("Listen failed");
     }
+    return fd;
+}
+
+// io_uring user_data: the connection pointer with the operation in the
+// low bits (allocations are 16-byte aligned). Writes carry their slot.
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_POLLOUT 3
+#define OP_CANCEL 4
+#define OP_WAKE 5
+#define OP_UDP 6          // -u: the UDP shard's socket
+#define OP_TIMER 7        // The worker's timer_fd
+#define OP_WRITE 8
+#define OP_MASK 15
+
+static inline uint64_t op_data(conn_t *c, int op) {
+    return (uint64_t)(uintptr_t)c | (uint64_t)op;
+}
+
+void uring_arm_recv(worker_t *w, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return;
+    uring_prep_recv_multishot(sqe, (unsigned)c->sock_slot, w->bufs.bgid, op_data(c, OP_RECV));
+    c->recv_armed = 1;
+    c->starved = 0;
+    c->pending++;
 }
 
-void receive_file(SOCKET sock, const char *filename, long long file_size) {
-    FILE *file;
-    char buf[BUFSIZE];
-    int bytes_received;
-    long long total_received = 0;
+// Wait for room in the socket buffer; the uring counterpart of EPOLLOUT.
+void uring_arm_pollout(worker_t *w, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return;
+    uring_prep_poll(sqe, (unsigned)c->sock_slot, POLLOUT, op_data(c, OP_POLLOUT));
+    c->pollout_armed = 1;
+    c->pending++;
+}
 
-    const char *base_filename = strrchr(filename, '\\');
-    if (base_filename) base_filename++;
-    else base_filename = filename;
+// Drop one use of a receive buffer; the last one gives it back to the kernel.
+void uring_buf_release(worker_t *w, int bid) {
+    if (--w->buf_refs[bid] > 0) return;
+    uring_bufs_add(&w->bufs, (uint16_t)bid);
+    w->bufs_free++;
+}
 
-    char full_path[512];
-    snprintf(full_path, sizeof(full_path), "%s%s", SAVE_DIR, base_filename);
+// Replies or room frames are waiting for room in the socket buffer.
+static inline int conn_backlogged(const conn_t *c) {
+    return c->out_len > c->out_off || c->room_blocked;
+}
 
-    file = fopen(full_path, "wb");
-    if (!file) {
-        printf("Error: Cannot create file '%s'\n", full_path);
-        send(sock, "ERROR", 5, 0);
+void conn_update_events(worker_t *w, conn_t *c) {
+    if (use_uring) {
+        // Receives keep landing in the connection's queue; it just stops
+        // being drained while replies are backed up
+        if (conn_backlogged(c) && !c->pollout_armed) uring_arm_pollout(w, c);
         return;
     }
+    struct epoll_event ev = {0};
+    // Stop reading while replies are backed up so a client that never
+    // reads cannot make us buffer without bound.
+    if (conn_backlogged(c)) {
+        ev.events = EPOLLOUT;
+    } else if (!c->stage_paused && !c->sched_paused && !c->sched_wait) {
+        ev.events = EPOLLIN;
+    }
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
 
-    send(sock, "READY", 5, 0);
-    printf("Receiving file: %s (Size: %lld bytes)\n", full_path, file_size);
+void close_pipe(conn_t *c) {
+    if (c->pipe_fd[0] >= 0) {
+        close(c->pipe_fd[0]);
+        close(c->pipe_fd[1]);
+        c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    }
+}
 
-    while (total_received < file_size) {
-        int remaining = (int)(file_size - total_received < BUFSIZE ? file_size - total_received : BUFSIZE);
-        bytes_received = recv(sock, buf, remaining, 0);
-        if (bytes_received <= 0) break;
-        fwrite(buf, 1, bytes_received, file);
-        total_received += bytes_received;
-        printf("Received %lld/%lld bytes (%.2f%%)\r", total_received, file_size, ((double)total_received / file_size) * 100);
+// Create and register a striped upload with its file preallocated.
+striped_t *striped_create(const char *filename, long long file_size) {
+    striped_t *t = (striped_t *)calloc(1, sizeof(striped_t));
+    if (!t) return NULL;
+    snprintf(t->full_path, sizeof(t->full_path), "%s%s", SAVE_DIR, filename);
+    t->fd = open(t->full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0) {
+        printf("Error: Cannot create file '%s'\n", t->full_path);
+        free(t);
+        return NULL;
+    }
+    if (file_size > 0 && fallocate(t->fd, 0, 0, file_size) < 0) {
+        // Not every filesystem can reserve blocks; at least set the size
+        if (ftruncate(t->fd, file_size) < 0) {
+            printf("Error: Cannot preallocate '%s': %s\n", t->full_path, strerror(errno));
+            close(t->fd);
+            remove(t->full_path);
+            free(t);
+            return NULL;
+        }
+    }
+    t->file_size = file_size;
+    t->refs = 1;
+    t->start_us = now_us();
+    if (getrandom(&t->id, sizeof(t->id), 0) != (ssize_t)sizeof(t->id) || t->id == 0) {
+        printf("Error: No transfer id for '%s'\n", filename);
+        close(t->fd);
+        remove(t->full_path);
+        free(t);
+        return NULL;
     }
 
-    fclose(file);
-    if (total_received == file_size) {
-        printf("\nFile received successfully: %s\n", full_path);
-        send(sock, "FILE_OK", 7, 0);
-    } else {
-        printf("\nFile transfer incomplete\n");
-        send(sock, "FILE_FAIL", 9, 0);
-        remove(full_path);
+    pthread_mutex_lock(&striped_lock);
+    int slot = -1;
+    for (int i = 0; i < MAX_STRIPED; i++) {
+        if (!striped_uploads[i]) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0) striped_uploads[slot] = t;
+    pthread_mutex_unlock(&striped_lock);
+
+    if (slot < 0) {
+        printf("Too many striped uploads, rejecting %s\n", filename);
+        close(t->fd);
+        remove(t->full_path);
+        free(t);
+        return NULL;
     }
+    return t;
 }
 
-unsigned __stdcall client_handler(void *data) {
-    client_info_t *info = (client_info_t *)data;
-    SOCKET client_sock = info->client_sock;
-    struct sockaddr_in clientaddr = info->client_addr;
-    free(info);  // Free the allocated structure
+striped_t *striped_attach(uint64_t id) {
+    striped_t *t = NULL;
+    pthread_mutex_lock(&striped_lock);
+    for (int i = 0; i < MAX_STRIPED; i++) {
+        if (striped_uploads[i] && striped_uploads[i]->id == id && !striped_uploads[i]->committed) {
+            t = striped_uploads[i];
+            t->refs++;
+            t->streams++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&striped_lock);
+    return t;
+}
 
-    char addr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &clientaddr.sin_addr, addr, sizeof(addr));
-    
-    char username[MAX_USERNAME] = "[unknown]";
-    char buf[BUFSIZE];
-
-    // First message should be username
-    int retval = recv(client_sock, buf, BUFSIZE - 1, 0);
-    if (retval > 0) {
-        buf[retval] = '\0';
-        if (strncmp(buf, "USER:", 5) == 0) {
-            strncpy(username, buf + 5, MAX_USERNAME - 1);
-            username[MAX_USERNAME - 1] = '\0';
-            printf("Client identified as: %s (%s)\n", username, addr);
-            send(client_sock, "USER_OK", 7, 0);
-        } else {
-            strcpy(username, addr);
-            send(client_sock, "USER_FAIL", 9, 0);
+// Drop one reference; the last one closes the file, and removes it unless
+// the upload was committed.
+void striped_release(striped_t *t) {
+    pthread_mutex_lock(&striped_lock);
+    int last = --t->refs == 0;
+    if (last) {
+        for (int i = 0; i < MAX_STRIPED; i++) {
+            if (striped_uploads[i] == t) striped_uploads[i] = NULL;
         }
     }
+    pthread_mutex_unlock(&striped_lock);
+    if (!last) return;
 
-    while (1) {
-        retval = recv(client_sock, buf, BUFSIZE - 1, 0);
-        if (retval <= 0) break;
-
-        buf[retval] = '\0';
-
-        if (strncmp(buf, "FILE:", 5) == 0) {
-            char *last_colon = strrchr(buf, ':');
-            if (!last_colon) continue;
-            
-            long long file_size = atoll(last_colon + 1);
-            *last_colon = '\0';
-            char *filename = buf + 5;
-            
-            printf("[%s] File transfer: %s (%lld bytes)\n", username, filename, file_size);
-            receive_file(client_sock, filename, file_size);
+    close(t->fd);
+    if (!t->committed) {
+        printf("Striped upload incomplete: %s\n", t->full_path);
+        remove(t->full_path);
+    }
+    free(t);
+}
+
+void delta_free(delta_t *d) {
+    if (d->basis_fd >= 0) close(d->basis_fd);
+    close(d->out_fd);
+    delta_index_free(&d->index.ix);
+    free(d);
+}
+
+// Memory held for a connection: its state, frame ring and outbound
+// buffer, receive buffers waiting in its io_uring queue, and the bitmap or
+// block index of a resumable or delta upload, and the CRC lists of a
+// verified one.
+size_t conn_mem(const conn_t *c) {
+    size_t n = pbuf_cap(c) + c->in.size + (c->out ? pbuf_cap(c->out) : 0);
+    n += (size_t)c->q_count * URING_BUF_SIZE;
+    if (c->resume) n += sizeof(resume_t) + resume_bitmap_size(c->resume);
+    if (c->delta) n += sizeof(delta_t) + ((size_t)c->delta->index.cap + 1) * sizeof(delta_sig_t);
+    if (c->verify) n += verify_mem(c->verify);
+    return n;
+}
+
+// Measure the connection after it grew and keep its peak.
+size_t conn_mem_update(conn_t *c) {
+    size_t n = conn_mem(c);
+    if (n > c->mem_peak) c->mem_peak = n;
+    return n;
+}
+
+// Add the connection's TCP_INFO to its profile's totals.
+void conn_tcp_sample(conn_t *c) {
+    tcp_sample_t s;
+    if (c->fd < 0 || tcp_sample(c->fd, &s) < 0) return;
+    tcp_record(c->tcp_role, &s, s.retrans - c->tcp_retrans);
+    c->tcp_retrans = s.retrans;
+    c->tcp_sample_us = now_us();
+}
+
+// The same, at most once per TCP_SAMPLE_INTERVAL_US while it is busy.
+void conn_tcp_tick(conn_t *c) {
+    if (now_us() - c->tcp_sample_us >= TCP_SAMPLE_INTERVAL_US) conn_tcp_sample(c);
+}
+
+// Apply another role's profile; what the connection did so far counts
+// towards the previous one.
+void conn_set_role(conn_t *c, int role) {
+    static int warned[TCP_ROLES];
+    if (c->fd < 0 || c->tcp_role == role) return;
+    if (c->tcp_sample_us) conn_tcp_sample(c);
+    c->tcp_role = role;
+    int failed = tcp_apply(c->fd, role);
+    if (failed && !__atomic_exchange_n(&warned[role], 1, __ATOMIC_RELAXED)) {
+        printf("Warning: %d socket option(s) of profile '%s' not applied: %s\n", failed, tcp_profiles[role].name,
+               strerror(errno));
+    }
+}
+
+// Give back the connection's transfer slot, or its place in the queue.
+// ok counts the upload against its user's quota.
+void conn_sched_release(conn_t *c, int ok) {
+    if (c->sched_wait) {
+        sched_cancel(c->sched_wait);
+        c->sched_wait = NULL;
+        free(c->sched_frame);
+        c->sched_frame = NULL;
+    }
+    if (!c->sched_admitted) return;
+    sched_release(c->sched_user, c->sched_size, ok);
+    c->sched_admitted = 0;
+    if (!c->data_stream) c->sched_user = NULL;
+}
+
+// An upload announced on this connection was accepted.
+void transfer_begin(conn_t *c) {
+    c->xfer_start_us = now_us();
+    metrics_add(M_TRANSFERS_STARTED, 1);
+    conn_set_role(c, TCP_ROLE_BULK);
+}
+
+void transfer_end(conn_t *c, int ok) {
+    if (!c->xfer_start_us) return;
+    metrics_add(ok ? M_TRANSFERS_OK : M_TRANSFERS_FAILED, 1);
+    metrics_record(H_TRANSFER_US, now_us() - c->xfer_start_us);
+    c->xfer_start_us = 0;
+    conn_sched_release(c, ok);
+    conn_set_role(c, TCP_ROLE_CHAT);
+}
+
+void conn_close(worker_t *w, conn_t *c) {
+    conn_tcp_sample(c);
+    if (!use_uring) epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+
+    if (c->file_fd >= 0 && !c->data_stream && !c->resume) {
+        close(c->file_fd);
+        printf("\nFile transfer incomplete\n");
+        remove(c->full_path);
+    }
+    if (c->striped) striped_release(c->striped);
+    if (c->resume) {
+        // Keep the partial file for the next attempt
+        if (resume_suspend(c->resume)) {
+            printf("\nFile transfer interrupted, kept for resume: %s (%llu/%llu bytes)\n", c->full_path,
+                   (unsigned long long)c->resume->bytes_done, (unsigned long long)c->resume->file_size);
         } else {
-            printf("[%s] Message: %s\n", username, buf);
-            send(client_sock, buf, retval, 0);
+            printf("\nFile transfer superseded by a newer attempt: %s\n", c->full_path);
+        }
+        resume_free(c->resume);
+        free(c->resume);
+    }
+    if (c->delta) {
+        printf("\nDelta transfer incomplete, old copy kept: %s\n", c->full_path);
+        remove(c->delta->tmp_path);
+        delta_free(c->delta);
+    }
+    if (c->verify) {
+        verify_free(c->verify);
+        free(c->verify);
+    }
+    if (c->stage) stage_file_abort(&w->stage, c->stage);
+    for (conn_t **p = &w->stage_paused; c->stage_paused && *p; p = &(*p)->stage_next) {
+        if (*p == c) {
+            *p = c->stage_next;
+            break;
         }
     }
+    for (conn_t **p = &w->sched_paused; c->sched_paused && *p; p = &(*p)->sched_next) {
+        if (*p == c) {
+            *p = c->sched_next;
+            break;
+        }
+    }
+    if (c->batch) {
+        printf("\nBatch upload incomplete, files already written are kept\n");
+        batch_detach(c->batch);
+    }
+    close_pipe(c);
+    transfer_end(c, 0);
+    conn_sched_release(c, 0);
+    sub_close(c->sub);
+    metrics_add(M_DISCONNECTS, 1);
+
+    printf("Client disconnected: %s (peak memory %zu KB)\n", c->username, c->mem_peak / 1024);
+    ring_put(&c->in);
+    pbuf_put(c->out);
+    pbuf_put(c);
+}
 
-    closesocket(client_sock);
-    printf("Client disconnected: %s\n", username);
+int out_append(conn_t *c, const char *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 256;
+        while (cap < c->out_len + len) cap *= 2;
+        char *p = (char *)pbuf_grow(c->out, c->out_len, cap);
+        if (!p) return -1;
+        c->out = p;
+        c->out_cap = pbuf_cap(p);
+        size_t mem = conn_mem_update(c);
+        if (mem > conn_mem_max) {
+            // A client that sends requests but never reads the replies
+            printf("Client %s is over its memory limit (%zu KB), disconnecting\n", c->username, mem / 1024);
+            return -1;
+        }
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
     return 0;
 }
 
-int main() {
-    create_save_directory();
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        err_quit("WSAStartup failed");
+// Queue a reply frame. Whatever the socket accepts right away is sent
+// directly from the caller's payload; the remainder waits in the
+// connection's outbound buffer for EPOLLOUT.
+int conn_send_frame_flags(worker_t *w, conn_t *c, uint8_t type, uint16_t flags, uint32_t stream_id,
+                          const char *payload, size_t len) {
+    char hdr[FRAME_HDR_SIZE];
+    frame_encode(hdr, type, flags, (uint32_t)len, stream_id);
+
+    size_t sent = 0;
+    if (c->out_len == c->out_off) {
+        struct iovec iov[2];
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = FRAME_HDR_SIZE;
+        iov[1].iov_base = (void *)payload;
+        iov[1].iov_len = len;
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = len ? 2 : 1;
+        ssize_t n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        metrics_add(M_SYS_SEND, 1);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            n = 0;
+        }
+        metrics_add(M_BYTES_SENT, (uint64_t)n);
+        sent = (size_t)n;
+        if (sent == FRAME_HDR_SIZE + len) return 0;
+        c->out_len = c->out_off = 0;
     }
 
-    SOCKET listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_sock == INVALID_SOCKET) {
-        err_quit("Socket creation failed");
+    if (sent < FRAME_HDR_SIZE) {
+        if (out_append(c, hdr + sent, FRAME_HDR_SIZE - sent) < 0) return -1;
+        sent = FRAME_HDR_SIZE;
     }
+    if (out_append(c, payload + (sent - FRAME_HDR_SIZE), len - (sent - FRAME_HDR_SIZE)) < 0) return -1;
+    conn_update_events(w, c);
+    return 0;
+}
 
-    struct sockaddr_in serveraddr = {0};
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serveraddr.sin_port = htons(SERVERPORT);
+int conn_send_frame(worker_t *w, conn_t *c, uint8_t type, uint32_t stream_id, const char *payload, size_t len) {
+    return conn_send_frame_flags(w, c, type, 0, stream_id, payload, len);
+}
 
-    if (bind(listen_sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) == SOCKET_ERROR) {
-        err_quit("Bind failed");
+int pwrite_all(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        uint64_t start = now_us();
+        ssize_t n = pwrite(fd, data, len, offset);
+        metrics_add(M_SYS_WRITE, 1);
+        metrics_record(H_WRITE_US, now_us() - start);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        offset += n;
     }
+    return 0;
+}
 
-    if (listen(listen_sock, SOMAXCONN) == SOCKET_ERROR) {
-        err_quit("Listen failed");
+int process_input(worker_t *w, conn_t *c);
+int handle_frame(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload);
+int dispatch_frame(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload);
+int uring_drain(worker_t *w, conn_t *c);
+void uring_conn_close(conn_t *c);
+int end_receive_file(worker_t *w, conn_t *c);
+
+// Write the room frames queued for this connection, up to ROOM_BATCH per
+// writev(), until the queue is empty or the socket is full. A frame the
+// socket took only part of finishes from the outbound buffer, so a reply
+// sent in between cannot split it.
+int room_flush(worker_t *w, conn_t *c) {
+    struct iovec iov[ROOM_BATCH];
+    c->room_blocked = 0;
+    while (c->out_len == c->out_off) {
+        int n = sub_peek(c->sub, iov, ROOM_BATCH);
+        if (n == 0) break;
+        ssize_t sent = writev(c->fd, iov, n);
+        metrics_add(M_SYS_SEND, 1);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            sent = 0;
+        }
+        metrics_add(M_BYTES_SENT, (uint64_t)sent);
+
+        int done = 0;
+        while (done < n && (size_t)sent >= iov[done].iov_len) sent -= (ssize_t)iov[done++].iov_len;
+        if (done < n && sent > 0) {
+            c->out_len = c->out_off = 0;
+            if (out_append(c, (char *)iov[done].iov_base + sent, iov[done].iov_len - (size_t)sent) < 0) return -1;
+            done++;
+        } else if (done < n) {
+            c->room_blocked = 1;
+        }
+        sub_pop(c->sub, done);
+        if (done < n || c->room_blocked) break;
     }
 
-    printf("Server started on port %d (Multi-client enabled)\n", SERVERPORT);
+    if (!conn_backlogged(c)) {
+        uint32_t dropped = sub_take_dropped(c->sub);
+        if (dropped > 0) {
+            char note[64];
+            int len = snprintf(note, sizeof(note), "(%u room messages dropped, reading too slowly)", dropped);
+            if (conn_send_frame(w, c, FRAME_MSG, 0, note, (size_t)len) < 0) return -1;
+        }
+    }
+    if (conn_backlogged(c)) conn_update_events(w, c);
+    return 0;
+}
 
-    while (1) {
-        client_info_t *info = (client_info_t *)malloc(sizeof(client_info_t));
-        int addrlen = sizeof(info->client_addr);
+// Close a connection from outside its own event handling.
+void conn_abort(worker_t *w, conn_t *c) {
+    if (!use_uring) {
+        conn_close(w, c);
+    } else {
+        uring_conn_close(c);
+        // Make sure a completion arrives to free it
+        if (c->pending == 0) uring_arm_pollout(w, c);
+    }
+}
 
-        info->client_sock = accept(listen_sock, (struct sockaddr *)&info->client_addr, &addrlen);
-        if (info->client_sock == INVALID_SOCKET) {
-            printf("Accept failed: %d\n", WSAGetLastError());
-            free(info);
-            continue;
+// Write out the connections that room members queued frames for.
+void room_deliver(worker_t *w) {
+    sub_t *s = room_inbox_take(&w->inbox);
+    while (s) {
+        sub_t *next = s->next_ready;
+        conn_t *c = (conn_t *)sub_claim(s);
+        // A backlogged connection picks its queue up in conn_flush()
+        if (c && !c->closing && !conn_backlogged(c) && room_flush(w, c) < 0) conn_abort(w, c);
+        sub_put(s);
+        s = next;
+    }
+}
+
+int conn_flush(worker_t *w, conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        metrics_add(M_SYS_SEND, 1);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        metrics_add(M_BYTES_SENT, (uint64_t)n);
+        c->out_off += (size_t)n;
+    }
+    c->out_len = c->out_off = 0;
+    if (room_flush(w, c) < 0) return -1;
+    conn_update_events(w, c);
+    // Frames that arrived while we were backed up are already in the ring
+    // (or the uring receive queue) and will not raise another EPOLLIN.
+    return use_uring ? uring_drain(w, c) : process_input(w, c);
+}
+
+// verify_chunk is the CRC chunk size of a verified upload, 0 otherwise.
+int begin_receive_file(worker_t *w, conn_t *c, uint32_t stream_id, const char *filename, long long file_size,
+                       int compressed, uint32_t verify_chunk) {
+    if (c->file_fd >= 0) {
+        printf("[%s] File transfer while another one is open\n", c->username);
+        return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    }
+    snprintf(c->full_path, sizeof(c->full_path), "%s%s", SAVE_DIR, filename);
+
+    if (verify_chunk) {
+        c->verify = (verify_t *)malloc(sizeof(verify_t));
+        if (!c->verify || verify_init(c->verify, (uint64_t)file_size, verify_chunk) < 0) {
+            printf("[%s] Bad verified upload (chunk size %u)\n", c->username, verify_chunk);
+            free(c->verify);
+            c->verify = NULL;
+            return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+        }
+        conn_mem_update(c);
+    }
+
+    // A verified upload may have to read the file back after a repair
+    c->file_fd = open(c->full_path, (verify_chunk ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+    if (c->file_fd < 0) {
+        printf("Error: Cannot create file '%s'\n", c->full_path);
+        if (c->verify) {
+            verify_free(c->verify);
+            free(c->verify);
+            c->verify = NULL;
+        }
+        return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    }
+
+    if (zero_copy && c->pipe_fd[0] < 0 && pipe2(c->pipe_fd, O_NONBLOCK) < 0) {
+        printf("pipe2 failed, using buffered receive: %s\n", strerror(errno));
+        c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    }
+    if (w->stage.depth && !compressed && c->pipe_fd[0] < 0) {
+        c->stage = stage_file_open(&w->stage, c->full_path, c->file_fd);
+        if (!c->stage) printf("Write-behind unavailable, writing '%s' inline: %s\n", c->full_path, strerror(errno));
+    }
+
+    c->body_off = 0;
+    c->file_size = file_size;
+    c->file_stream = stream_id;
+    c->total_received = 0;
+    c->wire_bytes = 0;
+    c->progress_us = 0;
+    transfer_begin(c);
+    printf("Receiving file: %s (Size: %lld bytes%s%s)\n", c->full_path, file_size, compressed ? ", compressed" : "",
+           verify_chunk ? ", verified" : "");
+    if (conn_send_frame(w, c, FRAME_READY, stream_id, NULL, 0) < 0) return -1;
+
+    // A compressed body comes as frames, parsed like any other
+    c->compressed = compressed;
+    if (compressed) return file_size == 0 ? end_receive_file(w, c) : 0;
+    c->state = CONN_FILE;
+    return 0;
+}
+
+int begin_striped_file(worker_t *w, conn_t *c, uint32_t stream_id, const char *filename, long long file_size) {
+    if (c->striped) return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    striped_t *t = striped_create(filename, file_size);
+    if (!t) return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+
+    c->striped = t;
+    c->file_stream = stream_id;
+    t->user = c->sched_user;
+    transfer_begin(c);
+    printf("Receiving striped file: %s (Size: %lld bytes)\n", t->full_path, file_size);
+
+    char id[8];
+    put_u64(id, t->id);
+    return conn_send_frame(w, c, FRAME_READY, stream_id, id, sizeof(id));
+}
+
+int commit_striped_file(worker_t *w, conn_t *c, uint32_t stream_id) {
+    striped_t *t = c->striped;
+    long long received = __atomic_load_n(&t->received, __ATOMIC_ACQUIRE);
+    int ok = received == t->file_size;
+    if (ok) {
+        __atomic_store_n(&t->committed, 1, __ATOMIC_RELEASE);
+        double secs = (now_us() - t->start_us) / 1e6;
+        printf("Striped file received successfully: %s (%lld bytes over %d streams in %.2f s, %.2f MB/s)\n",
+               t->full_path, received, t->streams, secs, secs > 0 ? received / secs / 1e6 : 0.0);
+    } else {
+        printf("Striped file incomplete at commit: %s (%lld/%lld bytes)\n", t->full_path, received, t->file_size);
+    }
+    c->striped = NULL;
+    striped_release(t);
+    transfer_end(c, ok);
+    return conn_send_frame(w, c, ok ? FRAME_FILE_OK : FRAME_FILE_FAIL, stream_id, NULL, 0);
+}
+
+// Open or reopen a resumable upload and tell the client what is missing.
+int begin_resume(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    uint64_t id;
+    file_info_t info;
+    char filename[256];
+    if (resume_info_decode(payload, hdr->length, &id, &info) < 0) return -1;
+    if (c->resume || c->striped || file_info_basename(&info, filename, sizeof(filename)) < 0) {
+        return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+    }
+
+    resume_t *r = (resume_t *)malloc(sizeof(resume_t));
+    int resumed = 0;
+    if (!r || resume_open(r, SAVE_DIR, id, info.size, RESUME_CHUNK_SIZE, &resumed) < 0) {
+        printf("Error: Cannot open resumable upload for '%s'\n", filename);
+        free(r);
+        return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+    }
+    c->resume = r;
+    c->file_stream = hdr->stream_id;
+    c->progress_us = 0;
+    conn_mem_update(c);
+    transfer_begin(c);
+    snprintf(c->full_path, sizeof(c->full_path), "%s%s", SAVE_DIR, filename);
+    if (resumed) {
+        printf("[%s] Resuming %s: %llu/%llu bytes already received\n", c->username, filename,
+               (unsigned long long)r->bytes_done, (unsigned long long)info.size);
+    } else {
+        printf("[%s] Resumable file transfer: %s (%llu bytes)\n", c->username, filename,
+               (unsigned long long)info.size);
+    }
+
+    size_t len = resume_missing(r, w->buf, sizeof(w->buf));
+    return conn_send_frame(w, c, FRAME_READY, hdr->stream_id, w->buf, len);
+}
+
+// FRAME_COMMIT of a resumable upload: move the file into place if every
+// chunk has arrived, otherwise checkpoint so the next attempt can go on.
+int commit_resumed_file(worker_t *w, conn_t *c, uint32_t stream_id) {
+    resume_t *r = c->resume;
+    int ok = resume_complete(r);
+    if (ok && resume_finish(r, c->full_path) < 0) {
+        printf("Error: Cannot move '%s' into place: %s\n", r->part_path, strerror(errno));
+        ok = 0;
+    } else if (ok) {
+        printf("\nFile received successfully: %s\n", c->full_path);
+    } else {
+        resume_checkpoint(r);
+        printf("\nFile incomplete at commit: %s (%llu/%llu bytes)\n", c->full_path,
+               (unsigned long long)r->bytes_done, (unsigned long long)r->file_size);
+    }
+    resume_free(r);
+    free(r);
+    c->resume = NULL;
+    transfer_end(c, ok);
+    return conn_send_frame(w, c, ok ? FRAME_FILE_OK : FRAME_FILE_FAIL, stream_id, NULL, 0);
+}
+
+// FRAME_COMMIT of a verified upload: compare every chunk's CRC with the
+// client's and ask again for the ranges that differ, up to
+// VERIFY_MAX_ROUNDS times. Once all match, the file's digest decides.
+int commit_verified_file(worker_t *w, conn_t *c, uint32_t stream_id, const char *payload, uint32_t len) {
+    verify_t *v = c->verify;
+    if (!v->expected) {
+        if (verify_set_expected(v, payload, len) < 0) {
+            printf("[%s] Checksum list does not match the file\n", c->username);
+            return -1;
+        }
+        conn_mem_update(c);
+    }
+
+    size_t ranges_len;
+    uint32_t bad = verify_bad_ranges(v, w->buf, &ranges_len);
+    if (bad) metrics_add(M_CRC_ERRORS, bad);
+    if (bad && v->rounds < VERIFY_MAX_ROUNDS) {
+        v->rounds++;
+        printf("\n[%s] %u chunks of %s failed their CRC, asking for them again (round %d)\n", c->username, bad,
+               c->full_path, v->rounds);
+        return conn_send_frame(w, c, FRAME_READY, stream_id, w->buf, ranges_len);
+    }
+
+    int ok = 0;
+    if (bad) {
+        printf("\nFile still damaged after %d rounds: %s\n", v->rounds, c->full_path);
+    } else if (v->repairing && verify_rehash(v, c->file_fd, w->buf, sizeof(w->buf)) < 0) {
+        printf("\nError: Cannot read back '%s': %s\n", c->full_path, strerror(errno));
+    } else if (!verify_digest_ok(v)) {
+        printf("\nFile rejected, digest does not match the client's: %s\n", c->full_path);
+        metrics_add(M_DIGEST_ERRORS, 1);
+    } else {
+        ok = 1;
+    }
+    close(c->file_fd);
+    c->file_fd = -1;
+    if (ok) {
+        printf("\nFile received successfully: %s (%u chunks and digest verified%s)\n", c->full_path, v->nchunks,
+               v->rounds ? " after repair" : "");
+    } else {
+        remove(c->full_path);
+    }
+    verify_free(v);
+    free(v);
+    c->verify = NULL;
+    transfer_end(c, ok);
+    return conn_send_frame(w, c, ok ? FRAME_FILE_OK : FRAME_FILE_FAIL, stream_id, NULL, 0);
+}
+
+int begin_batch(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    if (c->batch || hdr->length < BATCH_INFO_SIZE) return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+    uint32_t files = get_u32(payload);
+    uint64_t bytes = get_u64(payload + 4);
+    c->batch = batch_new(&w->batches, c, SAVE_DIR, files, bytes);
+    if (!c->batch) return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+
+    transfer_begin(c);
+    printf("[%s] Batch upload: %u files (%llu bytes) in packs\n", c->username, files, (unsigned long long)bytes);
+    return conn_send_frame(w, c, FRAME_READY, hdr->stream_id, NULL, 0);
+}
+
+// Every pack of the batch is written: report what came of it.
+int finish_batch(worker_t *w, conn_t *c) {
+    batch_t *b = c->batch;
+    pthread_mutex_lock(&b->lock);
+    uint32_t files = b->files, failed = b->failed;
+    uint64_t bytes = b->bytes;
+    pthread_mutex_unlock(&b->lock);
+    if (files + failed < b->announced) failed = b->announced - files;  // Never sent
+
+    double secs = (now_us() - b->start_us) / 1e6;
+    printf("Batch received: %u files (%llu bytes) in %.2f s (%.0f files/s)%s", files, (unsigned long long)bytes,
+           secs, secs > 0 ? files / secs : 0.0, failed ? "" : "\n");
+    if (failed) printf(", %u failed\n", failed);
+
+    char result[BATCH_RESULT_SIZE];
+    put_u32(result, files);
+    put_u32(result + 4, failed);
+    put_u64(result + 8, bytes);
+    batch_detach(b);
+    c->batch = NULL;
+    transfer_end(c, failed == 0);
+    return conn_send_frame(w, c, failed ? FRAME_FILE_FAIL : FRAME_FILE_OK, c->file_stream, result, sizeof(result));
+}
+
+// The packs of c's batch hold more than it announced and was admitted for:
+// fail it now and give back its slot and reservation. Its remaining packs
+// are dropped, and its FRAME_COMMIT gets no second reply.
+int overrun_batch(worker_t *w, conn_t *c) {
+    batch_t *b = c->batch;
+    b->overrun = 1;
+    printf("[%s] Batch failed: its packs hold more than the %llu bytes announced\n", c->username,
+           (unsigned long long)b->announced_bytes);
+    pthread_mutex_lock(&b->lock);
+    uint32_t files = b->files;
+    uint64_t bytes = b->bytes;
+    pthread_mutex_unlock(&b->lock);
+
+    char result[BATCH_RESULT_SIZE];
+    put_u32(result, files);
+    put_u32(result + 4, b->announced > files ? b->announced - files : 0);
+    put_u64(result + 8, bytes);
+    transfer_end(c, 0);
+    return conn_send_frame(w, c, FRAME_FILE_FAIL, c->file_stream, result, sizeof(result));
+}
+
+// Reply to the batches whose last pack a writer thread just finished.
+void batch_deliver(worker_t *w) {
+    batch_t *b = batch_inbox_take(&w->batches);
+    while (b) {
+        batch_t *next = b->next_ready;
+        conn_t *c = (conn_t *)batch_claim(b);
+        if (c && !c->closing && c->batch == b && finish_batch(w, c) < 0) conn_abort(w, c);
+        batch_put(b);
+        b = next;
+    }
+}
+
+// Stop reading c until the writer thread catches up (stage_deliver).
+void conn_stage_pause(worker_t *w, conn_t *c) {
+    if (c->stage_paused) return;
+    c->stage_paused = 1;
+    c->stage_next = w->stage_paused;
+    w->stage_paused = c;
+    conn_update_events(w, c);
+}
+
+// Resume the connections that waited for the writer thread: for a free
+// staging buffer, or for the rest of their file to reach the disk.
+void stage_deliver(worker_t *w) {
+    if (!w->stage_paused) return;
+    stage_want_notify(&w->stage);  // Before looking, see stage.h
+    stage_reclaim(&w->stage);
+    conn_t *c = w->stage_paused;
+    w->stage_paused = NULL;
+    while (c) {
+        conn_t *next = c->stage_next;
+        int waiting = c->total_received < c->file_size ? w->stage.nfree == 0
+                                                        : __atomic_load_n(&c->stage->pending, __ATOMIC_ACQUIRE) > 0;
+        if (waiting) {
+            c->stage_next = w->stage_paused;
+            w->stage_paused = c;
+        } else {
+            c->stage_paused = 0;
+            conn_update_events(w, c);
+            if (process_input(w, c) < 0) conn_close(w, c);
+        }
+        c = next;
+    }
+}
+
+// Start the queued uploads that have been admitted since.
+void admit_deliver(worker_t *w) {
+    sched_wait_t *wt = sched_inbox_take(&w->admits);
+    while (wt) {
+        sched_wait_t *next = wt->next;
+        conn_t *c = (conn_t *)wt->owner;  // Owned by this worker, so it cannot close meanwhile
+        if (!c) {
+            sched_release(wt->user, wt->size, 0);
+        } else {
+            c->sched_wait = NULL;
+            c->sched_user = wt->user;
+            c->sched_admitted = 1;
+            uint64_t waited = now_us() - wt->since_us;
+            metrics_record(H_ADMIT_WAIT_US, waited);
+            int r = 0;
+            if (!c->closing) {
+                printf("[%s] Upload admitted after %.2f s in the queue\n", c->username, waited / 1e6);
+                r = dispatch_frame(w, c, &c->sched_hdr, c->sched_frame);
+                if (c->sched_admitted && !c->xfer_start_us) conn_sched_release(c, 0);
+            }
+            free(c->sched_frame);
+            c->sched_frame = NULL;
+            if (r >= 0 && !use_uring) {
+                conn_update_events(w, c);
+                r = process_input(w, c);
+            } else if (r >= 0 && !c->closing) {
+                r = uring_drain(w, c);
+            }
+            if (r < 0) conn_abort(w, c);
         }
+        free(wt);
+        wt = next;
+    }
+}
 
-        char addr[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &info->client_addr.sin_addr, addr, sizeof(addr));
-        printf("New connection from: %s\n", addr);
+// -B: whether c must stop receiving because its user has spent this
+// round's share. It is then paused until the next round (sched_deliver).
+int conn_sched_hold(worker_t *w, conn_t *c) {
+    if (c->sched_paused) return 1;
+    if (!c->sched_user || sched_may_receive(c->sched_user)) return 0;
+    c->sched_paused = 1;
+    c->sched_pause_us = now_us();
+    c->sched_next = w->sched_paused;
+    w->sched_paused = c;
+    metrics_add(M_SCHED_PAUSES, 1);
+    conn_update_events(w, c);
+    return 1;
+}
+
+static inline void conn_sched_charge(conn_t *c, long long n) {
+    if (c->sched_user && n > 0) sched_charge(c->sched_user, (uint64_t)n);
+}
 
-        // Create a thread for this client
-        HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, client_handler, info, 0, NULL);
-        if (thread == NULL) {
-            printf("Failed to create thread for client\n");
-            closesocket(info->client_sock);
-            free(info);
+// A new round has started: resume the connections paused for the last one.
+// Those still in debt pause again at their next receive.
+void sched_deliver(worker_t *w) {
+    if (!w->sched_paused) return;
+    uint64_t now = now_us();
+    conn_t *c = w->sched_paused;
+    w->sched_paused = NULL;
+    while (c) {
+        conn_t *next = c->sched_next;
+        if (sched_round(c->sched_pause_us) == sched_round(now)) {
+            c->sched_next = w->sched_paused;
+            w->sched_paused = c;
         } else {
-            CloseHandle(thread); // We don't need to keep track of the thread
+            c->sched_paused = 0;
+            metrics_record(H_SCHED_WAIT_US, now - c->sched_pause_us);
+            if (!use_uring) {
+                conn_update_events(w, c);
+            } else if (!c->closing) {
+                if (!c->recv_armed && !c->paused && !conn_sched_hold(w, c)) uring_arm_recv(w, c);
+                if (uring_drain(w, c) < 0) uring_conn_close(c);
+            }
         }
+        c = next;
+    }
+}
+
+// Start a delta upload: send the client the signatures of the copy we
+// already have (building its index first if it is missing or stale).
+int begin_delta(worker_t *w, conn_t *c, uint32_t stream_id, const char *filename, long long file_size) {
+    if (c->delta || c->striped || c->resume) return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+
+    delta_t *d = (delta_t *)calloc(1, sizeof(delta_t));
+    if (!d) return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    snprintf(c->full_path, sizeof(c->full_path), "%s%s", SAVE_DIR, filename);
+    snprintf(d->tmp_path, sizeof(d->tmp_path), "%s.%s.delta", SAVE_DIR, filename);
+    d->out_fd = open(d->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (d->out_fd < 0 || delta_builder_init(&d->index, (uint64_t)file_size) < 0) {
+        printf("Error: Cannot create file '%s'\n", d->tmp_path);
+        if (d->out_fd >= 0) close(d->out_fd);
+        free(d->index.ix.sigs);
+        free(d);
+        return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    }
+
+    delta_index_t ix;
+    uint64_t start = now_us();
+    int built = delta_index_open(&ix, SAVE_DIR, filename, &d->basis_fd);
+    if (built < 0) {
+        printf("Error: Cannot index '%s': %s\n", c->full_path, strerror(errno));
+        remove(d->tmp_path);
+        d->basis_fd = -1;
+        delta_free(d);
+        return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    }
+    if (built) {
+        printf("Indexed %s: %u blocks of %u bytes in %.2f s\n", c->full_path, ix.nblocks, ix.block_size,
+               (now_us() - start) / 1e6);
+    }
+    d->block_size = ix.block_size;
+    d->nblocks = ix.nblocks;
+    d->file_size = file_size;
+    d->start_us = now_us();
+    bhash_init(&d->hash);
+    c->delta = d;
+    c->file_stream = stream_id;
+    if (conn_mem_update(c) > conn_mem_max) {
+        printf("Error: Delta upload of '%s' needs more than the %zu KB memory limit\n", c->full_path,
+               conn_mem_max / 1024);
+        c->delta = NULL;
+        remove(d->tmp_path);
+        delta_free(d);
+        delta_index_free(&ix);
+        return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    }
+    c->progress_us = 0;
+    transfer_begin(c);
+    printf("Receiving delta: %s (Size: %lld bytes, %u basis blocks)\n", c->full_path, file_size, d->nblocks);
+
+    char ready[DELTA_READY_SIZE];
+    put_u32(ready, d->block_size);
+    put_u32(ready + 4, d->nblocks);
+    int r = conn_send_frame(w, c, FRAME_READY, stream_id, ready, sizeof(ready));
+    for (uint32_t i = 0; r == 0 && i < ix.nblocks; i += DELTA_SIGS_PER_FRAME) {
+        uint32_t n = ix.nblocks - i < DELTA_SIGS_PER_FRAME ? ix.nblocks - i : DELTA_SIGS_PER_FRAME;
+        for (uint32_t j = 0; j < n; j++) delta_sig_encode(w->buf + DELTA_SIG_SIZE * j, &ix.sigs[i + j]);
+        r = conn_send_frame(w, c, FRAME_SIGNATURES, stream_id, w->buf, (size_t)n * DELTA_SIG_SIZE);
+    }
+    delta_index_free(&ix);
+    return r;
+}
+
+// Append bytes to the rebuilt file.
+int delta_output(conn_t *c, const char *data, size_t len) {
+    delta_t *d = c->delta;
+    if (pwrite_all(d->out_fd, data, len, d->written) < 0) {
+        printf("Error: write to '%s' failed: %s\n", d->tmp_path, strerror(errno));
+        return -1;
     }
+    metrics_add(M_BYTES_RECEIVED, len);
+    bhash_update(&d->hash, data, len);
+    delta_builder_update(&d->index, (const uint8_t *)data, len);
+    d->written += (long long)len;
+    return 0;
+}
 
-    closesocket(listen_sock);
-    WSACleanup();
+// Apply one FRAME_DELTA. Operations that reach outside the old copy or
+// past the announced size are protocol errors.
+int apply_delta(worker_t *w, conn_t *c, const char *payload, uint32_t len) {
+    delta_t *d = c->delta;
+    uint32_t off = 0;
+    while (off < len) {
+        if (payload[off] == DELTA_OP_COPY && len - off >= DELTA_COPY_SIZE) {
+            uint64_t first = get_u32(payload + off + 1);
+            uint64_t count = get_u32(payload + off + 5);
+            off += DELTA_COPY_SIZE;
+            if (first + count > d->nblocks ||
+                count * d->block_size > (uint64_t)(d->file_size - d->written)) {
+                printf("[%s] Delta copy outside the file\n", c->username);
+                return -1;
+            }
+            off_t from = (off_t)(first * d->block_size);
+            off_t end = (off_t)((first + count) * d->block_size);
+            while (from < end) {
+                ssize_t n = pread(d->basis_fd, w->buf, end - from < BUFSIZE ? (size_t)(end - from) : BUFSIZE, from);
+                if (n <= 0) {
+                    printf("Error: read from '%s' failed: %s\n", c->full_path, n < 0 ? strerror(errno) : "short file");
+                    return -1;
+                }
+                if (delta_output(c, w->buf, (size_t)n) < 0) return -1;
+                from += n;
+            }
+            d->copied += (long long)(count * d->block_size);
+        } else if (payload[off] == DELTA_OP_LITERAL && len - off >= DELTA_LITERAL_HDR_SIZE) {
+            uint32_t n = get_u32(payload + off + 1);
+            off += DELTA_LITERAL_HDR_SIZE;
+            if (n > len - off || n > (uint64_t)(d->file_size - d->written)) {
+                printf("[%s] Delta literal outside the file\n", c->username);
+                return -1;
+            }
+            if (delta_output(c, payload + off, n) < 0) return -1;
+            off += n;
+            d->literal += n;
+        } else {
+            printf("[%s] Malformed delta operation\n", c->username);
+            return -1;
+        }
+    }
+    if (progress_due(&c->progress_us, d->written == d->file_size)) {
+        printf("Rebuilt %lld/%lld bytes (%.2f%%)\r", d->written, d->file_size,
+               d->file_size ? ((double)d->written / d->file_size) * 100 : 100.0);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// FRAME_COMMIT of a delta upload carries the client's hash of the whole
+// file. Only a rebuilt file that matches it replaces the old copy.
+int commit_delta_file(worker_t *w, conn_t *c, uint32_t stream_id, const char *payload, uint32_t len) {
+    delta_t *d = c->delta;
+    c->delta = NULL;
+
+    bhash_t expect, got = bhash_final(&d->hash);
+    int ok = len >= 16 && d->written == d->file_size;
+    if (ok) {
+        bhash_decode(payload, &expect);
+        ok = bhash_eq(&expect, &got);
+    }
+    struct stat st;
+    if (ok && (fstat(d->out_fd, &st) < 0 || rename(d->tmp_path, c->full_path) < 0)) {
+        printf("Error: Cannot move '%s' into place: %s\n", d->tmp_path, strerror(errno));
+        ok = 0;
+    }
+
+    if (ok) {
+        char index_path[512];
+        const char *name = c->full_path + strlen(SAVE_DIR);
+        delta_index_path(index_path, sizeof(index_path), SAVE_DIR, name);
+        delta_index_save(&d->index.ix, index_path, &st);
+
+        double secs = (now_us() - d->start_us) / 1e6;
+        printf("\nDelta file received successfully: %s (%lld bytes: %lld from the old copy, %lld literal, %.2f s)\n",
+               c->full_path, d->written, d->copied, d->literal, secs);
+    } else {
+        printf("\nDelta file rejected: %s (%lld/%lld bytes, %s)\n", c->full_path, d->written, d->file_size,
+               d->written == d->file_size ? "hash mismatch" : "incomplete");
+        remove(d->tmp_path);
+    }
+    delta_free(d);
+    transfer_end(c, ok);
+    return conn_send_frame(w, c, ok ? FRAME_FILE_OK : FRAME_FILE_FAIL, stream_id, NULL, 0);
+}
+
+// First frame of a data connection: join the striped upload it names.
+int attach_stream(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    striped_t *t = hdr->length >= 8 ? striped_attach(get_u64(payload)) : NULL;
+    if (!t) return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+
+    c->striped = t;
+    c->data_stream = 1;
+    c->sched_user = t->user;
+    c->stream_bytes = 0;
+    c->stream_start_us = now_us();
+    snprintf(c->username, sizeof(c->username), "%s", c->addr);
+    conn_set_role(c, TCP_ROLE_BULK);
+    return conn_send_frame(w, c, FRAME_READY, hdr->stream_id, NULL, 0);
+}
+
+int begin_chunk(conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    chunk_info_t chunk;
+    if (chunk_info_decode(payload, hdr->length, &chunk) < 0) return -1;
+    if (c->verify) {
+        // A repair: whole chunks whose CRC did not match
+        if (!verify_chunk_aligned(c->verify, chunk.offset, chunk.length)) {
+            printf("[%s] Repair chunk not on chunk boundaries\n", c->username);
+            return -1;
+        }
+    } else {
+        uint64_t size = c->resume ? c->resume->file_size : (uint64_t)c->striped->file_size;
+        if (chunk.offset > size || chunk.length > size - chunk.offset) {
+            printf("[%s] Chunk outside the file\n", c->username);
+            return -1;
+        }
+    }
+    if (chunk.length == 0) return 0;
+
+    if (zero_copy && c->pipe_fd[0] < 0 && pipe2(c->pipe_fd, O_NONBLOCK) < 0) {
+        c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    }
+    if (c->verify) {
+        verify_seek(c->verify, chunk.offset);  // file_fd is still open from the first pass
+    } else if (c->resume) {
+        c->file_fd = c->resume->fd;  // Owned by the resume state
+    } else {
+        c->file_fd = c->striped->fd;  // Shared; never closed by the connection
+        snprintf(c->full_path, sizeof(c->full_path), "%s", c->striped->full_path);
+    }
+    c->body_off = (long long)chunk.offset;
+    c->file_size = (long long)chunk.length;
+    c->total_received = 0;
+    c->state = CONN_FILE;
+    return 0;
+}
+
+// The client sent its last chunk on this connection; every byte before
+// this frame is already written, so acknowledge the stream's total.
+int end_stream(worker_t *w, conn_t *c, uint32_t stream_id) {
+    double secs = (now_us() - c->stream_start_us) / 1e6;
+    printf("Stream %s of %s: %lld bytes in %.2f s (%.2f MB/s)\n", c->addr, c->striped->full_path, c->stream_bytes,
+           secs, secs > 0 ? c->stream_bytes / secs / 1e6 : 0.0);
+
+    char bytes[8];
+    put_u64(bytes, (uint64_t)c->stream_bytes);
+    return conn_send_frame(w, c, FRAME_FILE_OK, stream_id, bytes, sizeof(bytes));
+}
+
+// A file or chunk body has been fully written.
+int end_receive_file(worker_t *w, conn_t *c) {
+    if (c->stage) {
+        // The reply waits until the writer has the whole file on disk
+        if (stage_flush(&w->stage, c->stage) > 0) {
+            conn_stage_pause(w, c);
+            return 0;
+        }
+        int r = stage_file_close(c->stage);
+        c->stage = NULL;
+        if (r < 0) {
+            printf("Error: write to '%s' failed: %s\n", c->full_path, strerror(errno));
+            return -1;
+        }
+    }
+    c->state = CONN_CMD;
+    if (c->compressed) {
+        c->compressed = 0;
+        printf("\nDecompressed %lld bytes from %lld (%.2fx)", c->file_size, c->wire_bytes,
+               c->wire_bytes ? (double)c->file_size / c->wire_bytes : 1.0);
+    }
+    if (c->verify) return 0;  // FRAME_COMMIT decides
+    if (c->resume) {
+        c->file_fd = -1;
+        return 0;
+    }
+    if (c->data_stream) {
+        __atomic_add_fetch(&c->striped->received, c->file_size, __ATOMIC_RELEASE);
+        c->stream_bytes += c->file_size;
+        c->file_fd = -1;
+        return 0;
+    }
+
+    close(c->file_fd);
+    c->file_fd = -1;
+    printf("\nFile received successfully: %s\n", c->full_path);
+    transfer_end(c, 1);
+    return conn_send_frame(w, c, FRAME_FILE_OK, c->file_stream, NULL, 0);
+}
+
+void print_progress(conn_t *c) {
+    if (c->data_stream) return;  // Streams report once, when they end
+    if (c->resume) {
+        if (!progress_due(&c->progress_us, c->resume->bytes_done == c->resume->file_size)) return;
+        printf("Received %llu/%llu bytes (%.2f%%)\r", (unsigned long long)c->resume->bytes_done,
+               (unsigned long long)c->resume->file_size,
+               ((double)c->resume->bytes_done / c->resume->file_size) * 100);
+        return;
+    }
+    if (!progress_due(&c->progress_us, c->total_received == c->file_size)) return;
+    printf("Received %lld/%lld bytes (%.2f%%)\r", c->total_received, c->file_size,
+           ((double)c->total_received / c->file_size) * 100);
+}
+
+// Account for n more body bytes written to the file.
+void body_written(conn_t *c, long long n) {
+    long long from = c->body_off + c->total_received;
+    c->total_received += n;
+    metrics_add(M_BYTES_RECEIVED, (uint64_t)n);
+    if (c->resume) {
+        resume_mark_range(c->resume, c->body_off, from, from + n);
+        if (resume_checkpoint_due(c->resume) && resume_checkpoint(c->resume) < 0) {
+            printf("Warning: checkpoint of '%s' failed: %s\n", c->resume->part_path, strerror(errno));
+        }
+    }
+    conn_tcp_tick(c);
+    print_progress(c);
+}
+
+// Write-behind path: straight into a staging buffer, which the worker's
+// writer thread puts on disk.
+ssize_t receive_staged(worker_t *w, conn_t *c, size_t want) {
+    size_t room;
+    char *p = stage_reserve(&w->stage, c->stage, (uint64_t)(c->body_off + c->total_received), &room);
+    if (!p) {
+        conn_stage_pause(w, c);
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t n = recv(c->fd, p, want < room ? want : room, 0);
+    metrics_add(M_SYS_RECV, 1);
+    if (n <= 0) return n;
+    if (c->verify) verify_update(c->verify, p, (size_t)n);
+    stage_commit(&w->stage, c->stage, (size_t)n);
+    return n;
+}
+
+// Buffered path: one copy into w->buf, one copy back out to the page cache.
+ssize_t receive_buffered(worker_t *w, conn_t *c, size_t want) {
+    ssize_t n = recv(c->fd, w->buf, want, 0);
+    metrics_add(M_SYS_RECV, 1);
+    if (n <= 0) return n;
+    if (c->verify) verify_update(c->verify, w->buf, (size_t)n);
+    if (pwrite_all(c->file_fd, w->buf, (size_t)n, c->body_off + c->total_received) < 0) {
+        printf("Error: write to '%s' failed: %s\n", c->full_path, strerror(errno));
+        return -1;
+    }
+    return n;
+}
+
+// Zero-copy path: socket pages are moved into the pipe and from there into
+// the file without passing through user space.
+ssize_t receive_spliced(worker_t *w, conn_t *c, size_t want) {
+    ssize_t n = splice(c->fd, NULL, c->pipe_fd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    metrics_add(M_SYS_RECV, 1);
+    if (n <= 0) return n;
+
+    ssize_t left = n;
+    loff_t off = c->body_off + c->total_received;
+    while (left > 0) {
+        uint64_t start = now_us();
+        ssize_t m = splice(c->pipe_fd[0], NULL, c->file_fd, &off, left, SPLICE_F_MOVE);
+        metrics_add(M_SYS_WRITE, 1);
+        metrics_record(H_WRITE_US, now_us() - start);
+        if (m < 0 && errno == EINVAL) {
+            // Filesystem cannot take spliced pages: copy what is already
+            // in the pipe out by hand so no bytes are lost
+            m = read(c->pipe_fd[0], w->buf, left);
+            if (m > 0 && pwrite_all(c->file_fd, w->buf, (size_t)m, off) < 0) m = -1;
+            if (m > 0) off += m;
+        }
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            printf("Error: splice to '%s' failed: %s\n", c->full_path, strerror(errno));
+            return -1;
+        }
+        left -= m;
+    }
+    return n;
+}
+
+// One FRAME_BLOCK of a compressed upload: decompress it into the worker's
+// buffer and write it after the previous one.
+int receive_block(worker_t *w, conn_t *c, const char *payload, uint32_t len) {
+    const char *data;
+    long n = block_decode(payload, len, c->codecs, w->buf, &data);
+    if (n < 0 || n > c->file_size - c->total_received) {
+        printf("[%s] Bad compressed block\n", c->username);
+        return -1;
+    }
+    if (c->verify) verify_update(c->verify, data, (size_t)n);
+    if (pwrite_all(c->file_fd, data, (size_t)n, c->total_received) < 0) {
+        printf("Error: write to '%s' failed: %s\n", c->full_path, strerror(errno));
+        return -1;
+    }
+    c->wire_bytes += FRAME_HDR_SIZE + len;
+    body_written(c, n);
+    if (c->total_received < c->file_size) return 0;
+    return end_receive_file(w, c);
+}
+
+// Returns -1 when the connection should be closed.
+int handle_file_data(worker_t *w, conn_t *c) {
+    long long remaining = c->file_size - c->total_received;
+    long long most = c->stage ? STAGE_BUF_SIZE : BUFSIZE;
+    size_t want = (size_t)(remaining < most ? remaining : most);
+
+    ssize_t bytes_received;
+    if (c->stage) {
+        bytes_received = receive_staged(w, c, want);
+    } else if (c->pipe_fd[0] >= 0 && !c->verify) {  // Spliced bytes never pass by to be checksummed
+        bytes_received = receive_spliced(w, c, want);
+        if (bytes_received < 0 && errno == EINVAL) {
+            // Socket or filesystem does not support splice; fall back for good
+            printf("splice unsupported, using buffered receive\n");
+            close_pipe(c);
+            bytes_received = receive_buffered(w, c, want);
+        }
+    } else {
+        bytes_received = receive_buffered(w, c, want);
+    }
+    if (bytes_received < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (bytes_received == 0) return -1;
+
+    conn_sched_charge(c, bytes_received);
+    body_written(c, bytes_received);
+
+    if (c->total_received == c->file_size) {
+        return end_receive_file(w, c);
+    }
+    return 0;
+}
+
+// FRAME_JOIN: move to the named room, or leave the current one.
+int join_room(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    char name[ROOM_NAME_MAX];
+    char reply[128];
+    int len;
+    size_t n = hdr->length < ROOM_NAME_MAX - 1 ? hdr->length : ROOM_NAME_MAX - 1;
+    memcpy(name, payload, n);
+    name[n] = '\0';
+
+    if (name[0] == '\0') {
+        if (c->sub->room[0]) {
+            printf("[%s] Left room %s\n", c->username, c->sub->room);
+            len = snprintf(reply, sizeof(reply), "Left room %s", c->sub->room);
+            room_leave(c->sub);
+        } else {
+            len = snprintf(reply, sizeof(reply), "Not in a room");
+        }
+    } else if (strpbrk(name, " []")) {
+        len = snprintf(reply, sizeof(reply), "Invalid room name");
+    } else {
+        int members = room_join(c->sub, name);
+        if (members < 0) {
+            len = snprintf(reply, sizeof(reply), "Could not join %s: too many rooms", name);
+        } else {
+            printf("[%s] Joined room %s (%d members)\n", c->username, name, members);
+            len = snprintf(reply, sizeof(reply), "Joined room %s (%d members)", name, members);
+        }
+    }
+    return conn_send_frame(w, c, FRAME_MSG, hdr->stream_id, reply, (size_t)len);
+}
+
+// Hand a logged-in client a ticket for the UDP side (server.h), which its
+// UDP socket redeems with FRAME_BIND to upload under the same name.
+int grant_bulk(worker_t *w, conn_t *c, uint32_t stream_id) {
+    uint64_t token = c->authed && serve_udp ? bulk_grant(c->username) : 0;
+    if (token == 0) {
+        printf("[%s] Bulk channel refused\n", c->username);
+        return conn_send_frame(w, c, FRAME_ERROR, stream_id, NULL, 0);
+    }
+    char grant[BULK_GRANT_SIZE];
+    put_u64(grant, token);
+    put_u16(grant + 8, SERVERPORT);
+    printf("[%s] Bulk channel granted on UDP port %d\n", c->username, SERVERPORT);
+    return conn_send_frame(w, c, FRAME_BULK, stream_id, grant, sizeof(grant));
+}
+
+// Whether an upload on this connection has started and not yet ended.
+int upload_busy(const conn_t *c) {
+    return c->sched_admitted || c->batch || c->compressed || c->verify || c->resume || c->delta || c->striped ||
+           c->file_fd >= 0;
+}
+
+// The size of the upload hdr announces, if it starts one that has to be
+// admitted (admit.h). Data connections deliver for an admitted upload.
+int upload_size(const conn_t *c, const frame_hdr_t *hdr, const char *payload, uint64_t *size) {
+    file_info_t info;
+    uint64_t id;
+    if (c->data_stream) return 0;
+    if (hdr->type == FRAME_FILE && file_info_decode(payload, hdr->length, &info) == 0) {
+        *size = info.size;
+        return 1;
+    }
+    if (hdr->type == FRAME_RESUME && resume_info_decode(payload, hdr->length, &id, &info) == 0) {
+        *size = info.size;
+        return 1;
+    }
+    if (hdr->type == FRAME_BATCH && hdr->length >= BATCH_INFO_SIZE) {
+        *size = get_u64(payload + 4);
+        return 1;
+    }
+    return 0;
+}
+
+// Admit the upload hdr announces. Returns 1 if it may start now, 0 if it
+// was queued or refused, -1 to close the connection.
+int admit_upload(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload, uint64_t size) {
+    sched_user_t *user = NULL;
+    sched_wait_t *wait = NULL;
+    const char *why = "";
+    sched_result_t r = sched_admit(c->username, size, c, &w->admits, &user, &wait, &why);
+    if (r == SCHED_REFUSED) {
+        printf("[%s] Upload of %llu bytes refused: %s\n", c->username, (unsigned long long)size, why);
+        metrics_add(M_ADMIT_REFUSED, 1);
+        return conn_send_frame(w, c, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0) < 0 ? -1 : 0;
+    }
+    c->sched_size = size;
+    if (r == SCHED_ADMITTED) {
+        c->sched_user = user;
+        c->sched_admitted = 1;
+        metrics_record(H_ADMIT_WAIT_US, 0);
+        return 1;
+    }
+
+    // Reading stops until it is admitted (admit_deliver); the client is
+    // waiting for FRAME_READY anyway
+    c->sched_wait = wait;
+    c->sched_hdr = *hdr;
+    c->sched_frame = (char *)malloc(hdr->length + 1);
+    if (!c->sched_frame) return -1;
+    memcpy(c->sched_frame, payload, hdr->length);
+    metrics_add(M_ADMIT_QUEUED, 1);
+    printf("[%s] Upload of %llu bytes queued for a transfer slot\n", c->username, (unsigned long long)size);
+    conn_update_events(w, c);
+    return 0;
+}
+
+int handle_frame(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    metrics_add(M_FRAMES, 1);
+    conn_tcp_tick(c);
+    if (c->state == CONN_USER) {
+        c->state = CONN_CMD;
+        if (hdr->type == FRAME_ATTACH) return attach_stream(w, c, hdr, payload);
+        if (hdr->type == FRAME_USER && login_name(payload, hdr->length, c->username, sizeof(c->username)) == 0) {
+            c->authed = 1;
+            printf("Client identified as: %s (%s)\n", c->username, c->addr);
+            c->codecs = hdr->flags & codecs_available();
+            return conn_send_frame_flags(w, c, FRAME_USER_OK, (uint16_t)c->codecs, hdr->stream_id, NULL, 0);
+        }
+        strcpy(c->username, c->addr);
+        return conn_send_frame(w, c, FRAME_USER_FAIL, hdr->stream_id, NULL, 0);
+    }
+
+    uint64_t size;
+    if (upload_size(c, hdr, payload, &size)) {
+        // One upload at a time: a second one would take over the first one's state
+        if (upload_busy(c)) {
+            printf("[%s] Upload started while another one is in progress\n", c->username);
+            return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+        }
+        int r = admit_upload(w, c, hdr, payload, size);
+        if (r <= 0) return r;
+        r = dispatch_frame(w, c, hdr, payload);
+        if (c->sched_admitted && !c->xfer_start_us) conn_sched_release(c, 0);  // It never started
+        return r;
+    }
+    return dispatch_frame(w, c, hdr, payload);
+}
+
+// Act on a frame of a logged-in connection; uploads have been admitted.
+int dispatch_frame(worker_t *w, conn_t *c, const frame_hdr_t *hdr, const char *payload) {
+    switch (hdr->type) {
+    case FRAME_FILE: {
+        file_info_t info;
+        char filename[BATCH_PATH_MAX];
+        if (file_info_decode(payload, hdr->length, &info) < 0) return -1;
+        if (hdr->flags & FILE_FLAG_BATCH) {
+            // Part of a batch: keep the directories, within the save directory
+            char full_path[sizeof(c->full_path)];
+            if ((hdr->flags & (FILE_FLAG_STRIPED | FILE_FLAG_DELTA)) ||
+                batch_path(info.name, info.name_len, filename, sizeof(filename)) < 0) {
+                return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+            }
+            snprintf(full_path, sizeof(full_path), "%s%s", SAVE_DIR, filename);
+            if (batch_mkdirs(full_path, strlen(SAVE_DIR)) < 0) {
+                printf("Error: Cannot create directories for '%s'\n", full_path);
+                return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+            }
+        } else if (file_info_basename(&info, filename, sizeof(filename)) < 0) {
+            return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+        }
+
+        printf("[%s] File transfer: %s (%lld bytes)\n", c->username, filename, (long long)info.size);
+        if (hdr->flags & FILE_FLAG_STRIPED) {
+            return begin_striped_file(w, c, hdr->stream_id, filename, (long long)info.size);
+        }
+        if (hdr->flags & FILE_FLAG_DELTA) {
+            return begin_delta(w, c, hdr->stream_id, filename, (long long)info.size);
+        }
+        if ((hdr->flags & FILE_FLAG_COMPRESSED) && !c->codecs) {
+            printf("[%s] Compressed upload without an agreed codec\n", c->username);
+            return conn_send_frame(w, c, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+        }
+        return begin_receive_file(w, c, hdr->stream_id, filename, (long long)info.size,
+                                  (hdr->flags & FILE_FLAG_COMPRESSED) != 0,
+                                  (hdr->flags & FILE_FLAG_VERIFY) ? info.chunk_size : 0);
+    }
+    case FRAME_RESUME:
+        if (c->data_stream) break;
+        return begin_resume(w, c, hdr, payload);
+    case FRAME_CHUNK:
+        if (!c->data_stream && !c->resume && !(c->verify && c->verify->expected)) break;
+        return begin_chunk(c, hdr, payload);
+    case FRAME_DELTA:
+        if (!c->delta) break;
+        return apply_delta(w, c, payload, hdr->length);
+    case FRAME_BLOCK:
+        if (!c->compressed) break;
+        return receive_block(w, c, payload, hdr->length);
+    case FRAME_BATCH:
+        c->file_stream = hdr->stream_id;
+        return begin_batch(w, c, hdr, payload);
+    case FRAME_PACK:
+        if (!c->batch || c->batch->committed) break;
+        if (c->batch->overrun) return 0;
+        if (batch_account(c->batch, payload, hdr->length) < 0) return overrun_batch(w, c);
+        batch_submit(c->batch, payload, hdr->length);
+        return 0;
+    case FRAME_COMMIT:
+        if (c->batch && c->batch->overrun) {
+            batch_detach(c->batch);
+            c->batch = NULL;
+            return 0;
+        }
+        if (c->batch) {
+            c->file_stream = hdr->stream_id;
+            return batch_commit(c->batch) ? finish_batch(w, c) : 0;
+        }
+        if (c->verify && !c->compressed) return commit_verified_file(w, c, hdr->stream_id, payload, hdr->length);
+        if (c->data_stream) return end_stream(w, c, hdr->stream_id);
+        if (c->delta) return commit_delta_file(w, c, hdr->stream_id, payload, hdr->length);
+        if (c->resume) return commit_resumed_file(w, c, hdr->stream_id);
+        if (c->striped) return commit_striped_file(w, c, hdr->stream_id);
+        break;
+    case FRAME_MSG:
+        printf("[%s] Message: %.*s\n", c->username, (int)hdr->length, payload);
+        metrics_add(M_MESSAGES, 1);
+        if (c->sub->room[0]) {
+            int dropped;
+            int queued = room_publish(c->sub, c->username, payload, hdr->length, &dropped);
+            metrics_add(M_ROOM_FRAMES, (uint64_t)queued);
+            metrics_add(M_ROOM_DROPPED, (uint64_t)dropped);
+        }
+        return conn_send_frame(w, c, FRAME_MSG, hdr->stream_id, payload, hdr->length);
+    case FRAME_JOIN:
+        return join_room(w, c, hdr, payload);
+    case FRAME_BULK:
+        return grant_bulk(w, c, hdr->stream_id);
+    default:
+        break;
+    }
+    printf("[%s] Unexpected frame type %d\n", c->username, hdr->type);
+    return conn_send_frame(w, c, FRAME_ERROR, hdr->stream_id, NULL, 0);
+}
+
+// Parse every complete frame buffered in the ring. Bytes that follow a
+// FRAME_FILE header in the same read belong to the file body and are
+// written out before parsing resumes.
+int process_input(worker_t *w, conn_t *c) {
+    while (c->out_len == c->out_off && !c->stage_paused && !c->sched_wait) {
+        if (c->state == CONN_FILE) {
+            size_t avail = ring_used(&c->in);
+            long long remaining = c->file_size - c->total_received;
+            if (avail > (unsigned long long)remaining) avail = (size_t)remaining;
+            if (avail > 0 && c->stage) {
+                size_t room;
+                char *p = stage_reserve(&w->stage, c->stage, (uint64_t)(c->body_off + c->total_received), &room);
+                if (!p) {
+                    conn_stage_pause(w, c);
+                    return 0;
+                }
+                if (avail > room) avail = room;
+                memcpy(p, ring_read_ptr(&c->in), avail);
+                stage_commit(&w->stage, c->stage, avail);
+            } else if (avail > 0 &&
+                       pwrite_all(c->file_fd, ring_read_ptr(&c->in), avail, c->body_off + c->total_received) < 0) {
+                printf("Error: write to '%s' failed: %s\n", c->full_path, strerror(errno));
+                return -1;
+            }
+            if (avail > 0) {
+                if (c->verify) verify_update(c->verify, ring_read_ptr(&c->in), avail);
+                ring_consume(&c->in, avail);
+                body_written(c, (long long)avail);
+            }
+            if (c->total_received < c->file_size) {
+                if (ring_used(&c->in) > 0) continue;  // A staging buffer filled up
+                return 0;
+            }
+            if (end_receive_file(w, c) < 0) return -1;
+            continue;
+        }
+
+        frame_hdr_t hdr;
+        const char *payload;
+        int got = ring_peek_frame(&c->in, &hdr, &payload);
+        if (got < 0) {
+            printf("[%s] Protocol error\n", c->username);
+            return -1;
+        }
+        if (got == 0) return 0;
+
+        int r = handle_frame(w, c, &hdr, payload);
+        ring_consume(&c->in, FRAME_HDR_SIZE + hdr.length);
+        if (r < 0) return -1;
+    }
+    return 0;
+}
+
+int handle_readable(worker_t *w, conn_t *c) {
+    // Only a hangup is reported while paused
+    if (c->stage_paused || c->sched_paused || c->sched_wait) return -1;
+    if (conn_sched_hold(w, c)) return 0;
+    if (c->state == CONN_FILE) return handle_file_data(w, c);
+
+    ssize_t n = ring_recv(&c->in, c->fd);
+    metrics_add(M_SYS_RECV, 1);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (n == 0) return -1;
+    conn_sched_charge(c, n);
+    return process_input(w, c);
+}
+
+// State for a freshly accepted socket, or NULL (and the socket closed).
+conn_t *conn_new(worker_t *w, int fd, const struct sockaddr_in *clientaddr) {
+    conn_t *c = (conn_t *)pbuf_alloc(sizeof(conn_t));
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->state = CONN_USER;
+    c->file_fd = -1;
+    c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    c->sock_slot = c->file_slot = c->slot_file_fd = -1;
+    c->q_head = c->q_tail = -1;
+    c->tcp_role = -1;
+    inet_ntop(AF_INET, &clientaddr->sin_addr, c->addr, sizeof(c->addr));
+    strcpy(c->username, "[unknown]");
+    c->sub = sub_new(&w->inbox, c);
+    if (!c->sub || ring_get(&c->in, RING_SIZE) < 0) {
+        printf("Failed to allocate receive ring: %s\n", strerror(errno));
+        close(fd);
+        if (c->sub) sub_close(c->sub);
+        pbuf_put(c);
+        return NULL;
+    }
+    conn_mem_update(c);
+    conn_set_role(c, TCP_ROLE_CHAT);
+    c->tcp_sample_us = now_us();
+    return c;
+}
+
+void accept_clients(worker_t *w) {
+    while (1) {
+        struct sockaddr_in clientaddr;
+        socklen_t addrlen = sizeof(clientaddr);
+        int fd = accept4(w->listen_fd, (struct sockaddr *)&clientaddr, &addrlen, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("Accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        conn_t *c = conn_new(w, fd, &clientaddr);
+        if (!c) continue;
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            printf("Failed to register client: %s\n", strerror(errno));
+            close(fd);
+            ring_put(&c->in);
+            sub_close(c->sub);
+            pbuf_put(c);
+            continue;
+        }
+        metrics_add(M_CONNECTIONS, 1);
+        printf("New connection from: %s (worker %d)\n", c->addr, w->id);
+    }
+}
+
+// How long a worker may sleep: until the UDP shard's next timer, or the
+// next bandwidth round if connections wait for it. -1 for no limit.
+int worker_timeout_ms(worker_t *w) {
+    int timeout = w->udp ? udp_timeout_ms(w->udp) : -1;
+    if (w->sched_paused) {
+        uint64_t now = now_us();
+        int round = (int)((sched_next_round_us() - now + 999) / 1000);
+        if (timeout < 0 || round < timeout) timeout = round;
+    }
+    return timeout;
+}
+
+void *worker_loop(void *data) {
+    worker_t *w = (worker_t *)data;
+    struct epoll_event events[MAX_EVENTS];
+    metrics_thread_init(w->id);
+    room_local = &w->inbox;
+
+    while (1) {
+        if (w->udp) udp_flush(w->udp);
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, worker_timeout_ms(w));
+        metrics_add(M_SYS_WAIT, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err_quit("epoll_wait failed");
+        }
+        if (w->udp) udp_run_timers(w->udp);
+
+        for (int i = 0; i < n; i++) {
+            conn_t *c = (conn_t *)events[i].data.ptr;
+            if (!c) {
+                accept_clients(w);
+                continue;
+            }
+            if ((void *)c == &w->inbox) {
+                room_inbox_ack(&w->inbox);
+                continue;
+            }
+            if ((void *)c == w->udp) {
+                udp_receive_batch(w->udp);
+                continue;
+            }
+
+            int r = 0;
+            if (events[i].events & EPOLLOUT) {
+                r = conn_flush(w, c);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                r = handle_readable(w, c);
+            }
+            if (r < 0) conn_close(w, c);
+        }
+        room_deliver(w);
+        batch_deliver(w);
+        stage_deliver(w);
+        admit_deliver(w);
+        sched_deliver(w);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// io_uring backend
+//
+// Each worker keeps a multishot accept on its listener and a multishot
+// recv on every connection, both re-armed only when the kernel ends them.
+// Received buffers queue up per connection. Frame bytes are copied into
+// the connection's ring and parsed by the same code as the epoll loop;
+// file bodies are written straight from the receive buffers with
+// WRITE_FIXED, up to URING_WRITES_PER_CONN at a time, and the buffers go
+// back to the kernel when the last write using them completes.
+// ---------------------------------------------------------------------------
+
+int uring_slot_alloc(worker_t *w, int fd) {
+    if (w->nfree_slots == 0) return -1;
+    int slot = w->free_slots[--w->nfree_slots];
+    if (uring_set_file(&w->ring, (unsigned)slot, fd) < 0) {
+        w->free_slots[w->nfree_slots++] = slot;
+        return -1;
+    }
+    return slot;
+}
+
+void uring_slot_free(worker_t *w, int slot) {
+    if (slot < 0) return;
+    uring_set_file(&w->ring, (unsigned)slot, -1);
+    w->free_slots[w->nfree_slots++] = slot;
+}
+
+// Stop the connection: shutting the socket down ends its receive and poll,
+// and in-flight writes finish on their own. It is freed once the last
+// completion has arrived.
+void uring_conn_close(conn_t *c) {
+    if (c->closing) return;
+    c->closing = 1;
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+void uring_conn_free(worker_t *w, conn_t *c) {
+    while (c->q_head >= 0) {
+        int bid = c->q_head;
+        c->q_head = w->buf_next[bid];
+        uring_buf_release(w, bid);
+    }
+    uring_slot_free(w, c->file_slot);
+    uring_slot_free(w, c->sock_slot);
+    conn_close(w, c);
+}
+
+void uring_enqueue(worker_t *w, conn_t *c, int bid, uint32_t len) {
+    w->buf_refs[bid] = 1;
+    w->buf_off[bid] = 0;
+    w->buf_len[bid] = len;
+    w->buf_next[bid] = -1;
+    if (c->q_tail >= 0) {
+        w->buf_next[c->q_tail] = bid;
+    } else {
+        c->q_head = bid;
+    }
+    c->q_tail = bid;
+    c->q_count++;
+}
+
+// Take n bytes off the front of the queue.
+void uring_dequeue(worker_t *w, conn_t *c, uint32_t n) {
+    int bid = c->q_head;
+    w->buf_off[bid] += n;
+    w->buf_len[bid] -= n;
+    if (w->buf_len[bid] > 0) return;
+    c->q_head = w->buf_next[bid];
+    if (c->q_head < 0) c->q_tail = -1;
+    c->q_count--;
+    uring_buf_release(w, bid);
+}
+
+// A connection whose data arrives faster than it is consumed would take
+// the whole buffer pool from the others: cancel its receive, leaving the
+// rest in the socket for TCP flow control, until the queue drains.
+void uring_pause_recv(worker_t *w, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return;
+    uring_prep_cancel(sqe, op_data(c, OP_RECV), op_data(c, OP_CANCEL));
+    c->paused = 1;
+    c->pending++;
+}
+
+int uring_submit_write(worker_t *w, conn_t *c, unsigned i) {
+    uring_write_t *wr = &c->writes[i];
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return -1;
+    uring_prep_write_fixed(sqe, (unsigned)c->file_slot, uring_bufs_addr(&w->bufs, wr->bid) + wr->off, wr->len,
+                           wr->file_off, op_data(c, OP_WRITE + (int)i));
+    wr->submit_us = now_us();
+    metrics_add(M_SYS_WRITE, 1);
+    c->pending++;
+    return 0;
+}
+
+// Write the next queued body bytes to the file.
+int uring_write_body(worker_t *w, conn_t *c, long long undispatched) {
+    if (c->slot_file_fd != c->file_fd) {
+        if (c->file_slot < 0) {
+            c->file_slot = uring_slot_alloc(w, c->file_fd);
+        } else if (uring_set_file(&w->ring, (unsigned)c->file_slot, c->file_fd) < 0) {
+            return -1;
+        }
+        if (c->file_slot < 0) return -1;
+        c->slot_file_fd = c->file_fd;
+    }
+
+    int bid = c->q_head;
+    uint32_t n = w->buf_len[bid];
+    if ((long long)n > undispatched) n = (uint32_t)undispatched;
+    unsigned i = (c->wr_head + c->wr_count) % URING_WRITES_PER_CONN;
+    uring_write_t *wr = &c->writes[i];
+    wr->bid = (uint16_t)bid;
+    wr->off = w->buf_off[bid];
+    wr->len = wr->total = n;
+    wr->file_off = (uint64_t)(c->body_off + c->total_received + c->wr_bytes);
+    wr->done = 0;
+    if (c->verify) verify_update(c->verify, uring_bufs_addr(&w->bufs, bid) + wr->off, n);
+    if (uring_submit_write(w, c, i) < 0) return -1;
+    w->buf_refs[bid]++;
+    c->wr_count++;
+    c->wr_bytes += n;
+    uring_dequeue(w, c, n);
+    return 0;
+}
+
+// Consume queued receive buffers for as long as the protocol can make
+// progress. Returns -1 when the connection should be closed.
+int uring_process(worker_t *w, conn_t *c) {
+    while (!c->closing && c->out_len == c->out_off && !c->sched_wait) {
+        if (c->state == CONN_FILE) {
+            // Body bytes that arrived together with the frame that began it
+            if (ring_used(&c->in) > 0) {
+                if (process_input(w, c) < 0) return -1;
+                continue;
+            }
+            long long undispatched = c->file_size - c->total_received - c->wr_bytes;
+            if (undispatched == 0 || c->q_head < 0 || c->wr_count == URING_WRITES_PER_CONN) return 0;
+            if (uring_write_body(w, c, undispatched) < 0) {
+                printf("Error: cannot queue write to '%s'\n", c->full_path);
+                return -1;
+            }
+            continue;
+        }
+
+        if (c->q_head < 0) return 0;
+        int bid = c->q_head;
+        uint32_t n = w->buf_len[bid];
+        if (n > ring_space(&c->in)) n = (uint32_t)ring_space(&c->in);
+        memcpy(ring_write_ptr(&c->in), uring_bufs_addr(&w->bufs, bid) + w->buf_off[bid], n);
+        ring_produce(&c->in, n);
+        uring_dequeue(w, c, n);
+        if (process_input(w, c) < 0) return -1;
+        if (n == 0 && ring_space(&c->in) == 0) return -1;  // A full ring always holds a frame
+    }
+    return 0;
+}
+
+// Process what is queued, and resume a paused receive once the queue is
+// down to half its limit.
+int uring_drain(worker_t *w, conn_t *c) {
+    if (uring_process(w, c) < 0) return -1;
+    if (c->paused && !c->recv_armed && c->q_count <= URING_CONN_BUFS / 2 && !conn_sched_hold(w, c)) {
+        c->paused = 0;
+        uring_arm_recv(w, c);
+    }
+    return 0;
+}
+
+void uring_on_recv(worker_t *w, conn_t *c, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->pending--;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+        w->bufs_free--;
+        if (res > 0 && !c->closing) {
+            uring_enqueue(w, c, bid, (uint32_t)res);
+            conn_sched_charge(c, res);
+        } else {
+            w->buf_refs[bid] = 1;
+            uring_buf_release(w, bid);
+        }
+    }
+    if (c->closing) return;
+
+    if (res == -ENOBUFS) {
+        c->starved = 1;  // Re-armed once buffers come back
+    } else if (res == -ECANCELED && c->paused) {
+        // Paused; uring_drain() re-arms it
+    } else if (res <= 0) {
+        uring_conn_close(c);
+        return;
+    } else if (c->recv_armed && !c->paused &&
+               (conn_mem_update(c) > conn_mem_max || c->q_count >= URING_CONN_BUFS || conn_sched_hold(w, c))) {
+        uring_pause_recv(w, c);
+    } else if (!c->recv_armed && !c->paused && !conn_sched_hold(w, c)) {
+        uring_arm_recv(w, c);
+    }
+    if (uring_drain(w, c) < 0) uring_conn_close(c);
+}
+
+void uring_on_write(worker_t *w, conn_t *c, unsigned i, int res) {
+    uring_write_t *wr = &c->writes[i];
+    c->pending--;
+    metrics_record(H_WRITE_US, now_us() - wr->submit_us);
+    if (res < 0 || (res == 0 && wr->len > 0)) {
+        if (!c->closing) {
+            printf("Error: write to '%s' failed: %s\n", c->full_path, strerror(res < 0 ? -res : EIO));
+            uring_conn_close(c);
+        }
+        res = (int)wr->len;  // Retire it anyway so its buffer is released
+    }
+    if ((uint32_t)res < wr->len) {
+        // Short write: submit the rest
+        wr->off += (uint32_t)res;
+        wr->len -= (uint32_t)res;
+        wr->file_off += (uint64_t)res;
+        if (uring_submit_write(w, c, i) == 0) return;
+        uring_conn_close(c);
+    }
+    wr->done = 1;
+
+    while (c->wr_count > 0 && c->writes[c->wr_head].done) {
+        uring_write_t *head = &c->writes[c->wr_head];
+        c->wr_head = (c->wr_head + 1) % URING_WRITES_PER_CONN;
+        c->wr_count--;
+        c->wr_bytes -= head->total;
+        if (!c->closing) body_written(c, head->total);
+        uring_buf_release(w, head->bid);
+    }
+    if (c->closing) return;
+
+    if (c->state == CONN_FILE && c->wr_count == 0 && c->total_received == c->file_size) {
+        // The fd may be closed and reused by the next upload
+        uring_set_file(&w->ring, (unsigned)c->file_slot, -1);
+        c->slot_file_fd = -1;
+        if (end_receive_file(w, c) < 0) {
+            uring_conn_close(c);
+            return;
+        }
+    }
+    if (uring_drain(w, c) < 0) uring_conn_close(c);
+}
+
+void uring_on_accept(worker_t *w, int fd, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+        if (sqe) uring_prep_accept_multishot(sqe, w->listen_fd, OP_ACCEPT);
+    }
+    if (fd < 0) {
+        if (fd != -EAGAIN && fd != -EINTR) printf("Accept failed: %s\n", strerror(-fd));
+        return;
+    }
+
+    struct sockaddr_in clientaddr = {0};
+    socklen_t addrlen = sizeof(clientaddr);
+    getpeername(fd, (struct sockaddr *)&clientaddr, &addrlen);
+    conn_t *c = conn_new(w, fd, &clientaddr);
+    if (!c) return;
+    c->sock_slot = uring_slot_alloc(w, fd);
+    if (c->sock_slot < 0) {
+        printf("Failed to register client: %s\n", strerror(errno));
+        close(fd);
+        ring_put(&c->in);
+        sub_close(c->sub);
+        pbuf_put(c);
+        return;
+    }
+    uring_arm_recv(w, c);
+    metrics_add(M_CONNECTIONS, 1);
+    printf("New connection from: %s (worker %d, io_uring)\n", c->addr, w->id);
+}
+
+// Set up the worker's ring, buffers and fixed-file table. Returns -1 with
+// errno set if io_uring is unavailable or lacks a feature we need.
+int uring_worker_init(worker_t *w) {
+    if (uring_init(&w->ring, URING_ENTRIES) < 0) return -1;
+    size_t pool_size = (size_t)URING_BUFS * URING_BUF_SIZE;
+    w->pool = (char *)mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    w->buf_refs = (int *)calloc(URING_BUFS, sizeof(int));
+    w->buf_next = (int *)calloc(URING_BUFS, sizeof(int));
+    w->buf_off = (uint32_t *)calloc(URING_BUFS, sizeof(uint32_t));
+    w->buf_len = (uint32_t *)calloc(URING_BUFS, sizeof(uint32_t));
+    struct rlimit rl;
+    w->nslots = URING_FILE_SLOTS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)w->nslots) w->nslots = (int)rl.rlim_cur;
+    w->free_slots = (int *)malloc(w->nslots * sizeof(int));
+    if (w->pool == MAP_FAILED || !w->buf_refs || !w->buf_next || !w->buf_off || !w->buf_len || !w->free_slots) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (uring_register_files(&w->ring, (unsigned)w->nslots) < 0 || uring_register_buffer(&w->ring, w->pool, pool_size) < 0 ||
+        uring_bufs_init(&w->ring, &w->bufs, 0, w->pool, URING_BUFS, URING_BUF_SIZE) < 0) {
+        return -1;
+    }
+    w->bufs_free = URING_BUFS;
+    for (int i = 0; i < w->nslots; i++) w->free_slots[i] = w->nslots - 1 - i;
+    w->nfree_slots = w->nslots;
+    return 0;
+}
+
+// Set timer_fd to expire when the UDP shard's timers or the next bandwidth
+// round are due, if that moved.
+void worker_arm_timer(worker_t *w) {
+    uint64_t due = w->udp ? udp_next_due_us(w->udp) : UINT64_MAX;
+    if (w->sched_paused && sched_next_round_us() < due) due = sched_next_round_us();
+    if (due == w->timer_due) return;
+    w->timer_due = due;
+    struct itimerspec its = {};
+    if (due != UINT64_MAX) {
+        its.it_value.tv_sec = (time_t)(due / 1000000);
+        its.it_value.tv_nsec = (long)(due % 1000000) * 1000;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;  // Zero would disarm it
+    }
+    timerfd_settime(w->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void *uring_worker_loop(void *data) {
+    worker_t *w = (worker_t *)data;
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    uring_prep_accept_multishot(sqe, w->listen_fd, OP_ACCEPT);
+    int wake_slot = uring_slot_alloc(w, w->inbox.efd);
+    if (wake_slot < 0) err_quit("Failed to register wakeup eventfd");
+    sqe = uring_get_sqe(&w->ring);
+    uring_prep_poll(sqe, (unsigned)wake_slot, POLLIN, OP_WAKE);
+    metrics_thread_init(w->id);
+    room_local = &w->inbox;
+
+    // The UDP shard is polled like the wakeup eventfd, and timers go
+    // through a timerfd since the ring is waited on without a timeout
+    int udp_slot = -1, timer_slot = -1;
+    if (w->udp) {
+        udp_slot = uring_slot_alloc(w, w->udp->sock);
+        if (udp_slot < 0) err_quit("Failed to register UDP socket");
+        sqe = uring_get_sqe(&w->ring);
+        uring_prep_poll(sqe, (unsigned)udp_slot, POLLIN, OP_UDP);
+    }
+    if (w->udp || sched.rate) {
+        w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        timer_slot = w->timer_fd < 0 ? -1 : uring_slot_alloc(w, w->timer_fd);
+        if (timer_slot < 0) err_quit("Failed to set up worker timer");
+        sqe = uring_get_sqe(&w->ring);
+        uring_prep_poll(sqe, (unsigned)timer_slot, POLLIN, OP_TIMER);
+    }
+
+    // Connections whose receive ran out of buffers, oldest first, found by
+    // a scan of the few that are waiting; kept small by the per-connection
+    // queue limit
+    conn_t **starved = (conn_t **)malloc(w->nslots * sizeof(conn_t *));
+    int nstarved = 0;
+    if (!starved) err_quit("Worker allocation failed");
+
+    while (1) {
+        if (w->udp) {
+            udp_run_timers(w->udp);
+            udp_flush(w->udp);
+        }
+        if (timer_slot >= 0) worker_arm_timer(w);
+        if (uring_submit(&w->ring, 1) < 0 && errno != EBUSY) err_quit("io_uring_enter failed");
+        metrics_add(M_SYS_WAIT, 1);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&w->ring)) != NULL) {
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&w->ring);
+
+            int op = (int)(ud & OP_MASK);
+            conn_t *c = (conn_t *)(uintptr_t)(ud & ~(uint64_t)OP_MASK);
+            if (op == OP_ACCEPT) {
+                uring_on_accept(w, res, flags);
+                continue;
+            }
+            if (op == OP_WAKE) {
+                room_inbox_ack(&w->inbox);
+                sqe = uring_get_sqe(&w->ring);
+                if (sqe) uring_prep_poll(sqe, (unsigned)wake_slot, POLLIN, OP_WAKE);
+                continue;
+            }
+            if (op == OP_UDP || op == OP_TIMER) {
+                uint64_t expirations;
+                if (op == OP_UDP) {
+                    udp_receive_batch(w->udp);
+                } else if (read(w->timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    expirations = 0;  // The timers run at the top of the loop either way
+                }
+                sqe = uring_get_sqe(&w->ring);
+                if (sqe) uring_prep_poll(sqe, (unsigned)(op == OP_UDP ? udp_slot : timer_slot), POLLIN, op);
+                continue;
+            }
+            int was_starved = c->starved;
+            if (op == OP_RECV) {
+                uring_on_recv(w, c, res, flags);
+            } else if (op == OP_CANCEL) {
+                c->pending--;
+            } else if (op == OP_POLLOUT) {
+                c->pollout_armed = 0;
+                c->pending--;
+                if (!c->closing && conn_flush(w, c) < 0) uring_conn_close(c);
+                if (!c->closing && conn_backlogged(c) && !c->pollout_armed) uring_arm_pollout(w, c);
+            } else if (op >= OP_WRITE) {
+                uring_on_write(w, c, (unsigned)(op - OP_WRITE), res);
+            }
+            if (c->starved && !was_starved) starved[nstarved++] = c;
+
+            if (c->closing && c->pending == 0) {
+                for (int i = 0; i < nstarved; i++) {
+                    if (starved[i] != c) continue;
+                    memmove(starved + i, starved + i + 1, (nstarved - i - 1) * sizeof(conn_t *));
+                    nstarved--;
+                    break;
+                }
+                uring_conn_free(w, c);
+            }
+        }
+        room_deliver(w);
+        batch_deliver(w);
+        admit_deliver(w);
+        sched_deliver(w);
+
+        int rearmed = 0;
+        while (rearmed < nstarved && w->bufs_free >= URING_REARM_BUFS) {
+            conn_t *c = starved[rearmed++];
+            if (!c->closing && !c->recv_armed && !c->paused) uring_arm_recv(w, c);
+            c->starved = 0;
+        }
+        if (rearmed > 0) {
+            memmove(starved, starved + rearmed, (nstarved - rearmed) * sizeof(conn_t *));
+            nstarved -= rearmed;
+        }
+    }
+    return NULL;
+}
+
+// Gauges for the stats endpoint that no worker owns, the TCP_INFO totals
+// of each tuning profile, and the upload scheduler's state.
+void write_pool_metrics(FILE *out, const char *prefix) {
+    fprintf(out, "# HELP %s_pool_used_bytes Pooled buffer bytes handed out\n# TYPE %s_pool_used_bytes gauge\n", prefix,
+            prefix);
+    fprintf(out, "%s_pool_used_bytes %zu\n", prefix, pool_used_bytes());
+    fprintf(out, "# HELP %s_pool_reserved_bytes Memory held by the buffer pool\n# TYPE %s_pool_reserved_bytes gauge\n",
+            prefix, prefix);
+    fprintf(out, "%s_pool_reserved_bytes %zu\n", prefix, pool_reserved_bytes());
+    tcp_write_metrics(out, prefix);
+    sched_write_metrics(out, prefix);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-W writers] [-z] [-e uring|epoll] [-m conn_kb] [-M port]\n"
+                    "       [-Q buffers] [-K] [-u] [-T role=profile[,key=value...]]\n"
+                    "       [-a uploads] [-A uploads] [-q MB] [-D MB] [-B MB/s]\n", prog);
+    fprintf(stderr, "  -w N  number of worker threads (default: one per CPU)\n");
+    fprintf(stderr, "  -W N  threads creating the files of batch uploads (default %d, 0: the workers do it)\n",
+            BATCH_WRITERS);
+    fprintf(stderr, "  -z    zero-copy file receive with splice() (epoll only)\n");
+    fprintf(stderr, "  -e    event loop: io_uring (default, falls back to epoll) or epoll\n");
+    fprintf(stderr, "  -m N  memory limit per connection in KB (default %d)\n", CONN_MEM_MAX_KB);
+    fprintf(stderr, "  -M N  Prometheus metrics on 127.0.0.1:N (default %d, 0 disables)\n", METRICS_PORT);
+    fprintf(stderr, "  -Q N  1 MB write-behind buffers per epoll worker (default %d, 0 writes inline)\n", STAGE_DEPTH);
+    fprintf(stderr, "  -K    keep received files in the page cache instead of writing with O_DIRECT\n");
+    fprintf(stderr, "  -u    also serve UDP clients on the same port, from the same workers\n");
+    fprintf(stderr, "  -T    socket profile of the chat or bulk role: interactive, bulk or lan-low-latency,\n"
+                    "        optionally with sndbuf, rcvbuf, nodelay, cork, lowat, busy_poll or keepalive changed\n");
+    fprintf(stderr, "  -a N  uploads in progress at once; more wait in line (default: no limit)\n");
+    fprintf(stderr, "  -A N  uploads in progress at once per user; more wait in line (default: no limit)\n");
+    fprintf(stderr, "  -q N  MB each user may upload; larger uploads are refused (default: no limit)\n");
+    fprintf(stderr, "  -D N  MB to keep free on the disk; uploads that would use them are refused (default 0)\n");
+    fprintf(stderr, "  -B N  MB/s for all uploads together, shared equally by the users sending (default: no limit)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int metrics_port = METRICS_PORT;
+    int nwriters = BATCH_WRITERS;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:W:ze:m:M:T:Q:Kua:A:q:D:B:")) != -1) {
+        switch (opt) {
+        case 'w':
+            nworkers = atol(optarg);
+            break;
+        case 'W':
+            nwriters = atoi(optarg);
+            break;
+        case 'z':
+            zero_copy = 1;
+            break;
+        case 'm':
+            conn_mem_max = (size_t)atol(optarg) * 1024;
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            break;
+        case 'T':
+            if (tcp_profile_parse(optarg) < 0) usage(argv[0]);
+            break;
+        case 'Q':
+            stage_depth = atoi(optarg);
+            break;
+        case 'K':
+            stage_keep_cache = 1;
+            break;
+        case 'u':
+            serve_udp = 1;
+            break;
+        case 'a':
+            sched.max_active = atoi(optarg);
+            break;
+        case 'A':
+            sched.max_user_active = atoi(optarg);
+            break;
+        case 'q':
+            sched.quota = (uint64_t)atoll(optarg) * 1000000;
+            break;
+        case 'D':
+            sched.disk_reserve = (uint64_t)atoll(optarg) * 1000000;
+            break;
+        case 'B':
+            sched.rate = (uint64_t)(atof(optarg) * 1e6);
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = 1;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                use_uring = 0;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    if (nwriters < 0 || nwriters > BATCH_MAX_WRITERS) usage(argv[0]);
+    if (stage_depth < 0 || stage_depth > STAGE_MAX_DEPTH) usage(argv[0]);
+    if (sched.max_active < 0 || sched.max_user_active < 0) usage(argv[0]);
+    sched.dir = SAVE_DIR;
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    save_dir_create(SAVE_DIR);
+    if (serve_udp) save_dir_create(UDP_SAVE_DIR);
+
+    // Every worker owns an event loop and its own SO_REUSEPORT listener,
+    // so the kernel spreads incoming connections without a shared accept lock.
+    // With -u it also owns a UDP shard; all of them are bound before any
+    // thread starts (udp_shard_init).
+    worker_t *workers = (worker_t *)calloc(nworkers, sizeof(worker_t));
+    udp_shard_t *shards = serve_udp ? (udp_shard_t *)calloc(nworkers, sizeof(udp_shard_t)) : NULL;
+    if (!workers || (serve_udp && !shards)) err_quit("Worker allocation failed");
+
+    for (int i = 0; use_uring && i < nworkers; i++) {
+        if (uring_worker_init(&workers[i]) < 0) {
+            printf("io_uring unavailable (%s), using epoll\n", strerror(errno));
+            use_uring = 0;
+        }
+    }
+    if (use_uring && zero_copy) {
+        printf("-z has no effect with io_uring: bodies are written from the receive buffers\n");
+        zero_copy = 0;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->listen_fd = create_listener();
+        if (room_inbox_init(&w->inbox) < 0) err_quit("eventfd failed");
+        batch_inbox_init(&w->batches, w->inbox.efd);
+        sched_inbox_init(&w->admits, w->inbox.efd);
+        // io_uring writes bodies asynchronously already; epoll workers get
+        // a writer thread, labelled after the batch writers
+        int depth = use_uring || zero_copy ? 0 : stage_depth;
+        if (stage_init(&w->stage, depth, stage_keep_cache, w->inbox.efd, (int)nworkers + nwriters + i) < 0) {
+            err_quit("Write-behind buffer allocation failed");
+        }
+        if (serve_udp) {
+            w->udp = &shards[i];
+            // Without write-behind: a shard whose buffers are all in flight
+            // waits for its writer (stage_copy), and here that would stall
+            // the worker's TCP connections too
+            if (udp_shard_init(w->udp, i, SERVERPORT, 0, stage_keep_cache, 0) < 0) {
+                err_quit("UDP shard setup failed");
+            }
+            w->udp->admit = 1;
+        }
+        if (use_uring) {
+            fcntl(w->listen_fd, F_SETFL, fcntl(w->listen_fd, F_GETFL) & ~O_NONBLOCK);
+            continue;
+        }
+        w->epfd = epoll_create1(0);
+        if (w->epfd < 0) err_quit("epoll_create1 failed");
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) {
+            err_quit("epoll_ctl failed");
+        }
+        ev.data.ptr = &w->inbox;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->inbox.efd, &ev) < 0) {
+            err_quit("epoll_ctl failed");
+        }
+        ev.data.ptr = w->udp;
+        if (w->udp && epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->udp->sock, &ev) < 0) {
+            err_quit("epoll_ctl failed");
+        }
+    }
+
+    printf("Server started on port %d (%ld %s workers, %s receive)\n", SERVERPORT, nworkers,
+           use_uring ? "io_uring" : "epoll", use_uring ? "fixed-buffer" : zero_copy ? "zero-copy" : stage_depth ? "write-behind" : "buffered");
+    if (serve_udp) {
+        printf("UDP on port %d from the same workers (GRO %s, inline writes)\n", SERVERPORT,
+               shards[0].gro ? "on" : "off");
+    }
+
+    if (sched.max_active || sched.max_user_active || sched.quota || sched.disk_reserve || sched.rate) {
+        printf("Upload limits: %d at once, %d per user, %llu MB per user, %llu MB kept free, %.1f MB/s (0: none)\n",
+               sched.max_active, sched.max_user_active, (unsigned long long)(sched.quota / 1000000),
+               (unsigned long long)(sched.disk_reserve / 1000000), sched.rate / 1e6);
+    }
+
+    for (int r = 0; r < TCP_ROLES; r++) {
+        char desc[320];
+        tcp_profile_describe(r, desc, sizeof(desc));
+        printf("Socket profile %s\n", desc);
+    }
+
+    if (metrics_port > 0) {
+        if (metrics_serve(metrics_port, "server_tcp", write_pool_metrics) < 0) {
+            printf("Metrics endpoint unavailable on port %d: %s\n", metrics_port, strerror(errno));
+        } else {
+            printf("Metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+        }
+    }
+
+    if (batch_writers_start(nwriters, (int)nworkers) < 0) err_quit("Failed to create batch writer threads");
+
+    void *(*loop)(void *) = use_uring ? uring_worker_loop : worker_loop;
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, loop, &workers[i]) != 0) {
+            err_quit("Failed to create worker thread");
+        }
+    }
+    loop(&workers[0]);
+
+    return 0;
+}
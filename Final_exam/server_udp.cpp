@@ -1,153 +1,121 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <direct.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "udp_server.h"
 
 #define SERVERPORT 9000
-#define BUFSIZE 65536
-#define SAVE_DIR "udp_received\\"
+#define MAX_WORKERS 256
+#define METRICS_PORT 9101                 // Stats endpoint on 127.0.0.1 (-M)
 
-#pragma comment(lib, "ws2_32.lib")
+// Write-behind buffers per worker (0 writes inline), and whether the
+// writer leaves received files in the page cache.
+static int stage_depth = STAGE_DEPTH;
+static int stage_keep_cache = 0;
 
 void err_quit(const char *msg) {
-    fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
     exit(1);
 }
 
-void create_save_directory() {
-    if (_mkdir(SAVE_DIR) == 0) {
-        printf("Directory '%s' created successfully.\n", SAVE_DIR);
-    } else if (errno == EEXIST) {
-        // Directory already exists, no problem
-    } else {
-        printf("Failed to create directory '%s'\n", SAVE_DIR);
-    }
-}
-
-void receive_file(SOCKET sock, struct sockaddr_in *clientaddr, int addrlen, const char *filename, long long file_size) {
-    char full_path[512];
-    snprintf(full_path, sizeof(full_path), "%s%s", SAVE_DIR, filename);
+// Each worker owns a shard (udp_server.h): its socket and the sessions of
+// every peer the kernel hashes to it.
+void *worker_loop(void *data) {
+    udp_shard_t *w = (udp_shard_t *)data;
+    w->report_batches = 1;
+    w->stat_cpu_us = thread_cpu_us();
+    metrics_thread_init(w->id);
 
-    FILE *file = fopen(full_path, "wb");
-    if (!file) {
-        printf("Error: Cannot create file '%s'\n", full_path);
-        const char *failmsg = "FILE_FAIL";
-        sendto(sock, failmsg, (int)strlen(failmsg), 0, (struct sockaddr *)clientaddr, addrlen);
-        return;
+    while (1) {
+        udp_flush(w);
+        struct pollfd pfd = {w->sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, udp_timeout_ms(w));
+        metrics_add(M_SYS_WAIT, 1);
+        udp_run_timers(w);
+        if (ready <= 0) continue;
+
+        udp_receive_batch(w);
     }
+    return NULL;
+}
 
-    const char *ready_msg = "READY";
-    sendto(sock, ready_msg, (int)strlen(ready_msg), 0, (struct sockaddr *)clientaddr, addrlen);
-
-    char buf[BUFSIZE];
-    long long total_received = 0;
-
-    while (total_received < file_size) {
-        int bytes_to_recv = (int)((file_size - total_received) < BUFSIZE ? (file_size - total_received) : BUFSIZE);
-        int bytes_received = recvfrom(sock, buf, bytes_to_recv, 0, NULL, NULL);
-        if (bytes_received == SOCKET_ERROR) {
-            printf("recvfrom failed: %d\n", WSAGetLastError());
-            fclose(file);
-            remove(full_path);
-            return;
-        }
-        if (bytes_received == 0) break;
-
-        fwrite(buf, 1, bytes_received, file);
-        total_received += bytes_received;
+// Gauges for the stats endpoint that no worker owns.
+void write_pool_metrics(FILE *out, const char *prefix) {
+    fprintf(out, "# HELP %s_pool_used_bytes Pooled buffer bytes handed out\n# TYPE %s_pool_used_bytes gauge\n", prefix,
+            prefix);
+    fprintf(out, "%s_pool_used_bytes %zu\n", prefix, pool_used_bytes());
+    fprintf(out, "# HELP %s_pool_reserved_bytes Memory held by the buffer pool\n# TYPE %s_pool_reserved_bytes gauge\n",
+            prefix, prefix);
+    fprintf(out, "%s_pool_reserved_bytes %zu\n", prefix, pool_reserved_bytes());
+}
 
-        printf("Received %lld/%lld bytes (%.2f%%)\r", total_received, file_size, (double)total_received / file_size * 100);
-    }
-    printf("\n");
-
-    fclose(file);
-
-    if (total_received == file_size) {
-        printf("File received successfully: %s\n", full_path);
-        const char *okmsg = "FILE_OK";
-        sendto(sock, okmsg, (int)strlen(okmsg), 0, (struct sockaddr *)clientaddr, addrlen);
-    } else {
-        printf("File transfer incomplete\n");
-        const char *failmsg = "FILE_FAIL";
-        sendto(sock, failmsg, (int)strlen(failmsg), 0, (struct sockaddr *)clientaddr, addrlen);
-        remove(full_path);
-    }
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-M port] [-Q buffers] [-K]\n", prog);
+    fprintf(stderr, "  -w N  number of receive threads, each with its own socket (default: one per CPU)\n");
+    fprintf(stderr, "  -M N  Prometheus metrics on 127.0.0.1:N (default %d, 0 disables)\n", METRICS_PORT);
+    fprintf(stderr, "  -Q N  1 MB write-behind buffers per worker (default %d, 0 writes inline)\n", STAGE_DEPTH);
+    fprintf(stderr, "  -K    keep received files in the page cache instead of writing with O_DIRECT\n");
+    exit(1);
 }
 
-int main() {
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        err_quit("WSAStartup failed");
+int main(int argc, char **argv) {
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int metrics_port = METRICS_PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:M:Q:K")) != -1) {
+        switch (opt) {
+        case 'w':
+            nworkers = atol(optarg);
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            break;
+        case 'Q':
+            stage_depth = atoi(optarg);
+            break;
+        case 'K':
+            stage_keep_cache = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    if (stage_depth < 0 || stage_depth > STAGE_MAX_DEPTH) usage(argv[0]);
 
-    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock == INVALID_SOCKET) {
-        err_quit("Socket creation failed");
-    }
+    save_dir_create(UDP_SAVE_DIR);
 
-    struct sockaddr_in serveraddr = {0};
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serveraddr.sin_port = htons(SERVERPORT);
+    // All sockets are bound before any thread starts
+    udp_shard_t *workers = (udp_shard_t *)calloc(nworkers, sizeof(udp_shard_t));
+    if (!workers) err_quit("Worker allocation failed");
 
-    if (bind(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) == SOCKET_ERROR) {
-        err_quit("Bind failed");
+    for (int i = 0; i < nworkers; i++) {
+        if (udp_shard_init(&workers[i], i, SERVERPORT, stage_depth, stage_keep_cache, (int)nworkers + i) < 0) {
+            err_quit("Worker setup failed");
+        }
     }
 
-    create_save_directory();
-
-    printf("UDP server started on port %d\n", SERVERPORT);
-
-    char buf[BUFSIZE];
-    struct sockaddr_in clientaddr;
-    int addrlen = sizeof(clientaddr);
-
-    char last_username[64] = "[unknown]";
-
-    while (1) {
-        int retval = recvfrom(sock, buf, BUFSIZE - 1, 0, (struct sockaddr *)&clientaddr, &addrlen);
-        if (retval == SOCKET_ERROR) {
-            printf("recvfrom failed: %d\n", WSAGetLastError());
-            continue;
-        }
-        buf[retval] = '\0';
-
-        // Parse USER message
-        if (strncmp(buf, "USER:", 5) == 0) {
-            strncpy(last_username, buf + 5, sizeof(last_username) - 1);
-            last_username[sizeof(last_username) - 1] = '\0';
-            printf("Client identified as: %s\n", last_username);
-            const char *ok = "USER_OK";
-            sendto(sock, ok, (int)strlen(ok), 0, (struct sockaddr *)&clientaddr, addrlen);
-            continue;
+    printf("UDP server started on port %d (%ld workers, GRO %s, %s)\n", SERVERPORT, nworkers,
+           workers[0].gro ? "on" : "off", stage_depth ? "write-behind" : "inline writes");
+    if (metrics_port > 0) {
+        if (metrics_serve(metrics_port, "server_udp", write_pool_metrics) < 0) {
+            printf("Metrics endpoint unavailable on port %d: %s\n", metrics_port, strerror(errno));
+        } else {
+            printf("Metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
         }
+    }
 
-        // Parse FILE message
-        if (strncmp(buf, "FILE:", 5) == 0) {
-            // Format: FILE:<filename>:<filesize>
-            char *last_colon = strrchr(buf, ':');
-            if (!last_colon) continue;
-
-            long long file_size = atoll(last_colon + 1);
-            *last_colon = '\0';
-            char *filename = buf + 5;
-
-            printf("[%s] File transfer requested: %s (%lld bytes)\n", last_username, filename, file_size);
-            receive_file(sock, &clientaddr, addrlen, filename, file_size);
-            continue;
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            err_quit("Failed to create worker thread");
         }
-
-        // Otherwise treat as message
-        printf("[%s] says: %s\n", last_username, buf);
-
-        // Echo message back
-        sendto(sock, buf, retval, 0, (struct sockaddr *)&clientaddr, addrlen);
     }
+    worker_loop(&workers[0]);
 
-    closesocket(sock);
-    WSACleanup();
     return 0;
 }
@@ -0,0 +1,124 @@
+// Per-peer state for the UDP server.
+//
+// Sessions live in a fixed-size open-addressing hash table keyed by the
+// peer's address and port plus a session id. Id 0 is the peer itself (its
+// username); every file upload is a separate session under the stream id
+// of its FRAME_FILE, so one client can run several uploads at once and
+// datagrams from different peers never touch each other's files. Lookups
+// use linear probing and removal shifts later entries back instead of
+// leaving tombstones, so the table never needs rebuilding and handling a
+// datagram allocates nothing. Entries are kept to one cache line; the bulk
+// of an upload's state lives in a struct upload owned by the server.
+//
+// The table is not locked: each server thread owns one, together with its
+// own SO_REUSEPORT socket, and the kernel always hashes a given peer to the
+// same socket.
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define SESSION_TABLE_SIZE 4096            // Slots per thread, power of two
+#define SESSION_MAX_LOAD (SESSION_TABLE_SIZE * 3 / 4)
+#define SESSION_PEER_ID 0
+#define SESSION_PEER_IDLE_US 600000000ULL  // Forget a silent peer after 10 minutes
+
+typedef enum {
+    SESSION_FREE = 0,
+    SESSION_PEER,
+    SESSION_UPLOAD
+} session_kind_t;
+
+typedef struct {
+    uint32_t addr;  // Network byte order, as in sockaddr_in
+    uint16_t port;
+    uint32_t id;
+} session_key_t;
+
+typedef struct {
+    session_key_t key;
+    uint8_t kind;
+    uint64_t last_us;         // SESSION_PEER: last frame from the peer
+    char username[32];        // SESSION_PEER
+    struct upload *upload;    // SESSION_UPLOAD, owned by the server
+} session_t;
+
+typedef struct {
+    session_t *slots;
+    uint32_t count;
+} session_table_t;
+
+static inline session_key_t session_key(const struct sockaddr_in *peer, uint32_t id) {
+    session_key_t key;
+    key.addr = peer->sin_addr.s_addr;
+    key.port = peer->sin_port;
+    key.id = id;
+    return key;
+}
+
+static inline int session_key_eq(const session_key_t *a, const session_key_t *b) {
+    return a->addr == b->addr && a->port == b->port && a->id == b->id;
+}
+
+static inline uint32_t session_hash(const session_key_t *key) {
+    // splitmix64 finalizer over the packed key
+    uint64_t h = ((uint64_t)key->addr << 16 | key->port) ^ ((uint64_t)key->id * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (uint32_t)h & (SESSION_TABLE_SIZE - 1);
+}
+
+static inline int session_table_init(session_table_t *t) {
+    t->slots = (session_t *)calloc(SESSION_TABLE_SIZE, sizeof(session_t));
+    t->count = 0;
+    return t->slots ? 0 : -1;
+}
+
+static inline session_t *session_find(session_table_t *t, const session_key_t *key) {
+    for (uint32_t i = session_hash(key);; i = (i + 1) & (SESSION_TABLE_SIZE - 1)) {
+        session_t *s = &t->slots[i];
+        if (s->kind == SESSION_FREE) return NULL;
+        if (session_key_eq(&s->key, key)) return s;
+    }
+}
+
+// Claim a zeroed slot for a key that is not in the table yet. Returns NULL
+// when the table is full.
+static inline session_t *session_insert(session_table_t *t, const session_key_t *key, session_kind_t kind) {
+    if (t->count >= SESSION_MAX_LOAD) return NULL;
+    uint32_t i = session_hash(key);
+    while (t->slots[i].kind != SESSION_FREE) i = (i + 1) & (SESSION_TABLE_SIZE - 1);
+
+    session_t *s = &t->slots[i];
+    memset(s, 0, sizeof(*s));
+    s->key = *key;
+    s->kind = (uint8_t)kind;
+    t->count++;
+    return s;
+}
+
+// Free a slot, moving later members of its probe chain back so lookups
+// never stop early. Entries may move: pointers into the table are only
+// valid until the next removal.
+static inline void session_remove(session_table_t *t, session_t *s) {
+    uint32_t mask = SESSION_TABLE_SIZE - 1;
+    uint32_t hole = (uint32_t)(s - t->slots);
+    for (uint32_t i = (hole + 1) & mask; t->slots[i].kind != SESSION_FREE; i = (i + 1) & mask) {
+        uint32_t home = session_hash(&t->slots[i].key);
+        // Move the entry only if its home slot is not between the hole and i
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    memset(&t->slots[hole], 0, sizeof(session_t));
+    t->count--;
+}
+
+#endif
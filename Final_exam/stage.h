@@ -0,0 +1,408 @@
+// Write-behind staging for received file bodies, shared by both servers.
+//
+// A network worker receives body bytes straight into 1 MB staging buffers
+// (page aligned, so they can go to disk with O_DIRECT) and hands each full
+// one to its own writer thread. Buffers travel over two single-producer
+// single-consumer rings: the worker pushes full ones onto `todo`, the
+// writer pushes written ones back onto `done`, and neither side takes a
+// lock. A worker owns `depth` buffers; while all of them are queued the
+// caller decides what to do (the TCP server stops reading the connection,
+// the UDP server waits), so a slow disk costs at most depth MB of memory
+// and stalls the network only once that is used up.
+//
+// The writer opens each file a second time with O_DIRECT and writes every
+// aligned buffer through it, bypassing the page cache; the unaligned tail
+// of a file goes through the ordinary descriptor. On filesystems without
+// O_DIRECT it uses pwrite(), starts writeback of each buffer with
+// sync_file_range() and, once the previous one is on disk, drops it from
+// the cache with POSIX_FADV_DONTNEED, so received files do not push other
+// data out of memory either way. -K keeps plain buffered writes.
+//
+// A file stays alive until its last queued buffer is written: the owner
+// and every buffer in flight hold a reference, and the writer has its own
+// descriptors, so the owner may close and even unlink it at any time.
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "metrics.h"
+
+#define STAGE_BUF_SIZE (1024 * 1024)
+#define STAGE_ALIGN 4096      // O_DIRECT offsets, lengths and buffers
+#define STAGE_DEPTH 16        // Buffers per worker (-Q)
+#define STAGE_MAX_DEPTH 1024
+
+typedef struct {
+    int fd;               // Writer's descriptors: buffered...
+    int dfd;              // ...and O_DIRECT, or -1
+    int refs;             // The owner's and one per queued buffer
+    int pending;          // Buffers queued and not written yet
+    int error;            // errno of the first failed write, 0 if none
+    struct stage_buf *cur;  // Owner's buffer being filled
+
+    // Writer only: the range written last, dropped from the cache once
+    // the next one has been written (no O_DIRECT)
+    uint64_t prev_off;
+    uint64_t prev_len;
+} stage_file_t;
+
+typedef struct stage_buf {
+    stage_file_t *file;
+    char *data;
+    uint64_t off;         // File offset of data[0]
+    uint32_t len;
+    uint64_t fill_us;     // First byte staged
+    uint64_t queued_us;   // Handed to the writer
+} stage_buf_t;
+
+typedef struct {
+    uint32_t mask;
+    uint32_t head;        // Next slot the consumer takes
+    uint32_t tail;        // Next slot the producer fills
+    stage_buf_t **slots;
+} stage_ring_t;
+
+typedef struct {
+    int depth;            // 0: write-behind off
+    int keep_cache;
+    char *mem;
+    stage_buf_t *bufs;
+    stage_ring_t todo;    // Worker -> writer
+    stage_ring_t done;    // Writer -> worker
+    stage_buf_t **free;   // Worker's buffers ready to fill
+    int nfree;
+    int inflight;         // Handed to the writer and not reclaimed yet
+    int wake_fd;          // The writer sleeps on this eventfd...
+    int sleeping;         // ...after setting this
+    int notify_fd;        // Owner's eventfd, written when a buffer comes back...
+    int notify;           // ...if the owner asked
+    int metrics_id;
+    pthread_t thread;
+} stage_t;
+
+static inline int stage_ring_init(stage_ring_t *r, int depth) {
+    uint32_t cap = 1;
+    while (cap < (uint32_t)depth) cap <<= 1;
+    r->slots = (stage_buf_t **)calloc(cap, sizeof(stage_buf_t *));
+    r->mask = cap - 1;
+    r->head = r->tail = 0;
+    return r->slots ? 0 : -1;
+}
+
+// Producer side. Never full: at most depth buffers exist.
+static inline void stage_ring_push(stage_ring_t *r, stage_buf_t *b) {
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    r->slots[tail & r->mask] = b;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Consumer side: the oldest buffer, or NULL.
+static inline stage_buf_t *stage_ring_pop(stage_ring_t *r) {
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return NULL;
+    stage_buf_t *b = r->slots[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return b;
+}
+
+static inline int stage_ring_empty(stage_ring_t *r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline void stage_wake(int fd) {
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+// Owner side: open path for the writer. fd is the owner's descriptor of
+// the same file; the writer uses a duplicate. NULL (errno set) on failure.
+static inline stage_file_t *stage_file_open(stage_t *st, const char *path, int fd) {
+    stage_file_t *f = (stage_file_t *)pbuf_alloc(sizeof(stage_file_t));
+    if (!f) return NULL;
+    memset(f, 0, sizeof(*f));
+    f->fd = dup(fd);
+    if (f->fd < 0) {
+        pbuf_put(f);
+        return NULL;
+    }
+    f->dfd = st->keep_cache ? -1 : open(path, O_WRONLY | O_DIRECT);
+    f->refs = 1;
+    return f;
+}
+
+static inline void stage_file_put(stage_file_t *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    close(f->fd);
+    if (f->dfd >= 0) close(f->dfd);
+    pbuf_put(f);
+}
+
+static inline int stage_pwrite(int fd, const char *data, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Writer side: put one buffer on disk.
+static inline int stage_write(stage_t *st, stage_buf_t *b) {
+    stage_file_t *f = b->file;
+    const char *p = b->data;
+    uint64_t off = b->off;
+    size_t len = b->len;
+
+    if (f->dfd >= 0 && off % STAGE_ALIGN == 0 && len >= STAGE_ALIGN) {
+        size_t direct = len & ~(size_t)(STAGE_ALIGN - 1);
+        if (stage_pwrite(f->dfd, p, direct, off) == 0) {
+            p += direct;
+            off += direct;
+            len -= direct;
+        } else if (errno == EINVAL) {
+            close(f->dfd);  // Accepted at open, refused now: stay buffered
+            f->dfd = -1;
+        } else {
+            return -1;
+        }
+    }
+    if (len > 0 && stage_pwrite(f->fd, p, len, off) < 0) return -1;
+    if (f->dfd >= 0 || st->keep_cache) return 0;
+
+    // Start this buffer's writeback, then wait for the previous one's and
+    // drop it, so only about two buffers per file sit in the cache
+    sync_file_range(f->fd, (off_t)b->off, b->len, SYNC_FILE_RANGE_WRITE);
+    if (f->prev_len > 0) {
+        sync_file_range(f->fd, (off_t)f->prev_off, (off_t)f->prev_len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(f->fd, (off_t)f->prev_off, (off_t)f->prev_len, POSIX_FADV_DONTNEED);
+    }
+    f->prev_off = b->off;
+    f->prev_len = b->len;
+    return 0;
+}
+
+static inline void *stage_writer_loop(void *data) {
+    stage_t *st = (stage_t *)data;
+    metrics_thread_init(st->metrics_id);
+    while (1) {
+        stage_buf_t *b = stage_ring_pop(&st->todo);
+        if (!b) {
+            // Announce the sleep before looking once more, so a push in
+            // between either is seen here or sees the flag
+            __atomic_store_n(&st->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (stage_ring_empty(&st->todo)) {
+                uint64_t n;
+                ssize_t r = read(st->wake_fd, &n, sizeof(n));
+                (void)r;
+            }
+            __atomic_store_n(&st->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        uint64_t start = now_us();
+        metrics_record(H_STAGE_QUEUE_US, start - b->queued_us);
+        stage_file_t *f = b->file;
+        if (!__atomic_load_n(&f->error, __ATOMIC_RELAXED) && stage_write(st, b) < 0) {
+            __atomic_store_n(&f->error, errno ? errno : EIO, __ATOMIC_RELAXED);
+        }
+        metrics_add(M_SYS_WRITE, 1);
+        metrics_record(H_WRITE_US, now_us() - start);
+
+        b->file = NULL;
+        __atomic_sub_fetch(&f->pending, 1, __ATOMIC_RELEASE);
+        stage_file_put(f);
+        stage_ring_push(&st->done, b);
+        if (__atomic_exchange_n(&st->notify, 0, __ATOMIC_SEQ_CST)) stage_wake(st->notify_fd);
+    }
+    return NULL;
+}
+
+// Set up depth buffers and start the writer, labelled metrics_id. The
+// writer wakes notify_fd when asked (stage_want_notify); -1 gives the
+// stage an eventfd of its own, for stage_wait. depth 0 leaves it off.
+static inline int stage_init(stage_t *st, int depth, int keep_cache, int notify_fd, int metrics_id) {
+    memset(st, 0, sizeof(*st));
+    st->keep_cache = keep_cache;
+    st->metrics_id = metrics_id;
+    if (depth <= 0) return 0;
+
+    // Reserved up front, but pages are only touched once a buffer is used
+    st->mem = (char *)mmap(NULL, (size_t)depth * STAGE_BUF_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (st->mem == MAP_FAILED) return -1;
+    st->bufs = (stage_buf_t *)calloc(depth, sizeof(stage_buf_t));
+    st->free = (stage_buf_t **)calloc(depth, sizeof(stage_buf_t *));
+    st->wake_fd = eventfd(0, EFD_CLOEXEC);
+    st->notify_fd = notify_fd >= 0 ? notify_fd : eventfd(0, EFD_CLOEXEC);
+    if (!st->bufs || !st->free || st->wake_fd < 0 || st->notify_fd < 0 || stage_ring_init(&st->todo, depth) < 0 ||
+        stage_ring_init(&st->done, depth) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < depth; i++) {
+        st->bufs[i].data = st->mem + (size_t)i * STAGE_BUF_SIZE;
+        st->free[st->nfree++] = &st->bufs[i];
+    }
+    if (pthread_create(&st->thread, NULL, stage_writer_loop, st) != 0) return -1;
+    pthread_detach(st->thread);
+    st->depth = depth;
+    return 0;
+}
+
+// Owner side: take back every buffer the writer is done with. Returns how
+// many are free.
+static inline int stage_reclaim(stage_t *st) {
+    stage_buf_t *b;
+    while ((b = stage_ring_pop(&st->done)) != NULL) {
+        st->free[st->nfree++] = b;
+        st->inflight--;
+    }
+    return st->nfree;
+}
+
+// Owner side: have notify_fd written when the next buffer comes back.
+// Look at the done ring (stage_reclaim) afterwards, not before, or a
+// buffer returned in between goes unnoticed.
+static inline void stage_want_notify(stage_t *st) {
+    __atomic_store_n(&st->notify, 1, __ATOMIC_SEQ_CST);
+}
+
+// Owner side: block until the writer returns another buffer, unless one
+// came back since the caller last looked.
+static inline void stage_wait(stage_t *st) {
+    int inflight = st->inflight;
+    stage_reclaim(st);
+    if (st->inflight < inflight) return;
+    stage_want_notify(st);
+    if (stage_ring_empty(&st->done)) {
+        uint64_t n;
+        ssize_t r = read(st->notify_fd, &n, sizeof(n));
+        (void)r;
+    }
+    stage_reclaim(st);
+}
+
+// Owner side: hand the file's current buffer to the writer.
+static inline void stage_submit(stage_t *st, stage_file_t *f) {
+    stage_buf_t *b = f->cur;
+    if (!b) return;
+    f->cur = NULL;
+    uint64_t now = now_us();
+    metrics_record(H_STAGE_FILL_US, now - b->fill_us);
+    b->queued_us = now;
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->pending, 1, __ATOMIC_RELAXED);
+    st->inflight++;
+    stage_ring_push(&st->todo, b);
+    if (__atomic_load_n(&st->sleeping, __ATOMIC_SEQ_CST)) stage_wake(st->wake_fd);
+}
+
+// Owner side: with more files open than buffers, every buffer can end up
+// half filled by some file and none come back. Then the one filled
+// longest ago goes to the writer as it is.
+static inline void stage_evict(stage_t *st) {
+    if (st->inflight > 0) return;
+    stage_buf_t *oldest = NULL;
+    for (int i = 0; i < st->depth; i++) {
+        stage_buf_t *b = &st->bufs[i];
+        if (b->file && b->file->cur == b && (!oldest || b->fill_us < oldest->fill_us)) oldest = b;
+    }
+    if (oldest) stage_submit(st, oldest->file);
+}
+
+// Owner side: where the next bytes of the file, at offset off, go; *room
+// is how many fit. A buffer not continuing at off is handed on first.
+// NULL when every buffer is in flight (counted as a stall).
+static inline char *stage_reserve(stage_t *st, stage_file_t *f, uint64_t off, size_t *room) {
+    if (f->cur && f->cur->off + f->cur->len != off) stage_submit(st, f);
+    if (!f->cur) {
+        if (st->nfree == 0 && stage_reclaim(st) == 0) {
+            stage_evict(st);
+            metrics_add(M_STAGE_STALLS, 1);
+            return NULL;
+        }
+        stage_buf_t *b = st->free[--st->nfree];
+        b->file = f;
+        b->off = off;
+        b->len = 0;
+        b->fill_us = now_us();
+        f->cur = b;
+    }
+    *room = STAGE_BUF_SIZE - f->cur->len;
+    return f->cur->data + f->cur->len;
+}
+
+// Owner side: n bytes were put where stage_reserve pointed. A full buffer
+// goes to the writer at once.
+static inline void stage_commit(stage_t *st, stage_file_t *f, size_t n) {
+    f->cur->len += (uint32_t)n;
+    if (f->cur->len == STAGE_BUF_SIZE) stage_submit(st, f);
+}
+
+// Owner side: copy len bytes at offset off into staging, waiting for the
+// writer whenever every buffer is in flight.
+static inline void stage_copy(stage_t *st, stage_file_t *f, const char *data, size_t len, uint64_t off) {
+    while (len > 0) {
+        size_t room;
+        char *p = stage_reserve(st, f, off, &room);
+        if (!p) {
+            stage_wait(st);
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(p, data, n);
+        stage_commit(st, f, n);
+        data += n;
+        off += n;
+        len -= n;
+    }
+}
+
+// Owner side: hand on what is staged. Returns how many buffers of the
+// file are still being written.
+static inline int stage_flush(stage_t *st, stage_file_t *f) {
+    stage_submit(st, f);
+    return __atomic_load_n(&f->pending, __ATOMIC_ACQUIRE);
+}
+
+// Owner side: flush and wait until every byte is in the file.
+static inline void stage_sync(stage_t *st, stage_file_t *f) {
+    while (stage_flush(st, f) > 0) stage_wait(st);
+}
+
+// Owner side: let go of a file whose buffers are all written. Returns 0,
+// or -1 with errno set to the error of the first write that failed.
+static inline int stage_file_close(stage_file_t *f) {
+    int error = __atomic_load_n(&f->error, __ATOMIC_ACQUIRE);
+    stage_file_put(f);
+    if (error) errno = error;
+    return error ? -1 : 0;
+}
+
+// Owner side: give up a file; what is already queued still gets written.
+static inline void stage_file_abort(stage_t *st, stage_file_t *f) {
+    if (f->cur) {
+        f->cur->file = NULL;
+        st->free[st->nfree++] = f->cur;
+        f->cur = NULL;
+    }
+    stage_file_put(f);
+}
+
+#endif
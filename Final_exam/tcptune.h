@@ -0,0 +1,253 @@
+// Socket tuning profiles for the TCP server and client.
+//
+// A connection carries one of two kinds of traffic at a time: chat (small
+// frames, where latency matters) and bulk (file bodies, where throughput
+// does). Each role has a profile of socket options, applied when the
+// connection changes role: the server switches a connection to bulk when
+// it starts an upload and back to chat when the upload ends, the client
+// does the same around each upload, and connections that only carry file
+// data stay bulk. The built-in profiles are
+//
+//   interactive      TCP_NODELAY, TCP_NOTSENT_LOWAT 16 KB so queued chat
+//                    waits in the application (where rooms can drop it)
+//                    rather than in the socket, keepalive after 60 s idle
+//   bulk             buffers left to the kernel's autotuning, TCP_CORK
+//                    around each chunk header and its body, keepalive
+//   lan-low-latency  interactive plus SO_BUSY_POLL 50 us and 256 KB
+//                    buffers, keepalive after 10 s
+//
+// and `-T role=profile[,key=value...]` picks another one for a role or
+// changes single options (sndbuf, rcvbuf, nodelay, cork, lowat,
+// busy_poll, keepalive), so tuning needs no rebuild. Buffer sizes above
+// net.core.[rw]mem_max use SO_*BUFFORCE when the process may. A buffer
+// size, once set, stays for the life of the connection.
+//
+// Every connection's TCP_INFO is sampled while it is in use (at most once
+// a second, and when it changes role or closes) and added to its
+// profile's totals: samples, smoothed RTT, receive-side RTT, congestion
+// window, receive space and retransmitted segments. The server exports
+// them per profile on its stats endpoint.
+#ifndef TCPTUNE_H
+#define TCPTUNE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define TCP_SAMPLE_INTERVAL_US 1000000  // TCP_INFO per connection at most this often
+#define TCP_PROFILE_NAME 24
+
+typedef enum {
+    TCP_ROLE_CHAT,
+    TCP_ROLE_BULK,
+    TCP_ROLES
+} tcp_role_t;
+
+static const char *const tcp_role_names[TCP_ROLES] = {"chat", "bulk"};
+
+typedef struct {
+    char name[TCP_PROFILE_NAME];
+    int sndbuf;          // SO_SNDBUF bytes, 0 leaves it to autotuning
+    int rcvbuf;          // SO_RCVBUF bytes, 0 leaves it to autotuning
+    int nodelay;         // TCP_NODELAY
+    int cork;            // TCP_CORK around a chunk header and its body
+    int lowat;           // TCP_NOTSENT_LOWAT bytes, 0 for no limit
+    int busy_poll;       // SO_BUSY_POLL microseconds, 0 off
+    int keepalive;       // TCP_KEEPIDLE seconds, 0 for no keepalive
+
+    // TCP_INFO totals, updated atomically by any thread
+    uint64_t samples;
+    uint64_t rtt_us;
+    uint64_t rcv_rtt_us;
+    uint64_t cwnd;
+    uint64_t rcv_space;
+    uint64_t retrans;
+} tcp_profile_t;
+
+static const tcp_profile_t tcp_builtin[] = {
+    {"interactive", 0, 0, 1, 0, 16384, 0, 60, 0, 0, 0, 0, 0, 0},
+    {"bulk", 0, 0, 1, 1, 0, 0, 60, 0, 0, 0, 0, 0, 0},
+    {"lan-low-latency", 256 * 1024, 256 * 1024, 1, 0, 16384, 50, 10, 0, 0, 0, 0, 0, 0},
+};
+
+static tcp_profile_t tcp_profiles[TCP_ROLES] = {tcp_builtin[0], tcp_builtin[1]};
+
+// What one TCP_INFO read found.
+typedef struct {
+    uint32_t rtt_us;
+    uint32_t rttvar_us;
+    uint32_t rcv_rtt_us;
+    uint32_t cwnd;       // Segments
+    uint32_t mss;
+    uint32_t rcv_space;  // Bytes
+    uint32_t retrans;    // Segments retransmitted over the connection's life
+} tcp_sample_t;
+
+static inline const tcp_profile_t *tcp_builtin_find(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(tcp_builtin) / sizeof(tcp_builtin[0]); i++) {
+        if (strlen(tcp_builtin[i].name) == len && strncmp(tcp_builtin[i].name, name, len) == 0) return &tcp_builtin[i];
+    }
+    return NULL;
+}
+
+// A size with an optional k or m suffix.
+static inline int tcp_parse_size(const char *s, int *out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s || v < 0) return -1;
+    if (*end == 'k' || *end == 'K') v *= 1024, end++;
+    if (*end == 'm' || *end == 'M') v *= 1024 * 1024, end++;
+    if (*end != '\0' || v > (1L << 30)) return -1;
+    *out = (int)v;
+    return 0;
+}
+
+// Apply one -T argument: "role=profile[,key=value...]". Returns -1 if it
+// names no role, no profile or no option.
+static inline int tcp_profile_parse(const char *spec) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *eq = strchr(buf, '=');
+    if (!eq) return -1;
+    *eq = '\0';
+    int role = -1;
+    for (int r = 0; r < TCP_ROLES; r++) {
+        if (strcmp(buf, tcp_role_names[r]) == 0) role = r;
+    }
+    if (role < 0) return -1;
+
+    char *list = eq + 1;
+    char *comma = strchr(list, ',');
+    size_t name_len = comma ? (size_t)(comma - list) : strlen(list);
+    const tcp_profile_t *base = tcp_builtin_find(list, name_len);
+    if (!base) return -1;
+    tcp_profile_t p = *base;
+
+    char *save = NULL;
+    for (char *kv = comma ? strtok_r(comma + 1, ",", &save) : NULL; kv; kv = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(kv, '=');
+        if (!val) return -1;
+        *val++ = '\0';
+        int *field = strcmp(kv, "sndbuf") == 0      ? &p.sndbuf
+                     : strcmp(kv, "rcvbuf") == 0    ? &p.rcvbuf
+                     : strcmp(kv, "nodelay") == 0   ? &p.nodelay
+                     : strcmp(kv, "cork") == 0      ? &p.cork
+                     : strcmp(kv, "lowat") == 0     ? &p.lowat
+                     : strcmp(kv, "busy_poll") == 0 ? &p.busy_poll
+                     : strcmp(kv, "keepalive") == 0 ? &p.keepalive
+                                                    : NULL;
+        if (!field || tcp_parse_size(val, field) < 0) return -1;
+    }
+    // Overridden options mark the profile as changed in its name
+    if (comma) snprintf(p.name + strlen(p.name), sizeof(p.name) - strlen(p.name), "+");
+    tcp_profiles[role] = p;
+    return 0;
+}
+
+static inline void tcp_profile_describe(int role, char *out, size_t cap) {
+    const tcp_profile_t *p = &tcp_profiles[role];
+    snprintf(out, cap, "%s=%s (sndbuf %d, rcvbuf %d, nodelay %d, cork %d, lowat %d, busy_poll %d, keepalive %d)",
+             tcp_role_names[role], p->name, p->sndbuf, p->rcvbuf, p->nodelay, p->cork, p->lowat, p->busy_poll,
+             p->keepalive);
+}
+
+static inline int tcp_setopt(int fd, int level, int opt, int value) {
+    return setsockopt(fd, level, opt, &value, sizeof(value));
+}
+
+// Set a role's options on fd. Options the kernel refuses are skipped;
+// returns how many that was. Switching roles resets every option the new
+// profile leaves at 0 except the buffer sizes: once set they stay pinned
+// (the kernel has no way back to autotuning), so a role that leaves them
+// at 0 keeps whatever an earlier role chose.
+static inline int tcp_apply(int fd, int role) {
+    const tcp_profile_t *p = &tcp_profiles[role];
+    int failed = 0;
+    if (p->sndbuf && tcp_setopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, p->sndbuf) < 0 &&
+        tcp_setopt(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf) < 0) {
+        failed++;
+    }
+    if (p->rcvbuf && tcp_setopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, p->rcvbuf) < 0 &&
+        tcp_setopt(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf) < 0) {
+        failed++;
+    }
+    failed += tcp_setopt(fd, IPPROTO_TCP, TCP_NODELAY, p->nodelay) < 0;
+    failed += tcp_setopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->lowat ? p->lowat : -1) < 0;
+    // Kernels without busy polling refuse the option; that only counts when it is asked for
+    if (tcp_setopt(fd, SOL_SOCKET, SO_BUSY_POLL, p->busy_poll) < 0 && p->busy_poll) failed++;
+    failed += tcp_setopt(fd, SOL_SOCKET, SO_KEEPALIVE, p->keepalive > 0) < 0;
+    if (p->keepalive > 0) {
+        failed += tcp_setopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, p->keepalive) < 0;
+        failed += tcp_setopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, p->keepalive / 6 > 0 ? p->keepalive / 6 : 1) < 0;
+        failed += tcp_setopt(fd, IPPROTO_TCP, TCP_KEEPCNT, 6) < 0;
+    }
+    return failed;
+}
+
+// Hold back partial segments while a chunk header and its body are
+// written, if the role's profile asks for it; uncorking sends the rest.
+static inline void tcp_cork(int fd, int role, int on) {
+    if (tcp_profiles[role].cork) tcp_setopt(fd, IPPROTO_TCP, TCP_CORK, on);
+}
+
+static inline int tcp_sample(int fd, tcp_sample_t *s) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return -1;
+    s->rtt_us = ti.tcpi_rtt;
+    s->rttvar_us = ti.tcpi_rttvar;
+    s->rcv_rtt_us = ti.tcpi_rcv_rtt;
+    s->cwnd = ti.tcpi_snd_cwnd;
+    s->mss = ti.tcpi_snd_mss;
+    s->rcv_space = ti.tcpi_rcv_space;
+    s->retrans = ti.tcpi_total_retrans;
+    return 0;
+}
+
+// Add a sample to the totals of role's profile; retrans is the part of
+// the connection's retransmissions not counted before.
+static inline void tcp_record(int role, const tcp_sample_t *s, uint32_t retrans) {
+    tcp_profile_t *p = &tcp_profiles[role];
+    __atomic_add_fetch(&p->samples, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->rtt_us, s->rtt_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->rcv_rtt_us, s->rcv_rtt_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->cwnd, s->cwnd, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->rcv_space, s->rcv_space, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->retrans, retrans, __ATOMIC_RELAXED);
+}
+
+static inline void tcp_format(char *out, size_t cap, int role, const tcp_sample_t *s) {
+    snprintf(out, cap, "TCP (%s): rtt %.2f ms (+/- %.2f), cwnd %u x %u bytes, receive space %u KB, %u retransmits",
+             tcp_profiles[role].name, s->rtt_us / 1000.0, s->rttvar_us / 1000.0, s->cwnd, s->mss,
+             s->rcv_space / 1024, s->retrans);
+}
+
+// Per-profile totals in the Prometheus text format. Sums go with the
+// sample count, so a dashboard divides their rates for the mean.
+static inline void tcp_write_metrics(FILE *out, const char *prefix) {
+    static const char *const names[][2] = {
+        {"tcp_samples_total", "TCP_INFO samples taken"},
+        {"tcp_rtt_us_sum", "Smoothed RTT summed over samples"},
+        {"tcp_rcv_rtt_us_sum", "Receiver-side RTT estimate summed over samples"},
+        {"tcp_cwnd_segments_sum", "Congestion window summed over samples"},
+        {"tcp_rcv_space_bytes_sum", "Receive space summed over samples"},
+        {"tcp_retransmits_total", "Segments retransmitted"},
+    };
+    for (int m = 0; m < 6; m++) {
+        fprintf(out, "# HELP %s_%s %s, per tuning profile\n# TYPE %s_%s counter\n", prefix, names[m][0],
+                names[m][1], prefix, names[m][0]);
+        for (int r = 0; r < TCP_ROLES; r++) {
+            const tcp_profile_t *p = &tcp_profiles[r];
+            const uint64_t *v[] = {&p->samples, &p->rtt_us, &p->rcv_rtt_us, &p->cwnd, &p->rcv_space, &p->retrans};
+            fprintf(out, "%s_%s{role=\"%s\",profile=\"%s\"} %llu\n", prefix, names[m][0], tcp_role_names[r], p->name,
+                    (unsigned long long)__atomic_load_n(v[m], __ATOMIC_RELAXED));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,792 @@
+// The UDP server's worker, as a shard: one SO_REUSEPORT socket with the
+// sessions and uploads of every peer the kernel hashes to it. server_udp
+// runs one per thread; server_tcp -u runs one inside each of its workers,
+// next to the TCP listener, so both protocols share the same threads.
+//
+// The host loop waits for the socket to be readable and calls
+// udp_receive_batch(), calls udp_run_timers() when udp_timeout_ms() says
+// so, and udp_flush() before it sleeps. A loop that cannot sleep with a
+// timeout arms a timer for udp_next_due_us() instead. Uploads written
+// behind (stage.h) wait for the writer when every buffer is in flight, so
+// a host that must not block, like server_tcp, sets the shard up without.
+//
+// Nothing here is shared between shards; only logins by ticket go through
+// the locked table in server.h.
+#ifndef UDP_SERVER_H
+#define UDP_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "rudp.h"
+#include "resume.h"
+#include "session.h"
+#include "pool.h"
+#include "metrics.h"
+#include "stage.h"
+#include "server.h"
+#include "admit.h"
+
+#define UDP_SAVE_DIR "udp_received/"
+#define UDP_BUFSIZE 65536
+#define UDP_RECV_BATCH 32                 // Buffers per recvmmsg(); with GRO each may hold many datagrams
+#define UDP_SEND_BATCH 64                 // Replies queued per sendmmsg()
+#define UDP_SEND_SLOT_SIZE 128            // Fits an ACK and every control frame
+#define UDP_UPLOAD_LINGER_US 10000000     // Keep a finished upload to repeat its result
+#define UDP_SESSION_SWEEP_US 60000000     // How often idle peers are looked for
+#define UDP_UPLOAD_MEM_MAX (4 * 1024 * 1024)  // State one upload may hold (udp_upload_mem)
+
+// One file upload, found through its session (see session.h). The file is
+// written under a hidden temporary name and renamed into place once it is
+// complete, so concurrent uploads of the same name never interleave. A
+// resumable upload (FRAME_RESUME) uses the part file and manifest of its
+// transfer id instead, and keeps them when it fails.
+typedef struct upload {
+    struct upload *prev, *next;  // Worker's list of uploads, walked for timers
+    struct sockaddr_in peer;
+    uint32_t stream_id;
+    int reliable;                // rudp.h segments, or the plain in-order stream
+    int fd;
+    char full_path[512];
+    char part_path[512];
+    rudp_rx_t rx;                // Reliable mode only
+    int verify;                  // The client commits a digest (FILE_FLAG_VERIFY)...
+    int committed;               // ...and has
+    bhash_t digest;
+    resume_t *resume;            // Resumable uploads only; owns fd
+    stage_t *writer;             // Worker's write-behind (stage.h), when the upload uses it...
+    stage_file_t *stage;         // ...for this file
+    sched_user_t *sched_user;    // Who it was admitted for (admit.h), if the shard admits uploads
+    uint64_t resume_id;
+    uint64_t file_size;
+    uint64_t received;           // Plain mode only
+    uint64_t start_us;
+    uint64_t last_data_us;
+
+    // Set once the result went out; the upload then only lingers so a
+    // retransmitted frame can be answered again
+    int result;
+    uint64_t finished_us;
+} udp_upload_t;
+
+// Datagrams come in through recvmmsg() (coalesced by GRO when the kernel
+// can), and the small replies they trigger are queued and leave through
+// sendmmsg().
+typedef struct {
+    int id;
+    int sock;
+    pthread_t thread;
+    session_table_t sessions;
+    udp_upload_t *uploads;
+    stage_t stage;  // Write-behind buffers and writer thread
+    int admit;      // Uploads go through admit.h's admission (server_tcp -u)
+    uint64_t next_timer_us;
+    uint64_t next_sweep_us;
+
+    struct mmsghdr in_msgs[UDP_RECV_BATCH];
+    struct iovec in_iov[UDP_RECV_BATCH];
+    struct sockaddr_in in_addr[UDP_RECV_BATCH];
+    char in_cmsg[UDP_RECV_BATCH][UDP_GRO_CMSG_SPACE];
+    int gro;
+
+    char out_buf[UDP_SEND_BATCH][UDP_SEND_SLOT_SIZE];
+    struct mmsghdr out_msgs[UDP_SEND_BATCH];
+    struct iovec out_iov[UDP_SEND_BATCH];
+    struct sockaddr_in out_addr[UDP_SEND_BATCH];
+    int out_count;
+
+    // Batching statistics since the last report, printed after each upload
+    // when report_batches is set (server_udp; server_tcp has its metrics)
+    int report_batches;
+    uint64_t stat_recv_calls;
+    uint64_t stat_buffers;
+    uint64_t stat_dgrams;
+    uint64_t stat_send_calls;
+    uint64_t stat_sent;
+    uint64_t stat_cpu_us;
+} udp_shard_t;
+
+static inline void udp_flush(udp_shard_t *w) {
+    int sent = 0;
+    while (sent < w->out_count) {
+        int r = sendmmsg(w->sock, w->out_msgs + sent, w->out_count - sent, 0);
+        metrics_add(M_SYS_SEND, 1);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            // Replies are all retried by their peers, so drop what does not fit
+            break;
+        }
+        w->stat_send_calls++;
+        for (int i = sent; i < sent + r; i++) metrics_add(M_BYTES_SENT, w->out_msgs[i].msg_len);
+        sent += r;
+    }
+    w->stat_sent += w->out_count;
+    w->out_count = 0;
+}
+
+// Queue one reply frame for the next udp_flush(). Frames too large for
+// a queue slot go out directly, after whatever is queued before them.
+static inline void udp_send(udp_shard_t *w, const struct sockaddr_in *to, uint8_t type, uint32_t stream_id,
+                            const void *payload, size_t len) {
+    if (FRAME_HDR_SIZE + len > UDP_SEND_SLOT_SIZE) {
+        udp_flush(w);
+        if (sendto_frame(w->sock, to, type, 0, stream_id, payload, len) == 0) {
+            metrics_add(M_BYTES_SENT, FRAME_HDR_SIZE + len);
+        }
+        metrics_add(M_SYS_SEND, 1);
+        return;
+    }
+    if (w->out_count == UDP_SEND_BATCH) udp_flush(w);
+
+    int i = w->out_count++;
+    frame_encode(w->out_buf[i], type, 0, (uint32_t)len, stream_id);
+    if (len) memcpy(w->out_buf[i] + FRAME_HDR_SIZE, payload, len);
+    w->out_addr[i] = *to;
+    w->out_iov[i].iov_base = w->out_buf[i];
+    w->out_iov[i].iov_len = FRAME_HDR_SIZE + len;
+    memset(&w->out_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    w->out_msgs[i].msg_hdr.msg_name = &w->out_addr[i];
+    w->out_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    w->out_msgs[i].msg_hdr.msg_iov = &w->out_iov[i];
+    w->out_msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+static inline void udp_print_batch_stats(udp_shard_t *w) {
+    uint64_t cpu = thread_cpu_us();
+    double cpu_secs = (cpu - w->stat_cpu_us) / 1e6;
+    printf("Worker %d: %llu datagrams in %llu recvmmsg calls (%.1f per call, %.1f per %s buffer), "
+           "%llu replies in %llu sendmmsg calls (%.1f per call), %.0f datagrams/s per core\n",
+           w->id, (unsigned long long)w->stat_dgrams, (unsigned long long)w->stat_recv_calls,
+           w->stat_recv_calls ? (double)w->stat_dgrams / w->stat_recv_calls : 0.0,
+           w->stat_buffers ? (double)w->stat_dgrams / w->stat_buffers : 0.0, w->gro ? "GRO" : "receive",
+           (unsigned long long)w->stat_sent, (unsigned long long)w->stat_send_calls,
+           w->stat_send_calls ? (double)w->stat_sent / w->stat_send_calls : 0.0,
+           cpu_secs > 0 ? (w->stat_dgrams + w->stat_sent) / cpu_secs : 0.0);
+    w->stat_recv_calls = w->stat_buffers = w->stat_dgrams = w->stat_send_calls = w->stat_sent = 0;
+    w->stat_cpu_us = cpu;
+}
+
+static inline void udp_arm_timer(udp_shard_t *w, uint64_t when) {
+    if (when && when < w->next_timer_us) w->next_timer_us = when;
+}
+
+static inline void udp_upload_free(udp_shard_t *w, udp_upload_t *u) {
+    if (u->prev) u->prev->next = u->next;
+    else w->uploads = u->next;
+    if (u->next) u->next->prev = u->prev;
+
+    session_key_t key = session_key(&u->peer, u->stream_id);
+    session_t *s = session_find(&w->sessions, &key);
+    if (s) session_remove(&w->sessions, s);
+    pbuf_put(u);
+}
+
+// Memory an upload holds besides its file: its own state and the bitmaps
+// of received segments and synced chunks, which grow with the file size.
+static inline size_t udp_upload_mem(const udp_upload_t *u) {
+    size_t n = pbuf_cap(u);
+    if (u->reliable && u->rx.have) n += u->rx.nsegs / 8 + 1;
+    if (u->resume) n += sizeof(resume_t) + resume_bitmap_size(u->resume);
+    return n;
+}
+
+// Give up the part file of an upload that never got going.
+static inline void udp_discard_part(udp_upload_t *u) {
+    if (u->stage) {
+        stage_file_abort(u->writer, u->stage);
+        u->stage = NULL;
+    }
+    if (u->resume) {
+        resume_free(u->resume);
+        free(u->resume);
+        u->resume = NULL;
+        return;
+    }
+    close(u->fd);
+    unlink(u->part_path);
+}
+
+static inline void udp_finish_upload(udp_shard_t *w, udp_upload_t *u, int ok) {
+    if (u->stage && !ok) {
+        stage_file_abort(u->writer, u->stage);
+    } else if (u->stage) {
+        // Nothing is renamed into place before the writer has all of it
+        stage_sync(u->writer, u->stage);
+        if (stage_file_close(u->stage) < 0) {
+            printf("Error: write to '%s' failed: %s\n", u->part_path, strerror(errno));
+            ok = 0;
+        }
+    }
+    u->stage = NULL;
+    int corrupt = 0;
+    if (ok && u->verify) {
+        bhash_t digest = rudp_rx_digest(&u->rx);
+        corrupt = !bhash_eq(&digest, &u->digest);
+        ok = !corrupt;
+    }
+    if (!u->resume) close(u->fd);
+    if (u->reliable) rudp_rx_free(&u->rx);
+
+    uint64_t bytes = u->reliable ? u->rx.received_bytes : u->received;
+    if (ok && (u->resume ? resume_finish(u->resume, u->full_path) : rename(u->part_path, u->full_path)) < 0) {
+        printf("Error: Cannot rename '%s': %s\n", u->part_path, strerror(errno));
+        ok = 0;
+    }
+    metrics_add(ok ? M_TRANSFERS_OK : M_TRANSFERS_FAILED, 1);
+    metrics_record(H_TRANSFER_US, now_us() - u->start_us);
+    if (u->reliable && u->rx.corrupt) {
+        printf("Dropped %llu segments that failed their CRC\n", (unsigned long long)u->rx.corrupt);
+    }
+    if (ok) {
+        double secs = (now_us() - u->start_us) / 1e6;
+        printf("File received successfully: %s (%llu bytes in %.2f s%s)\n", u->full_path, (unsigned long long)bytes,
+               secs, u->verify ? ", digest verified" : "");
+    } else if (corrupt) {
+        printf("File rejected, digest does not match the client's: %s\n", u->full_path);
+        metrics_add(M_DIGEST_ERRORS, 1);
+        unlink(u->part_path);
+    } else if (u->resume && resume_suspend(u->resume)) {
+        printf("File transfer interrupted, kept for resume: %s (%llu/%llu bytes)\n", u->full_path,
+               (unsigned long long)u->resume->bytes_done, (unsigned long long)u->file_size);
+    } else if (u->resume) {
+        printf("File transfer superseded by a newer attempt: %s\n", u->full_path);
+    } else {
+        printf("File transfer incomplete: %s (%llu/%llu bytes)\n", u->full_path, (unsigned long long)bytes,
+               (unsigned long long)u->file_size);
+        unlink(u->part_path);
+    }
+    if (u->resume) {
+        resume_free(u->resume);
+        free(u->resume);
+        u->resume = NULL;
+    }
+    if (u->sched_user) sched_release(u->sched_user, u->file_size, ok);
+    u->sched_user = NULL;
+
+    if (w->report_batches) udp_print_batch_stats(w);
+
+    u->result = ok ? FRAME_FILE_OK : FRAME_FILE_FAIL;
+    u->finished_us = now_us();
+    udp_send(w, &u->peer, u->result, u->stream_id, NULL, 0);
+    udp_arm_timer(w, u->finished_us + UDP_UPLOAD_LINGER_US);
+}
+
+// rudp.h hooks of a written-behind upload.
+static inline void udp_stage_write(void *ctx, const char *data, uint32_t len, uint64_t offset) {
+    udp_upload_t *u = (udp_upload_t *)ctx;
+    stage_copy(u->writer, u->stage, data, len, offset);
+}
+
+static inline void udp_stage_sync(void *ctx) {
+    udp_upload_t *u = (udp_upload_t *)ctx;
+    stage_sync(u->writer, u->stage);
+}
+
+static inline int udp_upload_complete(const udp_upload_t *u) {
+    if (!u->reliable) return u->received >= u->file_size;
+    return rudp_rx_complete(&u->rx) && (!u->verify || u->committed);
+}
+
+static inline void udp_send_ack(udp_shard_t *w, udp_upload_t *u) {
+    char ack[RUDP_ACK_SIZE];
+    size_t len = rudp_rx_build_ack(&u->rx, ack);
+    udp_send(w, &u->peer, FRAME_ACK, u->stream_id, ack, len);
+}
+
+// READY for a new upload. A resumable one lists the ranges still missing.
+static inline void udp_send_ready(udp_shard_t *w, udp_upload_t *u) {
+    if (!u->resume) {
+        udp_send(w, &u->peer, FRAME_READY, u->stream_id, NULL, 0);
+        return;
+    }
+    char ranges[UDP_MAX_PAYLOAD];
+    size_t len = resume_missing(u->resume, ranges, sizeof(ranges));
+    udp_send(w, &u->peer, FRAME_READY, u->stream_id, ranges, len);
+}
+
+// A client that restarted comes back from a new port, while its old upload
+// may still be waiting out the idle timeout: checkpoint and retire that one
+// before the new upload reads the manifest.
+static inline void udp_retire_resumed(udp_shard_t *w, uint64_t resume_id) {
+    for (udp_upload_t *u = w->uploads; u; u = u->next) {
+        if (u->resume && !u->result && u->resume_id == resume_id) udp_finish_upload(w, u, 0);
+    }
+}
+
+// Open the files and state of a new upload and add it to the shard, or
+// send FRAME_FILE_FAIL and return NULL.
+static inline udp_upload_t *udp_new_upload(udp_shard_t *w, struct sockaddr_in *clientaddr, const frame_hdr_t *hdr,
+                                           const char *filename, const file_info_t *info, const uint64_t *resume_id,
+                                           int *resumed_out) {
+    int reliable = (hdr->flags & FILE_FLAG_RELIABLE) != 0;
+    udp_upload_t *u = (udp_upload_t *)pbuf_alloc(sizeof(udp_upload_t));
+    if (!u || (resume_id && !reliable)) {
+        udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+        pbuf_put(u);
+        return NULL;
+    }
+    memset(u, 0, sizeof(*u));
+    u->peer = *clientaddr;
+    u->stream_id = hdr->stream_id;
+    u->reliable = reliable;
+    u->file_size = info->size;
+    u->start_us = u->last_data_us = now_us();
+    snprintf(u->full_path, sizeof(u->full_path), "%s%s", UDP_SAVE_DIR, filename);
+
+    int resumed = 0;
+    if (resume_id) {
+        u->resume = (resume_t *)malloc(sizeof(resume_t));
+        if (!u->resume ||
+            resume_open(u->resume, UDP_SAVE_DIR, *resume_id, info->size, info->chunk_size, &resumed) < 0) {
+            printf("Error: Cannot open resumable upload for '%s'\n", filename);
+            udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+            free(u->resume);
+            pbuf_put(u);
+            return NULL;
+        }
+        u->resume_id = *resume_id;
+        u->fd = u->resume->fd;
+        snprintf(u->part_path, sizeof(u->part_path), "%s", u->resume->part_path);
+    } else {
+        snprintf(u->part_path, sizeof(u->part_path), "%s.%s.%08x%04x%08x.part", UDP_SAVE_DIR, filename,
+                 ntohl(clientaddr->sin_addr.s_addr), ntohs(clientaddr->sin_port), hdr->stream_id);
+        u->fd = open(u->part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);  // The digest reads reordered segments back
+        if (u->fd < 0) {
+            printf("Error: Cannot create file '%s'\n", u->part_path);
+            udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+            pbuf_put(u);
+            return NULL;
+        }
+    }
+    u->verify = reliable && !resume_id && (hdr->flags & FILE_FLAG_VERIFY);
+    if (reliable && (rudp_rx_init(&u->rx, u->fd, info->size, info->chunk_size) < 0 ||
+                     (u->verify && rudp_rx_enable_digest(&u->rx) < 0))) {
+        printf("Error: Bad segment size %u\n", info->chunk_size);
+        udp_discard_part(u);
+        udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+        pbuf_put(u);
+        return NULL;
+    }
+
+    // Resumable uploads write inline: their manifest must not get ahead
+    // of the file
+    if (w->stage.depth && !u->resume) {
+        u->writer = &w->stage;
+        u->stage = stage_file_open(&w->stage, u->part_path, u->fd);
+        if (!u->stage) printf("Write-behind unavailable, writing '%s' inline: %s\n", u->part_path, strerror(errno));
+    }
+    if (reliable && u->stage) {
+        u->rx.write = udp_stage_write;
+        u->rx.sync = udp_stage_sync;
+        u->rx.ctx = u;
+    }
+    if (udp_upload_mem(u) > UDP_UPLOAD_MEM_MAX) {
+        printf("Error: Upload of '%s' needs %zu KB of state, more than the %d KB limit\n", filename,
+               udp_upload_mem(u) / 1024, UDP_UPLOAD_MEM_MAX / 1024);
+        udp_discard_part(u);
+        if (reliable) rudp_rx_free(&u->rx);
+        udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+        pbuf_put(u);
+        return NULL;
+    }
+    if (u->resume) rudp_rx_restore(&u->rx, u->resume->done);
+
+    session_key_t key = session_key(clientaddr, hdr->stream_id);
+    session_t *s = session_insert(&w->sessions, &key, SESSION_UPLOAD);
+    if (!s) {
+        printf("Session table full, rejecting %s\n", filename);
+        udp_discard_part(u);
+        if (reliable) rudp_rx_free(&u->rx);
+        udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+        pbuf_put(u);
+        return NULL;
+    }
+    s->upload = u;
+    u->next = w->uploads;
+    if (w->uploads) w->uploads->prev = u;
+    w->uploads = u;
+
+    if (reliable && !u->resume && ftruncate(u->fd, (off_t)info->size) < 0) {
+        printf("Warning: Cannot preallocate '%s'\n", u->part_path);
+    }
+    *resumed_out = resumed;
+    return u;
+}
+
+// FRAME_FILE, or FRAME_RESUME when resume_id is given.
+static inline void udp_begin_upload(udp_shard_t *w, struct sockaddr_in *clientaddr, const frame_hdr_t *hdr,
+                                    const char *username, const char *filename, const file_info_t *info,
+                                    const uint64_t *resume_id) {
+    session_key_t key = session_key(clientaddr, hdr->stream_id);
+    session_t *s = session_find(&w->sessions, &key);
+    if (s) {
+        // A retransmitted FILE frame means our READY or the result was lost
+        udp_upload_t *u = s->upload;
+        if (u->result) udp_send(w, clientaddr, u->result, hdr->stream_id, NULL, 0);
+        else udp_send_ready(w, u);
+        return;
+    }
+
+    if (resume_id) udp_retire_resumed(w, *resume_id);  // Frees its transfer slot too
+
+    // Held to the same quota, disk budget and transfer limits as the TCP
+    // uploads of the same user, but never queued
+    sched_user_t *user = NULL;
+    if (w->admit) {
+        sched_wait_t *wait = NULL;
+        const char *why = "";
+        if (sched_admit(username, info->size, NULL, NULL, &user, &wait, &why) == SCHED_REFUSED) {
+            printf("[%s] Upload of %llu bytes refused: %s\n", username, (unsigned long long)info->size, why);
+            metrics_add(M_ADMIT_REFUSED, 1);
+            udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr->stream_id, NULL, 0);
+            return;
+        }
+        metrics_record(H_ADMIT_WAIT_US, 0);
+    }
+    int resumed = 0;
+    udp_upload_t *u = udp_new_upload(w, clientaddr, hdr, filename, info, resume_id, &resumed);
+    if (!u) {
+        if (user) sched_release(user, info->size, 0);
+        return;
+    }
+    u->sched_user = user;
+    int reliable = u->reliable;
+
+    if (resumed) {
+        printf("[%s] Resuming file: %s (%llu/%llu bytes already received, worker %d)\n", username, u->full_path,
+               (unsigned long long)u->resume->bytes_done, (unsigned long long)info->size, w->id);
+    } else if (reliable) {
+        printf("[%s] Receiving file: %s (%lld bytes, %u segments of %u bytes, worker %d)\n", username, u->full_path,
+               (long long)info->size, u->rx.nsegs, info->chunk_size, w->id);
+    } else {
+        printf("[%s] Receiving file: %s (%lld bytes, worker %d)\n", username, u->full_path, (long long)info->size,
+               w->id);
+    }
+    metrics_add(M_TRANSFERS_STARTED, 1);
+    udp_send_ready(w, u);
+    udp_arm_timer(w, u->last_data_us + RUDP_IDLE_TIMEOUT_US);
+    if (udp_upload_complete(u)) udp_finish_upload(w, u, 1);
+}
+
+static inline void udp_handle_data(udp_shard_t *w, struct sockaddr_in *clientaddr, const frame_hdr_t *hdr,
+                                   const char *payload) {
+    session_key_t key = session_key(clientaddr, hdr->stream_id);
+    session_t *s = session_find(&w->sessions, &key);
+    if (!s || s->kind != SESSION_UPLOAD) return;
+
+    udp_upload_t *u = s->upload;
+    if (u->result) {
+        // Still sending after the result went out: it was lost
+        if (u->reliable) udp_send(w, clientaddr, u->result, u->stream_id, NULL, 0);
+        return;
+    }
+    u->last_data_us = now_us();
+
+    if (!u->reliable) {
+        // Plain mode: datagrams are appended in arrival order, an empty one ends the file
+        if (hdr->length == 0) {
+            udp_finish_upload(w, u, u->received == u->file_size);
+            return;
+        }
+        ssize_t n = hdr->length;
+        if (u->stage) {
+            stage_copy(u->writer, u->stage, payload, hdr->length, u->received);
+        } else {
+            uint64_t start = now_us();
+            n = write(u->fd, payload, hdr->length);
+            metrics_add(M_SYS_WRITE, 1);
+            metrics_record(H_WRITE_US, now_us() - start);
+        }
+        if (n != (ssize_t)hdr->length) {
+            printf("Error: write to '%s' failed: %s\n", u->part_path, strerror(errno));
+            udp_finish_upload(w, u, 0);
+            return;
+        }
+        u->received += hdr->length;
+        metrics_add(M_BYTES_RECEIVED, hdr->length);
+        if (udp_upload_complete(u)) udp_finish_upload(w, u, u->received == u->file_size);
+        return;
+    }
+
+    // A segment that is new costs a pwrite() (or a copy into staging); one
+    // that is not was retransmitted
+    uint64_t bytes = u->rx.received_bytes;
+    uint64_t start = now_us();
+    int r = rudp_rx_on_data(&u->rx, payload, hdr->length);
+    if (r == RUDP_RX_WRITE_FAILED) {
+        printf("Error: write to '%s' failed: %s\n", u->part_path, strerror(errno));
+        udp_finish_upload(w, u, 0);
+        return;
+    }
+    if (r == RUDP_RX_CORRUPT) metrics_add(M_CRC_ERRORS, 1);
+    if (r < 0) return;
+    if (u->rx.received_bytes != bytes) {
+        metrics_add(M_BYTES_RECEIVED, u->rx.received_bytes - bytes);
+        if (!u->stage) {
+            metrics_add(M_SYS_WRITE, 1);
+            metrics_record(H_WRITE_US, now_us() - start);
+        }
+    } else {
+        metrics_add(M_RETRANSMITS, 1);
+    }
+    if (u->resume) {
+        uint64_t offset = get_u64(payload + 4);
+        resume_mark_range(u->resume, offset, offset, offset + hdr->length - RUDP_DATA_HDR_SIZE);
+        if (resume_checkpoint_due(u->resume) && resume_checkpoint(u->resume) < 0) {
+            printf("Warning: checkpoint of '%s' failed: %s\n", u->part_path, strerror(errno));
+        }
+    }
+    if (r > 0) udp_send_ack(w, u);
+    udp_arm_timer(w, u->rx.ack_due_us);
+    if (udp_upload_complete(u)) udp_finish_upload(w, u, 1);
+}
+
+// FRAME_COMMIT of a verified upload: the client's digest of the file.
+static inline void udp_handle_commit(udp_shard_t *w, struct sockaddr_in *clientaddr, const frame_hdr_t *hdr,
+                                     const char *payload) {
+    session_key_t key = session_key(clientaddr, hdr->stream_id);
+    session_t *s = session_find(&w->sessions, &key);
+    if (!s || s->kind != SESSION_UPLOAD) return;
+
+    udp_upload_t *u = s->upload;
+    if (u->result) {
+        udp_send(w, clientaddr, u->result, u->stream_id, NULL, 0);  // It was lost
+        return;
+    }
+    if (!u->verify || hdr->length != 16) return;
+    u->last_data_us = now_us();
+    bhash_decode(payload, &u->digest);
+    u->committed = 1;
+    if (udp_upload_complete(u)) udp_finish_upload(w, u, 1);
+}
+
+// Fire delayed ACKs, time out stalled uploads, drop finished ones once they
+// have lingered, and every so often forget peers that went quiet.
+static inline void udp_run_timers(udp_shard_t *w) {
+    uint64_t now = now_us();
+    if (now < w->next_timer_us && now < w->next_sweep_us) return;
+
+    w->next_timer_us = now + RUDP_IDLE_TIMEOUT_US;
+    udp_upload_t *next;
+    for (udp_upload_t *u = w->uploads; u; u = next) {
+        next = u->next;
+        if (u->result) {
+            if (now - u->finished_us >= UDP_UPLOAD_LINGER_US) udp_upload_free(w, u);
+            else udp_arm_timer(w, u->finished_us + UDP_UPLOAD_LINGER_US);
+            continue;
+        }
+        if (u->reliable && u->rx.ack_due_us && now >= u->rx.ack_due_us) udp_send_ack(w, u);
+        if (now - u->last_data_us >= RUDP_IDLE_TIMEOUT_US) {
+            printf("Transfer timed out\n");
+            udp_finish_upload(w, u, 0);
+            continue;
+        }
+        if (u->reliable) udp_arm_timer(w, u->rx.ack_due_us);
+        udp_arm_timer(w, u->last_data_us + RUDP_IDLE_TIMEOUT_US);
+    }
+
+    if (now < w->next_sweep_us) return;
+    w->next_sweep_us = now + UDP_SESSION_SWEEP_US;
+    for (uint32_t i = 0; i < SESSION_TABLE_SIZE;) {
+        session_t *s = &w->sessions.slots[i];
+        if (s->kind == SESSION_PEER && now - s->last_us >= SESSION_PEER_IDLE_US) {
+            metrics_add(M_DISCONNECTS, 1);
+            session_remove(&w->sessions, s);  // Refills slot i, look at it again
+            continue;
+        }
+        i++;
+    }
+}
+
+// When udp_run_timers() next has work, on the now_us() clock.
+static inline uint64_t udp_next_due_us(const udp_shard_t *w) {
+    return w->next_timer_us < w->next_sweep_us ? w->next_timer_us : w->next_sweep_us;
+}
+
+static inline int udp_timeout_ms(udp_shard_t *w) {
+    uint64_t now = now_us();
+    uint64_t due = udp_next_due_us(w);
+    return due > now ? (int)((due - now + 999) / 1000) : 0;
+}
+
+static inline void udp_handle_datagram(udp_shard_t *w, struct sockaddr_in *clientaddr, const char *buf, size_t len) {
+    frame_hdr_t hdr;
+    if (frame_parse_datagram(buf, (size_t)len, &hdr) < 0) {
+        printf("Dropped malformed datagram (%zu bytes)\n", len);
+        return;
+    }
+    const char *payload = buf + FRAME_HDR_SIZE;
+    metrics_add(M_FRAMES, 1);
+
+    if (hdr.type == FRAME_DATA) {
+        udp_handle_data(w, clientaddr, &hdr, payload);
+        return;
+    }
+
+    session_key_t key = session_key(clientaddr, SESSION_PEER_ID);
+    session_t *peer = session_find(&w->sessions, &key);
+    if (peer) peer->last_us = now_us();
+    const char *username = peer ? peer->username : "[unknown]";
+
+    // Parse USER and BIND frames: a name of its own, or the one a TCP login
+    // got the ticket for
+    if (hdr.type == FRAME_USER || hdr.type == FRAME_BIND) {
+        char name[USERNAME_MAX];
+        int bind = hdr.type == FRAME_BIND;
+        int ok = bind ? hdr.length == 8 && bulk_redeem(get_u64(payload), clientaddr, name, sizeof(name)) == 0
+                      : login_name(payload, hdr.length, name, sizeof(name)) == 0;
+        if (!ok) {
+            printf("Rejected %s from %s:%d\n", bind ? "bulk ticket" : "username", inet_ntoa(clientaddr->sin_addr),
+                   ntohs(clientaddr->sin_port));
+            udp_send(w, clientaddr, FRAME_USER_FAIL, hdr.stream_id, NULL, 0);
+            return;
+        }
+        if (!peer) {
+            peer = session_insert(&w->sessions, &key, SESSION_PEER);
+            if (peer) metrics_add(M_CONNECTIONS, 1);
+        }
+        if (!peer) {
+            printf("Session table full, rejecting user\n");
+            udp_send(w, clientaddr, FRAME_USER_FAIL, hdr.stream_id, NULL, 0);
+            return;
+        }
+        snprintf(peer->username, sizeof(peer->username), "%s", name);
+        peer->last_us = now_us();
+        printf("Client identified as: %s (%s:%d, worker %d%s)\n", peer->username, inet_ntoa(clientaddr->sin_addr),
+               ntohs(clientaddr->sin_port), w->id, bind ? ", bulk channel of its TCP login" : "");
+        udp_send(w, clientaddr, FRAME_USER_OK, hdr.stream_id, NULL, 0);
+        return;
+    }
+
+    // Parse FILE and RESUME frames
+    if (hdr.type == FRAME_FILE || hdr.type == FRAME_RESUME) {
+        file_info_t info;
+        uint64_t resume_id = 0;
+        char filename[256];
+        if (hdr.type == FRAME_FILE ? file_info_decode(payload, hdr.length, &info)
+                                   : resume_info_decode(payload, hdr.length, &resume_id, &info)) {
+            return;
+        }
+        if (file_info_basename(&info, filename, sizeof(filename)) < 0) {
+            udp_send(w, clientaddr, FRAME_FILE_FAIL, hdr.stream_id, NULL, 0);
+            return;
+        }
+        udp_begin_upload(w, clientaddr, &hdr, username, filename, &info, hdr.type == FRAME_RESUME ? &resume_id : NULL);
+        return;
+    }
+
+    if (hdr.type == FRAME_COMMIT) {
+        udp_handle_commit(w, clientaddr, &hdr, payload);
+        return;
+    }
+    if (hdr.type != FRAME_MSG) return;
+
+    // Otherwise treat as message
+    printf("[%s] says: %.*s\n", username, (int)hdr.length, payload);
+    metrics_add(M_MESSAGES, 1);
+
+    // Echo message back
+    udp_send(w, clientaddr, FRAME_MSG, hdr.stream_id, payload, hdr.length);
+}
+
+// Take up to UDP_RECV_BATCH buffers off the socket and handle every datagram
+// in them. Returns how many buffers were read.
+static inline int udp_receive_batch(udp_shard_t *w) {
+    for (int i = 0; i < UDP_RECV_BATCH; i++) {
+        struct msghdr *msg = &w->in_msgs[i].msg_hdr;
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+        msg->msg_control = w->gro ? w->in_cmsg[i] : NULL;
+        msg->msg_controllen = w->gro ? UDP_GRO_CMSG_SPACE : 0;
+    }
+
+    int n = recvmmsg(w->sock, w->in_msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    metrics_add(M_SYS_RECV, 1);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            printf("recvmmsg failed: %s\n", strerror(errno));
+        }
+        return 0;
+    }
+    w->stat_recv_calls++;
+    w->stat_buffers += n;
+
+    for (int i = 0; i < n; i++) {
+        const char *buf = (const char *)w->in_iov[i].iov_base;
+        size_t len = w->in_msgs[i].msg_len;
+        size_t seg = w->gro ? (size_t)udp_gro_size(&w->in_msgs[i].msg_hdr) : 0;
+        if (seg == 0) seg = len;
+
+        // A GRO buffer is a run of datagrams of seg bytes, the last maybe shorter
+        for (size_t off = 0; off < len; off += seg) {
+            size_t dlen = len - off < seg ? len - off : seg;
+            udp_handle_datagram(w, &w->in_addr[i], buf + off, dlen);
+            w->stat_dgrams++;
+        }
+    }
+    return n;
+}
+
+// Bind a socket to port beside the other shards'. -1 with errno set.
+static inline int udp_create_socket(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+
+    int on = 1;
+    struct sockaddr_in serveraddr = {0};
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons(port);
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        bind(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    rudp_tune_socket(sock);
+    return sock;
+}
+
+// Set up shard id on port with stage_depth write-behind buffers (stage.h),
+// whose writer is labelled metrics_id. All shards must be bound before any
+// of them receives, so the kernel's SO_REUSEPORT hash sends each peer to
+// the same shard for its lifetime. -1 with errno set.
+static inline int udp_shard_init(udp_shard_t *w, int id, uint16_t port, int stage_depth, int keep_cache,
+                                 int metrics_id) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->sock = udp_create_socket(port);
+    if (w->sock < 0) return -1;
+    w->gro = udp_enable_gro(w->sock) == 0;
+    if (session_table_init(&w->sessions) < 0 || stage_init(&w->stage, stage_depth, keep_cache, -1, metrics_id) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int j = 0; j < UDP_RECV_BATCH; j++) {
+        w->in_iov[j].iov_base = pbuf_alloc(UDP_BUFSIZE);
+        if (!w->in_iov[j].iov_base) {
+            errno = ENOMEM;
+            return -1;
+        }
+        w->in_iov[j].iov_len = UDP_BUFSIZE;
+        w->in_msgs[j].msg_hdr.msg_name = &w->in_addr[j];
+        w->in_msgs[j].msg_hdr.msg_iov = &w->in_iov[j];
+        w->in_msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    w->next_timer_us = w->next_sweep_us = now_us() + UDP_SESSION_SWEEP_US;
+    return 0;
+}
+
+#endif
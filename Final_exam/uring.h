@@ -0,0 +1,292 @@
+// Minimal io_uring access through the raw system calls, so the servers
+// need no liburing. Covers what the TCP server's uring backend uses: the
+// submission and completion rings, registered (fixed) files and buffers,
+// and a provided-buffer ring for multishot receives.
+//
+// Not thread-safe: each worker owns its ring. Rings are created before the
+// workers start, so IORING_SETUP_SINGLE_ISSUER (which ties a ring to the
+// creating thread) is not used.
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned entries;
+
+    // Submission queue: the kernel reads sqes named in array[head..tail)
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;  // Local tail: sqes filled in but not yet published
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring_t;
+
+// Provided buffers: equal-sized buffers carved from one region, handed to
+// the kernel through a ring it picks from when a receive completes.
+typedef struct {
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned entries;
+    uint16_t tail;
+    uint16_t bgid;
+    char *base;
+    uint32_t buf_size;
+} uring_bufs_t;
+
+static inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int uring_register(uring_t *u, unsigned opcode, const void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, u->fd, opcode, arg, nargs);
+}
+
+static inline void uring_free(uring_t *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+    if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_size);
+    if (u->sq_map && u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_map_size);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+// Set up a ring. Returns 0, or -1 with errno set (ENOSYS when the kernel
+// has no io_uring, EPERM when it is disabled).
+static inline int uring_init(uring_t *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        // Older kernel: no cooperative task running
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (u->fd < 0) return -1;
+    u->entries = p.sq_entries;
+
+    u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_size > u->sq_map_size) u->sq_map_size = u->cq_map_size;
+        u->cq_map_size = u->sq_map_size;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                         IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) goto fail;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    u->sq_head = (unsigned *)((char *)u->sq_map + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_map + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_map + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_map + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_map + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_map + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_map + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+    return 0;
+
+fail:
+    int saved = errno;
+    uring_free(u);
+    errno = saved;
+    return -1;
+}
+
+// Publish queued sqes and, if wait is set, block until at least one
+// completion is available.
+static inline int uring_submit(uring_t *u, int wait) {
+    unsigned tail = *u->sq_tail;
+    unsigned to_submit = u->sqe_tail - tail;
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && !wait) return 0;
+    int r;
+    do {
+        r = uring_enter(u->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+// Next free sqe, zeroed; submits what is queued first if the ring is full.
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+    while (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+        if (uring_submit(u, 0) < 0 && errno != EAGAIN && errno != EBUSY) return NULL;
+    }
+    unsigned idx = u->sqe_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sqe_tail++;
+    return sqe;
+}
+
+static inline struct io_uring_cqe *uring_peek_cqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Sparse table of fixed files; slots are filled with uring_set_file().
+static inline int uring_register_files(uring_t *u, unsigned count) {
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return uring_register(u, IORING_REGISTER_FILES2, &reg, sizeof(reg));
+}
+
+// Point fixed-file slot at fd, or clear it with fd = -1.
+static inline int uring_set_file(uring_t *u, unsigned slot, int fd) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t)(uintptr_t)&fd;
+    return uring_register(u, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+// Register one region as fixed buffer 0 for READ_FIXED/WRITE_FIXED.
+static inline int uring_register_buffer(uring_t *u, void *base, size_t len) {
+    struct iovec iov;
+    iov.iov_base = base;
+    iov.iov_len = len;
+    return uring_register(u, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+static inline void uring_bufs_add(uring_bufs_t *b, uint16_t bid) {
+    // Not br->bufs: the kernel header declares it as a flexible array after
+    // an empty struct, which is one byte (padded to eight) in C++
+    struct io_uring_buf *buf = (struct io_uring_buf *)b->br + (b->tail & (b->entries - 1));
+    buf->addr = (uint64_t)(uintptr_t)(b->base + (size_t)bid * b->buf_size);
+    buf->len = b->buf_size;
+    buf->bid = bid;
+    b->tail++;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+static inline char *uring_bufs_addr(const uring_bufs_t *b, uint16_t bid) {
+    return b->base + (size_t)bid * b->buf_size;
+}
+
+// Register count (a power of two) buffers of buf_size bytes at base as
+// buffer group bgid, all initially available to the kernel.
+static inline int uring_bufs_init(uring_t *u, uring_bufs_t *b, uint16_t bgid, char *base, unsigned count,
+                                  uint32_t buf_size) {
+    memset(b, 0, sizeof(*b));
+    b->br_size = count * sizeof(struct io_uring_buf);
+    b->br = (struct io_uring_buf_ring *)mmap(NULL, b->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                             -1, 0);
+    if (b->br == MAP_FAILED) return -1;
+    b->entries = count;
+    b->bgid = bgid;
+    b->base = base;
+    b->buf_size = buf_size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->br;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (uring_register(u, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(b->br, b->br_size);
+        b->br = NULL;
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) uring_bufs_add(b, (uint16_t)i);
+    return 0;
+}
+
+// Both the listener and the accepted sockets must be in blocking mode:
+// io_uring honours O_NONBLOCK and would end the operation with EAGAIN
+// instead of waiting.
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+// Multishot receive on a fixed file into buffers picked from group bgid.
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe, unsigned slot, uint16_t bgid,
+                                             uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = (int)slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+// Write from fixed buffer 0 to a fixed file.
+static inline void uring_prep_write_fixed(struct io_uring_sqe *sqe, unsigned slot, const void *buf, unsigned len,
+                                          uint64_t offset, uint64_t user_data) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = (int)slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+}
+
+// One-shot poll on a fixed file.
+static inline void uring_prep_poll(struct io_uring_sqe *sqe, unsigned slot, unsigned events, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = (int)slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+// Cancel the request submitted with user_data target; a multishot one
+// posts its final completion with -ECANCELED.
+static inline void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+#endif